@@ -0,0 +1,42 @@
+#!/bin/bash
+# Compares two results.jsonl files written by run.sh.
+#
+#   compare.sh OLD NEW
+#
+# Prints the wall time of each benchmark and phase in both files and
+# the ratio NEW/OLD. Phases that take less than 1ms in both are left out.
+set -e
+
+awk '
+    function field(name,    m) {
+        if (match($0, "\"" name "\":(\"[^\"]*\"|[^,}]*)")) {
+            m = substr($0, RSTART + length(name) + 3, RLENGTH - length(name) - 3)
+            gsub(/"/, "", m)
+            return m
+        }
+        return ""
+    }
+    field("wall_ms") == "" { next }
+    {
+        key = field("bench") SUBSEP field("phase")
+        if (FILENAME == ARGV[1]) {
+            old[key] = field("wall_ms")
+        } else {
+            new[key] = field("wall_ms")
+            if (!(key in seen)) {
+                seen[key] = 1
+                order[n++] = key
+            }
+        }
+    }
+    END {
+        printf "%-24s %-24s %10s %10s %7s\n", "benchmark", "phase", "old (ms)", "new (ms)", "ratio"
+        for (i = 0; i < n; i++) {
+            key = order[i]
+            if (!(key in old) || (old[key] < 1 && new[key] < 1))
+                continue
+            split(key, k, SUBSEP)
+            ratio = old[key] > 0 ? sprintf("%.2f", new[key] / old[key]) : "-"
+            printf "%-24s %-24s %10.2f %10.2f %7s\n", k[1], k[2], old[key], new[key], ratio
+        }
+    }' "$1" "$2"
@@ -0,0 +1,87 @@
+#!/bin/bash
+# Generates synthetic inputs for the compiler throughput benchmarks.
+#
+#   gen.sh DIR SCALE...
+#
+# Each SCALE is a number of lines for the "lines" inputs. The other
+# inputs have fixed sizes chosen to take a noticeable time to compile.
+set -e
+
+DIR=$1
+shift
+SCALES="$@"
+
+rm -rf $DIR
+mkdir -p $DIR
+
+# Straight-line code in functions of 100 lines each.
+for n in $SCALES; do
+    awk -v n=$n 'BEGIN {
+        for (i = 0; i < n; i += 100) {
+            printf "int f%d(int x) {\n", i
+            for (j = 2; j < 100; j++)
+                printf "    x = x * %d + (x >> 3) - %d;\n", j, i + j
+            printf "    return x; }\n"
+        }
+    }' > $DIR/lines-$n.c
+done
+
+# A chain of 16 macros, each expanding to the previous one with a
+# longer argument, used 200 times. Arguments are expanded at every level,
+# so the work grows much faster than the depth.
+awk 'BEGIN {
+    print "#define M0(x) (x)"
+    for (i = 1; i <= 16; i++)
+        printf "#define M%d(x) M%d((x) + %d)\n", i, i - 1, i
+    print "int f(int x) {"
+    for (i = 0; i < 200; i++)
+        printf "    x = M16(x);\n"
+    print "    return x; }"
+}' > $DIR/macro-depth.c
+
+# Many small functions.
+awk 'BEGIN {
+    for (i = 0; i < 10000; i++)
+        printf "int f%d(int a, int b) { return a * %d + b; }\n", i, i
+}' > $DIR/small-functions.c
+
+# A huge array initializer and an array of structs.
+awk 'BEGIN {
+    print "int data[200000] = {"
+    for (i = 0; i < 200000; i++)
+        printf "    %d,\n", (i * 7919) % 100003
+    print "};"
+    print "struct { int a; char *s; long b; } table[20000] = {"
+    for (i = 0; i < 20000; i++)
+        printf "    {%d, \"s%d\", %dL},\n", i, i, i * 3
+    print "};"
+}' > $DIR/initializer.c
+
+# A long `else if` chain.
+awk 'BEGIN {
+    print "int f(int x) {"
+    print "    if (x == 0) return 0;"
+    for (i = 1; i < 10000; i++)
+        printf "    else if (x == %d) return %d;\n", i, i * 3
+    print "    return -1; }"
+}' > $DIR/else-if.c
+
+# 200 headers, each included once and each including the same guarded
+# header, which defines types and prototypes.
+mkdir -p $DIR/include
+awk -v dir=$DIR/include 'BEGIN {
+    common = dir "/common.h"
+    print "#ifndef COMMON_H" > common
+    print "#define COMMON_H" > common
+    for (i = 0; i < 300; i++)
+        printf "typedef struct S%d { int a; long b; char c[8]; } S%d;\nint g%d(S%d *s);\n", i, i, i, i > common
+    print "#endif" > common
+    for (i = 0; i < 200; i++) {
+        h = sprintf("%s/h%d.h", dir, i)
+        printf "#include \"common.h\"\n" > h
+        printf "#define H%d_VALUE %d\nint h%d(S%d *s);\n", i, i, i, i % 300 > h
+        close(h)
+        printf "#include \"include/h%d.h\"\n", i
+    }
+    print "int main() { return H199_VALUE; }"
+}' > $DIR/include-fan-in.c
@@ -0,0 +1,98 @@
+// Runs a command and prints its wall time in milliseconds and the
+// number of user-space instructions it executed.
+//
+//   measure INPUT OUTPUT COMMAND [ARGS...]
+//
+// The command reads INPUT as stdin and writes its stdout to OUTPUT. The
+// instruction count is "n/a" if perf_event_open isn't available. The
+// exit status is that of the command, or 127 if it couldn't be run. This
+// helper is built with the host compiler because it uses
+// <linux/perf_event.h>.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Counts the instructions of a process from its next exec().
+static int open_counter(pid_t pid) {
+    struct perf_event_attr attr = {0};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: measure INPUT OUTPUT COMMAND [ARGS...]\n");
+        return 2;
+    }
+
+    // The child waits until the counter is attached before exec().
+    int go[2];
+    if (pipe(go)) {
+        perror("pipe");
+        return 2;
+    }
+
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid == 0) {
+        char c;
+        close(go[1]);
+        if (read(go[0], &c, 1) != 1)
+            _exit(127);
+
+        int in = open(argv[1], O_RDONLY);
+        int out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (in == -1 || out == -1) {
+            fprintf(stderr, "measure: cannot open %s or %s: %s\n", argv[1], argv[2], strerror(errno));
+            _exit(127);
+        }
+        dup2(in, 0);
+        dup2(out, 1);
+        execvp(argv[3], argv + 3);
+        fprintf(stderr, "measure: exec failed: %s: %s\n", argv[3], strerror(errno));
+        _exit(127);
+    }
+
+    int fd = open_counter(pid);
+    close(go[0]);
+    write(go[1], "x", 1);
+    close(go[1]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    double wall = now_ms() - start;
+
+    uint64_t count;
+    if (fd != -1 && read(fd, &count, sizeof(count)) == sizeof(count))
+        printf("%.2f %lu\n", wall, (unsigned long)count);
+    else
+        printf("%.2f n/a\n", wall);
+
+    // Exit with the status of the command, or like a shell if it was
+    // killed by a signal.
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
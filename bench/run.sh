@@ -0,0 +1,89 @@
+#!/bin/bash
+# Measures how fast a compiler compiles the synthetic inputs of gen.sh.
+#
+#   run.sh CC [DIR]
+#
+# Each input is compiled BENCH_RUNS times (default 3), and the fastest
+# run is the wall time of the benchmark. The bookkeeping of -ftime-report
+# and -fmem-report slows the compiler down, so they are given only to
+# one more run, which breaks the time down by phase and measures memory.
+# The results are written to DIR/results.jsonl (default bench/out), one
+# JSON object per line, which compare.sh compares between commits.
+# BENCH_SCALES gives the sizes of the "lines" inputs. A 1M-line input
+# needs about 6 GB of memory, so it isn't compiled by default.
+#
+# An input that fails to compile, e.g. because the compiler runs out of
+# memory, is recorded with its exit status and the other inputs are
+# still measured. The script then exits with a failure.
+set -e
+
+CC=$(cd $(dirname $1); pwd)/$(basename $1)
+DIR=${2:-bench/out}
+SCALES=${BENCH_SCALES:-"10000 100000"}
+RUNS=${BENCH_RUNS:-3}
+
+./bench/gen.sh $DIR/inputs $SCALES
+
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+RESULTS=$DIR/results.jsonl
+: > $RESULTS
+failed=
+
+printf "%-24s %12s %12s\n" benchmark "wall (ms)" "peak RSS (KiB)"
+
+for input in $DIR/inputs/*.c; do
+    name=$(basename $input .c)
+    best=
+    status=0
+
+    for i in $(seq $RUNS); do
+        start=$(date +%s%N)
+        (cd $DIR/inputs; $CC -Iinclude -S -o ../tmp.s $name.c) || { status=$?; break; }
+        end=$(date +%s%N)
+        ms=$(( (end - start) / 1000000 ))
+        if [ -z "$best" ] || [ $ms -lt $best ]; then
+            best=$ms
+        fi
+    done
+
+    if [ $status -eq 0 ]; then
+        (cd $DIR/inputs; $CC -ftime-report -fmem-report -Iinclude -S -o ../tmp.s $name.c 2> ../report.txt) ||
+            status=$?
+    fi
+
+    if [ $status -ne 0 ]; then
+        printf "{\"commit\":\"%s\",\"bench\":\"%s\",\"phase\":\"failed\",\"status\":%d}\n" \
+               $COMMIT $name $status >> $RESULTS
+        printf "%-24s %12s %12s\n" $name "failed" "exit $status"
+        failed=1
+        continue
+    fi
+
+    # Turn the rows of the time report into JSON objects.
+    awk -v commit=$COMMIT -v bench=$name -v wall=$best '
+        function emit(phase, wall, cpu, allocs, bytes) {
+            printf "{\"commit\":\"%s\",\"bench\":\"%s\",\"phase\":\"%s\",\"wall_ms\":%s,\"cpu_ms\":%s,\"allocs\":%s,\"bytes\":%s}\n",
+                   commit, bench, phase, wall, cpu, allocs, bytes
+        }
+        /^Time report/ { in_time = 1; next }
+        in_time && $1 == "phase" { next }
+        in_time && NF >= 5 {
+            phase = $1
+            for (i = 2; i <= NF - 4; i++)
+                phase = phase " " $i
+            emit(phase, $(NF-3), $(NF-2), $(NF-1), $NF)
+            if (phase == "total")
+                in_time = 0
+        }
+        /peak RSS:/ { rss = $3 }
+        END {
+            emit("process", wall, "null", "null", "null")
+            printf "{\"commit\":\"%s\",\"bench\":\"%s\",\"phase\":\"peak_rss\",\"kib\":%s}\n", commit, bench, rss
+        }' $DIR/report.txt >> $RESULTS
+
+    rss=$(awk '/peak RSS:/ { print $3 }' $DIR/report.txt)
+    printf "%-24s %12d %12d\n" $name $best $rss
+done
+
+echo "results: $RESULTS"
+[ -z "$failed" ]
@@ -0,0 +1,109 @@
+#!/bin/bash
+# Measures how fast the code generated by a compiler runs, compared
+# with gcc -O0 and gcc -O1, on the programs in examples/.
+#
+#   runtime.sh CC [DIR]
+#
+# Each program is built three ways and run BENCH_RUNS times (default 3).
+# The output of every run must match that of the gcc -O0 build. The
+# fastest run is reported with its instruction count and the size of
+# the .text section, and written to DIR/runtime.jsonl (default
+# bench/out). BENCH_PROGRAMS selects programs by name, and
+# BENCH_CFLAGS is passed to the compiler, e.g. "-O2". The brainfuck
+# interpreter running mandelbrot.bf takes minutes per run.
+set -e
+
+CC=$(cd "$(dirname "$1")"; pwd)/$(basename "$1")
+DIR=${2:-bench/out}
+RUNS=${BENCH_RUNS:-3}
+BIN=$DIR/runtime
+mkdir -p "$BIN"
+
+gcc -O2 -o "$BIN/measure" bench/measure.c
+
+# Conway's game of life reads commands from stdin.
+for i in $(seq 300); do echo n; done > "$BIN/life.in"
+echo q >> "$BIN/life.in"
+
+# name, source and arguments of each program
+PROGRAMS=(
+    "mandelbrot examples/mandelbrot.c"
+    "nqueen examples/nqueen.c"
+    "queen examples/queen.c"
+    "fib examples/fib.c"
+    "boyer_moore examples/boyer_moore.c"
+    "life examples/conway/life.c examples/conway/glidergun"
+    "bfi examples/brainfuxk/bfi.c examples/brainfuxk/mandelbrot.bf"
+)
+
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+RESULTS=$DIR/runtime.jsonl
+: > "$RESULTS"
+
+text_size() {
+    size -A "$1" | awk '$1 == ".text" { print $2 }'
+}
+
+printf "%-12s %-8s %12s %16s %10s %8s %8s\n" \
+       program compiler "wall (ms)" instructions "text (B)" "vs -O0" "vs -O1"
+
+for entry in "${PROGRAMS[@]}"; do
+    set -- $entry
+    name=$1
+    src=$2
+    shift 2
+    if [ -n "$BENCH_PROGRAMS" ] && [[ " $BENCH_PROGRAMS " != *" $name "* ]]; then
+        continue
+    fi
+    input=/dev/null
+    [ $name = life ] && input=$BIN/life.in
+
+    "$CC" $BENCH_CFLAGS -o "$BIN/$name-711cc.o" $src
+    gcc -O0 -c -o "$BIN/$name-O0.o" $src 2> /dev/null
+    gcc -O1 -c -o "$BIN/$name-O1.o" $src 2> /dev/null
+
+    declare -A wall insns text
+    for v in O0 O1 711cc; do
+        gcc -o "$BIN/$name-$v" "$BIN/$name-$v.o" 2> /dev/null
+        text[$v]=$(text_size "$BIN/$name-$v.o")
+
+        best=
+        for i in $(seq $RUNS); do
+            # The programs may exit with a non-zero status, which must be
+            # the same as that of the gcc -O0 build. 126 and above mean
+            # that the program couldn't be run or was killed.
+            result=$("$BIN/measure" "$input" "$BIN/$name-$v.out" "$BIN/$name-$v" "$@") \
+                && status=0 || status=$?
+            if [ -z "$result" ] || [ $status -ge 126 ]; then
+                echo "$name: running $v failed with status $status" >&2
+                exit 1
+            fi
+            [ $v = O0 ] && status_O0=$status
+            if [ $status != $status_O0 ] || ! cmp -s "$BIN/$name-O0.out" "$BIN/$name-$v.out"; then
+                echo "$name: output of $v differs from gcc -O0" >&2
+                exit 1
+            fi
+            read ms count <<< "$result"
+            if [ -z "$best" ] || awk "BEGIN { exit !($ms < $best) }"; then
+                best=$ms
+                insns[$v]=$count
+            fi
+        done
+        wall[$v]=$best
+    done
+
+    for v in 711cc O0 O1; do
+        r0=$(awk "BEGIN { printf \"%.2f\", ${wall[$v]} / ${wall[O0]} }")
+        r1=$(awk "BEGIN { printf \"%.2f\", ${wall[$v]} / ${wall[O1]} }")
+        compiler=$v
+        [ $v != 711cc ] && compiler="gcc -$v"
+        printf "%-12s %-8s %12.2f %16s %10d %8s %8s\n" \
+               $name "$compiler" ${wall[$v]} ${insns[$v]} ${text[$v]} $r0 $r1
+        count=${insns[$v]}
+        [ "$count" = n/a ] && count=null
+        printf '{"commit":"%s","program":"%s","compiler":"%s","wall_ms":%s,"instructions":%s,"text_bytes":%s}\n' \
+               $COMMIT $name "$compiler" ${wall[$v]} $count ${text[$v]} >> "$RESULTS"
+    done
+done
+
+echo "results: $RESULTS"
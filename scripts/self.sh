@@ -9,19 +9,14 @@ rm -rf $TMP
 mkdir -p $TMP
 
 711cc() {
-    $CC -c -o $TMP/${1%.c}.o -Isrc src/$1
+    $CC -j$(nproc) -c -Isrc ${@/#/src/}
+    mv ${@/%.c/.o} $TMP
 }
 
 cc() {
     gcc -c -o $TMP/${1%.c}.o src/$1
 }
 
-711cc main.c
-711cc type.c
-711cc parse.c
-711cc codegen.c
-711cc codegen_riscv.c
-711cc tokenize.c
-711cc preprocess.c
+711cc main.c type.c parse.c ir.c ssa.c opt.c regalloc.c codegen.c peephole.c codegen_riscv.c tokenize.c preprocess.c server.c cache.c timing.c trace.c
 
-(cd $TMP; gcc -o ../$OUTPUT *.o)
+(cd $TMP; gcc -pthread -o ../$OUTPUT *.o)
@@ -3,6 +3,12 @@
 #include <ctype.h>
 #include <errno.h>
 #include <libgen.h>
+#include <netdb.h>
+#include <limits.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -11,16 +17,51 @@
 #include <stdnoreturn.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+// Allocations are counted for -ftime-report and -fmem-report.
+// See timing.c.
+void *counted_calloc(size_t n, size_t size, char *expr);
+void *counted_malloc(size_t size, char *expr);
+void *counted_realloc(void *ptr, size_t size, char *expr);
+char *counted_strdup(char *s);
+char *counted_strndup(char *s, size_t n);
+
+#define calloc(n, size) counted_calloc(n, size, #size)
+#define malloc(size) counted_malloc(size, #size)
+#define realloc(ptr, size) counted_realloc(ptr, size, #size)
+#define strdup(s) counted_strdup(s)
+#define strndup(s, n) counted_strndup(s, n)
+
 typedef struct Type Type;
 typedef struct Hideset Hideset;
 typedef struct Member Member;
 typedef struct Relocation Relocation;
+typedef struct Context Context;
+typedef struct Macro Macro;
+typedef struct CondIncl CondIncl;
+typedef struct VarScope VarScope;
+typedef struct TagScope TagScope;
+typedef struct CachedFile CachedFile;
+typedef struct CachedPath CachedPath;
+typedef struct SharedCache SharedCache;
+typedef struct TimeReport TimeReport;
+typedef struct Trace Trace;
+typedef struct IncludeSpan IncludeSpan;
+typedef struct IncludeStat IncludeStat;
+typedef struct VReg VReg;
+typedef struct Insn Insn;
+typedef struct BasicBlock BasicBlock;
+typedef struct IRFunction IRFunction;
+typedef struct IRLabel IRLabel;
 
 //
 // tokenize.c
@@ -60,22 +101,28 @@ struct Token {
 noreturn void error(char *fmt, ...);
 noreturn void error_tok(Token *tok, char *fmt, ...);
 void warn_tok(Token *tok, char *fmt, ...);
+void set_diag_stream(FILE *out);
+FILE *diag_stream(void);
+noreturn void die(void);
 bool equal(Token *tok, char *op);
 Token *skip(Token *tok, char *op);
 bool consume(Token **rest, Token *tok, char *str);
 void convert_keywords(Token *tok);
 void convert_pp_tokens(Token *tok);
-char **get_input_files(void);
-Token *tokenize(char *filename, int file_no, char *p);
-Token *tokenize_file(char *filename);
+char **get_input_files(Context *ctx);
+int add_input_file(Context *ctx, char *path);
+Token *tokenize(Context *ctx, char *filename, int file_no, char *p);
+Token *tokenize_file(Context *ctx, char *filename);
 
 // 
 // preprocess.c
 //
 
-void init_macros(void);
-void define_macro(char *name, char *buf);
-Token *preprocess(Token *tok);
+void init_macros(Context *ctx);
+void define_macro(Context *ctx, char *name, char *buf);
+void add_cached_path(SharedCache *cache, char *key, char *filename, char *path);
+Token *preprocess(Context *ctx, Token *tok);
+void print_include_report(Context *ctx, FILE *out, char *filename);
 
 //
 // parse.c
@@ -93,6 +140,9 @@ struct Var {
 
     // Local variable 
     int offset;     
+    bool is_addr_taken; // `&` is applied to it
+    bool is_promoted;   // Can be kept in a register instead of memory
+    VReg *vreg;         // Register of a promoted variable in the IR
     
     // Global variable
     bool is_static;
@@ -225,8 +275,8 @@ typedef struct {
 } Program;
 
 Node *new_cast(Node *expr, Type *ty);
-long const_expr(Token **rest, Token *tok);
-Program *parse(Token *tok);
+long const_expr(Context *ctx, Token **rest, Token *tok);
+Program *parse(Context *ctx, Token *tok);
 
 //
 // type.c
@@ -333,23 +383,435 @@ Type *struct_type(void);
 Type *copy_type(Type *ty);
 void add_type(Node *node);
 
+//
+// ir.c
+//
+
+// Instructions of the intermediate representation. Each computes at
+// most one value into a virtual register, `dst`, from operands in
+// other virtual registers.
+typedef enum {
+    IR_IMM,         // dst = val
+    IR_FIMM,        // dst = fval
+    IR_MOV,         // dst = lhs
+    IR_ADD,         // dst = lhs + rhs
+    IR_SUB,         // dst = lhs - rhs
+    IR_MUL,         // dst = lhs * rhs
+    IR_DIV,         // dst = lhs / rhs
+    IR_MOD,         // dst = lhs % rhs
+    IR_AND,         // dst = lhs & rhs
+    IR_OR,          // dst = lhs | rhs
+    IR_XOR,         // dst = lhs ^ rhs
+    IR_SHL,         // dst = lhs << rhs
+    IR_SHR,         // dst = lhs >> rhs, arithmetic if ty is signed
+    IR_EQ,          // dst = lhs == rhs
+    IR_NE,          // dst = lhs != rhs
+    IR_LT,          // dst = lhs < rhs
+    IR_LE,          // dst = lhs <= rhs
+    IR_NOT,         // dst = ~lhs
+    IR_CAST,        // dst = (ty)lhs, where lhs is of type `from`
+    IR_ADDR,        // dst = &var
+    IR_LOAD,        // dst = *lhs
+    IR_STORE,       // *lhs = rhs
+    IR_COPY,        // Copy ty->size bytes from *rhs to *lhs
+    IR_PARAM,       // dst = the val'th parameter register, or stack slot if negative
+    IR_CALL,        // dst = lhs(args...)
+    IR_VA_START,    // Initialize the va_list at lhs
+    IR_PHI,         // dst = args[i] if control came from bbs[i]
+    IR_BR,          // Go to `then` if lhs != 0, otherwise to `els`
+    IR_JMP,         // Go to `then`
+    IR_RET,         // Return lhs, or nothing if lhs is NULL
+} InsnKind;
+
+// Virtual register
+struct VReg {
+    int id;
+    Type *ty;       // Type of the value. Arrays and structs are addresses.
+
+    // Set by count_defs()
+    Insn *def;      // Defining instruction, if there is only one
+    int ndefs;      // Number of defining instructions
+    int nuses;      // Number of operands that read the register
+
+    // Backend
+    int reg;        // Machine register, or -1 if the value is on the stack
+    int slot;       // Stack slot offset from the frame pointer
+};
+
+struct Insn {
+    Insn *next;
+    Insn *prev;
+    InsnKind kind;
+    Type *ty;       // Type of the operation, or of the operands of a comparison
+    Token *tok;     // Representative token
+
+    VReg *dst;
+    VReg *lhs;
+    VReg *rhs;
+
+    long val;       // IR_IMM or IR_PARAM
+    double fval;    // IR_FIMM
+    Var *var;       // IR_ADDR
+    Type *from;     // IR_CAST
+
+    // Function call or phi
+    Type *func_ty;
+    VReg **args;
+    int nargs;
+    BasicBlock **bbs;   // IR_PHI: predecessor that each argument comes from
+    VReg **live;        // IR_CALL: caller-saved registers live across the call
+    int nlive;
+
+    // Branch targets
+    BasicBlock *then;
+    BasicBlock *els;
+};
+
+// A basic block is a list of instructions that ends with a branch
+// and that control enters only at the beginning.
+struct BasicBlock {
+    BasicBlock *next;   // Next block in layout order
+    int id;
+    Insn *insns;
+    Insn *last;
+
+    // Control flow graph, set by build_cfg()
+    BasicBlock **preds;
+    int npreds;
+    BasicBlock *idom;   // Immediate dominator
+    int rpo;            // Index in reverse postorder
+};
+
+struct IRFunction {
+    Function *fn;
+    BasicBlock *bbs;        // Entry block followed by the others
+    BasicBlock **blocks;    // Blocks by id
+    int nblocks;
+    int nregs;
+    IRLabel *labels;        // Blocks of goto labels
+
+    // Set by build_cfg()
+    BasicBlock **order;     // Reachable blocks in reverse postorder
+    int norder;
+};
+
+VReg *new_vreg(IRFunction *ir, Type *ty);
+BasicBlock *new_block(IRFunction *ir);
+Insn *new_insn(InsnKind kind, Type *ty, Token *tok);
+void insert_insn(BasicBlock *bb, Insn *pos, Insn *insn);
+void remove_insn(BasicBlock *bb, Insn *insn);
+IRFunction *lower_function(Context *ctx, Function *fn);
+void count_defs(IRFunction *ir);
+void dump_ir(FILE *out, IRFunction *ir);
+
+//
+// ssa.c
+//
+
+int successors(BasicBlock *bb, BasicBlock **out);
+void build_cfg(IRFunction *ir);
+void build_dominators(IRFunction *ir);
+void to_ssa(IRFunction *ir);
+void from_ssa(IRFunction *ir);
+
+//
+// opt.c
+//
+
+void optimize(Context *ctx, IRFunction *ir);
+
+//
+// regalloc.c
+//
+
+// Machine registers that the register allocator may assign, numbered
+// by a backend.
+typedef struct {
+    int *callee_saved;  // General-purpose registers preserved across calls
+    int ncallee_saved;
+    int *caller_saved;  // General-purpose registers clobbered by calls
+    int ncaller_saved;
+    int *fp;            // Floating-point registers, all clobbered by calls
+    int nfp;
+    int *gp_args;       // Registers that pass arguments, or -1 for those
+    int ngp_args;       // that the backend uses as scratch registers
+    int *fp_args;
+    int nfp_args;
+} RegSet;
+
+bool is_remat(VReg *reg);
+void allocate_registers(IRFunction *ir, RegSet *set);
+
+//
+// peephole.c
+//
+
+// x86-64 general-purpose registers. The register allocator numbers
+// registers the same way and never assigns the last three.
+enum { RAX, RCX, RDX, RBX, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15, RBP, RSP, RIP };
+
+// x86-64 instructions
+typedef enum {
+    AS_LABEL,   // Label definition
+    AS_LOC,     // .loc directive
+    AS_MOV,
+    AS_MOVABS,
+    AS_MOVL,
+    AS_MOVQ,
+    AS_MOVD,
+    AS_MOVAPS,
+    AS_MOVZBL,
+    AS_MOVZWL,
+    AS_MOVSBL,
+    AS_MOVSWL,
+    AS_MOVSLQ,
+    AS_LEA,
+    AS_ADD,
+    AS_SUB,
+    AS_IMUL,
+    AS_AND,
+    AS_OR,
+    AS_XOR,
+    AS_NOT,
+    AS_SHL,
+    AS_SHR,
+    AS_SAR,
+    AS_CMP,
+    AS_DIV,
+    AS_IDIV,
+    AS_CQO,
+    AS_CDQ,
+    AS_SET,     // setcc
+    AS_JCC,     // jcc
+    AS_JMP,
+    AS_CALL,
+    AS_PUSH,
+    AS_POP,
+    AS_RET,
+    AS_XORPS,
+    // Scalar floating-point instructions, each of which is followed by
+    // its double-precision version
+    AS_MOVSS,
+    AS_MOVSD,
+    AS_ADDSS,
+    AS_ADDSD,
+    AS_SUBSS,
+    AS_SUBSD,
+    AS_MULSS,
+    AS_MULSD,
+    AS_DIVSS,
+    AS_DIVSD,
+    AS_UCOMISS,
+    AS_UCOMISD,
+    AS_CVTSS2SD,
+    AS_CVTSD2SS,
+    AS_CVTTSS2SI,
+    AS_CVTTSD2SI,
+    AS_CVTSI2SSL,
+    AS_CVTSI2SDL,
+    AS_CVTSI2SSQ,
+    AS_CVTSI2SDQ,
+} AsmOp;
+
+// Condition codes of setcc and jcc. Each is next to its inverse.
+typedef enum {
+    CC_E, CC_NE, CC_L, CC_GE, CC_LE, CC_G, CC_B, CC_AE, CC_BE, CC_A, CC_P, CC_NP,
+} AsmCond;
+
+typedef enum {
+    OPND_REG,   // General-purpose register
+    OPND_XMM,   // XMM register
+    OPND_IMM,   // `$val`, or `$sym` for an absolute address
+    OPND_MEM,   // `disp(%reg)`, or `sym(%rip)`
+    OPND_SYM,   // Jump or call target
+} AsmOperandKind;
+
+typedef struct {
+    AsmOperandKind kind;
+    int reg;    // Register, or base register of a memory operand
+    int size;   // Size of a general-purpose register in bytes
+    long val;   // Immediate value or displacement
+    char *sym;  // Symbol, or NULL
+} AsmOperand;
+
+// An x86-64 instruction or a label
+typedef struct AsmInsn AsmInsn;
+struct AsmInsn {
+    AsmInsn *next;
+    AsmInsn *prev;
+    AsmOp op;
+    AsmCond cc;         // Condition of AS_SET and AS_JCC
+    AsmOperand args[2]; // Operands in AT&T order
+    int nargs;
+};
+
+typedef struct {
+    AsmInsn *head;
+    AsmInsn *tail;
+} AsmList;
+
+void append_asm(AsmList *list, AsmInsn *insn);
+void peephole(AsmList *list);
+void print_insn(Context *ctx, AsmInsn *insn);
+void print_asm(Context *ctx, AsmList *list);
+
 //
 // codegen.c
 //
 
-void codegen(Program *prog);
+void codegen(Context *ctx, Program *prog);
 
 //
 // codegen_riscv.c
 //
 
-void codegen_riscv64(Program *prog);
+void codegen_riscv64(Context *ctx, Program *prog);
 
 //
 // main.c
 //
 
-extern char **include_paths;
-extern bool opt_fpic;
+// Compilations running in the same process share tokenized files and the
+// results of include path search. Files are keyed by absolute path and
+// revalidated by size and mtime, and paths are keyed by the include paths
+// they were searched in, so a compile server can keep the cache across
+// requests. Tokens are copied out of the cache because the preprocessor
+// rewrites token lists.
+struct SharedCache {
+    pthread_mutex_t mu;
+    CachedFile *files;          // Tokenized files
+    CachedPath *paths;          // Resolved #include <...> paths
+    FILE *log;                  // If non-NULL, new entries are logged here
+    char *build_id;             // Identifies the compiler for -fcache-dir
+};
+
+// A context holds all mutable state of a single compilation, from
+// command line options to the scopes of the parser and the register
+// stack of the code generator. Every phase of the compiler takes a
+// context as its first argument, so two compilations in the same
+// process never interfere with each other.
+struct Context {
+    // Options
+    char **include_paths;
+    bool opt_fpic;
+    char *feature;
+    int nthreads;               // Number of threads for a compilation
+    char *cache_dir;            // -fcache-dir
+    bool opt_H;                 // -H
+    bool opt_dump_ir;           // -fdump-ir
+    int opt_level;              // -O
+    bool opt_fpreprocessed;     // -fpreprocessed
+
+    SharedCache *cache;         // Shared by compilations in the process
+    TimeReport *time_report;    // -ftime-report
+    Trace *trace;               // -ftrace
+    char *search_key;           // Identifies include paths in the cache
+
+    // Tokenizer
+    char *current_filename;     // Input filename
+    char *current_input;        // Input string
+    char **input_files;         // A list of all input files
+    int file_no;
+
+    // Preprocessor
+    Macro *macros;
+    CondIncl *cond_incl;        // `#if` stack
+    IncludeSpan *include_span;  // Headers being preprocessed, for -ftrace and -H
+    IncludeStat *include_stats; // Statistics of included files, for -H
+    int counter;                // Value of the next __COUNTER__
+
+    // Parser
+    Var *locals;                // Local variables of the current function
+    Var *globals;               // Global variables
+    VarScope *var_scope;        // Scope for variables, typedefs and enums
+    TagScope *tag_scope;        // Scope for struct, union and enum tags
+    int scope_depth;            // Depth of the current block scope
+    Var *current_fn;            // Function being parsed
+    Node *current_switch;       // Switch statement being parsed
+    char *unique_prefix;        // Prefix of anonymous global names
+    int unique_id;              // Suffix of the next anonymous global
+
+    // Code generator
+    FILE *out;                  // Output assembly
+    FILE *tempfile;             // Temporary file that the output goes to
+    char *tempfile_path;
+    Function *gen_fn;           // Function being generated
+    int top;                    // Top of the register stack
+    int brknum;                 // Label number of the current "break"
+    int contnum;                // Label number of the current "continue"
+    int label;                  // Number of the next label
+    IRFunction *ir;             // Function being lowered or generated
+    AsmList *asm_list;          // Instructions of the function being generated
+    BasicBlock *bb;             // Block being lowered
+    BasicBlock *brk_bb;         // Target of "break" in lowering
+    BasicBlock *cont_bb;        // Target of "continue" in lowering
+};
+
+Context *new_context(void);
+void add_include_path(Context *ctx, char *path);
+void println(Context *ctx, char *fmt, ...);
+void parallel_for(Context *ctx, int n, void (*fn)(void *arg, int i), void *arg);
+void emit_functions(Context *ctx, Program *prog, void (*emit_fn)(Context *ctx, Function *fn));
+int run_driver(Context *ctx, int argc, char **argv);
+
+//
+// server.c
+//
+
+void run_server(Context *ctx, char *path);
+int run_client(char *path, int argc, char **argv);
+void run_worker(Context *ctx, char *addr);
+int run_on_worker(char *addr, char **flags, char *filename, char *text,
+                  FILE *out, FILE *diag);
+
+//
+// cache.c
+//
+
+char *cache_entry_path(Context *ctx, Token *tok, char *ext);
+char *function_entry_path(Context *ctx, Function *fn);
+char *cache_load(char *entry, size_t *len);
+void cache_store_buf(char *entry, char *buf, size_t len);
+void cache_store(char *path, char *entry);
+
+//
+// timing.c
+//
+
+typedef enum {
+    PHASE_OTHER,
+    PHASE_READ,
+    PHASE_TOKENIZE,
+    PHASE_INCLUDE,
+    PHASE_MACRO,
+    PHASE_COND,
+    PHASE_PREPROCESS,
+    PHASE_CONVERT,
+    PHASE_CACHE,
+    PHASE_OFFLOAD,
+    PHASE_PARSE,
+    PHASE_STACK,
+    PHASE_CODEGEN,
+    PHASE_OUTPUT,
+    PHASE_AS,
+    NUM_PHASES,
+} Phase;
+
+TimeReport *new_time_report(bool perf);
+void set_time_report(TimeReport *r);
+Phase enter_phase(Context *ctx, Phase phase);
+void add_cpu_time(Context *ctx, double sec);
+double thread_cpu_time(void);
+double rusage_time(struct rusage *ru);
+void print_time_report(Context *ctx, FILE *out, char *filename);
+void print_mem_report(Context *ctx, FILE *out, char *filename);
+
+//
+// trace.c
+//
 
-void println(char *fmt, ...);
+Trace *open_trace(char *path);
+double now_us(void);
+double trace_now(Context *ctx);
+void trace_span(Context *ctx, char *cat, char *name, double start);
+void trace_thread_name(Context *ctx, char *name);
@@ -0,0 +1,307 @@
+#include "711cc.h"
+
+// A compilation cache stores the output of a compilation in a directory
+// given by -fcache-dir, under a name derived from everything the output
+// depends on: the preprocessed tokens, the target, the options that
+// change code generation and the compiler itself. Because the key is
+// computed after preprocessing, an unchanged file is a hit even if it
+// was touched or its headers were rewritten with the same contents, and
+// on a hit we skip parsing, code generation and the assembler.
+
+typedef struct {
+    unsigned long h1;
+    unsigned long h2;
+} Hash;
+
+static void hash_init(Hash *h) {
+    h->h1 = 0xcbf29ce484222325;
+    h->h2 = 0x84222325cbf29ce4;
+}
+
+// Two FNV-1a style lanes with different multipliers, mixed together
+// at the end. This is not a cryptographic hash, but 128 bits are
+// plenty to avoid accidental collisions.
+static void hash_update(Hash *h, void *buf, long len) {
+    unsigned char *p = buf;
+    unsigned long h1 = h->h1;
+    unsigned long h2 = h->h2;
+    for (long i = 0; i < len; i++) {
+        h1 = (h1 ^ p[i]) * 0x100000001b3;
+        h2 = (h2 ^ p[i]) * 0x9e3779b97f4a7c15;
+    }
+    h->h1 = h1;
+    h->h2 = h2;
+}
+
+static void hash_str(Hash *h, char *str) {
+    // Include the terminator so that "ab","c" and "a","bc" differ.
+    hash_update(h, str, strlen(str) + 1);
+}
+
+static void hash_int(Hash *h, long val) {
+    hash_update(h, &val, sizeof(val));
+}
+
+static unsigned long mix(unsigned long x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccd;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53;
+    x ^= x >> 33;
+    return x;
+}
+
+// Returns the hash as 32 hex digits.
+static char *hash_final(Hash *h) {
+    unsigned long a = mix(h->h1 ^ mix(h->h2));
+    unsigned long b = mix(h->h2 ^ mix(a));
+    char *buf = calloc(1, 33);
+    sprintf(buf, "%016lx%016lx", a, b);
+    return buf;
+}
+
+// The build ID identifies the compiler binary, so that a rebuilt
+// compiler doesn't reuse the output of an old one. It is a hash of the
+// executable rather than its timestamp, which a rebuild from the same
+// sources wouldn't keep.
+static char *build_id(Context *ctx) {
+    SharedCache *cache = ctx->cache;
+    pthread_mutex_lock(&cache->mu);
+
+    if (!cache->build_id) {
+        FILE *in = fopen("/proc/self/exe", "r");
+        if (!in) {
+            pthread_mutex_unlock(&cache->mu);
+            error("-fcache-dir: cannot read /proc/self/exe: %s", strerror(errno));
+        }
+
+        Hash h;
+        hash_init(&h);
+        char buf[4096];
+        for (;;) {
+            int nr = fread(buf, 1, sizeof(buf), in);
+            if (nr == 0)
+                break;
+            hash_update(&h, buf, nr);
+        }
+        fclose(in);
+        cache->build_id = hash_final(&h);
+    }
+
+    pthread_mutex_unlock(&cache->mu);
+    return cache->build_id;
+}
+
+// Returns the path of the entry for a key in a cache directory.
+static char *entry_path(Context *ctx, Hash *h, char *ext) {
+    // Entries are spread over 256 subdirectories.
+    char *key = hash_final(h);
+    char *path = calloc(1, strlen(ctx->cache_dir) + strlen(key) + strlen(ext) + 4);
+    sprintf(path, "%s/%.2s/%s.%s", ctx->cache_dir, key, key + 2, ext);
+    return path;
+}
+
+// Returns the path of the cache entry for a compilation of the given
+// preprocessed tokens. `ext` is "s" for assembly and "o" for an object
+// file. The entry may not exist yet.
+char *cache_entry_path(Context *ctx, Token *tok, char *ext) {
+    Hash h;
+    hash_init(&h);
+    hash_str(&h, "711cc cache 1");
+    hash_str(&h, build_id(ctx));
+    hash_str(&h, ctx->feature);
+    hash_int(&h, ctx->opt_fpic);
+    hash_int(&h, ctx->opt_level);
+    hash_str(&h, ext);
+
+    // The assembler records the working directory in debug info.
+    if (!strcmp(ext, "o")) {
+        char *cwd = getcwd(NULL, 0);
+        if (cwd)
+            hash_str(&h, cwd);
+        free(cwd);
+    }
+
+    // Filenames and line numbers end up in .file and .loc directives.
+    char **paths = get_input_files(ctx);
+    for (int i = 0; paths[i]; i++)
+        hash_str(&h, paths[i]);
+
+    for (; tok->kind != TK_EOF; tok = tok->next) {
+        hash_int(&h, tok->kind);
+        hash_int(&h, tok->file_no);
+        hash_int(&h, tok->line_no);
+        hash_int(&h, tok->len);
+        hash_update(&h, tok->loc, tok->len);
+    }
+
+    return entry_path(ctx, &h, ext);
+}
+
+// The assembly of a function is cached separately, so that when a
+// file changes, only the functions that changed are generated again.
+// The key of a function covers everything code generation reads: the
+// AST of the body, the types and offsets of the variables it refers
+// to and the layouts of the struct members it accesses. Types are
+// hashed shallowly because code generation only looks at the kind,
+// size and signedness of a type and at what a pointer points to.
+
+static void hash_type(Hash *h, Type *ty) {
+    if (!ty) {
+        hash_int(h, -1);
+        return;
+    }
+    hash_int(h, ty->kind);
+    hash_int(h, ty->size);
+    hash_int(h, ty->align);
+    hash_int(h, ty->is_unsigned);
+    hash_int(h, ty->array_len);
+    if (ty->base) {
+        hash_int(h, ty->base->kind);
+        hash_int(h, ty->base->size);
+        hash_int(h, ty->base->is_unsigned);
+    }
+}
+
+static void hash_var(Hash *h, Var *var) {
+    if (!var) {
+        hash_int(h, -1);
+        return;
+    }
+    hash_str(h, var->name);
+    hash_type(h, var->ty);
+    hash_int(h, var->is_local);
+    hash_int(h, var->is_static);
+    hash_int(h, var->align);
+    hash_int(h, var->offset);
+}
+
+static void hash_node(Hash *h, Node *node) {
+    for (; node; node = node->next) {
+        hash_int(h, node->kind);
+        hash_type(h, node->ty);
+        hash_int(h, node->tok ? node->tok->file_no : -1);
+        hash_int(h, node->tok ? node->tok->line_no : -1);
+
+        hash_int(h, node->is_init);
+        hash_int(h, node->val);
+        hash_update(h, &node->fval, sizeof(node->fval));
+        hash_str(h, node->label_name ? node->label_name : "");
+        hash_int(h, node->case_label);
+        hash_int(h, node->case_end_label);
+        hash_var(h, node->var);
+
+        if (node->member) {
+            Member *mem = node->member;
+            hash_type(h, mem->ty);
+            hash_int(h, mem->offset);
+            hash_int(h, mem->is_bitfield);
+            hash_int(h, mem->bit_offset);
+            hash_int(h, mem->bit_width);
+        }
+
+        if (node->func_ty) {
+            hash_type(h, node->func_ty->return_ty);
+            for (Type *t = node->func_ty->params; t; t = t->next)
+                hash_type(h, t);
+            hash_int(h, node->func_ty->is_variadic);
+        }
+
+        hash_int(h, node->nargs);
+        for (int i = 0; i < node->nargs; i++)
+            hash_var(h, node->args[i]);
+
+        // A case node is reachable from both the body of a switch and
+        // its case list, so the list is hashed by label numbers only.
+        for (Node *n = node->case_next; n; n = n->case_next)
+            hash_int(h, n->case_label);
+        if (node->default_case)
+            hash_int(h, node->default_case->case_label);
+
+        hash_node(h, node->lhs);
+        hash_node(h, node->rhs);
+        hash_node(h, node->cond);
+        hash_node(h, node->then);
+        hash_node(h, node->els);
+        hash_node(h, node->init);
+        hash_node(h, node->inc);
+        hash_node(h, node->body);
+
+        // Separate the lists of sibling nodes.
+        hash_int(h, -2);
+    }
+}
+
+// Returns the path of the cache entry for the assembly of a function.
+char *function_entry_path(Context *ctx, Function *fn) {
+    Hash h;
+    hash_init(&h);
+    hash_str(&h, "711cc function 1");
+    hash_str(&h, build_id(ctx));
+    hash_str(&h, ctx->feature);
+    hash_int(&h, ctx->opt_fpic);
+    hash_int(&h, ctx->opt_level);
+
+    hash_str(&h, fn->name);
+    hash_int(&h, fn->is_static);
+    hash_int(&h, fn->is_variadic);
+    hash_int(&h, fn->stack_size);
+    for (Var *var = fn->params; var; var = var->next)
+        hash_var(&h, var);
+    hash_node(&h, fn->body);
+    return entry_path(ctx, &h, "fn.s");
+}
+
+// Reads a cache entry. Returns NULL if there is no such entry.
+char *cache_load(char *entry, size_t *len) {
+    FILE *in = fopen(entry, "r");
+    if (!in)
+        return NULL;
+
+    char *buf;
+    FILE *out = open_memstream(&buf, len);
+    char buf2[4096];
+    for (;;) {
+        int nr = fread(buf2, 1, sizeof(buf2), in);
+        if (nr == 0)
+            break;
+        fwrite(buf2, 1, nr, out);
+    }
+    fclose(out);
+    fclose(in);
+    return buf;
+}
+
+static bool make_dir(char *path) {
+    return !mkdir(path, 0777) || errno == EEXIST;
+}
+
+// Writes a cache entry. The data is written to a temporary file next to
+// the entry and renamed, so that a concurrent compilation never sees a
+// partially written entry. Failures are not errors because the cache is
+// only an optimization.
+void cache_store_buf(char *entry, char *buf, size_t len) {
+    char *dir = dirname(strdup(entry));
+    if (!make_dir(dirname(strdup(dir))) || !make_dir(dir))
+        return;
+
+    char *tmp = calloc(1, strlen(entry) + 8);
+    sprintf(tmp, "%s.XXXXXX", entry);
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+        return;
+
+    FILE *out = fdopen(fd, "w");
+    bool ok = fwrite(buf, 1, len, out) == len;
+    if (fclose(out) || !ok || rename(tmp, entry))
+        unlink(tmp);
+}
+
+// Copies a file to a cache entry.
+void cache_store(char *path, char *entry) {
+    size_t len;
+    char *buf = cache_load(path, &len);
+    if (buf)
+        cache_store_buf(entry, buf, len);
+    free(buf);
+}
@@ -1,208 +1,353 @@
 #include "711cc.h"
 
-static int top;
-static int brknum;
-static int contnum;
-static char *argreg8[] = {"%dil", "%sil", "%dl", "%cl", "%r8b", "%r9b"};
-static char *argreg16[] = {"%di", "%si", "%dx", "%cx", "%r8w", "%r9w"};
-static char *argreg32[] = {"%edi", "%esi", "%edx", "%ecx", "%r8d", "%r9d"};
-static char *argreg64[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
-static Function *current_fn;
-
-static int count(void) {
-    static int i = 1;
-    return i++;
+// The code generator selects x86-64 instructions for the IR of each
+// function (see ir.c). Virtual registers are assigned to machine
+// registers by the register allocator (see regalloc.c), and the ones
+// that don't get a register have an 8-byte stack slot below the local
+// variables. An instruction uses operands in registers directly and
+// loads the others to the scratch registers %rax, %rcx, %rdx, %xmm0
+// and %xmm1.
+//
+// A register defined only by an IR_IMM or an IR_ADDR gets neither a
+// machine register nor a slot. Its value is an immediate or an
+// address, which is used as an operand or recomputed wherever it is
+// needed.
+
+static int argreg[] = {RDI, RSI, RDX, RCX, R8, R9};
+
+// Registers for the register allocator. The scratch registers and the
+// registers to pass arguments are left out, so that loading operands
+// and arguments never overwrites an allocated register.
+static int callee_saved[] = {RBX, R12, R13, R14, R15};
+static int caller_saved[] = {R10, R11};
+static int fp_regs[] = {8, 9, 10, 11, 12, 13, 14, 15};
+
+// Argument registers that may hold a value computed for a call. Such a
+// value is the only one in the register, so loading the arguments still
+// never overwrites a value in use. %rdx, %rcx, %xmm0 and %xmm1 are
+// scratch registers.
+static int gp_arg_regs[] = {RDI, RSI, -1, -1, R8, R9};
+static int fp_arg_regs[] = {-1, -1, 2, 3, 4, 5, 6, 7};
+
+static AsmOperand reg(int r, int size) {
+    assert(size == 1 || size == 2 || size == 4 || size == 8);
+    AsmOperand opnd = {0};
+    opnd.kind = OPND_REG;
+    opnd.reg = r;
+    opnd.size = size;
+    return opnd;
 }
 
-static char *reg(int idx) {
-    static char *r[] = {"%r10", "%r11", "%r12", "%r13", "%r14", "%r15"};
-    if (idx < 0 || sizeof(r) / sizeof(*r) <= idx)
-        error("register out of range: %d", idx);
-    return r[idx];
+static AsmOperand xmm(int r) {
+    AsmOperand opnd = {0};
+    opnd.kind = OPND_XMM;
+    opnd.reg = r;
+    return opnd;
 }
 
-static char *xreg(Type *ty, int idx) {
-    if (ty->base || ty->size == 8)
-        return reg(idx);
+static AsmOperand imm(long val) {
+    AsmOperand opnd = {0};
+    opnd.kind = OPND_IMM;
+    opnd.val = val;
+    return opnd;
+}
 
-    static char *r[] = {"%r10d", "%r11d", "%r12d", "%r13d", "%r14d", "%r15d"};
-    if (idx < 0 || sizeof(r) / sizeof(*r) <= idx)
-        error("register out of range: %d", idx);
-    return r[idx];
+// `disp(%base)`
+static AsmOperand mem(int base, long disp) {
+    AsmOperand opnd = {0};
+    opnd.kind = OPND_MEM;
+    opnd.reg = base;
+    opnd.val = disp;
+    return opnd;
 }
 
-static char *freg(int idx) {
-    static char *r[] = {"%xmm8", "%xmm9", "%xmm10", "%xmm11", "%xmm12", "%xmm13"};
-    if (idx < 0 || sizeof(r) / sizeof(*r) <= idx)
-        error("register out of range: %d", idx);
-    return r[idx];
+// A stack slot, which is at a negative offset from the base pointer
+static AsmOperand slot(int offset) {
+    return mem(RBP, -offset);
 }
 
-static void gen_expr(Node *node);
-static void gen_stmt(Node *node);
-
-// Compute the absolute address of a given node.
-// It's an error if a given node does not reside in memory.
-static void gen_addr(Node *node) {
-    switch (node->kind) {
-    case ND_VAR:
-        if (node->var->is_local) {
-            // A local variable resides on the stack and has a fixed offset
-            // from the base pointer.
-            println("  lea -%d(%%rbp), %s", node->var->offset, reg(top++));
-            return;
-        }
+// `$sym`, `sym(%rip)` or a jump target
+static AsmOperand sym(AsmOperandKind kind, char *name) {
+    AsmOperand opnd = {0};
+    opnd.kind = kind;
+    opnd.reg = RIP;
+    opnd.sym = name;
+    return opnd;
+}
 
-        // Here we compute an absolute address of a given global variable.
-        // There are three different ways to compute a global variable below.
-        //
-        // 1. If -fno-pic is given, the resulting ELF module (i.e. an executable
-        //    or a .so file) doesn't have to be position-independent, meaning
-        //    that we can assume that the resulting code and data will be loaded
-        //    at a fixed memory location below 4 GiB. In this case, a 4-byte
-        //    absolute address can be computed at link-time and directly
-        //    embedded to a mov instruction.
-        //
-        // 2. If -fno-pic isn't given, the resulting ELF module may be loaded
-        //    anywhere in the 64-bit address space. We don't know the load
-        //    address at link-time. We have two different ways to compute an
-        //    address in this case:
-        //
-        // 2-1. A file-scope global variable: Because an ELF module is loaded to
-        //      memory as a unit, the relative offset between code and data in
-        //      the same ELF module is fixed whenever the module is loaded. A
-        //      file-scope global variable always resides in the same ELF object
-        //      as a use site, so we can use the RIP-relative addressing to
-        //      refer a variable. `foo(%rip)` refers address %RIP+addend where
-        //      addend is the offset between a use site and the location of
-        //      variable foo. The addend is computed by the linker at link-time.
-        //
-        // 2-2. A non-file-scope global variable: that variable may reside in a
-        //      different ELF module whose address is not known until run-time.
-        //      We know nothing about the location of the variable at link-time.
-        //      For those variable, each ELF module has a table of absolute
-        //      address of global variables. The table is called "GOT" (Global
-        //      Offset Tabel) and is filled by the loader. For example, if we
-        //      have a global variable foo which may not exist in the same ELF
-        //      module, we have a table entry for foo in a GOT, and at runtime
-        //      the table entry has a 8-byte absolute address of foo.
-        //
-        //      Since each ELF module has a GOT, and a relative address to a GOT
-        //      entry within the same ELF module doesn't change whenever the
-        //      module is loaded, we can use the RIP-relative memory access to
-        //      load a 8-byte value from GOT.
-        //
-        //      Not all variables need a GOT entry. By appending "@GOT" or
-        //      "@GOTPCREL" to a variable name, you can tell the linker you need
-        //      a GOT entry for that variable. "foo@GOTPCREL(%RIP)" refers a GOT
-        //      entry of variable foo at runtime.
-        if (!opt_fpic) {
-            // Load a 32-bit fixed address to a register.
-            println("  mov $%s, %s", node->var->name, reg(top++));
-        } else if (node->var->is_static) {
-            // Set %RIP+addend to a register.
-            println("  lea %s(%%rip), %s", node->var->name, reg(top++));
-        } else {
-            // Load a 64-bit address value from memory and set it to a register.
-            println("  mov %s@GOTPCREL(%%rip), %s", node->var->name, reg(top++));
-        }
-        return;
-    case ND_DEREF:
-        gen_expr(node->lhs);
-        return;
-    case ND_COMMA:
-        gen_expr(node->lhs);
-        top--;
-        gen_addr(node->rhs);
-        return;
-    case ND_MEMBER:
-        gen_addr(node->lhs);
-        println("  add $%d, %s", node->member->offset, reg(top - 1));
+// Appends an instruction to the list of the function being generated,
+// or prints it right away if the peephole optimizer doesn't run.
+static void emit_insn(Context *ctx, AsmInsn *insn) {
+    if (ctx->asm_list)
+        append_asm(ctx->asm_list, insn);
+    else
+        print_insn(ctx, insn);
+}
+
+static void emit0(Context *ctx, AsmOp op) {
+    AsmInsn insn = {0};
+    insn.op = op;
+    emit_insn(ctx, &insn);
+}
+
+static void emit1(Context *ctx, AsmOp op, AsmOperand a) {
+    AsmInsn insn = {0};
+    insn.op = op;
+    insn.args[0] = a;
+    insn.nargs = 1;
+    emit_insn(ctx, &insn);
+}
+
+static void emit2(Context *ctx, AsmOp op, AsmOperand a, AsmOperand b) {
+    AsmInsn insn = {0};
+    insn.op = op;
+    insn.args[0] = a;
+    insn.args[1] = b;
+    insn.nargs = 2;
+    emit_insn(ctx, &insn);
+}
+
+// setcc or jcc
+static void emit_cc(Context *ctx, AsmOp op, AsmCond cc, AsmOperand a) {
+    AsmInsn insn = {0};
+    insn.op = op;
+    insn.cc = cc;
+    insn.args[0] = a;
+    insn.nargs = 1;
+    emit_insn(ctx, &insn);
+}
+
+static void emit_label(Context *ctx, char *name) {
+    emit1(ctx, AS_LABEL, sym(OPND_SYM, name));
+}
+
+static void emit_jmp(Context *ctx, char *name) {
+    emit1(ctx, AS_JMP, sym(OPND_SYM, name));
+}
+
+static int count(Context *ctx) {
+    return ++ctx->label;
+}
+
+static char *format(char *fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    return strdup(buf);
+}
+
+// Values of integer types narrower than int are kept extended to 32
+// bits, so integer operations are either 32-bit or 64-bit.
+static int width(Type *ty) {
+    if (ty->kind == TY_ARRAY || ty->kind == TY_STRUCT || ty->kind == TY_FUNC)
+        return 8;
+    return ty->size == 8 ? 8 : 4;
+}
+
+// Returns the float or the double version of a scalar floating-point
+// instruction.
+static AsmOp fp_op(Type *ty, AsmOp op) {
+    return ty->kind == TY_FLOAT ? op : op + 1;
+}
+
+// Returns the instruction to load a char or a short extended to 32 bits.
+static AsmOp extend_op(Type *ty) {
+    if (ty->size == 1)
+        return ty->is_unsigned ? AS_MOVZBL : AS_MOVSBL;
+    assert(ty->size == 2);
+    return ty->is_unsigned ? AS_MOVZWL : AS_MOVSWL;
+}
+
+static bool fits_imm32(long val) {
+    return val == (int)val;
+}
+
+static bool is_imm(VReg *v) {
+    return v->ndefs == 1 && v->def->kind == IR_IMM;
+}
+
+static bool is_addr(VReg *v) {
+    return v->ndefs == 1 && v->def->kind == IR_ADDR;
+}
+
+static char *bb_label(Context *ctx, BasicBlock *bb) {
+    return format(".L.bb.%s.%d", ctx->gen_fn->name, bb->id);
+}
+
+// Compute the absolute address of a variable to a register.
+static void gen_addr(Context *ctx, Var *var, int r) {
+    if (var->is_local) {
+        // A local variable resides on the stack and has a fixed offset
+        // from the base pointer.
+        emit2(ctx, AS_LEA, slot(var->offset), reg(r, 8));
         return;
     }
 
-    error_tok(node->tok, "not an lvalue");
+    // Here we compute an absolute address of a given global variable.
+    // There are three different ways to compute a global variable below.
+    //
+    // 1. If -fno-pic is given, the resulting ELF module (i.e. an executable
+    //    or a .so file) doesn't have to be position-independent, meaning
+    //    that we can assume that the resulting code and data will be loaded
+    //    at a fixed memory location below 4 GiB. In this case, a 4-byte
+    //    absolute address can be computed at link-time and directly
+    //    embedded to a mov instruction.
+    //
+    // 2. If -fno-pic isn't given, the resulting ELF module may be loaded
+    //    anywhere in the 64-bit address space. We don't know the load
+    //    address at link-time. We have two different ways to compute an
+    //    address in this case:
+    //
+    // 2-1. A file-scope global variable: Because an ELF module is loaded to
+    //      memory as a unit, the relative offset between code and data in
+    //      the same ELF module is fixed whenever the module is loaded. A
+    //      file-scope global variable always resides in the same ELF object
+    //      as a use site, so we can use the RIP-relative addressing to
+    //      refer a variable. `foo(%rip)` refers address %RIP+addend where
+    //      addend is the offset between a use site and the location of
+    //      variable foo. The addend is computed by the linker at link-time.
+    //
+    // 2-2. A non-file-scope global variable: that variable may reside in a
+    //      different ELF module whose address is not known until run-time.
+    //      We know nothing about the location of the variable at link-time.
+    //      For those variable, each ELF module has a table of absolute
+    //      address of global variables. The table is called "GOT" (Global
+    //      Offset Tabel) and is filled by the loader. For example, if we
+    //      have a global variable foo which may not exist in the same ELF
+    //      module, we have a table entry for foo in a GOT, and at runtime
+    //      the table entry has a 8-byte absolute address of foo.
+    //
+    //      Since each ELF module has a GOT, and a relative address to a GOT
+    //      entry within the same ELF module doesn't change whenever the
+    //      module is loaded, we can use the RIP-relative memory access to
+    //      load a 8-byte value from GOT.
+    //
+    //      Not all variables need a GOT entry. By appending "@GOT" or
+    //      "@GOTPCREL" to a variable name, you can tell the linker you need
+    //      a GOT entry for that variable. "foo@GOTPCREL(%RIP)" refers a GOT
+    //      entry of variable foo at runtime.
+    if (!ctx->opt_fpic) {
+        // Load a 32-bit fixed address to a register.
+        emit2(ctx, AS_MOV, sym(OPND_IMM, var->name), reg(r, 8));
+    } else if (var->is_static) {
+        // Set %RIP+addend to a register.
+        emit2(ctx, AS_LEA, sym(OPND_MEM, var->name), reg(r, 8));
+    } else {
+        // Load a 64-bit address value from memory and set it to a register.
+        emit2(ctx, AS_MOV, sym(OPND_MEM, format("%s@GOTPCREL", var->name)), reg(r, 8));
+    }
 }
 
-// Load a value from where the stack top is pointing to.
-static void load(Type *ty) {
-    if (ty->kind == TY_ARRAY || ty->kind == TY_STRUCT || ty->kind == TY_FUNC) {
-        // If it is an array, do nothing because in general we can't load
-        // an entire array to a register. As a result, the result of an
-        // evaluation of an array becomes not the array itself but the
-        // address of the array. In other words, this is where "array is
-        // automatically converted to a pointer to the first element of
-        // the array in C" occurs.
+// Returns the bits of a constant as it is held in a register. A value
+// narrower than 8 bytes is held with the upper 32 bits cleared.
+static long imm_bits(VReg *v) {
+    if (width(v->ty) == 4)
+        return (unsigned)v->def->val;
+    return v->def->val;
+}
+
+static void load_imm(Context *ctx, Type *ty, long val, int r) {
+    if (width(ty) == 4)
+        emit2(ctx, AS_MOV, imm((int)val), reg(r, 4));
+    else if (fits_imm32(val))
+        emit2(ctx, AS_MOV, imm(val), reg(r, 8));
+    else
+        emit2(ctx, AS_MOVABS, imm(val), reg(r, 8));
+}
+
+// Load a value to a general-purpose register.
+static void load_gp(Context *ctx, VReg *v, int r) {
+    if (is_imm(v)) {
+        load_imm(ctx, v->ty, v->def->val, r);
         return;
     }
 
-    if (ty->kind == TY_FLOAT) {
-        println("  movss (%s), %s", reg(top - 1), freg(top - 1));
+    if (is_addr(v)) {
+        gen_addr(ctx, v->def->var, r);
         return;
     }
 
-    if (ty->kind == TY_DOUBLE) {
-        println("  movsd (%s), %s", reg(top - 1), freg(top - 1));
+    if (v->reg >= 0) {
+        if (v->reg != r)
+            emit2(ctx, AS_MOV, reg(v->reg, 8), reg(r, 8));
         return;
     }
-    
-    char *rs = reg(top - 1);
-    char *rd = xreg(ty, top - 1);
-    char *insn = ty->is_unsigned ? "movz" : "movs";
+    emit2(ctx, AS_MOV, slot(v->slot), reg(r, 8));
+}
 
-    // When we load a char or a short value to a register, we always
-    // extend them to the size of int, so we can assume the lower half of
-    // a register always contains a valid value. The upper half of a
-    // register for char, short and int may contain garbage. When we load
-    // a long value to a register, it simply occupies the entire register.
-    if (ty->size == 1)
-        println("  %sbl (%s), %s", insn, rs, rd);
-    else if (ty->size == 2)
-        println("  %swl (%s), %s", insn, rs, rd);
-    else
-        println("  mov (%s), %s", rs, rd);
+static void store_gp(Context *ctx, int r, VReg *v) {
+    if (v->reg >= 0) {
+        if (v->reg != r)
+            emit2(ctx, AS_MOV, reg(r, 8), reg(v->reg, 8));
+        return;
+    }
+    emit2(ctx, AS_MOV, reg(r, 8), slot(v->slot));
 }
 
-static void store(Type *ty) {
-    char *rd = reg(top - 1);
-    char *rs = reg(top - 2);
+static void load_fp(Context *ctx, VReg *v, int r) {
+    if (v->reg >= 0) {
+        if (v->reg != r)
+            emit2(ctx, AS_MOVAPS, xmm(v->reg), xmm(r));
+        return;
+    }
+    emit2(ctx, fp_op(v->ty, AS_MOVSS), slot(v->slot), xmm(r));
+}
 
-    if (ty->kind == TY_STRUCT) {
-        for (int i = 0; i < ty->size; i++) {
-            println("  mov %d(%s), %%al", i, rs);
-            println("  mov %%al, %d(%s)", i, rd);
-        }
-    } else if (ty->kind == TY_FLOAT) {
-        println("  movss %s, (%s)", freg(top - 2), rd);
-    } else if (ty->kind == TY_DOUBLE) {
-        println("  movsd %s, (%s)", freg(top - 2), rd);
-    } else if (ty->size == 1) {
-        println("  mov %sb, (%s)", rs, rd);
-    } else if (ty->size == 2) {
-        println("  mov %sw, (%s)", rs, rd);
-    } else if (ty->size == 4) {
-        println("  mov %sd, (%s)", rs, rd);
-    } else {
-        println("  mov %s, (%s)", rs, rd);
+static void store_fp(Context *ctx, int r, VReg *v) {
+    if (v->reg >= 0) {
+        if (v->reg != r)
+            emit2(ctx, AS_MOVAPS, xmm(r), xmm(v->reg));
+        return;
     }
+    emit2(ctx, fp_op(v->ty, AS_MOVSS), xmm(r), slot(v->slot));
+}
 
-    top--;
+// Returns the register to compute a result in, which is that of the
+// result itself unless an operand that is still to be read is there.
+static int result_reg(VReg *dst, VReg *operand, int scratch) {
+    if (dst->reg >= 0 && (!operand || operand->reg != dst->reg))
+        return dst->reg;
+    return scratch;
 }
 
-static void cmp_zero(Type *ty) {
-    if (ty->kind == TY_FLOAT) {
-        println("  xorps %%xmm0, %%xmm0");
-        println("  ucomiss %%xmm0, %s", freg(--top));
-    } else if (ty->kind == TY_DOUBLE) {
-        println("  xorpd %%xmm0, %%xmm0");
-        println("  ucomisd %%xmm0, %s", freg(--top));
-    } else {
-        println("  cmp $0, %s", reg(--top));
+// Returns an operand to read a value as a `size`-byte integer. The
+// value is loaded to a scratch register if it can't be an operand.
+static AsmOperand gp_operand(Context *ctx, VReg *v, int size, int scratch) {
+    if (is_imm(v) && size == 4)
+        return imm((int)v->def->val);
+    if (is_imm(v) && fits_imm32(imm_bits(v)))
+        return imm(imm_bits(v));
+    if (is_imm(v) || is_addr(v)) {
+        load_gp(ctx, v, scratch);
+        return reg(scratch, size);
     }
+    if (v->reg >= 0)
+        return reg(v->reg, size);
+    return slot(v->slot);
+}
+
+static AsmOperand fp_operand(VReg *v) {
+    if (v->reg >= 0)
+        return xmm(v->reg);
+    return slot(v->slot);
 }
 
-// Convert uint64 to double.
-static void convert_ulong_double(char *r, char *fr) {
+// Returns a memory operand for an address. The address is loaded to
+// a scratch register unless it is that of a local variable or it is
+// in a register.
+static AsmOperand mem_operand(Context *ctx, VReg *addr, int scratch) {
+    if (is_addr(addr) && addr->def->var->is_local)
+        return slot(addr->def->var->offset);
+    if (addr->reg >= 0)
+        return mem(addr->reg, 0);
+    load_gp(ctx, addr, scratch);
+    return mem(scratch, 0);
+}
+
+// Convert uint64 in %rax to double in %xmm0.
+static void convert_ulong_double(Context *ctx) {
     // This conversion is little tricky because x86 doesn't have an
     // instruction to convert uint64 to double. All we have is cvtsi2sd
     // which takes a signed 64-bit integer. Here is the strategy:
@@ -217,175 +362,378 @@ static void convert_ulong_double(char *r, char *fr) {
     //    This is a lossy conversion because double's fraction part (52
     //    bits long) can't represent all 64-bit integers. We need to
     //    keep the least significant bit to prevent a rounding error.
-    int c = count();
-    println("  cmp $0, %s", r);
-    println("  jl .L.cast.%d", c);
-    println("  cvtsi2sd %s, %s", r, fr);
-    println("  jmp .L.cast.end.%d", c);
-    println(".L.cast.%d:", c);
-    println("  mov %s, %%rax", r);
-    println("  and $1, %%rax");
-    println("  shr %s", r);
-    println("  or %%rax, %s", r);
-    println("  cvtsi2sd %s, %s", r, fr);
-    println("  addsd %s, %s", fr, fr);
-    println(".L.cast.end.%d:", c);
+    int c = count(ctx);
+    char *neg = format(".L.cast.%s.%d", ctx->gen_fn->name, c);
+    char *end = format(".L.cast.end.%s.%d", ctx->gen_fn->name, c);
+    emit2(ctx, AS_CMP, imm(0), reg(RAX, 8));
+    emit_cc(ctx, AS_JCC, CC_L, sym(OPND_SYM, neg));
+    emit2(ctx, AS_CVTSI2SDQ, reg(RAX, 8), xmm(0));
+    emit_jmp(ctx, end);
+    emit_label(ctx, neg);
+    emit2(ctx, AS_MOV, reg(RAX, 8), reg(RDX, 8));
+    emit2(ctx, AS_AND, imm(1), reg(RDX, 8));
+    emit1(ctx, AS_SHR, reg(RAX, 8));
+    emit2(ctx, AS_OR, reg(RDX, 8), reg(RAX, 8));
+    emit2(ctx, AS_CVTSI2SDQ, reg(RAX, 8), xmm(0));
+    emit2(ctx, AS_ADDSD, xmm(0), xmm(0));
+    emit_label(ctx, end);
 }
 
-static void cast(Type *from, Type *to) {
-    if (to->kind == TY_VOID)
+// Convert an integer in %rax from one type to another.
+static void cast_int(Context *ctx, Type *from, Type *to) {
+    if (to->size == 1 || to->size == 2)
+        emit2(ctx, extend_op(to), reg(RAX, to->size), reg(RAX, 4));
+    else if (to->size == 4)
+        emit2(ctx, AS_MOV, reg(RAX, 4), reg(RAX, 4));
+    else if (is_integer(from) && from->size < 8 && !from->is_unsigned)
+        emit2(ctx, AS_MOVSLQ, reg(RAX, 4), reg(RAX, 8));
+}
+
+// Convert an integer in %rax to a floating-point number in %xmm0.
+static void cast_int_fp(Context *ctx, Type *from, Type *to) {
+    if (from->size == 8 && from->is_unsigned) {
+        convert_ulong_double(ctx);
+        if (to->kind == TY_FLOAT)
+            emit2(ctx, AS_CVTSD2SS, xmm(0), xmm(0));
         return;
+    }
 
-    char *r = reg(top - 1);
-    char *fr = freg(top - 1);
+    if (width(from) == 8) {
+        emit2(ctx, fp_op(to, AS_CVTSI2SSQ), reg(RAX, 8), xmm(0));
+    } else if (from->is_unsigned) {
+        emit2(ctx, AS_MOV, reg(RAX, 4), reg(RAX, 4));
+        emit2(ctx, fp_op(to, AS_CVTSI2SSQ), reg(RAX, 8), xmm(0));
+    } else {
+        emit2(ctx, fp_op(to, AS_CVTSI2SSL), reg(RAX, 4), xmm(0));
+    }
+}
+
+// Compare a floating-point number in %xmm0 with zero.
+static void cmp_fp_zero(Context *ctx, Type *ty) {
+    emit2(ctx, AS_XORPS, xmm(1), xmm(1));
+    emit2(ctx, fp_op(ty, AS_UCOMISS), xmm(1), xmm(0));
+}
+
+static void gen_cast(Context *ctx, Insn *insn) {
+    Type *from = insn->from;
+    Type *to = insn->ty;
 
     if (to->kind == TY_BOOL) {
-        cmp_zero(from);
-        println("  setne %sb", reg(top));
-        println("  movzx %sb, %s", reg(top), reg(top));
-        top++;
+        if (is_flonum(from)) {
+            load_fp(ctx, insn->lhs, 0);
+            cmp_fp_zero(ctx, from);
+            emit_cc(ctx, AS_SET, CC_NE, reg(RAX, 1));
+            emit_cc(ctx, AS_SET, CC_P, reg(RDX, 1));
+            emit2(ctx, AS_OR, reg(RDX, 1), reg(RAX, 1));
+        } else {
+            load_gp(ctx, insn->lhs, RAX);
+            emit2(ctx, AS_CMP, imm(0), reg(RAX, width(from)));
+            emit_cc(ctx, AS_SET, CC_NE, reg(RAX, 1));
+        }
+        emit2(ctx, AS_MOVZBL, reg(RAX, 1), reg(RAX, 4));
+        store_gp(ctx, RAX, insn->dst);
         return;
     }
 
-    if (from->kind == TY_FLOAT) {
-        if (to->kind == TY_FLOAT)
+    if (is_flonum(from)) {
+        load_fp(ctx, insn->lhs, 0);
+        if (is_flonum(to)) {
+            if (from->kind != to->kind)
+                emit2(ctx, fp_op(from, AS_CVTSS2SD), xmm(0), xmm(0));
+            store_fp(ctx, 0, insn->dst);
             return;
-
-        if (to->kind == TY_DOUBLE)
-            println("  cvtss2sd %s, %s", fr, fr);
-        else
-            println("  cvttss2si %s, %s", fr, r);
+        }
+        emit2(ctx, fp_op(from, AS_CVTTSS2SI), xmm(0), reg(RAX, 8));
+        cast_int(ctx, ty_long, to);
+        store_gp(ctx, RAX, insn->dst);
         return;
     }
 
-    if (from->kind == TY_DOUBLE) {
-        if (to->kind == TY_DOUBLE)
-            return;
-
-        if (to->kind == TY_FLOAT)
-            println("  cvtsd2ss %s, %s", fr, fr);
-        else
-            println("  cvttsd2si %s, %s", fr, r);
+    load_gp(ctx, insn->lhs, RAX);
+    if (is_flonum(to)) {
+        cast_int_fp(ctx, from, to);
+        store_fp(ctx, 0, insn->dst);
         return;
     }
+    cast_int(ctx, from, to);
+    store_gp(ctx, RAX, insn->dst);
+}
 
-    if (to->kind == TY_FLOAT) {
-        println("  cvtsi2ss %s, %s", r, fr);
+static void gen_fp_binary(Context *ctx, Insn *insn) {
+    AsmOp ucomi = fp_op(insn->ty, AS_UCOMISS);
+
+    switch (insn->kind) {
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV: {
+        AsmOp op = insn->kind == IR_ADD ? AS_ADDSS : insn->kind == IR_SUB ? AS_SUBSS :
+                   insn->kind == IR_MUL ? AS_MULSS : AS_DIVSS;
+        int r = result_reg(insn->dst, insn->rhs, 0);
+        load_fp(ctx, insn->lhs, r);
+        emit2(ctx, fp_op(insn->ty, op), fp_operand(insn->rhs), xmm(r));
+        store_fp(ctx, r, insn->dst);
         return;
     }
+    }
 
-    if (to->kind == TY_DOUBLE) {
-        if (from->size == 8 && from->is_unsigned)
-            convert_ulong_double(r, fr);
-        else
-            println("  cvtsi2sd %s, %s", r, fr);
-        return;
+    // Comparisons. An unordered result, i.e. a NaN operand, sets ZF, PF
+    // and CF, so only `!=` is true for it.
+    load_fp(ctx, insn->lhs, 0);
+    load_fp(ctx, insn->rhs, 1);
+    switch (insn->kind) {
+    case IR_EQ:
+        emit2(ctx, ucomi, xmm(1), xmm(0));
+        emit_cc(ctx, AS_SET, CC_E, reg(RAX, 1));
+        emit_cc(ctx, AS_SET, CC_NP, reg(RDX, 1));
+        emit2(ctx, AS_AND, reg(RDX, 1), reg(RAX, 1));
+        break;
+    case IR_NE:
+        emit2(ctx, ucomi, xmm(1), xmm(0));
+        emit_cc(ctx, AS_SET, CC_NE, reg(RAX, 1));
+        emit_cc(ctx, AS_SET, CC_P, reg(RDX, 1));
+        emit2(ctx, AS_OR, reg(RDX, 1), reg(RAX, 1));
+        break;
+    case IR_LT:
+        emit2(ctx, ucomi, xmm(0), xmm(1));
+        emit_cc(ctx, AS_SET, CC_A, reg(RAX, 1));
+        break;
+    case IR_LE:
+        emit2(ctx, ucomi, xmm(0), xmm(1));
+        emit_cc(ctx, AS_SET, CC_AE, reg(RAX, 1));
+        break;
+    default:
+        error_tok(insn->tok, "invalid expression");
     }
+    emit2(ctx, AS_MOVZBL, reg(RAX, 1), reg(RAX, 4));
+    store_gp(ctx, RAX, insn->dst);
+}
 
-    char *insn = to->is_unsigned ? "movzx" : "movsx";
+static void gen_divmod(Context *ctx, Insn *insn) {
+    int w = width(insn->ty);
+    load_gp(ctx, insn->lhs, RAX);
 
-    if (to->size == 1) {
-        println("  %s %sb, %s", insn, r, r);
-    } else if (to->size == 2) {
-        println("  %s %sw, %s", insn, r, r);
-    } else if (to->size == 4) {
-        println("  mov %sd, %sd", r, r);
-    } else if (is_integer(from) && from->size < 8 && !from->is_unsigned) {
-        println("  movsx %sd, %s", r, r);
+    AsmOperand rs;
+    if (insn->rhs->reg >= 0) {
+        rs = reg(insn->rhs->reg, w);
+    } else {
+        load_gp(ctx, insn->rhs, RCX);
+        rs = reg(RCX, w);
     }
+
+    if (insn->ty->is_unsigned) {
+        emit2(ctx, AS_MOV, imm(0), reg(RDX, 4));
+        emit1(ctx, AS_DIV, rs);
+    } else {
+        emit0(ctx, w == 8 ? AS_CQO : AS_CDQ);
+        emit1(ctx, AS_IDIV, rs);
+    }
+    store_gp(ctx, insn->kind == IR_DIV ? RAX : RDX, insn->dst);
 }
 
-static void divmod(Node *node, char *rs, char *rd, char *r64, char *r32) {
-    if (node->ty->size == 8) {
-        println("  mov %s, %%rax", rd);
-        if (node->ty->is_unsigned) {
-            println("  mov $0, %%rdx");
-            println("  div %s", rs);
-        } else {
-            println("  cqo");
-            println("  idiv %s", rs);
-        }
-        println("  mov %s, %s", r64, rd);
+// Compare two integers and set the result to register `r`.
+static void gen_cmp(Context *ctx, Insn *insn, int r) {
+    int w = width(insn->ty);
+    AsmCond cc;
+    if (insn->kind == IR_EQ)
+        cc = CC_E;
+    else if (insn->kind == IR_NE)
+        cc = CC_NE;
+    else if (insn->kind == IR_LT)
+        cc = insn->ty->is_unsigned ? CC_B : CC_L;
+    else
+        cc = insn->ty->is_unsigned ? CC_BE : CC_LE;
+
+    AsmOperand rl;
+    if (insn->lhs->reg >= 0) {
+        rl = reg(insn->lhs->reg, w);
     } else {
-        println("  mov %s, %%eax", rd);
-        if (node->ty->is_unsigned) {
-            println("  mov $0, %%edx");
-            println("  div %s", rs);
+        load_gp(ctx, insn->lhs, RAX);
+        rl = reg(RAX, w);
+    }
+
+    emit2(ctx, AS_CMP, gp_operand(ctx, insn->rhs, w, RCX), rl);
+    emit_cc(ctx, AS_SET, cc, reg(r, 1));
+    emit2(ctx, AS_MOVZBL, reg(r, 1), reg(r, 4));
+    store_gp(ctx, r, insn->dst);
+}
+
+static void gen_binary(Context *ctx, Insn *insn) {
+    if (is_flonum(insn->ty)) {
+        gen_fp_binary(ctx, insn);
+        return;
+    }
+
+    if (insn->kind == IR_DIV || insn->kind == IR_MOD) {
+        gen_divmod(ctx, insn);
+        return;
+    }
+
+    int w = width(insn->ty);
+    int r = result_reg(insn->dst, insn->rhs, RAX);
+    AsmOperand rd = reg(r, w);
+
+    if (insn->kind == IR_EQ || insn->kind == IR_NE ||
+        insn->kind == IR_LT || insn->kind == IR_LE) {
+        gen_cmp(ctx, insn, r);
+        return;
+    }
+
+    load_gp(ctx, insn->lhs, r);
+
+    if (insn->kind == IR_SHL || insn->kind == IR_SHR) {
+        AsmOp op = insn->kind == IR_SHL ? AS_SHL : insn->ty->is_unsigned ? AS_SHR : AS_SAR;
+        if (is_imm(insn->rhs)) {
+            emit2(ctx, op, imm(insn->rhs->def->val & (w * 8 - 1)), rd);
         } else {
-            println("  cdq");
-            println("  idiv %s", rs);
+            load_gp(ctx, insn->rhs, RCX);
+            emit2(ctx, op, reg(RCX, 1), rd);
         }
-        println("  mov %s, %s", r32, rd);
+        store_gp(ctx, r, insn->dst);
+        return;
+    }
+
+    AsmOperand rs = gp_operand(ctx, insn->rhs, w, RCX);
+
+    switch (insn->kind) {
+    case IR_ADD:
+        emit2(ctx, AS_ADD, rs, rd);
+        break;
+    case IR_SUB:
+        emit2(ctx, AS_SUB, rs, rd);
+        break;
+    case IR_MUL:
+        emit2(ctx, AS_IMUL, rs, rd);
+        break;
+    case IR_AND:
+        emit2(ctx, AS_AND, rs, rd);
+        break;
+    case IR_OR:
+        emit2(ctx, AS_OR, rs, rd);
+        break;
+    case IR_XOR:
+        emit2(ctx, AS_XOR, rs, rd);
+        break;
+    default:
+        error_tok(insn->tok, "invalid expression");
     }
+    store_gp(ctx, r, insn->dst);
 }
 
-static void builtin_va_start(Node *node) {
-    int gp = 0;
-    int fp = 0;
+static void gen_load(Context *ctx, Insn *insn) {
+    Type *ty = insn->ty;
+    AsmOperand addr = mem_operand(ctx, insn->lhs, RAX);
 
-    for (Var *var = current_fn->params; var; var = var->next) {
-        if (is_flonum(var->ty))
-            fp++;
-        else
-            gp++;
+    if (is_flonum(ty)) {
+        int r = result_reg(insn->dst, NULL, 0);
+        emit2(ctx, fp_op(ty, AS_MOVSS), addr, xmm(r));
+        store_fp(ctx, r, insn->dst);
+        return;
     }
 
-    println("  mov -%d(%%rbp), %%rax", node->args[0]->offset);
-    println("  movl $%d, (%%rax)", gp * 8);
-    println("  movl $%d, 4(%%rax)", 48 + fp * 8);;
-    println("  mov %%rbp, 16(%%rax)");
-    println("  subq $128, 16(%%rax)");
-    top++;
+    // When we load a char or a short value to a register, we always
+    // extend them to the size of int, so we can assume the lower half of
+    // a register always contains a valid value.
+    int r = result_reg(insn->dst, NULL, RAX);
+    if (ty->size == 1 || ty->size == 2)
+        emit2(ctx, extend_op(ty), addr, reg(r, 4));
+    else
+        emit2(ctx, AS_MOV, addr, reg(r, ty->size));
+    store_gp(ctx, r, insn->dst);
 }
 
-// Load a local variable at RSP+offset to a xmm register.
-static void load_fp_arg(Type *ty, int offset, int r) {
-    if (ty->kind == TY_FLOAT)
-        println("  movss -%d(%%rbp), %%xmm%d", offset, r);
-    else
-        println("  movsd -%d(%%rbp), %%xmm%d", offset, r);
+static void gen_store(Context *ctx, Insn *insn) {
+    Type *ty = insn->ty;
+
+    if (is_flonum(ty)) {
+        int r = insn->rhs->reg >= 0 ? insn->rhs->reg : 0;
+        load_fp(ctx, insn->rhs, r);
+        emit2(ctx, fp_op(ty, AS_MOVSS), xmm(r), mem_operand(ctx, insn->lhs, RAX));
+        return;
+    }
+
+    int r = insn->rhs->reg >= 0 ? insn->rhs->reg : RCX;
+    load_gp(ctx, insn->rhs, r);
+    emit2(ctx, AS_MOV, reg(r, ty->size), mem_operand(ctx, insn->lhs, RAX));
 }
 
-// Load a local variable at RSP+offset to argreg[r].
-static void load_gp_arg(Type *ty, int offset, int r) {
-    char *insn = ty->is_unsigned ? "movz" : "movs";
+// Copy a struct.
+static void gen_copy(Context *ctx, Insn *insn) {
+    load_gp(ctx, insn->lhs, RAX);
+    load_gp(ctx, insn->rhs, RCX);
 
-    if (ty->size == 1)
-        println("  %sbl -%d(%%rbp), %s", insn, offset, argreg32[r]);
-    else if (ty->size == 2)
-        println("  %swl -%d(%%rbp), %s", insn, offset, argreg32[r]);
-    else if (ty->size == 4)
-        println("  mov -%d(%%rbp), %s", offset, argreg32[r]);
-    else
-        println("  mov -%d(%%rbp), %s", offset, argreg64[r]);
+    int size = insn->ty->size;
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        emit2(ctx, AS_MOV, mem(RCX, i), reg(RDX, 8));
+        emit2(ctx, AS_MOV, reg(RDX, 8), mem(RAX, i));
+    }
+    for (; i < size; i++) {
+        emit2(ctx, AS_MOV, mem(RCX, i), reg(RDX, 1));
+        emit2(ctx, AS_MOV, reg(RDX, 1), mem(RAX, i));
+    }
 }
 
-// Pushs a local variable at RSP+offset to the stack.
-static void push_arg(Type *ty, int offset) {
+static void gen_param(Context *ctx, Insn *insn) {
+    Type *ty = insn->ty;
+
+    if (insn->val >= 0) {
+        if (is_flonum(ty)) {
+            store_fp(ctx, insn->val, insn->dst);
+            return;
+        }
+
+        // The upper bits of a register for a narrow parameter are
+        // undefined, so clear them.
+        int r = argreg[insn->val];
+        if (ty->size == 1 || ty->size == 2)
+            emit2(ctx, extend_op(ty), reg(r, ty->size), reg(r, 4));
+        else if (width(ty) == 4)
+            emit2(ctx, AS_MOV, reg(r, 4), reg(r, 4));
+        store_gp(ctx, r, insn->dst);
+        return;
+    }
+
+    // Parameters passed on the stack are above the return address.
+    int offset = 16 + (-insn->val - 1) * 8;
     if (is_flonum(ty)) {
-        if (ty->kind == TY_FLOAT)
-            println("  mov -%d(%%rbp), %%eax", offset);
-        else
-            println("  mov -%d(%%rbp), %%rax", offset);
-    } else {
-        char *insn = ty->is_unsigned ? "movz" : "movs";
-        if (ty->size == 1)
-            println("  %sbl -%d(%%rbp), %%eax", insn, offset);
-        else if (ty->size == 2)
-            println("  %swl -%d(%%rbp), %%eax", insn, offset);
-        else if (ty->size == 4)
-            println("  mov -%d(%%rbp), %%eax", offset);
+        int r = result_reg(insn->dst, NULL, 0);
+        emit2(ctx, fp_op(ty, AS_MOVSS), mem(RBP, offset), xmm(r));
+        store_fp(ctx, r, insn->dst);
+        return;
+    }
+
+    int r = result_reg(insn->dst, NULL, RAX);
+    if (ty->size == 1 || ty->size == 2)
+        emit2(ctx, extend_op(ty), mem(RBP, offset), reg(r, 4));
+    else
+        emit2(ctx, AS_MOV, mem(RBP, offset), reg(r, width(ty)));
+    store_gp(ctx, r, insn->dst);
+}
+
+static void gen_va_start(Context *ctx, Insn *insn) {
+    int gp = 0;
+    int fp = 0;
+
+    for (Var *var = ctx->gen_fn->params; var; var = var->next) {
+        if (is_flonum(var->ty))
+            fp++;
         else
-            println("  mov -%d(%%rbp), %%rax", offset);
+            gp++;
     }
 
-    println("  push %%rax");
+    int stack = (gp > 6 ? gp - 6 : 0) + (fp > 8 ? fp - 8 : 0);
+
+    load_gp(ctx, insn->lhs, RAX);
+    emit2(ctx, AS_MOVL, imm(gp * 8), mem(RAX, 0));
+    emit2(ctx, AS_MOVL, imm(48 + fp * 8), mem(RAX, 4));
+    emit2(ctx, AS_LEA, mem(RBP, 16 + stack * 8), reg(RDX, 8));
+    emit2(ctx, AS_MOV, reg(RDX, 8), mem(RAX, 8));
+    emit2(ctx, AS_LEA, mem(RBP, -128), reg(RDX, 8));
+    emit2(ctx, AS_MOV, reg(RDX, 8), mem(RAX, 16));
 }
 
-// Load function call arguments. Arguments are already evaluated and
-// stored to the stack as local variables. What we need to do in this
-// function is to load them to registers or push them to the stack as
-// specified by the x86-64 psABI. Here is what the spec says:
+// Function calls follow the x86-64 psABI:
 //
 // - Up to 6 arguments of integral type are passed using RDI, RSI,
 //   RDX, RCX, R8 and R9.
@@ -400,668 +748,419 @@ static void push_arg(Type *ty, int offset) {
 //   the argument area must be aligned to a 16 byte boundary.
 //
 // - If a function is variadic, set the number of floating-point type
-//   arguments to RSP.
-static int load_args(Node *node) {
+//   arguments to RAX.
+static void gen_call(Context *ctx, Insn *insn) {
     int gp = 0;
     int fp = 0;
     int stack_size = 0;
-    bool *pass_stack = calloc(node->nargs, sizeof(bool));
-
-    // Load as many arguments as possible to the registers.
-    for (int i = 0; i < node->nargs; i++) {
-        Var *arg = node->args[i];
-
-        if (is_flonum(arg->ty)) {
-            if (fp < 8) {
-                load_fp_arg(arg->ty, arg->offset, fp++);
-                continue;
-            }
-        } else {
-            if (gp < 6) {
-                load_gp_arg(arg->ty, arg->offset, gp++);
-                continue;
-            }
-        }
-
-        pass_stack[i] = true;
-        stack_size += 8;
+    bool *pass_stack = calloc(insn->nargs, sizeof(bool));
+
+    // Save the caller-saved registers that hold values used after the
+    // call to their slots.
+    for (int i = 0; i < insn->nlive; i++) {
+        VReg *v = insn->live[i];
+        if (is_flonum(v->ty))
+            emit2(ctx, AS_MOVSD, xmm(v->reg), slot(v->slot));
+        else
+            emit2(ctx, AS_MOV, reg(v->reg, 8), slot(v->slot));
     }
 
-    // If we have arguments passed on the stack, push them to the stack.
-    if (stack_size) {
-        if (stack_size % 16) {
-            println("  sub $8, %%rsp");
+    for (int i = 0; i < insn->nargs; i++) {
+        if (is_flonum(insn->args[i]->ty) ? fp++ >= 8 : gp++ >= 6) {
+            pass_stack[i] = true;
             stack_size += 8;
         }
-
-        for (int i = node->nargs - 1; i >= 0; i--) {
-            if (!pass_stack[i])
-                continue;
-            Var *arg = node->args[i];
-            push_arg(arg->ty, arg->offset);
-        }
     }
 
-    // Set the number of floating-point arguments to RSP. Technically,
-    // we don't have to do this if a function isn't variadic, but we do
-    // this unconditionally for the sake of simplicity.
-    //
-    // The background of this ABI requirement: At the beginning of a
-    // variadic function, there exists code to save all parameter-passing
-    // registers to the stack so that va_arg can retrieve them one by one
-    // later. But in most cases, a variadic function doesn't take any
-    // floating-point argument, or even if it does, it takes only a few.
-    // So, saving all XMM0 to XMM7 registers is in most cases wasteful.
-    // By passing the actual number of floating-point arguments, the
-    // prologue code can save that cost.
-    int n = 0;
-    for (int i = 0; i < node->nargs; i++)
-        if (is_flonum(node->args[i]->ty))
-            n++;
-    println("  mov $%d, %%rax", n);
-
-    return stack_size;
-}
-
-// Generate code for a given node.
-static void gen_expr(Node *node) {
-    println("  .loc %d %d", node->tok->file_no, node->tok->line_no);
-
-    switch (node->kind) {
-    case ND_NUM:
-        if (node->ty->kind == TY_FLOAT) {
-            float val = node->fval;
-            println("  mov $%u, %%eax", *(int *)&val);
-            println("  movd %%eax, %s", freg(top++));
-        } else if (node->ty->kind == TY_DOUBLE) {
-            println("  movabs $%lu, %%rax", *(long *)&node->fval);
-            println("  movq %%rax, %s", freg(top++));
-        } else if (node->ty->kind == TY_LONG) {
-            println("  movabs $%lu, %s", node->val, reg(top++));
-        } else {
-            println("  mov $%lu, %s", node->val, reg(top++));
-        }
-        return;
-    case ND_VAR:
-        gen_addr(node);
-        load(node->ty);
-        return;
-    case ND_MEMBER: {
-        gen_addr(node);
-        load(node->ty);
-
-        Member *mem = node->member;
-        if (mem->is_bitfield) {
-            println("  shl $%d, %s", 64 - mem->bit_width - mem->bit_offset, reg(top - 1));
-            if (mem->ty->is_unsigned)
-                println("  shr $%d, %s", 64 - mem->bit_width, reg(top - 1));
-            else
-                println("  sar $%d, %s", 64 - mem->bit_width, reg(top - 1));
-        }
-        return;
+    // Push arguments passed on the stack.
+    if (stack_size % 16) {
+        emit2(ctx, AS_SUB, imm(8), reg(RSP, 8));
+        stack_size += 8;
     }
-    case ND_DEREF:
-        gen_expr(node->lhs);
-        load(node->ty);
-        return;
-    case ND_ADDR:
-        gen_addr(node->lhs);
-        return;
-    case ND_ASSIGN:
-        if (node->ty->kind == TY_ARRAY)
-            error_tok(node->tok, "not an lvalue");
- 
-        gen_expr(node->rhs);
-        gen_addr(node->lhs);
-
-        if (node->lhs->kind == ND_MEMBER && node->lhs->member->is_bitfield) {
-            // If the lhs is a bitfield, we need to read a value from memory
-            // and merge it with a new value.
-            Member *mem = node->lhs->member;
-            println("  mov %s, %s", reg(top - 1), reg(top));
-            top++;
-            load(mem->ty);
-
-            println("  and $%ld, %s", (1L << mem->bit_width) - 1, reg(top - 3));
-            println("  shl $%d, %s", mem->bit_offset, reg(top - 3));
-
-            long mask = ((1L << mem->bit_width) - 1) << mem->bit_offset;
-            println("  movabs $%ld, %%rax", ~mask);
-            println("  and %%rax, %s", reg(top - 1));
-            println("  or %s, %s", reg(top - 1), reg(top - 3));
-            top--;
-        }
 
-        store(node->ty);
-        return;
-    case ND_STMT_EXPR:
-        for (Node *n = node->body; n; n = n->next)
-            gen_stmt(n);
-        top++;
-        return;
-    case ND_NULL_EXPR:
-        top++;
-        return;
-    case ND_COMMA:
-        gen_expr(node->lhs);
-        top--;
-        gen_expr(node->rhs);
-        return;
-    case ND_CAST:
-        gen_expr(node->lhs);
-        cast(node->lhs->ty, node->ty);
-        return;
-    case ND_COND: {
-        int c = count();
-        gen_expr(node->cond);
-        cmp_zero(node->cond->ty);
-        println("  je .L.else.%d", c);
-        gen_expr(node->then);
-        top--;
-        println("  jmp .L.end.%d", c);
-        println(".L.else.%d:", c);
-        gen_expr(node->els);
-        println(".L.end.%d:", c);
-        return;
-    }
-    case ND_NOT:
-        gen_expr(node->lhs);
-        cmp_zero(node->lhs->ty);
-        println("  sete %sb", reg(top));
-        println("  movzx %sb, %s", reg(top), reg(top));
-        top++;
-        return;
-    case ND_BITNOT:
-        gen_expr(node->lhs);
-        println("  not %s", reg(top - 1));
-        return;
-    case ND_LOGAND: {
-        int c = count();
-        gen_expr(node->lhs);
-        cmp_zero(node->lhs->ty);
-        println("  je .L.false.%d", c);
-        gen_expr(node->rhs);
-        cmp_zero(node->rhs->ty);
-        println("  je .L.false.%d", c);
-        println("  mov $1, %s", reg(top));
-        println("  jmp .L.end.%d", c);
-        println(".L.false.%d:", c);
-        println("  mov $0, %s", reg(top++));
-        println(".L.end.%d:", c);
-        return;
-    }
-    case ND_LOGOR: {
-        int c = count();
-        gen_expr(node->lhs);
-        cmp_zero(node->lhs->ty);
-        println("  jne .L.true.%d", c);
-        gen_expr(node->rhs);
-        cmp_zero(node->rhs->ty);
-        println("  jne .L.true.%d", c);
-        println("  mov $0, %s", reg(top));
-        println("  jmp .L.end.%d", c);
-        println(".L.true.%d:", c);
-        println("  mov $1, %s", reg(top++));
-        println(".L.end.%d:", c);
-        return;
+    for (int i = insn->nargs - 1; i >= 0; i--) {
+        if (!pass_stack[i])
+            continue;
+        VReg *arg = insn->args[i];
+        if (is_flonum(arg->ty) && arg->reg >= 0)
+            emit2(ctx, AS_MOVQ, xmm(arg->reg), reg(RAX, 8));
+        else if (is_flonum(arg->ty))
+            emit2(ctx, AS_MOV, slot(arg->slot), reg(RAX, 8));
+        else
+            load_gp(ctx, arg, RAX);
+        emit1(ctx, AS_PUSH, reg(RAX, 8));
     }
-    case ND_FUNCALL: {
-        if (node->lhs->kind == ND_VAR &&
-                !strcmp(node->lhs->var->name, "__builtin_va_start")) {
-            builtin_va_start(node);
-            return;
-        }
 
-        // Save caller-saved registers
-        println("  sub $64, %%rsp");
-        println("  mov %%r10, (%%rsp)");
-        println("  mov %%r11, 8(%%rsp)");
-        println("  movsd %%xmm8, 16(%%rsp)");
-        println("  movsd %%xmm9, 24(%%rsp)");
-        println("  movsd %%xmm10, 32(%%rsp)");
-        println("  movsd %%xmm11, 40(%%rsp)");
-        println("  movsd %%xmm12, 48(%%rsp)");
-        println("  movsd %%xmm13, 56(%%rsp)");
-
-        gen_expr(node->lhs);
-        int memarg_size = load_args(node);
-
-        // Call a function
-        println("  call *%s", reg(--top));
-
-        if (memarg_size)
-            println("  sub $%d, %%rsp", memarg_size);
-
-        // The Systen V x86-64 ABI has a special rule regarding a boolean
-        // return value that only the lower 8 bits are valid for it and
-        // the upper 56bits may contain garbage. Here, we clear the upper
-        // 56 bits.
-        if (node->ty->kind == TY_BOOL)
-            println("  movzx %%al, %%eax");
-
-        // Restore caller-saved registers
-        println("  mov (%%rsp), %%r10");
-        println("  mov 8(%%rsp), %%r11");
-        println("  movsd 16(%%rsp), %%xmm8");
-        println("  movsd 24(%%rsp), %%xmm9");
-        println("  movsd 32(%%rsp), %%xmm10");
-        println("  movsd 40(%%rsp), %%xmm11");
-        println("  movsd 48(%%rsp), %%xmm12");
-        println("  movsd 56(%%rsp), %%xmm13");
-        println("  add $64, %%rsp");
-
-        if (node->ty->kind == TY_FLOAT)
-            println("  movss %%xmm0, %s", freg(top++));
-        else if (node->ty->kind == TY_DOUBLE)
-            println("  movsd %%xmm0, %s", freg(top++));
+    // Load the others to registers.
+    gp = fp = 0;
+    for (int i = 0; i < insn->nargs; i++) {
+        if (pass_stack[i])
+            continue;
+        VReg *arg = insn->args[i];
+        if (is_flonum(arg->ty))
+            load_fp(ctx, arg, fp++);
         else
-            println("  mov %%rax, %s", reg(top++));
-        return;
-    }
+            load_gp(ctx, arg, argreg[gp++]);
     }
 
-    // Binary expressions
-    gen_expr(node->lhs);
-    gen_expr(node->rhs);
-
-    char *rd = xreg(node->lhs->ty, top - 2);
-    char *rs = xreg(node->lhs->ty, top - 1);
-    char *fd = freg(top - 2);
-    char *fs = freg(top - 1);
-    top--;
-
-    switch (node->kind) {
-    case ND_ADD:
-        if (node->ty->kind == TY_FLOAT)
-            println("  addss %s, %s", fs, fd);
-        else if (node->ty->kind == TY_DOUBLE)
-            println("  addsd %s, %s", fs, fd);
+    // Call a function by name if we know it.
+    VReg *fn = insn->lhs;
+    if (is_addr(fn) && fn->def->var->ty->kind == TY_FUNC) {
+        Var *var = fn->def->var;
+        emit2(ctx, AS_MOV, imm(fp), reg(RAX, 4));
+        if (ctx->opt_fpic && !var->is_static)
+            emit1(ctx, AS_CALL, sym(OPND_SYM, format("%s@PLT", var->name)));
         else
-            println("  add %s, %s", rs, rd);
-        return;
-    case ND_SUB:
-        if (node->ty->kind == TY_FLOAT)
-            println("  subss %s, %s", fs, fd);
-        else if (node->ty->kind == TY_DOUBLE)
-            println("  subsd %s, %s", fs, fd);
-        else
-            println("  sub %s, %s", rs, rd);
-        return;
-    case ND_MUL:
-        if (node->ty->kind == TY_FLOAT)
-            println("  mulss %s, %s", fs, fd);
-        else if (node->ty->kind == TY_DOUBLE)
-            println("  mulsd %s, %s", fs, fd);
-        else
-            println("  imul %s, %s", rs, rd);
-        return;
-    case ND_DIV:
-        if (node->ty->kind == TY_FLOAT)
-            println("  divss %s, %s", fs, fd);
-        else if (node->ty->kind == TY_DOUBLE)
-            println("  divsd %s, %s", fs, fd);
-        else
-            divmod(node, rs, rd, "%rax", "%eax");
-        return;
-    case ND_MOD:
-        divmod(node, rs, rd, "%rdx", "%edx");
-        return;
-    case ND_BITAND:
-        println("  and %s, %s", rs, rd);
-        return;
-    case ND_BITOR:
-        println("  or %s, %s", rs, rd);
-        return;
-    case ND_BITXOR:
-        println("  xor %s, %s", rs, rd);
-        return;
-    case ND_EQ:
-        if (node->lhs->ty->kind == TY_FLOAT)
-            println("  ucomiss %s, %s", fs, fd);
-        else if (node->lhs->ty->kind == TY_DOUBLE)
-            println("  ucomisd %s, %s", fs, fd);
-        else
-            println("  cmp %s, %s", rs, rd);
-        println("  sete %%al");
-        println("  movzx %%al, %s", rd);
-        return;
-    case ND_NE:
-        if (node->lhs->ty->kind == TY_FLOAT)
-            println("  ucomiss %s, %s", fs, fd);
-        else if (node->lhs->ty->kind == TY_DOUBLE)
-            println("  ucomisd %s, %s", fs, fd);
+            emit1(ctx, AS_CALL, sym(OPND_SYM, var->name));
+    } else {
+        load_gp(ctx, fn, R11);
+        emit2(ctx, AS_MOV, imm(fp), reg(RAX, 4));
+        emit1(ctx, AS_CALL, reg(R11, 8));
+    }
+
+    if (stack_size)
+        emit2(ctx, AS_ADD, imm(stack_size), reg(RSP, 8));
+
+    for (int i = 0; i < insn->nlive; i++) {
+        VReg *v = insn->live[i];
+        if (is_flonum(v->ty))
+            emit2(ctx, AS_MOVSD, slot(v->slot), xmm(v->reg));
         else
-            println("  cmp %s, %s", rs, rd);
-        println("  setne %%al");
-        println("  movzx %%al, %s", rd);
-        return;
-    case ND_LT:
-        if (node->lhs->ty->kind == TY_FLOAT) {
-            println("  ucomiss %s, %s", fs, fd);
-            println("  setb %%al");
-        } else if (node->lhs->ty->kind == TY_DOUBLE) {
-            println("  ucomisd %s, %s", fs, fd);
-            println("  setb %%al");
-        } else {
-            println("  cmp %s, %s", rs, rd);
-            if (node->lhs->ty->is_unsigned)
-                println("  setb %%al");
-            else
-                println("  setl %%al");
-        }
-        println("  movzx %%al, %s", rd);
-        return;
-    case ND_LE:
-        if (node->lhs->ty->kind == TY_FLOAT) {
-            println("  ucomiss %s, %s", fs, fd);
-            println("  setbe %%al");
-        } else if (node->lhs->ty->kind == TY_DOUBLE) {
-            println("  ucomisd %s, %s", fs, fd);
-            println("  setbe %%al");
-        } else {
-            println("  cmp %s, %s", rs, rd);
-            if (node->lhs->ty->is_unsigned)
-                println("  setbe %%al");
-            else
-                println("  setle %%al");
-        }
-        println("  movzx %%al, %s", rd);
-        return;
-    case ND_SHL:
-        println("  mov %s, %%rcx", reg(top));
-        println("  shl %%cl, %s", rd);
+            emit2(ctx, AS_MOV, slot(v->slot), reg(v->reg, 8));
+    }
+
+    if (!insn->dst)
         return;
-    case ND_SHR:
-        println("  mov %s, %%rcx", reg(top));
-        if (node->lhs->ty->is_unsigned)
-            println("  shr %%cl, %s", rd);
-        else
-            println("  sar %%cl, %s", rd);
+
+    // The Systen V x86-64 ABI has a special rule regarding a boolean
+    // return value that only the lower 8 bits are valid for it and
+    // the upper 56bits may contain garbage. Here, we clear the upper
+    // 56 bits.
+    if (insn->ty->kind == TY_BOOL)
+        emit2(ctx, AS_MOVZBL, reg(RAX, 1), reg(RAX, 4));
+    else if (!is_flonum(insn->ty) && width(insn->ty) == 4)
+        emit2(ctx, AS_MOV, reg(RAX, 4), reg(RAX, 4));
+
+    if (is_flonum(insn->ty))
+        store_fp(ctx, 0, insn->dst);
+    else
+        store_gp(ctx, RAX, insn->dst);
+}
+
+static void gen_br(Context *ctx, Insn *insn) {
+    VReg *cond = insn->lhs;
+    char *then = bb_label(ctx, insn->then);
+    char *els = bb_label(ctx, insn->els);
+
+    if (is_imm(cond)) {
+        emit_jmp(ctx, cond->def->val ? then : els);
         return;
-    default:
-        error_tok(node->tok, "invalid expression");
     }
 
+    if (is_flonum(insn->ty)) {
+        load_fp(ctx, cond, 0);
+        cmp_fp_zero(ctx, insn->ty);
+        emit_cc(ctx, AS_JCC, CC_NE, sym(OPND_SYM, then));
+        emit_cc(ctx, AS_JCC, CC_P, sym(OPND_SYM, then));
+    } else {
+        int r = cond->reg >= 0 ? cond->reg : RAX;
+        load_gp(ctx, cond, r);
+        emit2(ctx, AS_CMP, imm(0), reg(r, width(insn->ty)));
+        emit_cc(ctx, AS_JCC, CC_NE, sym(OPND_SYM, then));
+    }
+    emit_jmp(ctx, els);
 }
 
-static void gen_stmt(Node *node) {
-    println("  .loc %d %d", node->tok->file_no, node->tok->line_no);
-
-    switch (node->kind) {
-    case ND_IF: {
-        int c = count();
-        if (node->els) {
-            gen_expr(node->cond);
-            cmp_zero(node->cond->ty);
-            println("  je .L.else.%d", c);
-            gen_stmt(node->then);
-            println("  jmp .L.end.%d", c);
-            println(".L.else.%d:", c);
-            gen_stmt(node->els);
-            println(".L.end.%d:", c);
+static void gen_insn(Context *ctx, Insn *insn) {
+    switch (insn->kind) {
+    case IR_IMM:
+        if (!is_imm(insn->dst)) {
+            int r = result_reg(insn->dst, NULL, RAX);
+            load_imm(ctx, insn->dst->ty, insn->val, r);
+            store_gp(ctx, r, insn->dst);
+        }
+        return;
+    case IR_FIMM: {
+        VReg *dst = insn->dst;
+        if (insn->ty->kind == TY_FLOAT) {
+            float val = insn->fval;
+            if (dst->reg < 0) {
+                emit2(ctx, AS_MOVL, imm(*(unsigned *)&val), slot(dst->slot));
+                return;
+            }
+            emit2(ctx, AS_MOV, imm(*(unsigned *)&val), reg(RAX, 4));
+            emit2(ctx, AS_MOVD, reg(RAX, 4), xmm(dst->reg));
         } else {
-            gen_expr(node->cond);
-            cmp_zero(node->cond->ty);
-            println("  je .L.end.%d", c);
-            gen_stmt(node->then);
-            println(".L.end.%d:", c);
+            emit2(ctx, AS_MOVABS, imm(*(long *)&insn->fval), reg(RAX, 8));
+            if (dst->reg < 0) {
+                emit2(ctx, AS_MOV, reg(RAX, 8), slot(dst->slot));
+                return;
+            }
+            emit2(ctx, AS_MOVQ, reg(RAX, 8), xmm(dst->reg));
         }
         return;
     }
-    case ND_FOR: {
-        int c = count();
-        int brk = brknum;
-        int cont = contnum;
-        brknum = contnum = c;
-
-        if (node->init)
-            gen_stmt(node->init);
-        println(".L.begin.%d:", c);
-        if (node->cond) {
-            gen_expr(node->cond);
-            cmp_zero(node->cond->ty);
-            println("  je .L.break.%d", c);
+    case IR_ADDR:
+        if (!is_addr(insn->dst)) {
+            int r = result_reg(insn->dst, NULL, RAX);
+            gen_addr(ctx, insn->var, r);
+            store_gp(ctx, r, insn->dst);
         }
-        gen_stmt(node->then);
-        println(".L.continue.%d:", c);
-        if (node->inc) {
-            gen_expr(node->inc);
-            top--;
+        return;
+    case IR_MOV:
+        if (is_flonum(insn->ty)) {
+            int r = result_reg(insn->dst, NULL, insn->lhs->reg >= 0 ? insn->lhs->reg : 0);
+            load_fp(ctx, insn->lhs, r);
+            store_fp(ctx, r, insn->dst);
+        } else {
+            int r = result_reg(insn->dst, NULL, insn->lhs->reg >= 0 ? insn->lhs->reg : RAX);
+            load_gp(ctx, insn->lhs, r);
+            store_gp(ctx, r, insn->dst);
         }
-        println("  jmp .L.begin.%d", c);
-        println(".L.break.%d:", c);
-
-        brknum = brk;
-        contnum = cont;
         return;
-    }
-    case ND_DO: {
-        int c = count();
-        int brk = brknum;
-        int cont = contnum;
-        brknum = contnum = c;
-
-        println(".L.begin.%d:", c);
-        gen_stmt(node->then);
-        println(".L.continue.%d:", c);
-        gen_expr(node->cond);
-        cmp_zero(node->cond->ty);
-        println("  jne .L.begin.%d", c);
-        println(".L.break.%d:", c);
-
-        brknum = brk;
-        contnum = cont;
+    case IR_NOT: {
+        int r = result_reg(insn->dst, NULL, RAX);
+        load_gp(ctx, insn->lhs, r);
+        emit1(ctx, AS_NOT, reg(r, width(insn->ty)));
+        store_gp(ctx, r, insn->dst);
         return;
     }
-    case ND_SWITCH: {
-        int c = count();
-        int brk = brknum;
-        brknum = c;
-        node->case_label = c;
-
-        gen_expr(node->cond);
-
-        for (Node *n = node->case_next; n; n = n->case_next) {
-            n->case_label = count();
-            n->case_end_label = c;
-            println("  cmp $%ld, %s", n->val, reg(top - 1));
-            println("  je .L.case.%d", n->case_label);
-        }
-        top--;
-
-        if (node->default_case) {
-            int i = count();
-            node->default_case->case_end_label = c;
-            node->default_case->case_label = i;
-            println("  jmp .L.case.%d", i);
-        }
-
-        println("  jmp .L.break.%d", c);
-        gen_stmt(node->then);
-        println(".L.break.%d:", c);
-
-        brknum = brk;
+    case IR_CAST:
+        gen_cast(ctx, insn);
         return;
-    }
-    case ND_CASE:
-        println(".L.case.%d:", node->case_label);
-        gen_stmt(node->lhs);
+    case IR_LOAD:
+        gen_load(ctx, insn);
         return;
-    case ND_BLOCK:
-        for (Node *n = node->body; n; n = n->next)
-            gen_stmt(n);
+    case IR_STORE:
+        gen_store(ctx, insn);
         return;
-    case ND_BREAK:
-        if (brknum == 0)
-            error_tok(node->tok, "stray break");
-        println("  jmp .L.break.%d", brknum);
+    case IR_COPY:
+        gen_copy(ctx, insn);
         return;
-    case ND_CONTINUE:
-        if (contnum == 0)
-            error_tok(node->tok, "stray continue");
-        println("  jmp .L.continue.%d", contnum);
+    case IR_PARAM:
+        gen_param(ctx, insn);
         return;
-    case ND_GOTO:
-        println("  jmp .L.label.%s.%s", current_fn->name, node->label_name);
+    case IR_CALL:
+        gen_call(ctx, insn);
         return;
-    case ND_LABEL:
-        println(".L.label.%s.%s:", current_fn->name, node->label_name);
-        gen_stmt(node->lhs);
+    case IR_VA_START:
+        gen_va_start(ctx, insn);
         return;
-    case ND_RETURN:
-        if (node->lhs) {
-            gen_expr(node->lhs);
-            if (is_flonum(node->lhs->ty))
-                println("  movsd %s, %%xmm0", freg(--top));
+    case IR_BR:
+        gen_br(ctx, insn);
+        return;
+    case IR_JMP:
+        emit_jmp(ctx, bb_label(ctx, insn->then));
+        return;
+    case IR_RET:
+        if (insn->lhs) {
+            if (is_flonum(insn->ty))
+                load_fp(ctx, insn->lhs, 0);
             else
-                println("  mov %s, %%rax", reg(--top));
+                load_gp(ctx, insn->lhs, RAX);
         }
-        println("  jmp .L.return.%s", current_fn->name);
-        return;
-    case ND_EXPR_STMT:
-        gen_expr(node->lhs);
-        top--;
+        emit_jmp(ctx, format(".L.return.%s", ctx->gen_fn->name));
         return;
-    default:
-        error_tok(node->tok, "invalid statement");
     }
+
+    gen_binary(ctx, insn);
 }
 
-static void emit_bss(Program *prog) {
-    println("  .bss");
+static void emit_bss(Context *ctx, Program *prog) {
+    println(ctx, "  .bss");
 
     for (Var *var = prog->globals; var; var = var->next) {
         if (var->init_data)
             continue;
 
-        println("  .align %d", var->align);
+        println(ctx, "  .align %d", var->align);
         if (!var->is_static)
-            println("  .globl %s", var->name);
-        println("%s:", var->name);
-        println("  .zero %d", var->ty->size);
+            println(ctx, "  .globl %s", var->name);
+        println(ctx, "%s:", var->name);
+        println(ctx, "  .zero %d", var->ty->size);
     }
 }
 
-static void emit_data(Program *prog) {
-    println("  .data");
+static void emit_data(Context *ctx, Program *prog) {
+    println(ctx, "  .data");
 
     for (Var *var = prog->globals; var; var = var->next) {
         if (!var->init_data)
             continue;
 
-        println("  .align %d", var->align);
+        println(ctx, "  .align %d", var->align);
         if (!var->is_static)
-            println("  .globl %s", var->name);
-        println("%s:", var->name);
+            println(ctx, "  .globl %s", var->name);
+        println(ctx, "%s:", var->name);
 
         Relocation *rel = var->rel;
         int pos = 0;
         while (pos < var->ty->size) {
             if (rel && rel->offset == pos) {
-                println("  .quad %s%+ld", rel->label, rel->addend);
+                println(ctx, "  .quad %s%+ld", rel->label, rel->addend);
                 rel = rel->next;
                 pos += 8;
             } else {
-                println("  .byte %d", var->init_data[pos++]);
+                println(ctx, "  .byte %d", var->init_data[pos++]);
             }
         }
     }
 }
 
-static char *get_argreg(int sz, int idx) {
-    if (sz == 1)
-        return argreg8[idx];
-    if (sz == 2)
-        return argreg16[idx];
-    if (sz == 4)
-        return argreg32[idx];
-    assert(sz == 8);
-    return argreg64[idx];
-}
 
-static void emit_text(Program *prog) {
-    println("  .text");
-
-    for (Function *fn = prog->fns; fn; fn = fn->next) {
-        if (!fn->is_static)
-            println("  .globl %s", fn->name);
-        println("%s:", fn->name);
-        current_fn = fn;
-    
-        // Prologue. %r12-15 are callee-saved retisters.
-        println("  push %%rbp");
-        println("  mov %%rsp, %%rbp");
-        println("  sub $%d, %%rsp", fn->stack_size);
-        println("  mov %%r12, -8(%%rbp)");
-        println("  mov %%r13, -16(%%rbp)");
-        println("  mov %%r14, -24(%%rbp)");
-        println("  mov %%r15, -32(%%rbp)");
-
-        // Save arg registers if function is variadic
-        if (fn->is_variadic) {
-            println("  mov %%rdi, -128(%%rbp)");
-            println("  mov %%rsi, -120(%%rbp)");
-            println("  mov %%rdx, -112(%%rbp)");
-            println("  mov %%rcx, -104(%%rbp)");
-            println("  mov %%r8, -96(%%rbp)");
-            println("  mov %%r9, -88(%%rbp)");
-            println("  movsd %%xmm0, -80(%%rbp)");
-            println("  movsd %%xmm1, -72(%%rbp)");
-            println("  movsd %%xmm2, -64(%%rbp)");
-            println("  movsd %%xmm3, -56(%%rbp)");
-            println("  movsd %%xmm4, -48(%%rbp)");
-            println("  movsd %%xmm5, -40(%%rbp)");
-        }
+static void emit_function(Context *ctx, Function *fn) {
+    IRFunction *ir = lower_function(ctx, fn);
+    optimize(ctx, ir);
+    if (ctx->opt_dump_ir)
+        dump_ir(diag_stream(), ir);
+    if (ctx->opt_level)
+        from_ssa(ir);
+
+    RegSet regs = {0};
+    regs.callee_saved = callee_saved;
+    regs.ncallee_saved = sizeof(callee_saved) / sizeof(*callee_saved);
+    regs.caller_saved = caller_saved;
+    regs.ncaller_saved = sizeof(caller_saved) / sizeof(*caller_saved);
+    regs.fp = fp_regs;
+    regs.nfp = sizeof(fp_regs) / sizeof(*fp_regs);
+    regs.gp_args = gp_arg_regs;
+    regs.ngp_args = sizeof(gp_arg_regs) / sizeof(*gp_arg_regs);
+    regs.fp_args = fp_arg_regs;
+    regs.nfp_args = sizeof(fp_arg_regs) / sizeof(*fp_arg_regs);
+    allocate_registers(ir, &regs);
+
+    // Assign stack slots below the local variables to the registers
+    // that are spilled. Callee-saved registers that are used are saved
+    // below them.
+    int offset = fn->stack_size;
+    bool used[16] = {0};
+    int gp_save[16] = {0};
+    int fp_save[16] = {0};
+    bool is_leaf = true;
+    for (BasicBlock *bb = ir->bbs; bb; bb = bb->next) {
+        for (Insn *insn = bb->insns; insn; insn = insn->next) {
+            if (insn->kind == IR_CALL || (insn->kind == IR_PARAM && insn->val < 0))
+                is_leaf = false;
+
+            VReg *vregs[] = {insn->dst, insn->lhs, insn->rhs};
+            for (int i = 0; i < 3 + insn->nargs; i++) {
+                VReg *v = (i < 3) ? vregs[i] : insn->args[i - 3];
+                if (!v || is_remat(v))
+                    continue;
+                if (v->reg >= 0 && !is_flonum(v->ty))
+                    used[v->reg] = true;
+                if (v->reg < 0 && !v->slot) {
+                    offset += 8;
+                    v->slot = offset;
+                }
+            }
 
-        // Push arguments to the stack
-        int gp = 0, fp = 0;
-        for (Var *var = fn->params; var; var = var->next) {
-            if (is_flonum(var->ty))
-                fp++;
-            else
-                gp++;
+            // Registers saved around a call share a slot per register.
+            for (int i = 0; i < insn->nlive; i++) {
+                VReg *v = insn->live[i];
+                int *slot = is_flonum(v->ty) ? &fp_save[v->reg] : &gp_save[v->reg];
+                if (!*slot) {
+                    offset += 8;
+                    *slot = offset;
+                }
+                v->slot = *slot;
+            }
         }
+    }
 
-        for (Var *var = fn->params; var; var = var->next) {
-            if (var->ty->kind == TY_FLOAT) {
-                println("  movss %%xmm%d, -%d(%%rbp)", --fp, var->offset);
-            } else if (var->ty->kind == TY_DOUBLE) {
-                println("  movsd %%xmm%d, -%d(%%rbp)", --fp, var->offset);
-            } else {
-                char *r = get_argreg(var->ty->size, --gp);
-                println("  mov %s, -%d(%%rbp)", r, var->offset);
+    int saved[16];
+    int saved_slot[16];
+    int nsaved = 0;
+    for (int i = 0; i < sizeof(callee_saved) / sizeof(*callee_saved); i++) {
+        if (!used[callee_saved[i]])
+            continue;
+        offset += 8;
+        saved[nsaved] = callee_saved[i];
+        saved_slot[nsaved++] = offset;
+    }
+    int stack_size = align_to(offset, 16);
+
+    // A function that calls nothing and keeps everything in scratch
+    // registers doesn't need a frame.
+    bool frameless = is_leaf && stack_size == 0 && !fn->is_variadic;
+
+    if (!fn->is_static)
+        println(ctx, "  .globl %s", fn->name);
+    println(ctx, "%s:", fn->name);
+    ctx->gen_fn = fn;
+
+    // With optimization, instructions are collected to a list for the
+    // peephole optimizer. Otherwise they are printed as they are built.
+    AsmList *list = NULL;
+    if (ctx->opt_level) {
+        list = calloc(1, sizeof(AsmList));
+        ctx->asm_list = list;
+    }
+
+    // Prologue
+    if (!frameless) {
+        emit1(ctx, AS_PUSH, reg(RBP, 8));
+        emit2(ctx, AS_MOV, reg(RSP, 8), reg(RBP, 8));
+        if (stack_size)
+            emit2(ctx, AS_SUB, imm(stack_size), reg(RSP, 8));
+    }
+    for (int i = 0; i < nsaved; i++)
+        emit2(ctx, AS_MOV, reg(saved[i], 8), slot(saved_slot[i]));
+
+    // Save arg registers if function is variadic
+    if (fn->is_variadic) {
+        for (int i = 0; i < 6; i++)
+            emit2(ctx, AS_MOV, reg(argreg[i], 8), slot(128 - i * 8));
+        for (int i = 0; i < 6; i++)
+            emit2(ctx, AS_MOVSD, xmm(i), slot(80 - i * 8));
+    }
+
+    // Emit code
+    Token *loc = NULL;
+    for (BasicBlock *bb = ir->bbs; bb; bb = bb->next) {
+        emit_label(ctx, bb_label(ctx, bb));
+
+        for (Insn *insn = bb->insns; insn; insn = insn->next) {
+            Token *tok = insn->tok;
+            if (tok && (!loc || tok->file_no != loc->file_no || tok->line_no != loc->line_no)) {
+                emit2(ctx, AS_LOC, imm(tok->file_no), imm(tok->line_no));
+                loc = tok;
             }
+            gen_insn(ctx, insn);
         }
-    
-        // Emit code
-        gen_stmt(fn->body);
-        assert(top == 0);
-
-        // The C spec defines a special rule for the main function.
-        // Reaching the end of the main function is equivalent to
-        // returning 0, even though the behavior is undefined for the
-        // other functions. See C11 5.1.2.2.3.
-        if (strcmp(fn->name, "main") == 0)
-            println("  mov $0, %%rax");
-    
-        // Epilogue
-        println(".L.return.%s:", fn->name);
-        println("  mov -8(%%rbp), %%r12");
-        println("  mov -16(%%rbp), %%r13");
-        println("  mov -24(%%rbp), %%r14");
-        println("  mov -32(%%rbp), %%r15");
-        println("  mov %%rbp, %%rsp");
-        println("  pop %%rbp");
-        println("  ret");
     }
+
+    // Epilogue
+    emit_label(ctx, format(".L.return.%s", fn->name));
+    for (int i = 0; i < nsaved; i++)
+        emit2(ctx, AS_MOV, slot(saved_slot[i]), reg(saved[i], 8));
+    if (!frameless) {
+        emit2(ctx, AS_MOV, reg(RBP, 8), reg(RSP, 8));
+        emit1(ctx, AS_POP, reg(RBP, 8));
+    }
+    emit0(ctx, AS_RET);
+
+    if (!list)
+        return;
+    ctx->asm_list = NULL;
+    double start = trace_now(ctx);
+    peephole(list);
+    trace_span(ctx, "opt", "peephole", start);
+    print_asm(ctx, list);
+}
+
+static void emit_text(Context *ctx, Program *prog) {
+    println(ctx, "  .text");
+
+    emit_functions(ctx, prog, emit_function);
 }
 
-void codegen(Program *prog) {
-    char **paths = get_input_files();
+void codegen(Context *ctx, Program *prog) {
+    char **paths = get_input_files(ctx);
     for (int i = 0; paths[i]; i++)
-        println("  .file %d \"%s\"", i + 1, paths[i]);
+        println(ctx, "  .file %d \"%s\"", i + 1, paths[i]);
 
-    emit_bss(prog);
-    emit_data(prog);
-    emit_text(prog);
+    emit_bss(ctx, prog);
+    emit_data(ctx, prog);
+    emit_text(ctx, prog);
 }
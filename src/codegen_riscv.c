@@ -1,17 +1,18 @@
 #include "711cc.h"
 
-static int top;
-static int brknum;
-static int contnum;
+// The RISC-V code generator still walks the AST of each function and
+// evaluates expressions on a stack of registers, s2-s11 and fs0-fs11.
+// Unlike the x86-64 backend, it doesn't use the IR of ir.c, so -O1 and
+// -O2 don't change its output, and promoted variables keep their stack
+// slots (see PHASE_STACK in main.c).
+
 static char *argreg[] = {"a0", "a1", "a2", "a3", "a4", "a5", "a6", "a7"};
 static char *fargreg[] = {"fa0", "fa1", "fa2", "fa3", "fa4", "fa5", "fa6", "fa7"};
 static int reg_save_area_offset[] = {-248/*a0*/, -240/*a1*/, -232/*a2*/, -224/*a3*/,
                                      -216/*a4*/, -208/*a5*/, -200/*a6*/, -192/*a7*/};
-static Function *current_fn;
 
-static int count(void) {
-    static int i = 1;
-    return i++;
+static int count(Context *ctx) {
+    return ++ctx->label;
 }
 
 static char *reg(int idx) {
@@ -35,28 +36,28 @@ static char *freg(int idx) {
 
 // In RISC-V, `addi` can take only sign-extended 12-bit immediated [-2048, 2047].
 // This function allows to take larger/smaller immedeates.
-static void gen_addi(char *rd, char *rs, long imm) {
+static void gen_addi(Context *ctx, char *rd, char *rs, long imm) {
     if (-2048 <= imm && imm <= 2047) {
-        println("  addi %s, %s, %ld", rd, rs, imm);
+        println(ctx, "  addi %s, %s, %ld", rd, rs, imm);
         return;
     }
 
-    println("  li t1, %ld", imm);
-    println("  add %s, %s, t1", rd, rs);
+    println(ctx, "  li t1, %ld", imm);
+    println(ctx, "  add %s, %s, t1", rd, rs);
 }
 
-static void gen_expr(Node *node);
-static void gen_stmt(Node *node);
+static void gen_expr(Context *ctx, Node *node);
+static void gen_stmt(Context *ctx, Node *node);
 
 // Compute the absolute address of a given node.
 // It's an error if a given node does not reside in memory.
-static void gen_addr(Node *node) {
+static void gen_addr(Context *ctx, Node *node) {
     switch (node->kind) {
     case ND_VAR:
         if (node->var->is_local) {
             // A local variable resides on the stack and has a fixed offset
             // from the base pointer.
-            gen_addi(reg(top++), "s0", -1 * node->var->offset);
+            gen_addi(ctx, reg(ctx->top++), "s0", -1 * node->var->offset);
             return;
         }
 
@@ -98,30 +99,30 @@ static void gen_addr(Node *node) {
         //      entry within the same ELF module doesn't change whenever the
         //      module is loaded, we can use the RIP-relative memory access to
         //      load a 8-byte value from GOT.
-        if (!opt_fpic) {
+        if (!ctx->opt_fpic) {
             // Load a 32-bit fixed address to a register.
-            println("  mov $%s, %s", node->var->name, reg(top++));
+            println(ctx, "  mov $%s, %s", node->var->name, reg(ctx->top++));
         } else if (node->var->is_static) {
             // Load an address to a register.
-            println("  lui %s, %%hi(%s)", reg(top), node->var->name);
-            println("  addi %s, %s, %%lo(%s)", reg(top), reg(top), node->var->name);
-            top++;
+            println(ctx, "  lui %s, %%hi(%s)", reg(ctx->top), node->var->name);
+            println(ctx, "  addi %s, %s, %%lo(%s)", reg(ctx->top), reg(ctx->top), node->var->name);
+            ctx->top++;
         } else {
             // Load a 64-bit address value from memory and set it to a register.
-            println("  la %s, %s", reg(top++), node->var->name);
+            println(ctx, "  la %s, %s", reg(ctx->top++), node->var->name);
         }
         return;
     case ND_DEREF:
-        gen_expr(node->lhs);
+        gen_expr(ctx, node->lhs);
         return;
     case ND_COMMA:
-        gen_expr(node->lhs);
-        top--;
-        gen_addr(node->rhs);
+        gen_expr(ctx, node->lhs);
+        ctx->top--;
+        gen_addr(ctx, node->rhs);
         return;
     case ND_MEMBER:
-        gen_addr(node->lhs);
-        gen_addi(reg(top - 1), reg(top - 1), node->member->offset);
+        gen_addr(ctx, node->lhs);
+        gen_addi(ctx, reg(ctx->top - 1), reg(ctx->top - 1), node->member->offset);
         return;
     }
 
@@ -129,7 +130,7 @@ static void gen_addr(Node *node) {
 }
 
 // Load a value from where the stack top is pointing to.
-static void load(Type *ty) {
+static void load(Context *ctx, Type *ty) {
     if (ty->kind == TY_ARRAY || ty->kind == TY_STRUCT || ty->kind == TY_FUNC) {
         // If it is an array, do nothing because in general we can't load
         // an entire array to a register. As a result, the result of an
@@ -141,17 +142,17 @@ static void load(Type *ty) {
     }
 
     if (ty->kind == TY_FLOAT) {
-        println("  flw %s, (%s)", freg(top - 1), reg(top - 1));
+        println(ctx, "  flw %s, (%s)", freg(ctx->top - 1), reg(ctx->top - 1));
         return;
     }
 
     if (ty->kind == TY_DOUBLE) {
-        println("  fld %s, (%s)", freg(top - 1), reg(top - 1));
+        println(ctx, "  fld %s, (%s)", freg(ctx->top - 1), reg(ctx->top - 1));
         return;
     }
     
-    char *rs = reg(top - 1);
-    char *rd = reg(top - 1);
+    char *rs = reg(ctx->top - 1);
+    char *rd = reg(ctx->top - 1);
 
     // When we load a char or a short value to a register, we always
     // extend them to the size of int, so we can assume the lower half of
@@ -160,83 +161,83 @@ static void load(Type *ty) {
     // a long value to a register, it simply occupies the entire register.
     if (ty->size == 1) {
         if (ty->is_unsigned)
-            println("  lbu %s, (%s)", rd, rs);
+            println(ctx, "  lbu %s, (%s)", rd, rs);
         else
-            println("  lb %s, (%s)", rd, rs);
+            println(ctx, "  lb %s, (%s)", rd, rs);
     }
     else if (ty->size == 2) {
         if (ty->is_unsigned)
-            println("  lhu %s, (%s)", rd, rs);
+            println(ctx, "  lhu %s, (%s)", rd, rs);
         else
-            println("  lh %s, (%s)", rd, rs);
+            println(ctx, "  lh %s, (%s)", rd, rs);
     }
     else if (ty->size == 4) {
         if (ty->is_unsigned)
-            println("  lwu %s, (%s)", rd, rs);
+            println(ctx, "  lwu %s, (%s)", rd, rs);
         else
-            println("  lw %s, (%s)", rd, rs);
+            println(ctx, "  lw %s, (%s)", rd, rs);
     }
     else {
-        println("  ld %s, (%s)", rd, rs);
+        println(ctx, "  ld %s, (%s)", rd, rs);
     }
 }
 
-static void store(Type *ty) {
-    char *rd = reg(top - 1);
-    char *rs = reg(top - 2);
+static void store(Context *ctx, Type *ty) {
+    char *rd = reg(ctx->top - 1);
+    char *rs = reg(ctx->top - 2);
 
     if (ty->kind == TY_STRUCT) {
         for (int i = 0; i < ty->size; i++) {
-            println("  lb t0, %d(%s)", i, rs);
-            println("  sb t0, %d(%s)", i, rd);
+            println(ctx, "  lb t0, %d(%s)", i, rs);
+            println(ctx, "  sb t0, %d(%s)", i, rd);
         }
     } else if (ty->kind == TY_FLOAT) {
-        println("  fsw %s, (%s)", freg(top - 2), rd);
+        println(ctx, "  fsw %s, (%s)", freg(ctx->top - 2), rd);
     } else if (ty->kind == TY_DOUBLE) {
-        println("  fsd %s, (%s)", freg(top - 2), rd);
+        println(ctx, "  fsd %s, (%s)", freg(ctx->top - 2), rd);
     } else if (ty->size == 1) {
-        println("  sb %s, (%s)", rs, rd);
+        println(ctx, "  sb %s, (%s)", rs, rd);
     } else if (ty->size == 2) {
-        println("  sh %s, (%s)", rs, rd);
+        println(ctx, "  sh %s, (%s)", rs, rd);
     } else if (ty->size == 4) {
-        println("  sw %s, (%s)", rs, rd);
+        println(ctx, "  sw %s, (%s)", rs, rd);
     } else {
-        println("  sd %s, (%s)", rs, rd);
+        println(ctx, "  sd %s, (%s)", rs, rd);
     }
 
-    top--;
+    ctx->top--;
 }
 
-static void cmp_zero(Type *ty) {
+static void cmp_zero(Context *ctx, Type *ty) {
     if (ty->kind == TY_FLOAT) {
-        char *fs = freg(--top);
-        char *rd = reg(top);
-        println("  fmv.s.x ft0, zero");
-        println("  feq.s %s, %s, ft0", rd, fs);
+        char *fs = freg(--ctx->top);
+        char *rd = reg(ctx->top);
+        println(ctx, "  fmv.s.x ft0, zero");
+        println(ctx, "  feq.s %s, %s, ft0", rd, fs);
     } else if (ty->kind == TY_DOUBLE) {
-        char *fs = freg(--top);
-        char *rd = reg(top);
-        println("  fmv.d.x ft0, zero");
-        println("  feq.d %s, %s, ft0", rd, fs);
+        char *fs = freg(--ctx->top);
+        char *rd = reg(ctx->top);
+        println(ctx, "  fmv.d.x ft0, zero");
+        println(ctx, "  feq.d %s, %s, ft0", rd, fs);
     } else {
-        char *rd = reg(--top);
+        char *rd = reg(--ctx->top);
         char *rs = rd;
-        println("  seqz %s, %s", rd, rs);
+        println(ctx, "  seqz %s, %s", rd, rs);
     }
 }
 
-static void cast(Type *from, Type *to) {
+static void cast(Context *ctx, Type *from, Type *to) {
     if (to->kind == TY_VOID)
         return;
 
-    char *r = reg(top - 1);
-    char *fr = freg(top - 1);
+    char *r = reg(ctx->top - 1);
+    char *fr = freg(ctx->top - 1);
 
     if (to->kind == TY_BOOL) {
-        cmp_zero(from);
-        println("  seqz %s, %s", reg(top), reg(top));
-        println("  andi %s, %s, 0xff", reg(top), reg(top));
-        top++;
+        cmp_zero(ctx, from);
+        println(ctx, "  seqz %s, %s", reg(ctx->top), reg(ctx->top));
+        println(ctx, "  andi %s, %s, 0xff", reg(ctx->top), reg(ctx->top));
+        ctx->top++;
         return;
     }
 
@@ -245,9 +246,9 @@ static void cast(Type *from, Type *to) {
             return;
 
         if (to->kind == TY_DOUBLE)
-            println("  fcvt.d.s %s, %s", fr, fr);
+            println(ctx, "  fcvt.d.s %s, %s", fr, fr);
         else /* integer */
-            println("  fcvt.l.s %s, %s, rtz", r, fr);
+            println(ctx, "  fcvt.l.s %s, %s, rtz", r, fr);
         return;
     }
 
@@ -256,19 +257,19 @@ static void cast(Type *from, Type *to) {
             return;
 
         if (to->kind == TY_FLOAT)
-            println("  fcvt.s.d %s, %s", fr, fr);
+            println(ctx, "  fcvt.s.d %s, %s", fr, fr);
         else /* integer */
-            println("  fcvt.l.d %s, %s, rtz", r, fr);
+            println(ctx, "  fcvt.l.d %s, %s, rtz", r, fr);
         return;
     }
 
     if (to->kind == TY_FLOAT) {
-        println("  fcvt.s.l %s, %s", fr, r);
+        println(ctx, "  fcvt.s.l %s, %s", fr, r);
         return;
     }
 
     if (to->kind == TY_DOUBLE) {
-        println("  fcvt.d.l %s, %s", fr, r);
+        println(ctx, "  fcvt.d.l %s, %s", fr, r);
         return;
     }
 
@@ -278,138 +279,138 @@ static void cast(Type *from, Type *to) {
     // (sp) to t0 register, and re-store it to (sp) after cast.
     char *suffix = to->is_unsigned ? "u" : "";
     if (to->size == 1) {
-        println("  addi sp, sp, -8");
-        println("  sd %s, (sp)", r);
-        println("  lb%s %s, (sp)", suffix, r);
-        println("  addi sp, sp, 8");
+        println(ctx, "  addi sp, sp, -8");
+        println(ctx, "  sd %s, (sp)", r);
+        println(ctx, "  lb%s %s, (sp)", suffix, r);
+        println(ctx, "  addi sp, sp, 8");
     } else if (to->size == 2) {
-        println("  addi sp, sp, -8");
-        println("  sd %s, (sp)", r);
-        println("  lh%s %s, (sp)", suffix, r);
-        println("  addi sp, sp, 8");
+        println(ctx, "  addi sp, sp, -8");
+        println(ctx, "  sd %s, (sp)", r);
+        println(ctx, "  lh%s %s, (sp)", suffix, r);
+        println(ctx, "  addi sp, sp, 8");
     } else if (to->size == 4) {
-        println("  addi sp, sp, -8");
-        println("  sd %s, (sp)", r);
-        println("  lw%s %s, (sp)", suffix, r);
-        println("  addi sp, sp, 8");
+        println(ctx, "  addi sp, sp, -8");
+        println(ctx, "  sd %s, (sp)", r);
+        println(ctx, "  lw%s %s, (sp)", suffix, r);
+        println(ctx, "  addi sp, sp, 8");
     } else if (is_integer(from) && from->size < 8 && !from->is_unsigned) {
-        println("  mv %s, %s", r, r);
+        println(ctx, "  mv %s, %s", r, r);
     }
 }
 
-static void divmod(Node *node, char *rs, char *rd) {
+static void divmod(Context *ctx, Node *node, char *rs, char *rd) {
     if (node->ty->is_unsigned) {
-        println("  divu %s, %s, %s", rd, rd, rs);
+        println(ctx, "  divu %s, %s, %s", rd, rd, rs);
     } else {
-        println("  div %s, %s, %s", rd, rd, rs);
+        println(ctx, "  div %s, %s, %s", rd, rd, rs);
     }
 }
 
-static void builtin_va_start(Node *node) {
+static void builtin_va_start(Context *ctx, Node *node) {
     int gp = 0;
     int fp = 0;
 
-    for (Var *var = current_fn->params; var; var = var->next) {
+    for (Var *var = ctx->gen_fn->params; var; var = var->next) {
         if (is_flonum(var->ty))
             fp++;
         else
             gp++;
     }
 
-    println("  mov -%d(%%rbp), %%rax", node->args[0]->offset);
-    println("  movl $%d, (%%rax)", gp * 8);
-    println("  movl $%d, 4(%%rax)", 48 + fp * 8);;
-    println("  mov %%rbp, 16(%%rax)");
-    println("  subq $128, 16(%%rax)");
-    top++;
+    println(ctx, "  mov -%d(%%rbp), %%rax", node->args[0]->offset);
+    println(ctx, "  movl $%d, (%%rax)", gp * 8);
+    println(ctx, "  movl $%d, 4(%%rax)", 48 + fp * 8);;
+    println(ctx, "  mov %%rbp, 16(%%rax)");
+    println(ctx, "  subq $128, 16(%%rax)");
+    ctx->top++;
 }
 
-static void gen_offset_instr(char *instr, char *rd, char *r1, long offset) {
+static void gen_offset_instr(Context *ctx, char *instr, char *rd, char *r1, long offset) {
     if (-2048 <= offset && offset <= 2047) {
-        println("  %s %s, %ld(%s)", instr, rd, offset, r1);
+        println(ctx, "  %s %s, %ld(%s)", instr, rd, offset, r1);
         return;
     }
 
-    println("  li t1, %ld", offset);
-    println("  add t2, %s, t1", r1);
-    println("  %s %s, (t2)", instr, rd);
+    println(ctx, "  li t1, %ld", offset);
+    println(ctx, "  add t2, %s, t1", r1);
+    println(ctx, "  %s %s, (t2)", instr, rd);
 }
 
 // Load a local variable at RSP+offset to a floating register.
-static void load_fp_arg(Type *ty, int offset, int fr, int gr) {
+static void load_fp_arg(Context *ctx, Type *ty, int offset, int fr, int gr) {
     if (ty->kind == TY_FLOAT) {
-        gen_offset_instr("flw", fargreg[fr], "s0", -1 * offset);
-        println("  fmv.x.w %s, %s", argreg[gr], fargreg[fr]);
+        gen_offset_instr(ctx, "flw", fargreg[fr], "s0", -1 * offset);
+        println(ctx, "  fmv.x.w %s, %s", argreg[gr], fargreg[fr]);
     } else {
-        gen_offset_instr("fld", fargreg[fr], "s0", -1 * offset);
-        println("  fmv.x.d %s, %s", argreg[gr], fargreg[fr]);
+        gen_offset_instr(ctx, "fld", fargreg[fr], "s0", -1 * offset);
+        println(ctx, "  fmv.x.d %s, %s", argreg[gr], fargreg[fr]);
     }
 }
 
 // Load a local variable at RSP+offset to argreg[r].
-static void load_gp_arg(Type *ty, int offset, int r) {
+static void load_gp_arg(Context *ctx, Type *ty, int offset, int r) {
     if (ty->size == 1) {
         if (ty->is_unsigned)
-            gen_offset_instr("lbu", argreg[r], "s0", -1 * offset);
+            gen_offset_instr(ctx, "lbu", argreg[r], "s0", -1 * offset);
         else
-            gen_offset_instr("lb", argreg[r], "s0", -1 * offset);
+            gen_offset_instr(ctx, "lb", argreg[r], "s0", -1 * offset);
     } else if (ty->size == 2) {
         if (ty->is_unsigned)
-            gen_offset_instr("lhu", argreg[r], "s0", -1 * offset);
+            gen_offset_instr(ctx, "lhu", argreg[r], "s0", -1 * offset);
         else
-            gen_offset_instr("lh", argreg[r], "s0", -1 * offset);
+            gen_offset_instr(ctx, "lh", argreg[r], "s0", -1 * offset);
     } else if (ty->size == 4) {
         if (ty->is_unsigned)
-            gen_offset_instr("lwu", argreg[r], "s0", -1 * offset);
+            gen_offset_instr(ctx, "lwu", argreg[r], "s0", -1 * offset);
         else
-            gen_offset_instr("lw", argreg[r], "s0", -1 * offset);
+            gen_offset_instr(ctx, "lw", argreg[r], "s0", -1 * offset);
     } else {
-        gen_offset_instr("ld", argreg[r], "s0", -1 * offset);
+        gen_offset_instr(ctx, "ld", argreg[r], "s0", -1 * offset);
     }
 }
 
-static void cast_cond_zero(int kind) {
+static void cast_cond_zero(Context *ctx, int kind) {
      if (kind == TY_DOUBLE)
-         println("  fcvt.l.d %s, %s, rtz", reg(top - 1), freg(top - 1));
+         println(ctx, "  fcvt.l.d %s, %s, rtz", reg(ctx->top - 1), freg(ctx->top - 1));
      if (kind == TY_FLOAT)
-         println("  fcvt.l.s %s, %s, rtz", reg(top - 1), freg(top - 1));
+         println(ctx, "  fcvt.l.s %s, %s, rtz", reg(ctx->top - 1), freg(ctx->top - 1));
 }
 
 // Pushs a local variable at RSP+offset to the stack.
-static void push_arg(Type *ty, int offset) {
-    println("  li t0, %d", offset);
-    println("  sub t0, s0, t0");
+static void push_arg(Context *ctx, Type *ty, int offset) {
+    println(ctx, "  li t0, %d", offset);
+    println(ctx, "  sub t0, s0, t0");
 
     if (is_flonum(ty)) {
         if (ty->kind == TY_FLOAT)
-            println("  mov -%d(%%rbp), %%eax", offset);
+            println(ctx, "  mov -%d(%%rbp), %%eax", offset);
         else
-            println("  mov -%d(%%rbp), %%rax", offset);
+            println(ctx, "  mov -%d(%%rbp), %%rax", offset);
     } else {
         if (ty->size == 1) {
             if (ty->is_unsigned)
-                println("  lbu t0, (t0)");
+                println(ctx, "  lbu t0, (t0)");
             else
-                println("  lb t0, (t0)");
-            println("  sb t0, (s0)");
+                println(ctx, "  lb t0, (t0)");
+            println(ctx, "  sb t0, (s0)");
         } else if (ty->size == 2) {
             if (ty->is_unsigned)
-                println("  lhu t0, (t0)");
+                println(ctx, "  lhu t0, (t0)");
             else
-                println("  lh t0, (t0)");
-            println("  sh t0, (s0)");
+                println(ctx, "  lh t0, (t0)");
+            println(ctx, "  sh t0, (s0)");
         } else if (ty->size == 4) {
             if (ty->is_unsigned)
-                println("  lwu t0, (t0)");
+                println(ctx, "  lwu t0, (t0)");
             else
-                println("  lw t0, (t0)");
-            println("  sw t0, (s0)");
+                println(ctx, "  lw t0, (t0)");
+            println(ctx, "  sw t0, (s0)");
         } else {
-            println("  ld t0, (t0)");
-            println("  sd t0, (s0)");
+            println(ctx, "  ld t0, (t0)");
+            println(ctx, "  sd t0, (s0)");
         }
     }
-    println("  sub s0 s0 8");
+    println(ctx, "  sub s0 s0 8");
 }
 
 // Load function call arguments. Arguments are already evaluated and
@@ -430,7 +431,7 @@ static void push_arg(Type *ty, int offset) {
 //
 // - If a function is variadic, set the number of floating-point type
 //   arguments to RSP.
-static int load_args(Node *node) {
+static int load_args(Context *ctx, Node *node) {
     int gp = 0;
     int fp = 0;
     int stack_size = 0;
@@ -442,12 +443,12 @@ static int load_args(Node *node) {
 
         if (is_flonum(arg->ty)) {
             if (fp < 8) {
-                load_fp_arg(arg->ty, arg->offset, fp++, gp++);
+                load_fp_arg(ctx, arg->ty, arg->offset, fp++, gp++);
                 continue;
             }
         } else {
             if (gp < 8) {
-                load_gp_arg(arg->ty, arg->offset, gp++);
+                load_gp_arg(ctx, arg->ty, arg->offset, gp++);
                 continue;
             }
         }
@@ -459,7 +460,7 @@ static int load_args(Node *node) {
     // If we have arguments passed on the stack, push them to the stack.
     if (stack_size) {
         if (stack_size % 16) {
-            println("  sub sp, sp, 8");
+            println(ctx, "  sub sp, sp, 8");
             stack_size += 8;
         }
 
@@ -467,7 +468,7 @@ static int load_args(Node *node) {
             if (!pass_stack[i])
                 continue;
             Var *arg = node->args[i];
-            push_arg(arg->ty, arg->offset);
+            push_arg(ctx, arg->ty, arg->offset);
         }
     }
 
@@ -475,340 +476,340 @@ static int load_args(Node *node) {
 }
 
 // Generate code for a given node.
-static void gen_expr(Node *node) {
-    println("  .loc %d %d", node->tok->file_no, node->tok->line_no);
+static void gen_expr(Context *ctx, Node *node) {
+    println(ctx, "  .loc %d %d", node->tok->file_no, node->tok->line_no);
 
     switch (node->kind) {
     case ND_NUM:
         if (node->ty->kind == TY_FLOAT) {
             float val = node->fval;
-            println("  li t1, %lu", *(unsigned *)(&val));
-            println("  addi sp, sp, -8");
-            println("  sw t1, (sp)");
-            println("  flw %s, (sp)", freg(top++));
-            println("  addi sp, sp, 8");
+            println(ctx, "  li t1, %lu", *(unsigned *)(&val));
+            println(ctx, "  addi sp, sp, -8");
+            println(ctx, "  sw t1, (sp)");
+            println(ctx, "  flw %s, (sp)", freg(ctx->top++));
+            println(ctx, "  addi sp, sp, 8");
         } else if (node->ty->kind == TY_DOUBLE) {
-            println("  li t1, %lu", *(unsigned long *)(&(node->fval)));
-            println("  addi sp, sp, -8");
-            println("  sd t1, (sp)");
-            println("  fld %s, (sp)", freg(top++));
-            println("  addi sp, sp, 8");
+            println(ctx, "  li t1, %lu", *(unsigned long *)(&(node->fval)));
+            println(ctx, "  addi sp, sp, -8");
+            println(ctx, "  sd t1, (sp)");
+            println(ctx, "  fld %s, (sp)", freg(ctx->top++));
+            println(ctx, "  addi sp, sp, 8");
         } else {
-            println("  li %s, %lu", reg(top++), node->val);
+            println(ctx, "  li %s, %lu", reg(ctx->top++), node->val);
         }
         return;
     case ND_VAR:
-        gen_addr(node);
-        load(node->ty);
+        gen_addr(ctx, node);
+        load(ctx, node->ty);
         return;
     case ND_MEMBER: {
-        gen_addr(node);
-        load(node->ty);
+        gen_addr(ctx, node);
+        load(ctx, node->ty);
 
         Member *mem = node->member;
         if (mem->is_bitfield) {
-            println("  shl $%d, %s", 64 - mem->bit_width - mem->bit_offset, reg(top - 1));
+            println(ctx, "  shl $%d, %s", 64 - mem->bit_width - mem->bit_offset, reg(ctx->top - 1));
             if (mem->ty->is_unsigned)
-                println("  shr $%d, %s", 64 - mem->bit_width, reg(top - 1));
+                println(ctx, "  shr $%d, %s", 64 - mem->bit_width, reg(ctx->top - 1));
             else
-                println("  sar $%d, %s", 64 - mem->bit_width, reg(top - 1));
+                println(ctx, "  sar $%d, %s", 64 - mem->bit_width, reg(ctx->top - 1));
         }
         return;
     }
     case ND_DEREF:
-        gen_expr(node->lhs);
-        load(node->ty);
+        gen_expr(ctx, node->lhs);
+        load(ctx, node->ty);
         return;
     case ND_ADDR:
-        gen_addr(node->lhs);
+        gen_addr(ctx, node->lhs);
         return;
     case ND_ASSIGN:
         if (node->ty->kind == TY_ARRAY)
             error_tok(node->tok, "not an lvalue");
  
-        gen_expr(node->rhs);
-        gen_addr(node->lhs);
+        gen_expr(ctx, node->rhs);
+        gen_addr(ctx, node->lhs);
 
         if (node->lhs->kind == ND_MEMBER && node->lhs->member->is_bitfield) {
             // If the lhs is a bitfield, we need to read a value from memory
             // and merge it with a new value.
             Member *mem = node->lhs->member;
-            println("  mov %s, %s", reg(top - 1), reg(top));
-            top++;
-            load(mem->ty);
+            println(ctx, "  mov %s, %s", reg(ctx->top - 1), reg(ctx->top));
+            ctx->top++;
+            load(ctx, mem->ty);
 
-            println("  and $%ld, %s", (1L << mem->bit_width) - 1, reg(top - 3));
-            println("  shl $%d, %s", mem->bit_offset, reg(top - 3));
+            println(ctx, "  and $%ld, %s", (1L << mem->bit_width) - 1, reg(ctx->top - 3));
+            println(ctx, "  shl $%d, %s", mem->bit_offset, reg(ctx->top - 3));
 
             long mask = ((1L << mem->bit_width) - 1) << mem->bit_offset;
-            println("  movabs $%ld, %%rax", ~mask);
-            println("  and %%rax, %s", reg(top - 1));
-            println("  or %s, %s", reg(top - 1), reg(top - 3));
-            top--;
+            println(ctx, "  movabs $%ld, %%rax", ~mask);
+            println(ctx, "  and %%rax, %s", reg(ctx->top - 1));
+            println(ctx, "  or %s, %s", reg(ctx->top - 1), reg(ctx->top - 3));
+            ctx->top--;
         }
 
-        store(node->ty);
+        store(ctx, node->ty);
         return;
     case ND_STMT_EXPR:
         for (Node *n = node->body; n; n = n->next)
-            gen_stmt(n);
-        top++;
+            gen_stmt(ctx, n);
+        ctx->top++;
         return;
     case ND_NULL_EXPR:
-        top++;
+        ctx->top++;
         return;
     case ND_COMMA:
-        gen_expr(node->lhs);
-        top--;
-        gen_expr(node->rhs);
+        gen_expr(ctx, node->lhs);
+        ctx->top--;
+        gen_expr(ctx, node->rhs);
         return;
     case ND_CAST:
-        gen_expr(node->lhs);
-        cast(node->lhs->ty, node->ty);
+        gen_expr(ctx, node->lhs);
+        cast(ctx, node->lhs->ty, node->ty);
         return;
     case ND_COND: {
-        int c = count();
-        gen_expr(node->cond);
-        cmp_zero(node->cond->ty);
-        println("  bne %s, zero, .L.else.%d", reg(top), c);
-        gen_expr(node->then);
-        top--;
-        println("  j .L.end.%d", c);
-        println(".L.else.%d:", c);
-        gen_expr(node->els);
-        println(".L.end.%d:", c);
+        int c = count(ctx);
+        gen_expr(ctx, node->cond);
+        cmp_zero(ctx, node->cond->ty);
+        println(ctx, "  bne %s, zero, .L.else.%s.%d", reg(ctx->top), ctx->gen_fn->name, c);
+        gen_expr(ctx, node->then);
+        ctx->top--;
+        println(ctx, "  j .L.end.%s.%d", ctx->gen_fn->name, c);
+        println(ctx, ".L.else.%s.%d:", ctx->gen_fn->name, c);
+        gen_expr(ctx, node->els);
+        println(ctx, ".L.end.%s.%d:", ctx->gen_fn->name, c);
         return;
     }
     case ND_NOT: {
-        gen_expr(node->lhs);
-        cmp_zero(node->lhs->ty);
-        println(" snez %s, %s", reg(top), reg(top));
-        println(" andi %s, %s, 0xff", reg(top), reg(top));
-        top++;
+        gen_expr(ctx, node->lhs);
+        cmp_zero(ctx, node->lhs->ty);
+        println(ctx, " snez %s, %s", reg(ctx->top), reg(ctx->top));
+        println(ctx, " andi %s, %s, 0xff", reg(ctx->top), reg(ctx->top));
+        ctx->top++;
         return;
     }
     case ND_BITNOT: {
-        gen_expr(node->lhs);
-        char *tr = reg(top - 1);
-        println("  not %s, %s", tr, tr);
+        gen_expr(ctx, node->lhs);
+        char *tr = reg(ctx->top - 1);
+        println(ctx, "  not %s, %s", tr, tr);
         return;
     }
     case ND_LOGAND: {
-        int c = count();
-        gen_expr(node->lhs);
-        println("  beqz %s, .L.false.%d", reg(--top), c);
-        gen_expr(node->rhs);
-        println("  beqz %s, .L.false.%d", reg(--top), c);
-        println("  li %s, 1", reg(top));
-        println("  j .L.end.%d", c);
-        println(".L.false.%d:", c);
-        println("  mv %s, zero", reg(top++));
-        println(".L.end.%d:", c);
+        int c = count(ctx);
+        gen_expr(ctx, node->lhs);
+        println(ctx, "  beqz %s, .L.false.%s.%d", reg(--ctx->top), ctx->gen_fn->name, c);
+        gen_expr(ctx, node->rhs);
+        println(ctx, "  beqz %s, .L.false.%s.%d", reg(--ctx->top), ctx->gen_fn->name, c);
+        println(ctx, "  li %s, 1", reg(ctx->top));
+        println(ctx, "  j .L.end.%s.%d", ctx->gen_fn->name, c);
+        println(ctx, ".L.false.%s.%d:", ctx->gen_fn->name, c);
+        println(ctx, "  mv %s, zero", reg(ctx->top++));
+        println(ctx, ".L.end.%s.%d:", ctx->gen_fn->name, c);
         return;
     }
     case ND_LOGOR: {
-        int c = count();
-        gen_expr(node->lhs);
-        println("  bnez %s, .L.true.%d", reg(--top), c);
-        gen_expr(node->rhs);
-        println("  bnez %s, .L.true.%d", reg(--top), c);
-        println("  mv %s, zero", reg(top));
-        println("  j .L.end.%d", c);
-        println(".L.true.%d:", c);
-        println("  li %s, 1", reg(top++));
-        println(".L.end.%d:", c);
+        int c = count(ctx);
+        gen_expr(ctx, node->lhs);
+        println(ctx, "  bnez %s, .L.true.%s.%d", reg(--ctx->top), ctx->gen_fn->name, c);
+        gen_expr(ctx, node->rhs);
+        println(ctx, "  bnez %s, .L.true.%s.%d", reg(--ctx->top), ctx->gen_fn->name, c);
+        println(ctx, "  mv %s, zero", reg(ctx->top));
+        println(ctx, "  j .L.end.%s.%d", ctx->gen_fn->name, c);
+        println(ctx, ".L.true.%s.%d:", ctx->gen_fn->name, c);
+        println(ctx, "  li %s, 1", reg(ctx->top++));
+        println(ctx, ".L.end.%s.%d:", ctx->gen_fn->name, c);
         return;
     }
     case ND_FUNCALL: {
         if (node->lhs->kind == ND_VAR &&
                 !strcmp(node->lhs->var->name, "__builtin_va_start")) {
-            builtin_va_start(node);
+            builtin_va_start(ctx, node);
             return;
         }
 
         // Save caller-saved registers
-        println("  addi sp, sp, -72");
-        println("  sd ra, 8(sp)");
-        println("  sd t0, 16(sp)");
-        println("  sd t1, 24(sp)");
-        println("  sd t2, 32(sp)");
-        println("  sd t3, 40(sp)");
-        println("  sd t4, 48(sp)");
-        println("  sd t5, 56(sp)");
-        println("  sd t6, 64(sp)");
-
-        int memarg_size = load_args(node);
+        println(ctx, "  addi sp, sp, -72");
+        println(ctx, "  sd ra, 8(sp)");
+        println(ctx, "  sd t0, 16(sp)");
+        println(ctx, "  sd t1, 24(sp)");
+        println(ctx, "  sd t2, 32(sp)");
+        println(ctx, "  sd t3, 40(sp)");
+        println(ctx, "  sd t4, 48(sp)");
+        println(ctx, "  sd t5, 56(sp)");
+        println(ctx, "  sd t6, 64(sp)");
+
+        int memarg_size = load_args(ctx, node);
 
         // Call a function
-        println("  call %s", node->lhs->var->name);
+        println(ctx, "  call %s", node->lhs->var->name);
 
         if (memarg_size)
-            println("  sub s0, s0, %d", memarg_size);
+            println(ctx, "  sub s0, s0, %d", memarg_size);
 
         // If a type of function is boolean, returns value
         // that only the lower 8bits are valid for it and
         // the upper 56bits may contain garbage.
         if (node->ty->kind == TY_BOOL) {
-            println("  sd a0, (sp)");
-            println("  lb a0, (sp)");
+            println(ctx, "  sd a0, (sp)");
+            println(ctx, "  lb a0, (sp)");
         }
 
         // Restore caller-saved registers
-        println("  ld ra, 8(sp)");
-        println("  ld t0, 16(sp)");
-        println("  ld t1, 24(sp)");
-        println("  ld t2, 32(sp)");
-        println("  ld t3, 40(sp)");
-        println("  ld t4, 48(sp)");
-        println("  ld t5, 56(sp)");
-        println("  ld t6, 64(sp)");
-        println("  addi sp, sp, 72");
+        println(ctx, "  ld ra, 8(sp)");
+        println(ctx, "  ld t0, 16(sp)");
+        println(ctx, "  ld t1, 24(sp)");
+        println(ctx, "  ld t2, 32(sp)");
+        println(ctx, "  ld t3, 40(sp)");
+        println(ctx, "  ld t4, 48(sp)");
+        println(ctx, "  ld t5, 56(sp)");
+        println(ctx, "  ld t6, 64(sp)");
+        println(ctx, "  addi sp, sp, 72");
 
         if (node->ty->kind == TY_FLOAT)
-            println("  fmv.s %s, fa0", freg(top++));
+            println(ctx, "  fmv.s %s, fa0", freg(ctx->top++));
         else if (node->ty->kind == TY_DOUBLE)
-            println("  fmv.d %s, fa0", freg(top++));
+            println(ctx, "  fmv.d %s, fa0", freg(ctx->top++));
         else
-            println("  mv %s, a0", reg(top++));
+            println(ctx, "  mv %s, a0", reg(ctx->top++));
 
         return;
     }
     }
 
     // Binary expressions
-    gen_expr(node->lhs);
-    gen_expr(node->rhs);
+    gen_expr(ctx, node->lhs);
+    gen_expr(ctx, node->rhs);
 
-    char *rd = reg(top - 2);
-    char *rs = reg(top - 1);
-    char *fd = freg(top - 2);
-    char *fs = freg(top - 1);
-    top--;
+    char *rd = reg(ctx->top - 2);
+    char *rs = reg(ctx->top - 1);
+    char *fd = freg(ctx->top - 2);
+    char *fs = freg(ctx->top - 1);
+    ctx->top--;
 
     switch (node->kind) {
     case ND_ADD:
         if (node->ty->kind == TY_FLOAT)
-            println("  fadd.s %s, %s, %s", fd, fd, fs);
+            println(ctx, "  fadd.s %s, %s, %s", fd, fd, fs);
         else if (node->ty->kind == TY_DOUBLE)
-            println("  fadd.d %s, %s, %s", fd, fd, fs);
+            println(ctx, "  fadd.d %s, %s, %s", fd, fd, fs);
         else
-            println("  add %s, %s, %s", rd, rd, rs);
+            println(ctx, "  add %s, %s, %s", rd, rd, rs);
         return;
     case ND_SUB:
         if (node->ty->kind == TY_FLOAT) {
-            println("  fsub.s %s, %s, %s", fd, fd, fs);
+            println(ctx, "  fsub.s %s, %s, %s", fd, fd, fs);
         } else if (node->ty->kind == TY_DOUBLE) {
-            println("  fsub.d %s, %s, %s", fd, fd, fs);
+            println(ctx, "  fsub.d %s, %s, %s", fd, fd, fs);
         } else {
-            println("  sub %s, %s, %s", rd, rd, rs);
+            println(ctx, "  sub %s, %s, %s", rd, rd, rs);
             // For minus value, it be cast unsigned or not.
             if (!node->ty->is_unsigned)
                 return;
-            println("  ld t0, (s0)");
+            println(ctx, "  ld t0, (s0)");
             if (node->ty->size == 1) {
-                println("  sb %s, (s0)", rd);
-                println("  lbu %s, (s0)", rd);
+                println(ctx, "  sb %s, (s0)", rd);
+                println(ctx, "  lbu %s, (s0)", rd);
             } else if (node->ty->size == 2) {
-                println("  sh %s, (s0)", rd);
-                println("  lhu %s, (s0)", rd);
+                println(ctx, "  sh %s, (s0)", rd);
+                println(ctx, "  lhu %s, (s0)", rd);
             } else if (node->ty->size == 4) {
-                println("  sw %s, (s0)", rd);
-                println("  lwu %s, (s0)", rd);
+                println(ctx, "  sw %s, (s0)", rd);
+                println(ctx, "  lwu %s, (s0)", rd);
             }
-            println("  sd t0, (s0)");
+            println(ctx, "  sd t0, (s0)");
         }
         return;
     case ND_MUL:
         if (node->ty->kind == TY_FLOAT)
-            println("  fmul.s %s, %s, %s", fd, fd, fs);
+            println(ctx, "  fmul.s %s, %s, %s", fd, fd, fs);
         else if (node->ty->kind == TY_DOUBLE)
-            println("  fmul.d %s, %s, %s", fd, fd, fs);
+            println(ctx, "  fmul.d %s, %s, %s", fd, fd, fs);
         else
-            println("  mul %s, %s, %s", rd, rd, rs);
+            println(ctx, "  mul %s, %s, %s", rd, rd, rs);
         return;
     case ND_DIV:
         if (node->ty->kind == TY_FLOAT)
-            println("  fdiv.s %s, %s, %s", fd, fd, fs);
+            println(ctx, "  fdiv.s %s, %s, %s", fd, fd, fs);
         else if (node->ty->kind == TY_DOUBLE)
-            println("  fdiv.d %s, %s, %s", fd, fd, fs);
+            println(ctx, "  fdiv.d %s, %s, %s", fd, fd, fs);
         else
-            divmod(node, rs, rd);
+            divmod(ctx, node, rs, rd);
         return;
     case ND_MOD:
         if (node->ty->is_unsigned)
-            println("  remu %s, %s, %s", rd, rd, rs);
+            println(ctx, "  remu %s, %s, %s", rd, rd, rs);
         else
-            println("  rem %s, %s, %s", rd, rd, rs);
+            println(ctx, "  rem %s, %s, %s", rd, rd, rs);
         return;
     case ND_BITAND:
-        println("  and %s, %s, %s", rd, rd, rs);
+        println(ctx, "  and %s, %s, %s", rd, rd, rs);
         return;
     case ND_BITOR:
-        println("  or %s, %s, %s", rd, rd, rs);
+        println(ctx, "  or %s, %s, %s", rd, rd, rs);
         return;
     case ND_BITXOR:
-        println("  xor %s, %s, %s", rd, rd, rs);
+        println(ctx, "  xor %s, %s, %s", rd, rd, rs);
         return;
     case ND_EQ:
         if (node->lhs->ty->kind == TY_FLOAT)
-            println("  feq.s %s, %s, %s", rd, fd, fs);
+            println(ctx, "  feq.s %s, %s, %s", rd, fd, fs);
         else if (node->lhs->ty->kind == TY_DOUBLE)
-            println("  feq.d %s, %s, %s", rd, fd, fs);
+            println(ctx, "  feq.d %s, %s, %s", rd, fd, fs);
         else {
-            println("  sub %s, %s, %s", rd, rd, rs);
-            println("  seqz %s, %s", rd, rd);
+            println(ctx, "  sub %s, %s, %s", rd, rd, rs);
+            println(ctx, "  seqz %s, %s", rd, rd);
         }
         return;
     case ND_NE:
         if (node->lhs->ty->kind == TY_FLOAT) {
-            println("  feq.s %s, %s, %s", rd, fd, fs);
-            println("  seqz %s, %s", rd, rd);
+            println(ctx, "  feq.s %s, %s, %s", rd, fd, fs);
+            println(ctx, "  seqz %s, %s", rd, rd);
         }
         else if (node->lhs->ty->kind == TY_DOUBLE) {
-            println("  feq.d %s, %s, %s", rd, fd, fs);
-            println("  seqz %s, %s", rd, rd);
+            println(ctx, "  feq.d %s, %s, %s", rd, fd, fs);
+            println(ctx, "  seqz %s, %s", rd, rd);
         }
         else {
-            println("  sub %s, %s, %s", rd, rd, rs);
-            println("  snez %s, %s", rd, rd);
+            println(ctx, "  sub %s, %s, %s", rd, rd, rs);
+            println(ctx, "  snez %s, %s", rd, rd);
         }
         return;
     case ND_LT:
         if (node->lhs->ty->kind == TY_FLOAT) {
-            println("  flt.s %s, %s, %s", rd, fd, fs);
+            println(ctx, "  flt.s %s, %s, %s", rd, fd, fs);
         } else if (node->lhs->ty->kind == TY_DOUBLE) {
-            println("  flt.d %s, %s, %s", rd, fd, fs);
+            println(ctx, "  flt.d %s, %s, %s", rd, fd, fs);
         } else {
             if (node->lhs->ty->is_unsigned)
-                println("  sltu %s, %s, %s", rd, rd, rs);
+                println(ctx, "  sltu %s, %s, %s", rd, rd, rs);
             else
-                println("  slt %s, %s, %s", rd, rd, rs);
+                println(ctx, "  slt %s, %s, %s", rd, rd, rs);
         }
         return;
     case ND_LE:
         if (node->lhs->ty->kind == TY_FLOAT) {
-            println("  fle.s %s, %s, %s", rd, fd, fs);
+            println(ctx, "  fle.s %s, %s, %s", rd, fd, fs);
         } else if (node->lhs->ty->kind == TY_DOUBLE) {
-            println("  fle.d %s, %s, %s", rd, fd, fs);
+            println(ctx, "  fle.d %s, %s, %s", rd, fd, fs);
         } else {
             if (node->lhs->ty->is_unsigned)
-                println("  setbe %%al");
+                println(ctx, "  setbe %%al");
             else
-                println("  slt %s, %s, %s", rd, rs, rd);
-            println("  seqz %s, %s", rd, rd);
+                println(ctx, "  slt %s, %s, %s", rd, rs, rd);
+            println(ctx, "  seqz %s, %s", rd, rd);
         }
         return;
     case ND_SHL:
-        println("  sll %s, %s, %s", rd, rd, reg(top));
+        println(ctx, "  sll %s, %s, %s", rd, rd, reg(ctx->top));
         return;
     case ND_SHR:
         if (node->lhs->ty->is_unsigned)
-            println("  srl %s, %s, %s", rd, rd, reg(top));
+            println(ctx, "  srl %s, %s, %s", rd, rd, reg(ctx->top));
         else
             if (node->lhs->ty->size == 4)
-                println("  sraw %s, %s, %s", rd, rd, reg(top));
+                println(ctx, "  sraw %s, %s, %s", rd, rd, reg(ctx->top));
             else
-                println("  sra %s, %s, %s", rd, rd, reg(top));
+                println(ctx, "  sra %s, %s, %s", rd, rd, reg(ctx->top));
         return;
     default:
         error_tok(node->tok, "invalid expression");
@@ -816,175 +817,175 @@ static void gen_expr(Node *node) {
 
 }
 
-static void gen_stmt(Node *node) {
-    println("  .loc %d %d", node->tok->file_no, node->tok->line_no);
+static void gen_stmt(Context *ctx, Node *node) {
+    println(ctx, "  .loc %d %d", node->tok->file_no, node->tok->line_no);
 
     switch (node->kind) {
     case ND_IF: {
-        int c = count();
+        int c = count(ctx);
         if (node->els) {
-            gen_expr(node->cond);
-            cmp_zero(node->cond->ty);
-            println("  bnez %s, .L.else.%d", reg(top), c);
-            gen_stmt(node->then);
-            println("  jal zero, .L.end.%d", c);
-            println(".L.else.%d:", c);
-            gen_stmt(node->els);
-            println(".L.end.%d:", c);
+            gen_expr(ctx, node->cond);
+            cmp_zero(ctx, node->cond->ty);
+            println(ctx, "  bnez %s, .L.else.%s.%d", reg(ctx->top), ctx->gen_fn->name, c);
+            gen_stmt(ctx, node->then);
+            println(ctx, "  jal zero, .L.end.%s.%d", ctx->gen_fn->name, c);
+            println(ctx, ".L.else.%s.%d:", ctx->gen_fn->name, c);
+            gen_stmt(ctx, node->els);
+            println(ctx, ".L.end.%s.%d:", ctx->gen_fn->name, c);
         } else {
-            gen_expr(node->cond);
-            cmp_zero(node->cond->ty);
-            println("  bnez %s, .L.end.%d", reg(top), c);
-            gen_stmt(node->then);
-            println(".L.end.%d:", c);
+            gen_expr(ctx, node->cond);
+            cmp_zero(ctx, node->cond->ty);
+            println(ctx, "  bnez %s, .L.end.%s.%d", reg(ctx->top), ctx->gen_fn->name, c);
+            gen_stmt(ctx, node->then);
+            println(ctx, ".L.end.%s.%d:", ctx->gen_fn->name, c);
         }
         return;
     }
     case ND_FOR: {
-        int c = count();
-        int brk = brknum;
-        int cont = contnum;
-        brknum = contnum = c;
+        int c = count(ctx);
+        int brk = ctx->brknum;
+        int cont = ctx->contnum;
+        ctx->brknum = ctx->contnum = c;
 
         if (node->init)
-            gen_stmt(node->init);
-        println(".L.begin.%d:", c);
+            gen_stmt(ctx, node->init);
+        println(ctx, ".L.begin.%s.%d:", ctx->gen_fn->name, c);
         if (node->cond) {
-            gen_expr(node->cond);
-            cast_cond_zero(node->cond->ty->kind);
-            println("  beqz %s, .L.break.%d", reg(--top), c);
+            gen_expr(ctx, node->cond);
+            cast_cond_zero(ctx, node->cond->ty->kind);
+            println(ctx, "  beqz %s, .L.break.%s.%d", reg(--ctx->top), ctx->gen_fn->name, c);
         }
-        gen_stmt(node->then);
-        println(".L.continue.%d:", c);
+        gen_stmt(ctx, node->then);
+        println(ctx, ".L.continue.%s.%d:", ctx->gen_fn->name, c);
         if (node->inc) {
-            gen_expr(node->inc);
-            top--;
+            gen_expr(ctx, node->inc);
+            ctx->top--;
         }
-        println("  j .L.begin.%d", c);
-        println(".L.break.%d:", c);
+        println(ctx, "  j .L.begin.%s.%d", ctx->gen_fn->name, c);
+        println(ctx, ".L.break.%s.%d:", ctx->gen_fn->name, c);
 
-        brknum = brk;
-        contnum = cont;
+        ctx->brknum = brk;
+        ctx->contnum = cont;
         return;
     }
     case ND_DO: {
-        int c = count();
-        int brk = brknum;
-        int cont = contnum;
-        brknum = contnum = c;
-
-        println(".L.begin.%d:", c);
-        gen_stmt(node->then);
-        println(".L.continue.%d:", c);
-        gen_expr(node->cond);
-        cast_cond_zero(node->cond->ty->kind);
-        println("  bnez %s, .L.begin.%d", reg(--top), c);
-        println(".L.break.%d:", c);
-
-        brknum = brk;
-        contnum = cont;
+        int c = count(ctx);
+        int brk = ctx->brknum;
+        int cont = ctx->contnum;
+        ctx->brknum = ctx->contnum = c;
+
+        println(ctx, ".L.begin.%s.%d:", ctx->gen_fn->name, c);
+        gen_stmt(ctx, node->then);
+        println(ctx, ".L.continue.%s.%d:", ctx->gen_fn->name, c);
+        gen_expr(ctx, node->cond);
+        cast_cond_zero(ctx, node->cond->ty->kind);
+        println(ctx, "  bnez %s, .L.begin.%s.%d", reg(--ctx->top), ctx->gen_fn->name, c);
+        println(ctx, ".L.break.%s.%d:", ctx->gen_fn->name, c);
+
+        ctx->brknum = brk;
+        ctx->contnum = cont;
         return;
     }
     case ND_SWITCH: {
-        int c = count();
-        int brk = brknum;
-        brknum = c;
+        int c = count(ctx);
+        int brk = ctx->brknum;
+        ctx->brknum = c;
         node->case_label = c;
 
-        gen_expr(node->cond);
+        gen_expr(ctx, node->cond);
 
         for (Node *n = node->case_next; n; n = n->case_next) {
-            n->case_label = count();
+            n->case_label = count(ctx);
             n->case_end_label = c;
-            println("  addi t0, %s, -%ld", reg(top - 1), n->val);
-            println("  beqz t0, .L.case.%d", n->case_label);
+            println(ctx, "  addi t0, %s, -%ld", reg(ctx->top - 1), n->val);
+            println(ctx, "  beqz t0, .L.case.%s.%d", ctx->gen_fn->name, n->case_label);
         }
-        top--;
+        ctx->top--;
 
         if (node->default_case) {
-            int i = count();
+            int i = count(ctx);
             node->default_case->case_end_label = c;
             node->default_case->case_label = i;
-            println("  j .L.case.%d", i);
+            println(ctx, "  j .L.case.%s.%d", ctx->gen_fn->name, i);
         }
 
-        println("  j .L.break.%d", c);
-        gen_stmt(node->then);
-        println(".L.break.%d:", c);
+        println(ctx, "  j .L.break.%s.%d", ctx->gen_fn->name, c);
+        gen_stmt(ctx, node->then);
+        println(ctx, ".L.break.%s.%d:", ctx->gen_fn->name, c);
 
-        brknum = brk;
+        ctx->brknum = brk;
         return;
     }
     case ND_CASE:
-        println(".L.case.%d:", node->case_label);
-        gen_stmt(node->lhs);
+        println(ctx, ".L.case.%s.%d:", ctx->gen_fn->name, node->case_label);
+        gen_stmt(ctx, node->lhs);
         return;
     case ND_BLOCK:
         for (Node *n = node->body; n; n = n->next)
-            gen_stmt(n);
+            gen_stmt(ctx, n);
         return;
     case ND_BREAK:
-        if (brknum == 0)
+        if (ctx->brknum == 0)
             error_tok(node->tok, "stray break");
-        println("  j .L.break.%d", brknum);
+        println(ctx, "  j .L.break.%s.%d", ctx->gen_fn->name, ctx->brknum);
         return;
     case ND_CONTINUE:
-        if (contnum == 0)
+        if (ctx->contnum == 0)
             error_tok(node->tok, "stray continue");
-        println("  j .L.continue.%d", contnum);
+        println(ctx, "  j .L.continue.%s.%d", ctx->gen_fn->name, ctx->contnum);
         return;
     case ND_GOTO:
-        println("  j .L.label.%s.%s", current_fn->name, node->label_name);
+        println(ctx, "  j .L.label.%s.%s", ctx->gen_fn->name, node->label_name);
         return;
     case ND_LABEL:
-        println(".L.label.%s.%s:", current_fn->name, node->label_name);
-        gen_stmt(node->lhs);
+        println(ctx, ".L.label.%s.%s:", ctx->gen_fn->name, node->label_name);
+        gen_stmt(ctx, node->lhs);
         return;
     case ND_RETURN:
         if (node->lhs) {
-            gen_expr(node->lhs);
+            gen_expr(ctx, node->lhs);
             if (is_flonum(node->lhs->ty))
-                println("  fmv.d fa0, %s", freg(--top));
+                println(ctx, "  fmv.d fa0, %s", freg(--ctx->top));
             else
-                println("  mv a0, %s", reg(--top));
+                println(ctx, "  mv a0, %s", reg(--ctx->top));
         }
-        println("  j .L.return.%s", current_fn->name);
+        println(ctx, "  j .L.return.%s", ctx->gen_fn->name);
         return;
     case ND_EXPR_STMT:
-        gen_expr(node->lhs);
-        top--;
+        gen_expr(ctx, node->lhs);
+        ctx->top--;
         return;
     default:
         error_tok(node->tok, "invalid statement");
     }
 }
 
-static void emit_bss(Program *prog) {
-    println("  .bss");
+static void emit_bss(Context *ctx, Program *prog) {
+    println(ctx, "  .bss");
 
     for (Var *var = prog->globals; var; var = var->next) {
         if (var->init_data)
             continue;
 
-        println("  .align %d", var->align);
+        println(ctx, "  .align %d", var->align);
         if (!var->is_static)
-            println("  .globl %s", var->name);
-        println("%s:", var->name);
-        println("  .zero %d", var->ty->size);
+            println(ctx, "  .globl %s", var->name);
+        println(ctx, "%s:", var->name);
+        println(ctx, "  .zero %d", var->ty->size);
     }
 }
 
-static void emit_data(Program *prog) {
-    println("  .data");
+static void emit_data(Context *ctx, Program *prog) {
+    println(ctx, "  .data");
 
     for (Var *var = prog->globals; var; var = var->next) {
         if (!var->init_data)
             continue;
 
-        println("  .align %d", var->align);
+        println(ctx, "  .align %d", var->align);
         if (!var->is_static)
-            println("  .globl %s", var->name);
-        println("%s:", var->name);
+            println(ctx, "  .globl %s", var->name);
+        println(ctx, "%s:", var->name);
 
         Relocation *rel = var->rel;
         int pos = 0;
@@ -1020,157 +1021,159 @@ static void emit_data(Program *prog) {
                 }
                 buf[buf_pos++] = var->init_data[pos++];
             }
-            println("  .string \"%s\"", buf);
+            println(ctx, "  .string \"%s\"", buf);
             memset(&buf[0], 0, sizeof(buf));
             continue;
         }
 
         while (pos < var->ty->size) {
             if (rel && rel->offset == pos) {
-                println("  .quad %s%+ld", rel->label, rel->addend);
+                println(ctx, "  .quad %s%+ld", rel->label, rel->addend);
                 rel = rel->next;
                 pos += 8;
             } else {
-                println("  .byte %d", var->init_data[pos++]);
+                println(ctx, "  .byte %d", var->init_data[pos++]);
             }
         }
     }
 }
 
-static void emit_text(Program *prog) {
-    println("  .text");
+static void emit_function(Context *ctx, Function *fn) {
+    println(ctx, "  .align 1");
+    if (!fn->is_static) {
+        println(ctx, "  .globl %s", fn->name);
+    }
+    println(ctx, "  .type %s, @function", fn->name);
+    println(ctx, "%s:", fn->name);
+    ctx->gen_fn = fn;
+
+    // Prologue. s0-11, fs0-11 are callee-saved retisters.
+    println(ctx, "  addi sp, sp, -8");
+    println(ctx, "  sd s0, (sp)");
+
+    println(ctx, "  mv s0, sp");
+    gen_addi(ctx, "sp", "sp", -1 * fn->stack_size);
+    println(ctx, "  sd s1, -8(s0)");
+    println(ctx, "  sd s2, -16(s0)");
+    println(ctx, "  sd s3, -24(s0)");
+    println(ctx, "  sd s4, -32(s0)");
+    println(ctx, "  sd s5, -40(s0)");
+    println(ctx, "  sd s6, -48(s0)");
+    println(ctx, "  sd s7, -56(s0)");
+    println(ctx, "  sd s8, -64(s0)");
+    println(ctx, "  sd s9, -72(s0)");
+    println(ctx, "  sd s10, -80(s0)");
+    println(ctx, "  sd s11, -88(s0)");
+
+    println(ctx, "  fsd fs0, -96(s0)");
+    println(ctx, "  fsd fs1, -104(s0)");
+    println(ctx, "  fsd fs2, -112(s0)");
+    println(ctx, "  fsd fs3, -120(s0)");
+    println(ctx, "  fsd fs4, -128(s0)");
+    println(ctx, "  fsd fs5, -136(s0)");
+    println(ctx, "  fsd fs6, -144(s0)");
+    println(ctx, "  fsd fs7, -152(s0)");
+    println(ctx, "  fsd fs8, -160(s0)");
+    println(ctx, "  fsd fs9, -168(s0)");
+    println(ctx, "  fsd fs10, -176(s0)");
+    println(ctx, "  fsd fs11, -184(s0)");
+
+    //// Save arg registers if function is variadic
+    if (fn->is_variadic) {
+        println(ctx, "  sd a0, %d(s0)", reg_save_area_offset[0]);
+        println(ctx, "  sd a1, %d(s0)", reg_save_area_offset[1]);
+        println(ctx, "  sd a2, %d(s0)", reg_save_area_offset[2]);
+        println(ctx, "  sd a3, %d(s0)", reg_save_area_offset[3]);
+        println(ctx, "  sd a4, %d(s0)", reg_save_area_offset[4]);
+        println(ctx, "  sd a5, %d(s0)", reg_save_area_offset[5]);
+        println(ctx, "  sd a6, %d(s0)", reg_save_area_offset[6]);
+        println(ctx, "  sd a7, %d(s0)", reg_save_area_offset[7]);
+    }
 
-    for (Function *fn = prog->fns; fn; fn = fn->next) {
-        println("  .align 1");
-        if (!fn->is_static) {
-            println("  .globl %s", fn->name);
-        }
-        println("  .type %s, @function", fn->name);
-        println("%s:", fn->name);
-        current_fn = fn;
-
-        // Prologue. s0-11, fs0-11 are callee-saved retisters.
-        println("  addi sp, sp, -8");
-        println("  sd s0, (sp)");
-
-        println("  mv s0, sp");
-        gen_addi("sp", "sp", -1 * fn->stack_size);
-        println("  sd s1, -8(s0)");
-        println("  sd s2, -16(s0)");
-        println("  sd s3, -24(s0)");
-        println("  sd s4, -32(s0)");
-        println("  sd s5, -40(s0)");
-        println("  sd s6, -48(s0)");
-        println("  sd s7, -56(s0)");
-        println("  sd s8, -64(s0)");
-        println("  sd s9, -72(s0)");
-        println("  sd s10, -80(s0)");
-        println("  sd s11, -88(s0)");
-
-        println("  fsd fs0, -96(s0)");
-        println("  fsd fs1, -104(s0)");
-        println("  fsd fs2, -112(s0)");
-        println("  fsd fs3, -120(s0)");
-        println("  fsd fs4, -128(s0)");
-        println("  fsd fs5, -136(s0)");
-        println("  fsd fs6, -144(s0)");
-        println("  fsd fs7, -152(s0)");
-        println("  fsd fs8, -160(s0)");
-        println("  fsd fs9, -168(s0)");
-        println("  fsd fs10, -176(s0)");
-        println("  fsd fs11, -184(s0)");
-
-        //// Save arg registers if function is variadic
-        if (fn->is_variadic) {
-            println("  sd a0, %d(s0)", reg_save_area_offset[0]);
-            println("  sd a1, %d(s0)", reg_save_area_offset[1]);
-            println("  sd a2, %d(s0)", reg_save_area_offset[2]);
-            println("  sd a3, %d(s0)", reg_save_area_offset[3]);
-            println("  sd a4, %d(s0)", reg_save_area_offset[4]);
-            println("  sd a5, %d(s0)", reg_save_area_offset[5]);
-            println("  sd a6, %d(s0)", reg_save_area_offset[6]);
-            println("  sd a7, %d(s0)", reg_save_area_offset[7]);
-        }
+    // Push arguments to the stack
+    int gp = 0, fp = 0;
+    for (Var *var = fn->params; var; var = var->next) {
+        if (is_flonum(var->ty))
+            fp++;
+        else
+            gp++;
+    }
 
-        // Push arguments to the stack
-        int gp = 0, fp = 0;
-        for (Var *var = fn->params; var; var = var->next) {
-            if (is_flonum(var->ty))
-                fp++;
+    for (Var *var = fn->params; var; var = var->next) {
+        if (var->ty->kind == TY_FLOAT) {
+            gen_offset_instr(ctx, "fsw", fargreg[--fp], "s0", -1 * var->offset);
+        } else if (var->ty->kind == TY_DOUBLE) {
+            gen_offset_instr(ctx, "fsd", fargreg[--fp], "s0", -1 * var->offset);
+        } else {
+            char *r = argreg[--gp];
+            if (var->ty->size == 1)
+                println(ctx, "  sb %s, -%d(s0)", r, var->offset);
+            else if (var->ty->size == 2)
+                println(ctx, "  sh %s, -%d(s0)", r, var->offset);
+            else if (var->ty->size == 4)
+                println(ctx, "  sw %s, -%d(s0)", r, var->offset);
             else
-                gp++;
+                println(ctx, "  sd %s, -%d(s0)", r, var->offset);
         }
-
-        for (Var *var = fn->params; var; var = var->next) {
-            if (var->ty->kind == TY_FLOAT) {
-                gen_offset_instr("fsw", fargreg[--fp], "s0", -1 * var->offset);
-            } else if (var->ty->kind == TY_DOUBLE) {
-                gen_offset_instr("fsd", fargreg[--fp], "s0", -1 * var->offset);
-            } else {
-                char *r = argreg[--gp];
-                if (var->ty->size == 1)
-                    println("  sb %s, -%d(s0)", r, var->offset);
-                else if (var->ty->size == 2)
-                    println("  sh %s, -%d(s0)", r, var->offset);
-                else if (var->ty->size == 4)
-                    println("  sw %s, -%d(s0)", r, var->offset);
-                else
-                    println("  sd %s, -%d(s0)", r, var->offset);
-            }
-        }
-    
-        // Emit code
-        gen_stmt(fn->body);
-        assert(top == 0);
-
-        // The C spec defines a special rule for the main function.
-        // Reaching the end of the main function is equivalent to
-        // returning 0, even though the behavior is undefined for the
-        // other functions. See C11 5.1.2.2.3.
-        if (strcmp(fn->name, "main") == 0)
-            println("  mv a0, zero");
-    
-        // Epilogue
-        println(".L.return.%s:", fn->name);
-
-        println("  ld s1, -8(s0)");
-        println("  ld s2, -16(s0)");
-        println("  ld s3, -24(s0)");
-        println("  ld s4, -32(s0)");
-        println("  ld s5, -40(s0)");
-        println("  ld s6, -48(s0)");
-        println("  ld s7, -56(s0)");
-        println("  ld s8, -64(s0)");
-        println("  ld s9, -72(s0)");
-        println("  ld s10, -80(s0)");
-        println("  ld s11, -88(s0)");
-
-        println("  fld fs0, -96(s0)");
-        println("  fld fs1, -104(s0)");
-        println("  fld fs2, -112(s0)");
-        println("  fld fs3, -120(s0)");
-        println("  fld fs4, -128(s0)");
-        println("  fld fs5, -136(s0)");
-        println("  fld fs6, -144(s0)");
-        println("  fld fs7, -152(s0)");
-        println("  fld fs8, -160(s0)");
-        println("  fld fs9, -168(s0)");
-        println("  fld fs10, -176(s0)");
-        println("  fld fs11, -184(s0)");
-
-        println("  mv sp, s0");
-        println("  ld s0, (sp)");
-        println("  addi sp, sp, 8");
-        println("  ret");
     }
+
+    // Emit code
+    gen_stmt(ctx, fn->body);
+    assert(ctx->top == 0);
+
+    // The C spec defines a special rule for the main function.
+    // Reaching the end of the main function is equivalent to
+    // returning 0, even though the behavior is undefined for the
+    // other functions. See C11 5.1.2.2.3.
+    if (strcmp(fn->name, "main") == 0)
+        println(ctx, "  mv a0, zero");
+
+    // Epilogue
+    println(ctx, ".L.return.%s:", fn->name);
+
+    println(ctx, "  ld s1, -8(s0)");
+    println(ctx, "  ld s2, -16(s0)");
+    println(ctx, "  ld s3, -24(s0)");
+    println(ctx, "  ld s4, -32(s0)");
+    println(ctx, "  ld s5, -40(s0)");
+    println(ctx, "  ld s6, -48(s0)");
+    println(ctx, "  ld s7, -56(s0)");
+    println(ctx, "  ld s8, -64(s0)");
+    println(ctx, "  ld s9, -72(s0)");
+    println(ctx, "  ld s10, -80(s0)");
+    println(ctx, "  ld s11, -88(s0)");
+
+    println(ctx, "  fld fs0, -96(s0)");
+    println(ctx, "  fld fs1, -104(s0)");
+    println(ctx, "  fld fs2, -112(s0)");
+    println(ctx, "  fld fs3, -120(s0)");
+    println(ctx, "  fld fs4, -128(s0)");
+    println(ctx, "  fld fs5, -136(s0)");
+    println(ctx, "  fld fs6, -144(s0)");
+    println(ctx, "  fld fs7, -152(s0)");
+    println(ctx, "  fld fs8, -160(s0)");
+    println(ctx, "  fld fs9, -168(s0)");
+    println(ctx, "  fld fs10, -176(s0)");
+    println(ctx, "  fld fs11, -184(s0)");
+
+    println(ctx, "  mv sp, s0");
+    println(ctx, "  ld s0, (sp)");
+    println(ctx, "  addi sp, sp, 8");
+    println(ctx, "  ret");
+}
+
+static void emit_text(Context *ctx, Program *prog) {
+    println(ctx, "  .text");
+
+    emit_functions(ctx, prog, emit_function);
 }
 
-void codegen_riscv64(Program *prog) {
-    char **paths = get_input_files();
+void codegen_riscv64(Context *ctx, Program *prog) {
+    char **paths = get_input_files(ctx);
     for (int i = 0; paths[i]; i++)
-        println("  .file %d \"%s\"", i + 1, paths[i]);
+        println(ctx, "  .file %d \"%s\"", i + 1, paths[i]);
 
-    emit_bss(prog);
-    emit_data(prog);
-    emit_text(prog);
+    emit_bss(ctx, prog);
+    emit_data(ctx, prog);
+    emit_text(ctx, prog);
 }
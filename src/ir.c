@@ -0,0 +1,811 @@
+#include "711cc.h"
+
+// This file lowers the AST of a function to a three-address
+// intermediate representation. A function becomes a list of basic
+// blocks, each of which is a list of instructions ending with a
+// branch, and every value is computed into a new virtual register.
+// A local variable of scalar type whose address is never taken lives
+// in a virtual register of its own. The other variables stay in memory
+// and are accessed with IR_LOAD and IR_STORE through IR_ADDR. The IR
+// doesn't depend on the target, and a backend selects machine
+// instructions for it.
+
+struct IRLabel {
+    IRLabel *next;
+    char *name;
+    BasicBlock *bb;
+};
+
+VReg *new_vreg(IRFunction *ir, Type *ty) {
+    VReg *reg = calloc(1, sizeof(VReg));
+    reg->id = ++ir->nregs;
+    reg->ty = ty;
+    return reg;
+}
+
+BasicBlock *new_block(IRFunction *ir) {
+    BasicBlock *bb = calloc(1, sizeof(BasicBlock));
+    bb->id = ir->nblocks++;
+
+    if ((bb->id & (bb->id - 1)) == 0)
+        ir->blocks = realloc(ir->blocks, sizeof(BasicBlock *) * (bb->id ? bb->id * 2 : 1));
+    ir->blocks[bb->id] = bb;
+    return bb;
+}
+
+Insn *new_insn(InsnKind kind, Type *ty, Token *tok) {
+    Insn *insn = calloc(1, sizeof(Insn));
+    insn->kind = kind;
+    insn->ty = ty;
+    insn->tok = tok;
+    return insn;
+}
+
+// Inserts an instruction before `pos`, or at the end of a block if
+// `pos` is NULL.
+void insert_insn(BasicBlock *bb, Insn *pos, Insn *insn) {
+    insn->next = pos;
+    insn->prev = pos ? pos->prev : bb->last;
+    if (insn->prev)
+        insn->prev->next = insn;
+    else
+        bb->insns = insn;
+    if (pos)
+        pos->prev = insn;
+    else
+        bb->last = insn;
+}
+
+void remove_insn(BasicBlock *bb, Insn *insn) {
+    if (insn->prev)
+        insn->prev->next = insn->next;
+    else
+        bb->insns = insn->next;
+    if (insn->next)
+        insn->next->prev = insn->prev;
+    else
+        bb->last = insn->prev;
+}
+
+static VReg *new_reg(Context *ctx, Type *ty) {
+    return new_vreg(ctx->ir, ty);
+}
+
+static BasicBlock *new_bb(Context *ctx) {
+    return new_block(ctx->ir);
+}
+
+static bool is_terminated(BasicBlock *bb) {
+    if (!bb->last)
+        return false;
+    InsnKind k = bb->last->kind;
+    return k == IR_BR || k == IR_JMP || k == IR_RET;
+}
+
+static Insn *emit(Context *ctx, InsnKind kind, Token *tok);
+
+static void emit_jmp(Context *ctx, BasicBlock *bb, Token *tok) {
+    emit(ctx, IR_JMP, tok)->then = bb;
+}
+
+// Makes a given block the current one. Blocks are laid out in the
+// order in which they become current. If the previous block falls
+// through, it jumps to the new one, so every block ends with a branch.
+static void start_bb(Context *ctx, BasicBlock *bb, Token *tok) {
+    if (!is_terminated(ctx->bb))
+        emit_jmp(ctx, bb, tok);
+    ctx->bb->next = bb;
+    ctx->bb = bb;
+}
+
+static Insn *emit(Context *ctx, InsnKind kind, Token *tok) {
+    // Code after a branch is unreachable, but it still needs a block.
+    if (is_terminated(ctx->bb))
+        start_bb(ctx, new_bb(ctx), tok);
+
+    Insn *insn = new_insn(kind, NULL, tok);
+    insert_insn(ctx->bb, NULL, insn);
+    return insn;
+}
+
+static VReg *emit_imm(Context *ctx, Type *ty, long val, Token *tok) {
+    Insn *insn = emit(ctx, IR_IMM, tok);
+    insn->ty = ty;
+    insn->val = val;
+    insn->dst = new_reg(ctx, ty);
+    return insn->dst;
+}
+
+static VReg *emit_fimm(Context *ctx, Type *ty, double fval, Token *tok) {
+    Insn *insn = emit(ctx, IR_FIMM, tok);
+    insn->ty = ty;
+    insn->fval = fval;
+    insn->dst = new_reg(ctx, ty);
+    return insn->dst;
+}
+
+static VReg *emit_binary(Context *ctx, InsnKind kind, Type *ty, Type *dst_ty,
+                         VReg *lhs, VReg *rhs, Token *tok) {
+    Insn *insn = emit(ctx, kind, tok);
+    insn->ty = ty;
+    insn->lhs = lhs;
+    insn->rhs = rhs;
+    insn->dst = new_reg(ctx, dst_ty);
+    return insn->dst;
+}
+
+static void emit_mov(Context *ctx, VReg *dst, VReg *src, Token *tok) {
+    Insn *insn = emit(ctx, IR_MOV, tok);
+    insn->ty = dst->ty;
+    insn->lhs = src;
+    insn->dst = dst;
+}
+
+static void emit_br(Context *ctx, VReg *cond, Type *ty, BasicBlock *then,
+                    BasicBlock *els, Token *tok) {
+    Insn *insn = emit(ctx, IR_BR, tok);
+    insn->ty = ty;
+    insn->lhs = cond;
+    insn->then = then;
+    insn->els = els;
+}
+
+static VReg *emit_load(Context *ctx, VReg *addr, Type *ty, Token *tok) {
+    // An array, a struct or a function isn't loaded. Its value is its
+    // address, which is how an array decays to a pointer in C.
+    if (ty->kind == TY_ARRAY || ty->kind == TY_STRUCT || ty->kind == TY_FUNC)
+        return addr;
+
+    Insn *insn = emit(ctx, IR_LOAD, tok);
+    insn->ty = ty;
+    insn->lhs = addr;
+    insn->dst = new_reg(ctx, ty);
+    return insn->dst;
+}
+
+static void emit_store(Context *ctx, VReg *addr, VReg *val, Type *ty, Token *tok) {
+    Insn *insn = emit(ctx, ty->kind == TY_STRUCT ? IR_COPY : IR_STORE, tok);
+    insn->ty = ty;
+    insn->lhs = addr;
+    insn->rhs = val;
+}
+
+static BasicBlock *label_bb(Context *ctx, char *name) {
+    for (IRLabel *l = ctx->ir->labels; l; l = l->next)
+        if (!strcmp(l->name, name))
+            return l->bb;
+
+    IRLabel *l = calloc(1, sizeof(IRLabel));
+    l->name = name;
+    l->bb = new_bb(ctx);
+    l->next = ctx->ir->labels;
+    ctx->ir->labels = l;
+    return l->bb;
+}
+
+static VReg *gen_expr(Context *ctx, Node *node);
+static void gen_stmt(Context *ctx, Node *node);
+
+// Compute the address of a given node.
+// It's an error if a given node does not reside in memory.
+static VReg *gen_addr(Context *ctx, Node *node) {
+    switch (node->kind) {
+    case ND_VAR: {
+        Insn *insn = emit(ctx, IR_ADDR, node->tok);
+        insn->ty = ty_ulong;
+        insn->var = node->var;
+        insn->dst = new_reg(ctx, ty_ulong);
+        return insn->dst;
+    }
+    case ND_DEREF:
+        return gen_expr(ctx, node->lhs);
+    case ND_COMMA:
+        gen_expr(ctx, node->lhs);
+        return gen_addr(ctx, node->rhs);
+    case ND_MEMBER: {
+        VReg *addr = gen_addr(ctx, node->lhs);
+        if (node->member->offset == 0)
+            return addr;
+        VReg *off = emit_imm(ctx, ty_long, node->member->offset, node->tok);
+        return emit_binary(ctx, IR_ADD, ty_ulong, ty_ulong, addr, off, node->tok);
+    }
+    }
+
+    error_tok(node->tok, "not an lvalue");
+}
+
+// Returns a zero of the same type as a given value.
+static VReg *zero(Context *ctx, Type *ty, Token *tok) {
+    if (is_flonum(ty))
+        return emit_fimm(ctx, ty, 0, tok);
+    return emit_imm(ctx, ty, 0, tok);
+}
+
+// Extracts a bitfield from the word that contains it.
+static VReg *load_bitfield(Context *ctx, VReg *val, Member *mem, Token *tok) {
+    Type *ty = mem->ty->is_unsigned ? ty_ulong : ty_long;
+    VReg *shl = emit_imm(ctx, ty_long, 64 - mem->bit_width - mem->bit_offset, tok);
+    val = emit_binary(ctx, IR_SHL, ty_long, ty_long, val, shl, tok);
+    VReg *shr = emit_imm(ctx, ty_long, 64 - mem->bit_width, tok);
+    val = emit_binary(ctx, IR_SHR, ty, ty, val, shr, tok);
+    if (mem->ty->size == 8)
+        return val;
+
+    // Truncate the value so that it is represented like any other
+    // value of the member type.
+    Insn *insn = emit(ctx, IR_CAST, tok);
+    insn->ty = mem->ty;
+    insn->from = ty;
+    insn->lhs = val;
+    insn->dst = new_reg(ctx, mem->ty);
+    return insn->dst;
+}
+
+// Merges a new value of a bitfield with the word that contains it.
+static VReg *store_bitfield(Context *ctx, VReg *addr, VReg *val, Member *mem, Token *tok) {
+    VReg *word = emit_load(ctx, addr, mem->ty, tok);
+
+    long mask = (1L << mem->bit_width) - 1;
+    val = emit_binary(ctx, IR_AND, ty_long, ty_long, val, emit_imm(ctx, ty_long, mask, tok), tok);
+    val = emit_binary(ctx, IR_SHL, ty_long, ty_long, val,
+                      emit_imm(ctx, ty_long, mem->bit_offset, tok), tok);
+
+    VReg *keep = emit_imm(ctx, ty_long, ~(mask << mem->bit_offset), tok);
+    word = emit_binary(ctx, IR_AND, ty_long, ty_long, word, keep, tok);
+    return emit_binary(ctx, IR_OR, ty_long, mem->ty, word, val, tok);
+}
+
+// Lowers `&&` and `||`. The value of the right-hand side is only
+// computed if the left-hand side doesn't decide the result.
+static VReg *gen_logical(Context *ctx, Node *node) {
+    bool is_and = node->kind == ND_LOGAND;
+    BasicBlock *rhs_bb = new_bb(ctx);
+    BasicBlock *short_bb = new_bb(ctx);
+    BasicBlock *other_bb = new_bb(ctx);
+    BasicBlock *end_bb = new_bb(ctx);
+    VReg *dst = new_reg(ctx, ty_int);
+
+    VReg *lhs = gen_expr(ctx, node->lhs);
+    if (is_and)
+        emit_br(ctx, lhs, node->lhs->ty, rhs_bb, short_bb, node->tok);
+    else
+        emit_br(ctx, lhs, node->lhs->ty, short_bb, rhs_bb, node->tok);
+
+    start_bb(ctx, rhs_bb, node->tok);
+    VReg *rhs = gen_expr(ctx, node->rhs);
+    if (is_and)
+        emit_br(ctx, rhs, node->rhs->ty, other_bb, short_bb, node->tok);
+    else
+        emit_br(ctx, rhs, node->rhs->ty, short_bb, other_bb, node->tok);
+
+    start_bb(ctx, other_bb, node->tok);
+    emit_mov(ctx, dst, emit_imm(ctx, ty_int, is_and, node->tok), node->tok);
+    emit_jmp(ctx, end_bb, node->tok);
+
+    start_bb(ctx, short_bb, node->tok);
+    emit_mov(ctx, dst, emit_imm(ctx, ty_int, !is_and, node->tok), node->tok);
+    start_bb(ctx, end_bb, node->tok);
+    return dst;
+}
+
+static VReg *gen_funcall(Context *ctx, Node *node) {
+    // Arguments are already evaluated and stored to local variables.
+    VReg **args = calloc(node->nargs, sizeof(VReg *));
+    for (int i = 0; i < node->nargs; i++) {
+        Var *var = node->args[i];
+        if (var->vreg) {
+            args[i] = var->vreg;
+            continue;
+        }
+
+        Insn *insn = emit(ctx, IR_ADDR, node->tok);
+        insn->ty = ty_ulong;
+        insn->var = var;
+        insn->dst = new_reg(ctx, ty_ulong);
+        args[i] = emit_load(ctx, insn->dst, var->ty, node->tok);
+    }
+
+    if (node->lhs->kind == ND_VAR &&
+            !strcmp(node->lhs->var->name, "__builtin_va_start")) {
+        emit(ctx, IR_VA_START, node->tok)->lhs = args[0];
+        return NULL;
+    }
+
+    VReg *fn = gen_expr(ctx, node->lhs);
+    Insn *insn = emit(ctx, IR_CALL, node->tok);
+    insn->ty = node->ty;
+    insn->lhs = fn;
+    insn->func_ty = node->func_ty;
+    insn->args = args;
+    insn->nargs = node->nargs;
+    if (node->ty->kind != TY_VOID)
+        insn->dst = new_reg(ctx, node->ty);
+    return insn->dst;
+}
+
+static InsnKind binary_kind(NodeKind kind) {
+    switch (kind) {
+    case ND_ADD: return IR_ADD;
+    case ND_SUB: return IR_SUB;
+    case ND_MUL: return IR_MUL;
+    case ND_DIV: return IR_DIV;
+    case ND_MOD: return IR_MOD;
+    case ND_BITAND: return IR_AND;
+    case ND_BITOR: return IR_OR;
+    case ND_BITXOR: return IR_XOR;
+    case ND_SHL: return IR_SHL;
+    case ND_SHR: return IR_SHR;
+    case ND_EQ: return IR_EQ;
+    case ND_NE: return IR_NE;
+    case ND_LT: return IR_LT;
+    case ND_LE: return IR_LE;
+    }
+    return -1;
+}
+
+// Lowers an expression and returns the register holding its value,
+// or NULL if it has no value.
+static VReg *gen_expr(Context *ctx, Node *node) {
+    switch (node->kind) {
+    case ND_NUM:
+        if (is_flonum(node->ty))
+            return emit_fimm(ctx, node->ty, node->fval, node->tok);
+        return emit_imm(ctx, node->ty, node->val, node->tok);
+    case ND_VAR:
+        if (node->var->vreg) {
+            // Read a copy, because the variable may be assigned
+            // before the value is used.
+            VReg *val = new_reg(ctx, node->ty);
+            emit_mov(ctx, val, node->var->vreg, node->tok);
+            return val;
+        }
+        return emit_load(ctx, gen_addr(ctx, node), node->ty, node->tok);
+    case ND_DEREF:
+        return emit_load(ctx, gen_addr(ctx, node), node->ty, node->tok);
+    case ND_MEMBER: {
+        VReg *val = emit_load(ctx, gen_addr(ctx, node), node->ty, node->tok);
+        if (node->member->is_bitfield)
+            return load_bitfield(ctx, val, node->member, node->tok);
+        return val;
+    }
+    case ND_ADDR:
+        return gen_addr(ctx, node->lhs);
+    case ND_ASSIGN: {
+        if (node->ty->kind == TY_ARRAY)
+            error_tok(node->tok, "not an lvalue");
+
+        VReg *val = gen_expr(ctx, node->rhs);
+        Node *lhs = node->lhs;
+        while (lhs->kind == ND_COMMA) {
+            gen_expr(ctx, lhs->lhs);
+            lhs = lhs->rhs;
+        }
+
+        if (lhs->kind == ND_VAR && lhs->var->vreg) {
+            emit_mov(ctx, lhs->var->vreg, val, node->tok);
+            return val;
+        }
+
+        VReg *addr = gen_addr(ctx, lhs);
+
+        if (lhs->kind == ND_MEMBER && lhs->member->is_bitfield) {
+            VReg *word = store_bitfield(ctx, addr, val, lhs->member, node->tok);
+            emit_store(ctx, addr, word, node->ty, node->tok);
+            return val;
+        }
+
+        emit_store(ctx, addr, val, node->ty, node->tok);
+        return val;
+    }
+    case ND_STMT_EXPR:
+        // The value of a statement expression is that of its last
+        // expression statement.
+        for (Node *n = node->body; n; n = n->next) {
+            if (!n->next && n->kind == ND_EXPR_STMT)
+                return gen_expr(ctx, n->lhs);
+            gen_stmt(ctx, n);
+        }
+        return NULL;
+    case ND_NULL_EXPR:
+        return NULL;
+    case ND_COMMA:
+        gen_expr(ctx, node->lhs);
+        return gen_expr(ctx, node->rhs);
+    case ND_CAST: {
+        VReg *val = gen_expr(ctx, node->lhs);
+        if (node->ty->kind == TY_VOID)
+            return NULL;
+
+        Insn *insn = emit(ctx, IR_CAST, node->tok);
+        insn->ty = node->ty;
+        insn->from = node->lhs->ty;
+        insn->lhs = val;
+        insn->dst = new_reg(ctx, node->ty);
+        return insn->dst;
+    }
+    case ND_COND: {
+        BasicBlock *then_bb = new_bb(ctx);
+        BasicBlock *els_bb = new_bb(ctx);
+        BasicBlock *end_bb = new_bb(ctx);
+        VReg *dst = NULL;
+        if (node->ty->kind != TY_VOID)
+            dst = new_reg(ctx, node->ty);
+
+        VReg *cond = gen_expr(ctx, node->cond);
+        emit_br(ctx, cond, node->cond->ty, then_bb, els_bb, node->tok);
+
+        start_bb(ctx, then_bb, node->tok);
+        VReg *then = gen_expr(ctx, node->then);
+        if (dst)
+            emit_mov(ctx, dst, then, node->tok);
+        emit_jmp(ctx, end_bb, node->tok);
+
+        start_bb(ctx, els_bb, node->tok);
+        VReg *els = gen_expr(ctx, node->els);
+        if (dst)
+            emit_mov(ctx, dst, els, node->tok);
+        start_bb(ctx, end_bb, node->tok);
+        return dst;
+    }
+    case ND_NOT: {
+        VReg *val = gen_expr(ctx, node->lhs);
+        return emit_binary(ctx, IR_EQ, node->lhs->ty, ty_int, val,
+                           zero(ctx, node->lhs->ty, node->tok), node->tok);
+    }
+    case ND_BITNOT: {
+        VReg *val = gen_expr(ctx, node->lhs);
+        Insn *insn = emit(ctx, IR_NOT, node->tok);
+        insn->lhs = val;
+        insn->ty = node->ty;
+        insn->dst = new_reg(ctx, node->ty);
+        return insn->dst;
+    }
+    case ND_LOGAND:
+    case ND_LOGOR:
+        return gen_logical(ctx, node);
+    case ND_FUNCALL:
+        return gen_funcall(ctx, node);
+    }
+
+    // Binary expressions
+    InsnKind kind = binary_kind(node->kind);
+    if (kind == -1)
+        error_tok(node->tok, "invalid expression");
+
+    VReg *lhs = gen_expr(ctx, node->lhs);
+    VReg *rhs = gen_expr(ctx, node->rhs);
+    return emit_binary(ctx, kind, node->lhs->ty, node->ty, lhs, rhs, node->tok);
+}
+
+static void gen_stmt(Context *ctx, Node *node) {
+    switch (node->kind) {
+    case ND_IF: {
+        BasicBlock *then_bb = new_bb(ctx);
+        BasicBlock *els_bb = node->els ? new_bb(ctx) : NULL;
+        BasicBlock *end_bb = new_bb(ctx);
+
+        VReg *cond = gen_expr(ctx, node->cond);
+        emit_br(ctx, cond, node->cond->ty, then_bb, els_bb ? els_bb : end_bb, node->tok);
+
+        start_bb(ctx, then_bb, node->tok);
+        gen_stmt(ctx, node->then);
+        if (els_bb) {
+            emit_jmp(ctx, end_bb, node->tok);
+            start_bb(ctx, els_bb, node->tok);
+            gen_stmt(ctx, node->els);
+        }
+        start_bb(ctx, end_bb, node->tok);
+        return;
+    }
+    case ND_FOR: {
+        BasicBlock *begin_bb = new_bb(ctx);
+        BasicBlock *body_bb = new_bb(ctx);
+        BasicBlock *cont_bb = new_bb(ctx);
+        BasicBlock *brk_bb = new_bb(ctx);
+        BasicBlock *brk = ctx->brk_bb;
+        BasicBlock *cont = ctx->cont_bb;
+        ctx->brk_bb = brk_bb;
+        ctx->cont_bb = cont_bb;
+
+        if (node->init)
+            gen_stmt(ctx, node->init);
+        start_bb(ctx, begin_bb, node->tok);
+        if (node->cond) {
+            VReg *cond = gen_expr(ctx, node->cond);
+            emit_br(ctx, cond, node->cond->ty, body_bb, brk_bb, node->tok);
+        }
+        start_bb(ctx, body_bb, node->tok);
+        gen_stmt(ctx, node->then);
+        start_bb(ctx, cont_bb, node->tok);
+        if (node->inc)
+            gen_expr(ctx, node->inc);
+        emit_jmp(ctx, begin_bb, node->tok);
+        start_bb(ctx, brk_bb, node->tok);
+
+        ctx->brk_bb = brk;
+        ctx->cont_bb = cont;
+        return;
+    }
+    case ND_DO: {
+        BasicBlock *body_bb = new_bb(ctx);
+        BasicBlock *cont_bb = new_bb(ctx);
+        BasicBlock *brk_bb = new_bb(ctx);
+        BasicBlock *brk = ctx->brk_bb;
+        BasicBlock *cont = ctx->cont_bb;
+        ctx->brk_bb = brk_bb;
+        ctx->cont_bb = cont_bb;
+
+        start_bb(ctx, body_bb, node->tok);
+        gen_stmt(ctx, node->then);
+        start_bb(ctx, cont_bb, node->tok);
+        VReg *cond = gen_expr(ctx, node->cond);
+        emit_br(ctx, cond, node->cond->ty, body_bb, brk_bb, node->tok);
+        start_bb(ctx, brk_bb, node->tok);
+
+        ctx->brk_bb = brk;
+        ctx->cont_bb = cont;
+        return;
+    }
+    case ND_SWITCH: {
+        BasicBlock *brk_bb = new_bb(ctx);
+        BasicBlock *brk = ctx->brk_bb;
+        ctx->brk_bb = brk_bb;
+
+        // Compare the value with each case label in turn.
+        VReg *cond = gen_expr(ctx, node->cond);
+        Type *ty = node->cond->ty;
+
+        for (Node *n = node->case_next; n; n = n->case_next) {
+            BasicBlock *case_bb = new_bb(ctx);
+            BasicBlock *next_bb = new_bb(ctx);
+            n->case_label = case_bb->id;
+
+            VReg *val = emit_imm(ctx, ty, n->val, n->tok);
+            VReg *eq = emit_binary(ctx, IR_EQ, ty, ty_int, cond, val, n->tok);
+            emit_br(ctx, eq, ty_int, case_bb, next_bb, n->tok);
+            start_bb(ctx, next_bb, n->tok);
+        }
+
+        if (node->default_case) {
+            BasicBlock *bb = new_bb(ctx);
+            node->default_case->case_label = bb->id;
+            emit_jmp(ctx, bb, node->tok);
+        } else {
+            emit_jmp(ctx, brk_bb, node->tok);
+        }
+
+        gen_stmt(ctx, node->then);
+        start_bb(ctx, brk_bb, node->tok);
+
+        ctx->brk_bb = brk;
+        return;
+    }
+    case ND_CASE:
+        start_bb(ctx, ctx->ir->blocks[node->case_label], node->tok);
+        gen_stmt(ctx, node->lhs);
+        return;
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next)
+            gen_stmt(ctx, n);
+        return;
+    case ND_BREAK:
+        if (!ctx->brk_bb)
+            error_tok(node->tok, "stray break");
+        emit_jmp(ctx, ctx->brk_bb, node->tok);
+        return;
+    case ND_CONTINUE:
+        if (!ctx->cont_bb)
+            error_tok(node->tok, "stray continue");
+        emit_jmp(ctx, ctx->cont_bb, node->tok);
+        return;
+    case ND_GOTO:
+        emit_jmp(ctx, label_bb(ctx, node->label_name), node->tok);
+        return;
+    case ND_LABEL:
+        start_bb(ctx, label_bb(ctx, node->label_name), node->tok);
+        gen_stmt(ctx, node->lhs);
+        return;
+    case ND_RETURN: {
+        VReg *val = node->lhs ? gen_expr(ctx, node->lhs) : NULL;
+        Insn *insn = emit(ctx, IR_RET, node->tok);
+        insn->lhs = val;
+        insn->ty = node->lhs ? node->lhs->ty : ty_void;
+        return;
+    }
+    case ND_EXPR_STMT:
+        gen_expr(ctx, node->lhs);
+        return;
+    }
+
+    error_tok(node->tok, "invalid statement");
+}
+
+// Copies parameters to their local variables, or reads them directly
+// to the registers of promoted variables. Parameters are assigned
+// to registers of their class from left to right as in the psABIs of
+// both targets, and the rest are numbered from -1 in the order they are
+// passed on the stack.
+static void gen_params(Context *ctx, Function *fn) {
+    int n = 0;
+    for (Var *var = fn->params; var; var = var->next)
+        n++;
+
+    // fn->params is in reverse order.
+    Var **params = calloc(n, sizeof(Var *));
+    int i = n;
+    for (Var *var = fn->params; var; var = var->next)
+        params[--i] = var;
+
+    // Read all parameters before anything else, because a backend
+    // may use parameter registers as scratch registers.
+    VReg **vals = calloc(n, sizeof(VReg *));
+    int gp = 0, fp = 0, stack = 0;
+    for (int i = 0; i < n; i++) {
+        Var *var = params[i];
+        Insn *insn = emit(ctx, IR_PARAM, var->tok);
+        insn->ty = var->ty;
+        insn->dst = vals[i] = var->vreg ? var->vreg : new_reg(ctx, var->ty);
+
+        if (is_flonum(var->ty))
+            insn->val = (fp < 8) ? fp++ : -(++stack);
+        else
+            insn->val = (gp < 6) ? gp++ : -(++stack);
+    }
+
+    for (int i = 0; i < n; i++) {
+        Var *var = params[i];
+        if (var->vreg)
+            continue;
+
+        Insn *addr = emit(ctx, IR_ADDR, var->tok);
+        addr->ty = ty_ulong;
+        addr->var = var;
+        addr->dst = new_reg(ctx, ty_ulong);
+        emit_store(ctx, addr->dst, vals[i], var->ty, var->tok);
+    }
+}
+
+// Assigns registers to the variables that don't have to be in memory.
+static void promote_vars(Context *ctx, Function *fn) {
+    for (Var *var = fn->locals; var; var = var->next)
+        var->vreg = var->is_promoted ? new_reg(ctx, var->ty) : NULL;
+}
+
+IRFunction *lower_function(Context *ctx, Function *fn) {
+    IRFunction *ir = calloc(1, sizeof(IRFunction));
+    ir->fn = fn;
+    ctx->ir = ir;
+    ctx->brk_bb = ctx->cont_bb = NULL;
+    ir->bbs = ctx->bb = new_bb(ctx);
+
+    promote_vars(ctx, fn);
+    gen_params(ctx, fn);
+    gen_stmt(ctx, fn->body);
+
+    // The C spec defines a special rule for the main function.
+    // Reaching the end of the main function is equivalent to
+    // returning 0, even though the behavior is undefined for the
+    // other functions. See C11 5.1.2.2.3.
+    if (!is_terminated(ctx->bb)) {
+        VReg *val = NULL;
+        if (strcmp(fn->name, "main") == 0)
+            val = emit_imm(ctx, ty_int, 0, fn->body->tok);
+
+        Insn *insn = emit(ctx, IR_RET, fn->body->tok);
+        insn->lhs = val;
+        insn->ty = val ? ty_int : ty_void;
+    }
+    return ir;
+}
+
+static void count_use(VReg *reg) {
+    if (reg)
+        reg->nuses++;
+}
+
+// Finds the instructions that define each register and counts the
+// operands that read it.
+void count_defs(IRFunction *ir) {
+    for (BasicBlock *bb = ir->bbs; bb; bb = bb->next) {
+        for (Insn *insn = bb->insns; insn; insn = insn->next) {
+            if (insn->dst) {
+                insn->dst->def = NULL;
+                insn->dst->ndefs = 0;
+                insn->dst->nuses = 0;
+            }
+        }
+    }
+
+    for (BasicBlock *bb = ir->bbs; bb; bb = bb->next) {
+        for (Insn *insn = bb->insns; insn; insn = insn->next) {
+            if (insn->dst) {
+                insn->dst->def = insn;
+                insn->dst->ndefs++;
+            }
+            count_use(insn->lhs);
+            count_use(insn->rhs);
+            for (int i = 0; i < insn->nargs; i++)
+                count_use(insn->args[i]);
+        }
+    }
+}
+
+static char *insn_name[] = {
+    "imm", "fimm", "mov", "add", "sub", "mul", "div", "mod", "and", "or",
+    "xor", "shl", "shr", "eq", "ne", "lt", "le", "not", "cast", "addr",
+    "load", "store", "copy", "param", "call", "va_start", "phi", "br", "jmp",
+    "ret",
+};
+
+static char *type_name(Type *ty) {
+    switch (ty->kind) {
+    case TY_VOID: return "void";
+    case TY_BOOL: return "bool";
+    case TY_CHAR: return ty->is_unsigned ? "u8" : "i8";
+    case TY_SHORT: return ty->is_unsigned ? "u16" : "i16";
+    case TY_INT: return ty->is_unsigned ? "u32" : "i32";
+    case TY_LONG: return ty->is_unsigned ? "u64" : "i64";
+    case TY_FLOAT: return "f32";
+    case TY_DOUBLE: return "f64";
+    case TY_ENUM: return "i32";
+    case TY_PTR: return "ptr";
+    case TY_FUNC: return "fn";
+    case TY_ARRAY: return "arr";
+    case TY_STRUCT: return "struct";
+    }
+    return "?";
+}
+
+// Prints the IR of a function for -fdump-ir.
+void dump_ir(FILE *out, IRFunction *ir) {
+    fprintf(out, "function %s\n", ir->fn->name);
+
+    for (BasicBlock *bb = ir->bbs; bb; bb = bb->next) {
+        fprintf(out, "bb%d:\n", bb->id);
+
+        for (Insn *insn = bb->insns; insn; insn = insn->next) {
+            fprintf(out, "  ");
+            if (insn->dst)
+                fprintf(out, "v%d = ", insn->dst->id);
+            fprintf(out, "%s", insn_name[insn->kind]);
+            if (insn->ty)
+                fprintf(out, ".%s", type_name(insn->ty));
+
+            switch (insn->kind) {
+            case IR_IMM:
+            case IR_PARAM:
+                fprintf(out, " %ld", insn->val);
+                break;
+            case IR_FIMM:
+                fprintf(out, " %g", insn->fval);
+                break;
+            case IR_CAST:
+                fprintf(out, " %s", type_name(insn->from));
+                break;
+            case IR_ADDR:
+                fprintf(out, " %s", insn->var->name[0] ? insn->var->name : "<tmp>");
+                break;
+            }
+
+            if (insn->lhs)
+                fprintf(out, " v%d", insn->lhs->id);
+            if (insn->rhs)
+                fprintf(out, " v%d", insn->rhs->id);
+            for (int i = 0; i < insn->nargs; i++) {
+                if (insn->kind == IR_PHI && insn->args[i])
+                    fprintf(out, " [v%d bb%d]", insn->args[i]->id, insn->bbs[i]->id);
+                else if (insn->kind == IR_PHI)
+                    fprintf(out, " [undef bb%d]", insn->bbs[i]->id);
+                else
+                    fprintf(out, "%s v%d", i ? "," : " (", insn->args[i]->id);
+            }
+            if (insn->kind == IR_CALL)
+                fprintf(out, insn->nargs ? ")" : " ()");
+            if (insn->then)
+                fprintf(out, " bb%d", insn->then->id);
+            if (insn->els)
+                fprintf(out, " bb%d", insn->els->id);
+            fprintf(out, "\n");
+        }
+    }
+}
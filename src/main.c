@@ -1,8 +1,5 @@
 #include "711cc.h"
 
-char **include_paths;
-bool opt_fpic = true;
-
 static bool opt_E;
 static bool opt_M;
 static bool opt_MP;
@@ -11,19 +8,205 @@ static bool opt_c;
 
 static char *opt_MF;
 static char *opt_MT;
+static char *opt_o;
+static int opt_j = 1;
+static bool opt_watch;
+static bool opt_ftime_report;
+static bool opt_fmem_report;
+static bool opt_fperf_counters;
+
+static char **opt_offload;
+static int noffload;
+
+static char **input_paths;
+
+// A job compiles one input file. If there are multiple input files,
+// jobs run on worker threads, and what they would write to stdout and
+// stderr is buffered and printed in input order after all jobs finish.
+typedef struct Job Job;
+struct Job {
+    Context *ctx;
+    int index;
+    char *input_path;
+    char *output_path;
+    bool ok;
 
-static FILE *tempfile;
-static char *input_path;
-static char *output_path;
-static char *tempfile_path;
+    FILE *out;          // Standard output of the job
+    char *out_buf;
+    size_t out_len;
 
-static char *feature = "x86_64";
+    FILE *diag;         // Diagnostics of the job if run on a thread
+    char *diag_buf;
+    size_t diag_len;
+};
+
+static Job **jobs;
+static int njobs;
+
+Context *new_context(void) {
+    Context *ctx = calloc(1, sizeof(Context));
+    ctx->include_paths = calloc(1, sizeof(char *));
+    ctx->opt_fpic = true;
+    ctx->feature = "x86_64";
+    ctx->nthreads = 1;
+    ctx->cache = calloc(1, sizeof(SharedCache));
+    pthread_mutex_init(&ctx->cache->mu, NULL);
+    return ctx;
+}
 
-void println(char *fmt, ...) {
+void println(Context *ctx, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(tempfile, fmt, ap);
-    fprintf(tempfile, "\n");
+    vfprintf(ctx->out, fmt, ap);
+    fprintf(ctx->out, "\n");
+}
+
+// parallel_for() runs fn(arg, i) for each i in [0, n) on up to
+// ctx->nthreads threads. Diagnostics of each task are buffered and
+// reported in index order, and the first failed task terminates the
+// caller, so the result is the same as running the tasks in order.
+typedef struct Pool Pool;
+struct Pool {
+    Context *ctx;
+    pthread_mutex_t mu;
+    int next;               // Index of the next task to run
+    int n;
+    void (*fn)(void *arg, int i);
+    void *arg;
+
+    int *state;             // 0: not started, 1: running, 2: done
+    FILE **diag;
+    char **diag_buf;
+    size_t *diag_len;
+};
+
+static void *pool_thread(void *arg) {
+    Pool *pool = arg;
+
+    // Allocations and CPU time of this thread count toward the
+    // -ftime-report of the compilation it works for.
+    set_time_report(pool->ctx->time_report);
+    trace_thread_name(pool->ctx, "parallel_for");
+    double start = thread_cpu_time();
+
+    for (;;) {
+        pthread_mutex_lock(&pool->mu);
+        int i = pool->next++;
+        pthread_mutex_unlock(&pool->mu);
+        if (i >= pool->n) {
+            add_cpu_time(pool->ctx, thread_cpu_time() - start);
+            return NULL;
+        }
+
+        // An error in a task ends this thread. The remaining tasks
+        // are picked up by the other threads or by the caller.
+        pool->state[i] = 1;
+        set_diag_stream(pool->diag[i]);
+        pool->fn(pool->arg, i);
+        pool->state[i] = 2;
+    }
+}
+
+void parallel_for(Context *ctx, int n, void (*fn)(void *arg, int i), void *arg) {
+    int nthreads = ctx->nthreads < n ? ctx->nthreads : n;
+    if (nthreads <= 1) {
+        for (int i = 0; i < n; i++)
+            fn(arg, i);
+        return;
+    }
+
+    Pool *pool = calloc(1, sizeof(Pool));
+    pthread_mutex_init(&pool->mu, NULL);
+    pool->ctx = ctx;
+    pool->n = n;
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->state = calloc(n, sizeof(int));
+    pool->diag = calloc(n, sizeof(FILE *));
+    pool->diag_buf = calloc(n, sizeof(char *));
+    pool->diag_len = calloc(n, sizeof(size_t));
+    for (int i = 0; i < n; i++)
+        pool->diag[i] = open_memstream(&pool->diag_buf[i], &pool->diag_len[i]);
+
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++)
+        if (pthread_create(&threads[i], NULL, pool_thread, pool))
+            error("cannot create a thread");
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    FILE *out = diag_stream();
+    for (int i = 0; i < n; i++) {
+        fclose(pool->diag[i]);
+        if (pool->state[i] == 0) {
+            fn(arg, i);
+            continue;
+        }
+        fwrite(pool->diag_buf[i], 1, pool->diag_len[i], out);
+        if (pool->state[i] == 1)
+            die();
+    }
+}
+
+typedef struct FunctionOutput FunctionOutput;
+struct FunctionOutput {
+    Context ctx;
+    Function *fn;
+    char *buf;
+    size_t len;
+    void (*emit_fn)(Context *ctx, Function *fn);
+};
+
+static void emit_function_task(void *arg, int i) {
+    FunctionOutput *fo = (FunctionOutput *)arg + i;
+
+    // The key has to be computed before code generation, which
+    // writes label numbers to the AST.
+    double trace_start = trace_now(&fo->ctx);
+    char *entry = NULL;
+    if (fo->ctx.cache_dir) {
+        entry = function_entry_path(&fo->ctx, fo->fn);
+        fo->buf = cache_load(entry, &fo->len);
+        if (fo->buf) {
+            trace_span(&fo->ctx, "codegen (cached)", fo->fn->name, trace_start);
+            return;
+        }
+    }
+
+    fo->ctx.out = open_memstream(&fo->buf, &fo->len);
+    fo->emit_fn(&fo->ctx, fo->fn);
+    fclose(fo->ctx.out);
+    trace_span(&fo->ctx, "codegen", fo->fn->name, trace_start);
+
+    if (entry)
+        cache_store_buf(entry, fo->buf, fo->len);
+}
+
+// Code generation for a function depends only on the function itself,
+// so each function is emitted to its own buffer with its own label
+// numbers, possibly in parallel, and the buffers are written out in
+// source order. With -fcache-dir, the assembly of a function that
+// hasn't changed since an earlier compilation is taken from the cache.
+void emit_functions(Context *ctx, Program *prog, void (*emit_fn)(Context *ctx, Function *fn)) {
+    int n = 0;
+    for (Function *fn = prog->fns; fn; fn = fn->next)
+        n++;
+
+    FunctionOutput *fos = calloc(n, sizeof(FunctionOutput));
+    int i = 0;
+    for (Function *fn = prog->fns; fn; fn = fn->next) {
+        fos[i].ctx = *ctx;
+        fos[i].ctx.top = 0;
+        fos[i].ctx.label = 0;
+        fos[i].fn = fn;
+        fos[i].emit_fn = emit_fn;
+        i++;
+    }
+
+    parallel_for(ctx, n, emit_function_task, fos);
+
+    for (int i = 0; i < n; i++)
+        fwrite(fos[i].buf, 1, fos[i].len, ctx->out);
 }
 
 static void usage(int status) {
@@ -31,51 +214,67 @@ static void usage(int status) {
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  --feature=[x86-64/riscv64]   Specify target architecture, default is x86-64.\n");
     fprintf(stderr, "  -o [output file]             Specify output file.\n");
+    fprintf(stderr, "  -j [N]                       Compile up to N input files, or functions of one file, in parallel.\n");
     fprintf(stderr, "  -fpic/-fPIC                  The ELF module may be loaded anywhere in the 64-bit address space.\n");
     fprintf(stderr, "  -fno-pic/-fno-PIC            The ELF module doesn't have to be position-independent.\n");
+    fprintf(stderr, "  -fcache-dir=[dir]            Reuse outputs of earlier compilations stored in a directory.\n");
+    fprintf(stderr, "  -ftime-report                Print the time and memory spent in each phase of compilation.\n");
+    fprintf(stderr, "  -fperf-counters              Add hardware performance counters to -ftime-report.\n");
+    fprintf(stderr, "  -fmem-report                 Print allocations by kind of object and by phase, and the peak RSS.\n");
+    fprintf(stderr, "  -ftrace=[file]               Write a Chrome trace of headers, macros and functions to a file.\n");
+    fprintf(stderr, "  -fdump-ir                    Print the intermediate representation of each function.\n");
+    fprintf(stderr, "  -O0/-O1/-O2                  Set the optimization level, default is -O0.\n");
     fprintf(stderr, "  -S                           Outputs as assembly.\n");
     fprintf(stderr, "  -E                           Show preprocessed tokens.\n");
     fprintf(stderr, "  -I[path]                     Add include path.\n");
     fprintf(stderr, "  -D[Macro]                    Set an expand macro.\n");
+    fprintf(stderr, "  -H                           Print the cost of each included file.\n");
     fprintf(stderr, "  -M                           Show a list of include path of main file.\n");
     fprintf(stderr, "  -MD                          Show a list of include path, except that `-E` is not implied.\n");
     fprintf(stderr, "  -MP                          Add a phony target for each dependency other than the main file.\n");
     fprintf(stderr, "  -MT[target]                  Change the target for `-M`.\n");
     fprintf(stderr, "  -MF[file]                    Change the file for showing a list of include path.\n");
+    fprintf(stderr, "  --watch                      Stay resident and recompile files when they or their headers change.\n");
+    fprintf(stderr, "  -fpreprocessed               The input is the output of -E and isn't preprocessed again.\n");
+    fprintf(stderr, "  --offload=[addr,...]         Preprocess locally and compile on workers.\n");
+    fprintf(stderr, "  --worker [[host:]port]       Run as a worker that compiles preprocessed files for --offload.\n");
+    fprintf(stderr, "  --server [socket]            Run as a compile server listening on a Unix socket.\n");
+    fprintf(stderr, "  --client [socket] ...        Compile on a server with the rest of the options.\n");
 
     exit(status);
 }
 
-static void add_include_path(char *path) {
-    static int len = 2;
-    include_paths = realloc(include_paths, sizeof(char *) * len);
-    include_paths[len - 2] = path;
-    include_paths[len - 1] = NULL;
-    len++;
+void add_include_path(Context *ctx, char *path) {
+    int len = 0;
+    while (ctx->include_paths[len])
+        len++;
+    ctx->include_paths = realloc(ctx->include_paths, sizeof(char *) * (len + 2));
+    ctx->include_paths[len] = path;
+    ctx->include_paths[len + 1] = NULL;
 }
 
-static void add_default_include_paths(char *argv0) {
+static void add_default_include_paths(Context *ctx, char *argv0) {
     // We expect that this compiler's specific include files
     // are installed to ./include relative to argv[0].
     char *buf = calloc(1, strlen(argv0) + 10);
     sprintf(buf, "%s/include", dirname(strdup(argv0)));
-    add_include_path(buf);
+    add_include_path(ctx, buf);
 
     // Add standard include paths.
-    add_include_path("/usr/local/include");
-    add_include_path("/usr/include/x86_64-linux-gnu");
-    add_include_path("/usr/include");
+    add_include_path(ctx, "/usr/local/include");
+    add_include_path(ctx, "/usr/include/x86_64-linux-gnu");
+    add_include_path(ctx, "/usr/include");
 }
 
-static void define(char *str) {
+static void define(Context *ctx, char *str) {
     char *eq = strchr(str, '=');
     if (eq)
-        define_macro(strndup(str, eq - str), eq + 1);
+        define_macro(ctx, strndup(str, eq - str), eq + 1);
     else
-        define_macro(str, "");
+        define_macro(ctx, str, "");
 }
 
-static char *get_output_filename() {
+static char *get_output_filename(char *input_path) {
     // If no output filename was specified, the output filename is made
     // by replacing ".c" with ".o" or ".s". If the input filename
     // doesn't end with ".c", we simply append ".o" or ".s".
@@ -92,35 +291,116 @@ static char *get_output_filename() {
     return buf;
 }
 
-static void parse_args(int argc, char **argv) {
+static void add_input_path(char *path) {
+    static int len = 2;
+    input_paths = realloc(input_paths, sizeof(char *) * len);
+    input_paths[len - 2] = path;
+    input_paths[len - 1] = NULL;
+    len++;
+}
+
+static void parse_args(Context *ctx, int argc, char **argv) {
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "--help"))
             usage(0);
 
         if (!strncmp(argv[i], "--feature=", 10)) {
-            feature = argv[i] + 10;
+            ctx->feature = argv[i] + 10;
             continue;
         }
 
         if (!strcmp(argv[i], "-o")) {
             if (!argv[++i])
                 usage(1);
-            output_path = argv[i];
+            opt_o = argv[i];
             continue;
         }
 
         if (!strncmp(argv[i], "-o", 2)) {
-            output_path = argv[i] + 2;
+            opt_o = argv[i] + 2;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-j")) {
+            if (!argv[++i])
+                usage(1);
+            opt_j = atoi(argv[i]);
+            if (opt_j < 1)
+                usage(1);
+            ctx->nthreads = opt_j;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "-j", 2)) {
+            opt_j = atoi(argv[i] + 2);
+            if (opt_j < 1)
+                usage(1);
+            ctx->nthreads = opt_j;
             continue;
         }
 
         if (!strcmp(argv[i], "-fpic") || !strcmp(argv[i], "-fPIC")) {
-            opt_fpic = true;
+            ctx->opt_fpic = true;
             continue;
         }
 
         if (!strcmp(argv[i], "-fno-pic") || !strcmp(argv[i], "-fno-PIC")) {
-            opt_fpic = false;
+            ctx->opt_fpic = false;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "-fcache-dir=", 12)) {
+            ctx->cache_dir = argv[i] + 12;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "--offload=", 10)) {
+            char *p = strdup(argv[i] + 10);
+            for (char *addr = strtok(p, ","); addr; addr = strtok(NULL, ",")) {
+                opt_offload = realloc(opt_offload, sizeof(char *) * (noffload + 1));
+                opt_offload[noffload++] = addr;
+            }
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-H")) {
+            ctx->opt_H = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fdump-ir")) {
+            ctx->opt_dump_ir = true;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "-ftrace=", 8)) {
+            ctx->trace = open_trace(argv[i] + 8);
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fperf-counters")) {
+            opt_ftime_report = true;
+            opt_fperf_counters = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fmem-report")) {
+            opt_fmem_report = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-ftime-report")) {
+            opt_ftime_report = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fpreprocessed")) {
+            ctx->opt_fpreprocessed = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--watch")) {
+            opt_watch = true;
             continue;
         }
 
@@ -175,37 +455,55 @@ static void parse_args(int argc, char **argv) {
         }
 
         if (!strncmp(argv[i], "-I", 2)) {
-            add_include_path(argv[i] + 2);
+            add_include_path(ctx, argv[i] + 2);
             continue;
         }
 
         if (!strcmp(argv[i], "-D")) {
             if (!argv[++i])
                 usage(1);
-            define(argv[i]);
+            define(ctx, argv[i]);
             continue;
         }
 
         if (!strncmp(argv[i], "-D", 2)) {
-            define(argv[i] + 2);
+            define(ctx, argv[i] + 2);
+            continue;
+        }
+
+        if (!strncmp(argv[i], "-O", 2)) {
+            // -O3 is the same as -O2, and -Os and -Og are -O1.
+            char *level = argv[i] + 2;
+            if (*level == '\0' || !strcmp(level, "s") || !strcmp(level, "g"))
+                ctx->opt_level = 1;
+            else if (isdigit(*level) && level[1] == '\0')
+                ctx->opt_level = (*level - '0' > 2) ? 2 : *level - '0';
+            else
+                error("unknown optimization level, %s", argv[i]);
             continue;
         }
 
-        if (!strncmp(argv[i], "-W", 2) || !strncmp(argv[i], "-O", 2) ||
-            !strcmp(argv[i], "-g"))
+        if (!strncmp(argv[i], "-W", 2) || !strcmp(argv[i], "-g"))
             continue;
 
         if (argv[i][0] == '-' && argv[i][1] != '\0')
             error("unknown argument, %s", argv[i]);
 
-        input_path = argv[i];
+        add_input_path(argv[i]);
     }
 
-    if (!input_path)
+    if (!input_paths)
         error("no input files");
 
-    if (!output_path)
-        output_path = get_output_filename();
+    if (input_paths[1] && opt_o)
+        error("cannot specify -o with multiple files");
+
+    if (input_paths[1] && opt_MF)
+        error("cannot specify -MF with multiple files");
+
+    // Only the x86-64 backend generates code from the IR.
+    if (ctx->opt_dump_ir && strcmp(ctx->feature, "x86_64"))
+        error("-fdump-ir is supported only for x86-64");
 }
 
 // Handle -M, -MM and the like. If these options are given, the
@@ -214,17 +512,17 @@ static void parse_args(int argc, char **argv) {
 // used to automate file dependency management.
 //
 // You can ignore this function if you aren't sure what -M options are.
-static void print_dependencies(void) {
+static void print_dependencies(Job *job) {
     FILE *out;
     if (opt_MF) {
         out = fopen(opt_MF, "w");
         if (!out)
             error("-MF: cannot open %s: %s", opt_MF, strerror(errno));
     } else {
-        out = stdout;
+        out = job->out;
     }
 
-    char **paths = get_input_files();
+    char **paths = get_input_files(job->ctx);
     fprintf(out, "%s:", opt_MT ? opt_MT : paths[0]);
 
     for (int i = 1; paths[i]; i++)
@@ -235,22 +533,73 @@ static void print_dependencies(void) {
         for (int i = 1; paths[i]; i++)
             fprintf(out, "%s:\n\n", paths[i]);
 
-    if (out != stdout)
+    if (out != job->out)
         fclose(out);
 }
 
 // Print tokens to stdout. Used for -E.
-static void print_tokens(Token *tok) {
+static void print_tokens(FILE *out, Token *tok) {
     int line = 1;
     for (; tok->kind != TK_EOF; tok = tok->next) {
         if (line > 1 && tok->at_bol)
-            printf("\n");
+            fprintf(out, "\n");
         if (tok->has_space && !tok->at_bol)
-            printf(" ");
-        printf("%.*s", tok->len, tok->loc);
+            fprintf(out, " ");
+        fprintf(out, "%.*s", tok->len, tok->loc);
         line++;
     }
-    printf("\n");
+    fprintf(out, "\n");
+}
+
+static void print_line_marker(FILE *out, Token *tok) {
+    fprintf(out, "# %d \"", tok->line_no);
+    for (char *p = tok->filename; *p; p++) {
+        if (*p == '\\' || *p == '"')
+            fputc('\\', out);
+        fputc(*p, out);
+    }
+    fprintf(out, "\"\n");
+}
+
+// The location of a string or character literal with an encoding
+// prefix doesn't include the prefix, so we recover it from the type.
+static char *literal_prefix(Token *tok) {
+    Type *ty = NULL;
+    if (tok->kind == TK_STR)
+        ty = tok->ty->base;
+    else if (tok->kind == TK_NUM && tok->loc[0] == '\'')
+        ty = tok->ty;
+
+    if (!ty || ty->size == 1 || (tok->kind == TK_NUM && ty->kind == TY_INT && !ty->is_unsigned))
+        return "";
+    if (ty->size == 2)
+        return "u";
+    return ty->is_unsigned ? "U" : "L";
+}
+
+// Print tokens with linemarkers, so that compiling the output with
+// -fpreprocessed gives the same filenames and line numbers as compiling
+// the original file. Tokens are always separated by a space, so that two
+// tokens are never read back as one.
+static void print_tokens_with_markers(FILE *out, Token *tok) {
+    char *filename = NULL;
+    int line_no = 0;
+
+    for (; tok->kind != TK_EOF; tok = tok->next) {
+        bool same_file = filename && !strcmp(filename, tok->filename);
+        if (!filename || (tok->at_bol && !(same_file && tok->line_no == line_no))) {
+            if (filename)
+                fprintf(out, "\n");
+            if (!same_file || tok->line_no != line_no + 1)
+                print_line_marker(out, tok);
+            filename = tok->filename;
+            line_no = tok->line_no;
+        } else {
+            fprintf(out, " ");
+        }
+        fprintf(out, "%s%.*s", literal_prefix(tok), tok->len, tok->loc);
+    }
+    fprintf(out, "\n");
 }
 
 static void copy_file(FILE *in, FILE *out) {
@@ -263,53 +612,169 @@ static void copy_file(FILE *in, FILE *out) {
     }
 }
 
+// Writes the contents of `in` to the output file of a job.
+static void write_output(Job *job, FILE *in) {
+    FILE *out;
+    if (strcmp(job->output_path, "-") == 0) {
+        out = job->out;
+    } else {
+        out = fopen(job->output_path, "w");
+        if (!out)
+            error("cannot open output file: %s: %s", job->output_path, strerror(errno));
+    }
+    copy_file(in, out);
+    if (out != job->out)
+        fclose(out);
+}
+
+// Sends preprocessed tokens to a worker given by --offload and writes
+// the output file it sends back. Workers are assigned to input files in
+// turn, and if a worker can't be reached, the next one is tried. Returns
+// false if no worker can be reached, in which case we compile locally.
+static bool offload(Job *job, Token *tok, char *entry) {
+    Context *ctx = job->ctx;
+
+    char *text;
+    size_t text_len;
+    FILE *f = open_memstream(&text, &text_len);
+    print_tokens_with_markers(f, tok);
+    fclose(f);
+
+    char *feature = calloc(1, strlen(ctx->feature) + 11);
+    sprintf(feature, "--feature=%s", ctx->feature);
+    char level[] = "-O0";
+    level[2] += ctx->opt_level;
+    char *flags[] = {feature, ctx->opt_fpic ? "-fpic" : "-fno-pic", level, opt_S ? "-S" : "-c", NULL};
+
+    for (int i = 0; i < noffload; i++) {
+        char *buf, *diag_buf;
+        size_t len, diag_len;
+        FILE *out = open_memstream(&buf, &len);
+        FILE *diag = open_memstream(&diag_buf, &diag_len);
+        int status = run_on_worker(opt_offload[(job->index + i) % noffload],
+                                   flags, job->input_path, text, out, diag);
+        fclose(out);
+        fclose(diag);
+        if (status == -1)
+            continue;
+
+        fwrite(diag_buf, 1, diag_len, diag_stream());
+        if (status)
+            die();
+
+        FILE *in = fmemopen(buf, len, "r");
+        write_output(job, in);
+        fclose(in);
+        if (entry)
+            cache_store_buf(entry, buf, len);
+        return true;
+    }
+    return false;
+}
+
 static void cleanup(void) {
-    if (tempfile_path)
-        unlink(tempfile_path);
+    for (int i = 0; i < njobs; i++)
+        if (jobs[i]->ctx->tempfile_path)
+            unlink(jobs[i]->ctx->tempfile_path);
 }
 
-int main(int argc, char **argv) {
-    init_macros();
-    add_default_include_paths(argv[0]);
-    parse_args(argc, argv);
-    atexit(cleanup);
+static Job *new_job(Context *base, char *input_path) {
+    Job *job = calloc(1, sizeof(Job));
+    job->ctx = calloc(1, sizeof(Context));
+    *job->ctx = *base;
+    job->input_path = input_path;
+    job->output_path = opt_o ? opt_o : get_output_filename(input_path);
+    job->out = stdout;
+    job->index = njobs;
+
+    jobs = realloc(jobs, sizeof(Job *) * (njobs + 1));
+    jobs[njobs++] = job;
+    return job;
+}
+
+static void compile_file2(Job *job) {
+    Context *ctx = job->ctx;
 
     // Open a temporary output file.
-    tempfile_path = strdup("/tmp/711cc-XXXXXX");
-    int fd = mkstemp(tempfile_path);
-    if (!fd)
-        error("cannot create a temporary file: %s: %s", tempfile_path, strerror(errno));
-    tempfile = fdopen(fd, "w");
+    ctx->tempfile_path = strdup("/tmp/711cc-XXXXXX");
+    int fd = mkstemp(ctx->tempfile_path);
+    if (fd == -1)
+        error("cannot create a temporary file: %s: %s", ctx->tempfile_path, strerror(errno));
+    ctx->tempfile = fdopen(fd, "w");
+    ctx->out = ctx->tempfile;
 
     // Tokenize
-    Token *tok = tokenize_file(input_path);
+    double trace_start = trace_now(ctx);
+    Token *tok = tokenize_file(ctx, job->input_path);
     if (!tok)
-        error("%s: %s", input_path, strerror(errno));
+        error("%s: %s", job->input_path, strerror(errno));
 
-    // Preprocess
-    tok = preprocess(tok);
+    // Preprocess. With -fpreprocessed, only linemarkers are processed,
+    // and identifiers are not expanded again.
+    tok = preprocess(ctx, tok);
+    trace_span(ctx, "phase", "preprocess", trace_start);
 
     // If -M or -MD are given, print out dependency info for make command.
     if (opt_M)
-        print_dependencies();
+        print_dependencies(job);
 
     // If -E is given, print out preprocessed C code as a result.
     if (opt_E) {
-        print_tokens(tok);
-        exit(0);
+        print_tokens(job->out, tok);
+        fclose(ctx->tempfile);
+        return;
+    }
+
+    // If -fcache-dir is given and the same tokens have been compiled
+    // with the same options before, the cached output is the result.
+    char *entry = NULL;
+    if (ctx->cache_dir) {
+        enter_phase(ctx, PHASE_CACHE);
+        entry = cache_entry_path(ctx, tok, opt_S ? "s" : "o");
+        FILE *in = fopen(entry, "r");
+        if (in) {
+            enter_phase(ctx, PHASE_OUTPUT);
+            write_output(job, in);
+            fclose(in);
+            fclose(ctx->tempfile);
+            return;
+        }
+    }
+
+    // If --offload is given, the rest of the work is done by a worker.
+    if (opt_offload) {
+        enter_phase(ctx, PHASE_OFFLOAD);
+        if (offload(job, tok, entry)) {
+            fclose(ctx->tempfile);
+            return;
+        }
     }
 
     // Parse
-    Program *prog = parse(tok);
+    enter_phase(ctx, PHASE_PARSE);
+    trace_start = trace_now(ctx);
+    Program *prog = parse(ctx, tok);
+    trace_span(ctx, "phase", "parse", trace_start);
 
+    enter_phase(ctx, PHASE_STACK);
     for (Function *fn = prog->fns; fn; fn = fn->next) {
-        // Besides local variables, callee-saved registers take 200 bytes
-        // and the variable-argument save area takes 48 bytes in the stack.
-        int offset = fn->is_variadic ? 128 : 104;
+        // Variadic functions save the argument registers at the top of
+        // the stack frame. The x86-64 backend saves callee-saved registers
+        // below the local variables. On RISC-V, callee-saved registers
+        // take 200 bytes at the top of the stack frame.
+        int offset;
+        if (!strcmp(ctx->feature, "x86_64"))
+            offset = fn->is_variadic ? 128 : 0;
+        else
+            offset = fn->is_variadic ? 128 : 104;
         if (strcmp(fn->name, "main") == 0 )
             offset = offset + 8;
 
         for (Var *var = fn->locals; var; var = var->next) {
+            // The x86-64 backend keeps promoted variables in registers.
+            if (var->is_promoted && !strcmp(ctx->feature, "x86_64"))
+                continue;
+
             offset = align_to(offset, var->align);
             offset += var->ty->size;
             var->offset = offset;
@@ -318,51 +783,325 @@ int main(int argc, char **argv) {
     }
 
     // Traverse the AST to emit assembly
-    if (!strcmp(feature, "x86_64"))
-        codegen(prog);
-    else if (!strcmp(feature, "riscv64"))
-        codegen_riscv64(prog);
+    enter_phase(ctx, PHASE_CODEGEN);
+    trace_start = trace_now(ctx);
+    if (!strcmp(ctx->feature, "x86_64"))
+        codegen(ctx, prog);
+    else if (!strcmp(ctx->feature, "riscv64"))
+        codegen_riscv64(ctx, prog);
     else
-        error("feature not supported: %s", feature);
+        error("feature not supported: %s", ctx->feature);
+    trace_span(ctx, "phase", "codegen", trace_start);
 
     // If -S is given, assembly text is the final output.
     if (opt_S) {
-        fseek(tempfile, 0, SEEK_SET);
-
-        FILE *out;
-        if (strcmp(output_path, "-") == 0) {
-            out = stdout;
-        } else {
-            out = fopen(output_path, "w");
-            if (!out)
-                error("cannot open output file: %s: %s", output_path, strerror(errno));
-        }
-        copy_file(tempfile, out);
-        exit(0);
+        enter_phase(ctx, PHASE_OUTPUT);
+        fseek(ctx->tempfile, 0, SEEK_SET);
+        write_output(job, ctx->tempfile);
+        fclose(ctx->tempfile);
+        if (entry)
+            cache_store(ctx->tempfile_path, entry);
+        return;
     }
 
-    // Otherwise, run the assembler to assemble our output.
-    fclose(tempfile);
+    // Otherwise, run the assembler to assemble our output. Its CPU time
+    // is that of the children waited for in the meantime, which is only
+    // approximate if other jobs run their assemblers at the same time.
+    enter_phase(ctx, PHASE_AS);
+    fclose(ctx->tempfile);
+
+    struct rusage before;
+    getrusage(RUSAGE_CHILDREN, &before);
+    trace_start = trace_now(ctx);
 
     pid_t pid;
     if ((pid = fork()) == 0) {
         // Child process. Run the assembler.
-        execlp("as", "-c", "-o", output_path, tempfile_path, (char *)0);
+        execlp("as", "-c", "-o", job->output_path, ctx->tempfile_path, (char *)0);
         fprintf(stderr, "exec failed: as: %s", strerror(errno));
         _exit(1);
     }
 
     // Wait for the child process to finish.
+    int status;
     for (;;) {
-        int status;
         int w = waitpid(pid, &status, 0);
-        if (!w) {
+        if (!w)
             error("waitpid failed: %s", strerror(errno));
-            exit(1);
-        }
         if (WIFEXITED(status))
             break;
     }
 
-    return 0;
+    trace_span(ctx, "phase", "assembler", trace_start);
+
+    struct rusage after;
+    getrusage(RUSAGE_CHILDREN, &after);
+    add_cpu_time(ctx, rusage_time(&after) - rusage_time(&before));
+
+    if (entry && WEXITSTATUS(status) == 0)
+        cache_store(job->output_path, entry);
+}
+
+static void compile_file(Job *job) {
+    Context *ctx = job->ctx;
+    if (opt_ftime_report || opt_fmem_report)
+        ctx->time_report = new_time_report(opt_fperf_counters);
+
+    trace_thread_name(ctx, job->input_path);
+    double trace_start = trace_now(ctx);
+    compile_file2(job);
+    trace_span(ctx, "compile", job->input_path, trace_start);
+
+    if (ctx->opt_H)
+        print_include_report(ctx, diag_stream(), job->input_path);
+    if (opt_ftime_report)
+        print_time_report(ctx, diag_stream(), job->input_path);
+    if (opt_fmem_report)
+        print_mem_report(ctx, diag_stream(), job->input_path);
+}
+
+// At most opt_j jobs run at the same time. A slot is released when
+// a worker thread exits, whether it finished its job or stopped at an
+// error, so we release it from the destructor of a thread-specific key.
+static pthread_mutex_t slot_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_cond = PTHREAD_COND_INITIALIZER;
+static pthread_key_t slot_key;
+static int free_slots;
+
+static void release_slot(void *arg) {
+    pthread_mutex_lock(&slot_mu);
+    free_slots++;
+    pthread_cond_signal(&slot_cond);
+    pthread_mutex_unlock(&slot_mu);
+}
+
+static void *compile_thread(void *arg) {
+    Job *job = arg;
+    pthread_setspecific(slot_key, job);
+    set_diag_stream(job->diag);
+    compile_file(job);
+    job->ok = true;
+    return NULL;
+}
+
+static bool run_jobs(Job **list, int n) {
+    static bool initialized;
+    if (!initialized) {
+        pthread_key_create(&slot_key, release_slot);
+        free_slots = opt_j;
+        initialized = true;
+    }
+
+    pthread_t *threads = calloc(n, sizeof(pthread_t));
+    for (int i = 0; i < n; i++) {
+        Job *job = list[i];
+        job->ctx->nthreads = 1;
+        job->out = open_memstream(&job->out_buf, &job->out_len);
+        job->diag = open_memstream(&job->diag_buf, &job->diag_len);
+
+        pthread_mutex_lock(&slot_mu);
+        while (free_slots == 0)
+            pthread_cond_wait(&slot_cond, &slot_mu);
+        free_slots--;
+        pthread_mutex_unlock(&slot_mu);
+
+        if (pthread_create(&threads[i], NULL, compile_thread, job))
+            error("cannot create a thread");
+    }
+
+    // Print the outputs in input order regardless of the order in
+    // which jobs finished.
+    bool ok = true;
+    for (int i = 0; i < n; i++) {
+        Job *job = list[i];
+        pthread_join(threads[i], NULL);
+        fclose(job->out);
+        fclose(job->diag);
+        fwrite(job->out_buf, 1, job->out_len, stdout);
+        fwrite(job->diag_buf, 1, job->diag_len, stderr);
+        ok = ok && job->ok;
+    }
+    free(threads);
+    return ok;
+}
+
+// In watch mode, we stay resident after compiling the input files and
+// recompile an input file whenever a file it depends on changes. The
+// dependencies of a file are the files it read in its last compilation,
+// just like -M prints. Tokenized headers stay in the shared cache, which
+// revalidates them by size and mtime.
+//
+// We watch the directories of the dependencies rather than the files
+// themselves, because editors often save a file by writing a new file
+// and renaming it over the old one.
+typedef struct Dependency Dependency;
+struct Dependency {
+    Dependency *next;
+    int job;        // Index in the list of watched jobs
+    int wd;         // Watch descriptor of the directory
+    char *name;     // Filename in the directory
+};
+
+static Dependency *add_dependency(Dependency *deps, int fd, int job, char *path) {
+    if (path[0] != '/') {
+        char *cwd = getcwd(NULL, 0);
+        if (!cwd)
+            return deps;
+        char *buf = calloc(1, strlen(cwd) + strlen(path) + 2);
+        sprintf(buf, "%s/%s", cwd, path);
+        free(cwd);
+        path = buf;
+    }
+
+    int mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE;
+    int wd = inotify_add_watch(fd, dirname(strdup(path)), mask);
+    if (wd == -1)
+        return deps;
+
+    Dependency *dep = calloc(1, sizeof(Dependency));
+    dep->job = job;
+    dep->wd = wd;
+    dep->name = basename(strdup(path));
+    dep->next = deps;
+    return dep;
+}
+
+// Waits until a file changes, and returns whether each job depends on
+// a changed file.
+static bool *wait_for_changes(int fd, Dependency *deps, int n) {
+    bool *changed = calloc(n, sizeof(bool));
+    bool found = false;
+    char buf[4096];
+
+    struct pollfd pfd = {};
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    // An editor or a build step often writes several files at once,
+    // so we wait until no more events arrive for a short time.
+    while (!found || poll(&pfd, 1, 50) > 0) {
+        long len = read(fd, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len == -1 && errno == EINTR)
+                continue;
+            error("--watch: read failed: %s", strerror(errno));
+        }
+
+        for (char *p = buf; p < buf + len;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (!ev->len)
+                continue;
+
+            for (Dependency *dep = deps; dep; dep = dep->next) {
+                if (dep->wd == ev->wd && !strcmp(dep->name, ev->name)) {
+                    changed[dep->job] = true;
+                    found = true;
+                }
+            }
+        }
+    }
+    return changed;
+}
+
+static void remove_tempfiles(Job **list, int n) {
+    for (int i = 0; i < n; i++) {
+        if (list[i]->ctx->tempfile_path) {
+            unlink(list[i]->ctx->tempfile_path);
+            list[i]->ctx->tempfile_path = NULL;
+        }
+    }
+}
+
+noreturn static void watch(Context *ctx) {
+    int fd = inotify_init();
+    if (fd == -1)
+        error("--watch: inotify_init failed: %s", strerror(errno));
+
+    // Compile everything first. Jobs always run on threads so that an
+    // error in one compilation doesn't end the process.
+    int n = njobs;
+    Job **list = calloc(n, sizeof(Job *));
+    for (int i = 0; i < n; i++)
+        list[i] = jobs[i];
+    run_jobs(list, n);
+
+    for (;;) {
+        remove_tempfiles(list, n);
+        fflush(stdout);
+        fflush(stderr);
+
+        Dependency *deps = NULL;
+        for (int i = 0; i < n; i++) {
+            deps = add_dependency(deps, fd, i, list[i]->input_path);
+            char **paths = get_input_files(list[i]->ctx);
+            for (int j = 0; paths && paths[j]; j++)
+                deps = add_dependency(deps, fd, i, paths[j]);
+        }
+
+        bool *changed = wait_for_changes(fd, deps, n);
+
+        Job **rerun = calloc(n, sizeof(Job *));
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            if (changed[i]) {
+                list[i] = new_job(ctx, list[i]->input_path);
+                rerun[m++] = list[i];
+            }
+        }
+        run_jobs(rerun, m);
+        free(rerun);
+        free(changed);
+    }
+}
+
+// Compiles input files as the command line arguments say. `ctx` has
+// predefined macros and the default include paths.
+int run_driver(Context *ctx, int argc, char **argv) {
+    parse_args(ctx, argc, argv);
+    atexit(cleanup);
+
+    for (int i = 0; input_paths[i]; i++)
+        new_job(ctx, input_paths[i]);
+
+    if (opt_watch)
+        watch(ctx);
+
+    if (njobs == 1) {
+        compile_file(jobs[0]);
+        return 0;
+    }
+    return run_jobs(jobs, njobs) ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    // A client forwards the rest of the arguments to a server.
+    if (argc >= 3 && !strcmp(argv[1], "--client")) {
+        char *path = argv[2];
+        argv[2] = argv[0];
+        return run_client(path, argc - 2, argv + 2);
+    }
+
+    Context *ctx = new_context();
+    init_macros(ctx);
+
+    // A server compiles files in the directories of its clients, so its
+    // own include directory has to be an absolute path.
+    if (argc == 3 && !strcmp(argv[1], "--server")) {
+        char *self = calloc(1, PATH_MAX);
+        if (readlink("/proc/self/exe", self, PATH_MAX - 1) <= 0)
+            self = argv[0];
+        add_default_include_paths(ctx, self);
+        run_server(ctx, argv[2]);
+        return 0;
+    }
+
+    // A worker compiles only preprocessed files.
+    if (argc == 3 && !strcmp(argv[1], "--worker")) {
+        run_worker(ctx, argv[2]);
+        return 0;
+    }
+
+    add_default_include_paths(ctx, argv[0]);
+    return run_driver(ctx, argc, argv);
 }
@@ -0,0 +1,612 @@
+#include "711cc.h"
+
+// This file implements the optimization passes that run on the IR in
+// SSA form, and a pass manager that runs them according to -O.
+//
+// -O0 doesn't optimize at all. -O1 converts a function to SSA form
+// and runs each pass once, and -O2 repeats the passes until none of
+// them changes the function, because one pass often exposes more work
+// for another. For example, folding a branch condition to a constant
+// makes a block unreachable, and removing it turns a phi into a copy.
+
+static bool is_const(VReg *reg) {
+    return reg && reg->def && reg->def->kind == IR_IMM;
+}
+
+static bool is_fconst(VReg *reg) {
+    return reg && reg->def && reg->def->kind == IR_FIMM;
+}
+
+static void make_imm(Insn *insn, long val) {
+    insn->kind = IR_IMM;
+    insn->ty = insn->dst->ty;
+    insn->val = val;
+    insn->lhs = insn->rhs = NULL;
+}
+
+static void make_fimm(Insn *insn, double fval) {
+    insn->kind = IR_FIMM;
+    insn->ty = insn->dst->ty;
+    insn->fval = fval;
+    insn->lhs = insn->rhs = NULL;
+}
+
+static int size_of(Type *ty) {
+    if (ty->kind == TY_ARRAY || ty->kind == TY_STRUCT || ty->kind == TY_FUNC)
+        return 8;
+    return ty->size;
+}
+
+// Returns an integer converted to a given type. An IR_IMM holds the
+// value of its type, e.g. -1 for an int and 4294967295 for an unsigned
+// int with all bits set.
+static long normalize(Type *ty, long val) {
+    if (ty->kind == TY_BOOL)
+        return val != 0;
+
+    switch (size_of(ty)) {
+    case 1:
+        return ty->is_unsigned ? (long)(unsigned char)val : (long)(signed char)val;
+    case 2:
+        return ty->is_unsigned ? (long)(unsigned short)val : (long)(short)val;
+    case 4:
+        return ty->is_unsigned ? (long)(unsigned)val : (long)(int)val;
+    }
+    return val;
+}
+
+// Returns the value of a constant register. The parser doesn't
+// always normalize a literal, e.g. U'\xffffffff' is held as -1.
+static long const_val(VReg *reg) {
+    return normalize(reg->ty, reg->def->val);
+}
+
+// Computes an integer operation as the backend would. Returns false
+// if it traps, i.e. a division by zero or an overflowing division.
+static bool fold_int(Insn *insn, long a, long b, long *res) {
+    Type *ty = insn->ty;
+    bool is_unsigned = ty->is_unsigned;
+    int bits = size_of(ty) * 8;
+    long min = bits == 64 ? (long)(1UL << 63) : -(1L << (bits - 1));
+    unsigned long ua = a;
+    unsigned long ub = b;
+
+    switch (insn->kind) {
+    case IR_ADD: *res = ua + ub; break;
+    case IR_SUB: *res = ua - ub; break;
+    case IR_MUL: *res = ua * ub; break;
+    case IR_DIV:
+    case IR_MOD:
+        if (b == 0 || (!is_unsigned && a == min && b == -1))
+            return false;
+        if (insn->kind == IR_DIV)
+            *res = is_unsigned ? (long)(ua / ub) : a / b;
+        else
+            *res = is_unsigned ? (long)(ua % ub) : a % b;
+        break;
+    case IR_AND: *res = a & b; break;
+    case IR_OR: *res = a | b; break;
+    case IR_XOR: *res = a ^ b; break;
+    case IR_SHL: *res = ua << (b & (bits - 1)); break;
+    case IR_SHR:
+        if (is_unsigned)
+            *res = ua >> (b & (bits - 1));
+        else
+            *res = a >> (b & (bits - 1));
+        break;
+    case IR_EQ: *res = a == b; return true;
+    case IR_NE: *res = a != b; return true;
+    case IR_LT: *res = is_unsigned ? ua < ub : a < b; return true;
+    case IR_LE: *res = is_unsigned ? ua <= ub : a <= b; return true;
+    case IR_NOT: *res = ~a; break;
+    default:
+        return false;
+    }
+    *res = normalize(insn->dst->ty, *res);
+    return true;
+}
+
+static bool fold_fp(Insn *insn, double a, double b) {
+    double res;
+
+    switch (insn->kind) {
+    case IR_ADD: res = a + b; break;
+    case IR_SUB: res = a - b; break;
+    case IR_MUL: res = a * b; break;
+    case IR_DIV: res = a / b; break;
+    case IR_EQ: make_imm(insn, a == b); return true;
+    case IR_NE: make_imm(insn, a != b); return true;
+    case IR_LT: make_imm(insn, a < b); return true;
+    case IR_LE: make_imm(insn, a <= b); return true;
+    default:
+        return false;
+    }
+
+    // A float operation is rounded to float, which is exact because
+    // a double holds the exact result of two floats.
+    make_fimm(insn, insn->ty->kind == TY_FLOAT ? (float)res : res);
+    return true;
+}
+
+static bool fold_cast(Insn *insn) {
+    Type *from = insn->from;
+    Type *to = insn->ty;
+
+    if (is_fconst(insn->lhs)) {
+        double val = insn->lhs->def->fval;
+        if (is_flonum(to)) {
+            make_fimm(insn, (to->kind == TY_FLOAT) ? (float)val : val);
+            return true;
+        }
+        if (to->kind == TY_BOOL) {
+            make_imm(insn, val != 0);
+            return true;
+        }
+
+        // Leave an out-of-range conversion to the hardware.
+        if (!(val > -9.2e18 && val < 9.2e18))
+            return false;
+        make_imm(insn, normalize(to, (long)val));
+        return true;
+    }
+
+    if (!is_const(insn->lhs))
+        return false;
+
+    long val = const_val(insn->lhs);
+    if (is_flonum(to)) {
+        double d;
+        if (size_of(from) == 8 && from->is_unsigned)
+            d = (double)(unsigned long)val;
+        else
+            d = (double)val;
+        make_fimm(insn, (to->kind == TY_FLOAT) ? (float)d : d);
+        return true;
+    }
+
+    make_imm(insn, normalize(to, val));
+    return true;
+}
+
+// Replaces an instruction with a copy of one of its operands.
+static void make_mov(Insn *insn, VReg *src) {
+    insn->kind = IR_MOV;
+    insn->ty = insn->dst->ty;
+    insn->lhs = src;
+    insn->rhs = NULL;
+}
+
+// Simplifies an operation with an identity or a zero, e.g. x+0 or x*1.
+static bool simplify_identity(Insn *insn) {
+    if (is_flonum(insn->ty))
+        return false;
+
+    VReg *lhs = insn->lhs;
+    VReg *rhs = insn->rhs;
+    long l = is_const(lhs) ? const_val(lhs) : -1;
+    long r = is_const(rhs) ? const_val(rhs) : -1;
+
+    switch (insn->kind) {
+    case IR_ADD:
+    case IR_OR:
+    case IR_XOR:
+        if (is_const(lhs) && l == 0) {
+            make_mov(insn, rhs);
+            return true;
+        }
+        // fallthrough
+    case IR_SUB:
+    case IR_SHL:
+    case IR_SHR:
+        if (is_const(rhs) && r == 0) {
+            make_mov(insn, lhs);
+            return true;
+        }
+        return false;
+    case IR_MUL:
+        if (is_const(lhs) && l == 1) {
+            make_mov(insn, rhs);
+            return true;
+        }
+        // fallthrough
+    case IR_DIV:
+        if (is_const(rhs) && r == 1) {
+            make_mov(insn, lhs);
+            return true;
+        }
+        return false;
+    }
+    return false;
+}
+
+// Folds an instruction whose operands are constants.
+static bool fold_insn(Insn *insn) {
+    switch (insn->kind) {
+    case IR_CAST:
+        return fold_cast(insn);
+    case IR_NOT: {
+        long val;
+        if (!is_const(insn->lhs) || !fold_int(insn, const_val(insn->lhs), 0, &val))
+            return false;
+        make_imm(insn, val);
+        return true;
+    }
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV:
+    case IR_MOD:
+    case IR_AND:
+    case IR_OR:
+    case IR_XOR:
+    case IR_SHL:
+    case IR_SHR:
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+        break;
+    default:
+        return false;
+    }
+
+    if (is_fconst(insn->lhs) && is_fconst(insn->rhs))
+        return fold_fp(insn, insn->lhs->def->fval, insn->rhs->def->fval);
+
+    if (!is_const(insn->lhs) || !is_const(insn->rhs))
+        return simplify_identity(insn);
+
+    long val;
+    if (!fold_int(insn, const_val(insn->lhs), const_val(insn->rhs), &val))
+        return false;
+    make_imm(insn, val);
+    return true;
+}
+
+// Folds a phi whose arguments are all the same constant. The result
+// is moved below the other phis of the block.
+static bool fold_phi(BasicBlock *bb, Insn *insn) {
+    if (insn->nargs == 0)
+        return false;
+
+    for (int i = 0; i < insn->nargs; i++) {
+        VReg *arg = insn->args[i];
+        if (!is_const(arg) || const_val(arg) != const_val(insn->args[0]))
+            return false;
+    }
+
+    Insn *pos = insn->next;
+    while (pos && pos->kind == IR_PHI)
+        pos = pos->next;
+
+    make_imm(insn, const_val(insn->args[0]));
+    insn->nargs = 0;
+    insn->args = NULL;
+    insn->bbs = NULL;
+    remove_insn(bb, insn);
+    insert_insn(bb, pos, insn);
+    return true;
+}
+
+// Constant propagation evaluates operations on constants at compile
+// time. Blocks are visited in reverse postorder, so that definitions
+// are usually folded before their uses, and the walk is repeated until
+// a loop doesn't feed a folded value back to a phi any more.
+static bool const_prop(IRFunction *ir) {
+    bool changed = false;
+
+    for (bool again = true; again;) {
+        again = false;
+        for (int i = 0; i < ir->norder; i++) {
+            BasicBlock *bb = ir->order[i];
+            for (Insn *insn = bb->insns, *next; insn; insn = next) {
+                next = insn->next;
+                if (insn->kind == IR_PHI ? fold_phi(bb, insn) : fold_insn(insn))
+                    again = changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+// Returns true if a cast doesn't change the bits of a value in a
+// register. A value narrower than 8 bytes is held extended to 32 bits
+// with the upper 32 bits cleared, so for example a cast from int to
+// unsigned int or from unsigned int to long is a copy.
+static bool is_nop_cast(Type *from, Type *to) {
+    if (is_flonum(from) || is_flonum(to))
+        return from->kind == to->kind;
+    if (to->kind == TY_BOOL)
+        return from->kind == TY_BOOL;
+    if (from->kind == TY_BOOL)
+        return true;
+
+    int fsize = size_of(from);
+    int tsize = size_of(to);
+    if (tsize == 8)
+        return fsize == 8 || from->is_unsigned;
+    if (tsize == 4)
+        return fsize <= 4;
+    if (fsize == tsize)
+        return from->is_unsigned == to->is_unsigned;
+    return fsize < tsize && (from->is_unsigned || !to->is_unsigned);
+}
+
+// Returns the register that a phi always copies, or NULL if there is
+// no such register. An argument that is the phi itself comes from a
+// loop that doesn't change the value.
+static VReg *phi_source(Insn *insn) {
+    VReg *src = NULL;
+    for (int i = 0; i < insn->nargs; i++) {
+        VReg *arg = insn->args[i];
+        if (arg == insn->dst)
+            continue;
+        if (!arg || (src && arg != src))
+            return NULL;
+        src = arg;
+    }
+    return src;
+}
+
+static VReg *resolve(VReg **repl, VReg *reg) {
+    while (reg && repl[reg->id])
+        reg = repl[reg->id];
+    return reg;
+}
+
+// Copy propagation replaces the uses of a register that is a copy of
+// another one with the other one and removes the copy.
+static bool copy_prop(IRFunction *ir) {
+    VReg **repl = calloc(ir->nregs + 1, sizeof(VReg *));
+    bool changed = false;
+
+    for (int i = 0; i < ir->norder; i++) {
+        for (Insn *insn = ir->order[i]->insns; insn; insn = insn->next) {
+            VReg *src = NULL;
+            if (insn->kind == IR_MOV)
+                src = insn->lhs;
+            else if (insn->kind == IR_PHI)
+                src = phi_source(insn);
+
+            // A constant is held as a value of its own type, so a cast
+            // of it is left to constant propagation.
+            if (insn->kind == IR_CAST && is_nop_cast(insn->from, insn->ty)) {
+                VReg *reg = resolve(repl, insn->lhs);
+                if (!is_const(reg) && !is_fconst(reg))
+                    src = insn->lhs;
+            }
+
+            if (src && resolve(repl, src) != insn->dst) {
+                repl[insn->dst->id] = src;
+                changed = true;
+            }
+        }
+    }
+
+    if (!changed)
+        return false;
+
+    for (int i = 0; i < ir->norder; i++) {
+        BasicBlock *bb = ir->order[i];
+        for (Insn *insn = bb->insns, *next; insn; insn = next) {
+            next = insn->next;
+            if (insn->dst && repl[insn->dst->id]) {
+                remove_insn(bb, insn);
+                continue;
+            }
+            insn->lhs = resolve(repl, insn->lhs);
+            insn->rhs = resolve(repl, insn->rhs);
+            for (int j = 0; j < insn->nargs; j++)
+                insn->args[j] = resolve(repl, insn->args[j]);
+        }
+    }
+    count_defs(ir);
+    return true;
+}
+
+static bool has_side_effect(Insn *insn) {
+    switch (insn->kind) {
+    case IR_STORE:
+    case IR_COPY:
+    case IR_CALL:
+    case IR_VA_START:
+    case IR_BR:
+    case IR_JMP:
+    case IR_RET:
+        return true;
+    }
+    return false;
+}
+
+static void drop_use(VReg *reg) {
+    if (reg)
+        reg->nuses--;
+}
+
+// Dead code elimination removes instructions whose results are never
+// used. Blocks are visited backwards, so a chain of dead instructions
+// is usually removed in a single walk.
+static bool dce(IRFunction *ir) {
+    bool changed = false;
+    count_defs(ir);
+
+    for (bool again = true; again;) {
+        again = false;
+        for (int i = ir->norder - 1; i >= 0; i--) {
+            BasicBlock *bb = ir->order[i];
+            for (Insn *insn = bb->last, *prev; insn; insn = prev) {
+                prev = insn->prev;
+                if (!insn->dst || insn->dst->nuses > 0)
+                    continue;
+
+                if (has_side_effect(insn)) {
+                    // A call is kept even if its value is unused.
+                    insn->dst = NULL;
+                    continue;
+                }
+
+                remove_insn(bb, insn);
+                drop_use(insn->lhs);
+                drop_use(insn->rhs);
+                for (int j = 0; j < insn->nargs; j++)
+                    drop_use(insn->args[j]);
+                again = changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+// Makes a branch to `from` jump to `to` instead.
+static void retarget(BasicBlock *bb, BasicBlock *from, BasicBlock *to) {
+    Insn *insn = bb->last;
+    if (insn->then == from)
+        insn->then = to;
+    if (insn->els == from)
+        insn->els = to;
+}
+
+static bool has_phi(BasicBlock *bb) {
+    return bb->insns && bb->insns->kind == IR_PHI;
+}
+
+// CFG simplification folds branches on constants, removes unreachable
+// blocks, makes branches to a block that just jumps elsewhere go there
+// directly, and merges a block into its only predecessor if it is the
+// only successor of the predecessor.
+static bool simplify_cfg(IRFunction *ir) {
+    bool changed = false;
+
+    for (bool again = true; again;) {
+        again = false;
+
+        for (BasicBlock *bb = ir->bbs; bb; bb = bb->next) {
+            Insn *insn = bb->last;
+            if (insn->kind != IR_BR)
+                continue;
+            if (insn->then != insn->els && !is_const(insn->lhs))
+                continue;
+
+            BasicBlock *target = insn->then;
+            if (insn->then != insn->els && const_val(insn->lhs) == 0)
+                target = insn->els;
+            BasicBlock *other = (target == insn->then) ? insn->els : insn->then;
+
+            // Forget the edge to the other block.
+            if (other != target) {
+                for (Insn *phi = other->insns; phi && phi->kind == IR_PHI; phi = phi->next) {
+                    int j = 0;
+                    for (int k = 0; k < phi->nargs; k++) {
+                        if (phi->bbs[k] == bb)
+                            continue;
+                        phi->args[j] = phi->args[k];
+                        phi->bbs[j] = phi->bbs[k];
+                        j++;
+                    }
+                    phi->nargs = j;
+                }
+            }
+
+            insn->kind = IR_JMP;
+            insn->lhs = NULL;
+            insn->then = target;
+            insn->els = NULL;
+            again = true;
+        }
+        build_cfg(ir);
+
+        // Thread jumps through empty blocks.
+        for (int i = 1; i < ir->norder; i++) {
+            BasicBlock *bb = ir->order[i];
+            Insn *insn = bb->insns;
+            if (insn != bb->last || insn->kind != IR_JMP)
+                continue;
+            BasicBlock *target = insn->then;
+            if (target == bb || has_phi(target))
+                continue;
+
+            for (int j = 0; j < bb->npreds; j++)
+                retarget(bb->preds[j], bb, target);
+            again = true;
+        }
+        build_cfg(ir);
+
+        // Merge blocks.
+        for (int i = 0; i < ir->norder; i++) {
+            BasicBlock *bb = ir->order[i];
+            if (!bb->last)
+                continue;
+
+            while (bb->last->kind == IR_JMP) {
+                BasicBlock *succ = bb->last->then;
+                if (succ == bb || succ == ir->bbs || succ->npreds != 1)
+                    break;
+
+                // A phi with a single argument is a copy.
+                for (Insn *phi = succ->insns; phi && phi->kind == IR_PHI; phi = phi->next) {
+                    VReg *arg = phi->args[0];
+                    phi->kind = IR_MOV;
+                    phi->nargs = 0;
+                    phi->args = NULL;
+                    phi->bbs = NULL;
+                    phi->lhs = arg;
+                }
+
+                remove_insn(bb, bb->last);
+                for (Insn *insn = succ->insns, *next; insn; insn = next) {
+                    next = insn->next;
+                    insert_insn(bb, NULL, insn);
+                }
+                succ->insns = succ->last = NULL;
+
+                BasicBlock *next[2];
+                int nnext = successors(bb, next);
+                for (int j = 0; j < nnext; j++)
+                    for (Insn *phi = next[j]->insns; phi && phi->kind == IR_PHI; phi = phi->next)
+                        for (int k = 0; k < phi->nargs; k++)
+                            if (phi->bbs[k] == succ)
+                                phi->bbs[k] = bb;
+                again = true;
+            }
+        }
+        build_cfg(ir);
+
+        changed |= again;
+    }
+    return changed;
+}
+
+typedef struct {
+    char *name;
+    bool (*run)(IRFunction *ir);
+} Pass;
+
+static Pass passes[] = {
+    {"simplify-cfg", simplify_cfg},
+    {"const-prop", const_prop},
+    {"copy-prop", copy_prop},
+    {"dce", dce},
+};
+
+// Runs the optimization passes on a function, which is left in SSA
+// form. from_ssa() converts it back for the backend.
+void optimize(Context *ctx, IRFunction *ir) {
+    if (ctx->opt_level == 0)
+        return;
+
+    double start = trace_now(ctx);
+    to_ssa(ir);
+    trace_span(ctx, "opt", "ssa", start);
+
+    for (int round = 0; round < 16; round++) {
+        bool changed = false;
+        for (int i = 0; i < sizeof(passes) / sizeof(*passes); i++) {
+            start = trace_now(ctx);
+            if (passes[i].run(ir))
+                changed = true;
+            trace_span(ctx, "opt", passes[i].name, start);
+        }
+        if (!changed || ctx->opt_level < 2)
+            break;
+    }
+}
@@ -20,7 +20,6 @@
 
 // Scope for local, global variables or typedefs
 // or enum constants
-typedef struct VarScope VarScope;
 struct VarScope {
     VarScope *next;
     char *name;
@@ -33,7 +32,6 @@ struct VarScope {
 };
 
 // Scope for struct, union or union tags
-typedef struct TagScope TagScope;
 struct TagScope {
     TagScope *next;
     char *name;
@@ -81,94 +79,72 @@ struct InitDesg {
     Var *var;
 };
 
-// All local variable instances created during parsing are
-// accumulated to this list.
-static Var *locals;
-
-// Likewise, global variables are accumulated to this list.
-static Var *globals;
-
-// C has two block scopes; one is for variables/typedefs and
-// the other is for struct/union/enum tags.
-static VarScope *var_scope;
-static TagScope *tag_scope;
-
-// scope_depth is incremented by one at the beginning of a block
-// scope and decremented by one at the end of a block scope.
-static int scope_depth;
-
-// Points to the function object the parser is currently parsing.
-static Var *current_fn;
-
-// Points to a node representing a switch if we are parsing
-// a switch statement. Otherwise, NULL.
-static Node *current_switch;
-
-static bool is_typename(Token *tok);
-static Type *typespec(Token **rest, Token *tok, VarAttr *attr);
-static Type *typename(Token **rest, Token *tok);
-static Type *enum_specifier(Token **rest, Token *tok);
-static Type *type_suffix(Token **rest, Token *tok, Type *ty);
-static Type *declarator(Token **rest, Token *tok, Type *ty);
-static Node *declaration(Token **rest, Token *tok);
-static Initializer *initializer(Token **rest, Token *tok, Type *ty);
-static Initializer *initializer2(Token **rest, Token *tok, Type *ty);
-static Node *lvar_initializer(Token **rest, Token *tok, Var *var);
-static void gvar_initializer(Token **rest, Token *tok, Var *var);
-static Node *compound_stmt(Token **rest, Token *tok);
-static Node *stmt(Token **rest, Token *tok);
-static Node *expr_stmt(Token **rest, Token *tok);
-static Node *expr(Token **rest, Token *tok);
+static bool is_typename(Context *ctx, Token *tok);
+static Type *typespec(Context *ctx, Token **rest, Token *tok, VarAttr *attr);
+static Type *typename(Context *ctx, Token **rest, Token *tok);
+static Type *enum_specifier(Context *ctx, Token **rest, Token *tok);
+static Type *type_suffix(Context *ctx, Token **rest, Token *tok, Type *ty);
+static Type *declarator(Context *ctx, Token **rest, Token *tok, Type *ty);
+static Node *declaration(Context *ctx, Token **rest, Token *tok);
+static Initializer *initializer(Context *ctx, Token **rest, Token *tok, Type *ty);
+static Initializer *initializer2(Context *ctx, Token **rest, Token *tok, Type *ty);
+static Node *lvar_initializer(Context *ctx, Token **rest, Token *tok, Var *var);
+static void gvar_initializer(Context *ctx, Token **rest, Token *tok, Var *var);
+static Node *compound_stmt(Context *ctx, Token **rest, Token *tok);
+static Node *stmt(Context *ctx, Token **rest, Token *tok);
+static Node *expr_stmt(Context *ctx, Token **rest, Token *tok);
+static Node *expr(Context *ctx, Token **rest, Token *tok);
 static long eval(Node *node);
 static long eval_addr(Node *node, Var **var);
 static long eval_rval(Node *node, Var **var);
-static Node *assign(Token **rest, Token *tok);
-static Node *logor(Token **rest, Token *tok);
+static Node *assign(Context *ctx, Token **rest, Token *tok);
+static Node *logor(Context *ctx, Token **rest, Token *tok);
 static double eval_double(Node *node);
-static Node *conditional(Token **rest, Token *tok);
-static Node *logand(Token **rest, Token *tok);
-static Node *bitor(Token **rest, Token *tok);
-static Node *bitxor(Token **rest, Token *tok);
-static Node *bitand(Token **rest, Token *tok);
-static Node *equality(Token **rest, Token *tok);
-static Node *relational(Token **rest, Token *tok);
-static Node *shift(Token **rest, Token *tok);
-static Node *add(Token **rest, Token *tok);
+static void fold_constants(Node *node);
+static Node *conditional(Context *ctx, Token **rest, Token *tok);
+static Node *logand(Context *ctx, Token **rest, Token *tok);
+static Node *bitor(Context *ctx, Token **rest, Token *tok);
+static Node *bitxor(Context *ctx, Token **rest, Token *tok);
+static Node *bitand(Context *ctx, Token **rest, Token *tok);
+static Node *equality(Context *ctx, Token **rest, Token *tok);
+static Node *relational(Context *ctx, Token **rest, Token *tok);
+static Node *shift(Context *ctx, Token **rest, Token *tok);
+static Node *add(Context *ctx, Token **rest, Token *tok);
 static Node *new_add(Node *lhs, Node *rhs, Token *tok);
 static Node *new_sub(Node *lhs, Node *rhs, Token *tok);
-static Node *mul(Token **rest, Token *tok);
-static Node *cast(Token **rest, Token *tok);
-static Type *struct_decl(Token **rest, Token *tok);
-static Type *union_decl(Token **rest, Token *tok);
-static Node *postfix(Token **rest, Token *tok);
-static Node *funcall(Token **rest, Token *tok, Node *node);
-static Node *unary(Token **rest, Token *tok);
-static Node *primary(Token **rest, Token *tok);
+static Node *mul(Context *ctx, Token **rest, Token *tok);
+static Node *cast(Context *ctx, Token **rest, Token *tok);
+static Type *struct_decl(Context *ctx, Token **rest, Token *tok);
+static Type *union_decl(Context *ctx, Token **rest, Token *tok);
+static Node *postfix(Context *ctx, Token **rest, Token *tok);
+static Node *funcall(Context *ctx, Token **rest, Token *tok, Node *node);
+static Node *unary(Context *ctx, Token **rest, Token *tok);
+static Node *primary(Context *ctx, Token **rest, Token *tok);
 
-static void enter_scope(void) {
-    scope_depth++;
+static void enter_scope(Context *ctx) {
+    ctx->scope_depth++;
 }
 
-static void leave_scope(void) {
-    scope_depth--;
+static void leave_scope(Context *ctx) {
+    ctx->scope_depth--;
 
-    while (var_scope && var_scope->depth > scope_depth)
-        var_scope = var_scope->next;
+    while (ctx->var_scope && ctx->var_scope->depth > ctx->scope_depth)
+        ctx->var_scope = ctx->var_scope->next;
 
-    while (tag_scope && tag_scope->depth > scope_depth)
-        tag_scope = tag_scope->next;
+    while (ctx->tag_scope && ctx->tag_scope->depth > ctx->scope_depth)
+        ctx->tag_scope = ctx->tag_scope->next;
 }
 
 // Find a variable or a typedef by name
-static VarScope *find_var(Token *tok) {
-    for (VarScope *sc = var_scope; sc; sc = sc->next)
+static VarScope *find_var(Context *ctx, Token *tok) {
+    for (VarScope *sc = ctx->var_scope; sc; sc = sc->next)
         if (strlen(sc->name) == tok->len && !strncmp(tok->loc, sc->name, tok->len))
             return sc;
     return NULL;
 }
 
-static TagScope *find_tag(Token *tok) {
-    for (TagScope *sc = tag_scope; sc; sc = sc->next)
+static TagScope *find_tag(Context *ctx, Token *tok) {
+    for (TagScope *sc = ctx->tag_scope; sc; sc = sc->next)
         if (strlen(sc->name) == tok->len && !strncmp(tok->loc, sc->name, tok->len))
             return sc;
     return NULL;
@@ -194,6 +170,17 @@ static Node *new_unary(NodeKind kind, Node *expr, Token *tok) {
     return node;
 }
 
+// Takes the address of an lvalue. A local variable whose address is
+// taken has to stay in memory.
+static Node *new_addr(Node *expr, Token *tok) {
+    Node *node = expr;
+    while (node->kind == ND_COMMA || node->kind == ND_MEMBER)
+        node = (node->kind == ND_COMMA) ? node->rhs : node->lhs;
+    if (node->kind == ND_VAR && node->var->is_local)
+        node->var->is_addr_taken = true;
+    return new_unary(ND_ADDR, expr, tok);
+}
+
 static Node *new_num(long val, Token *tok) {
     Node *node = new_node(ND_NUM, tok);
     node->val = val;
@@ -224,12 +211,12 @@ Node *new_cast(Node *expr, Type *ty) {
     return node;
 }
 
-static VarScope *push_scope(char *name) {
+static VarScope *push_scope(Context *ctx, char *name) {
     VarScope *sc = calloc(1, sizeof(VarScope));
-    sc->next = var_scope;
+    sc->next = ctx->var_scope;
     sc->name = name;
-    sc->depth = scope_depth;
-    var_scope = sc;
+    sc->depth = ctx->scope_depth;
+    ctx->var_scope = sc;
     return sc;
 }
 
@@ -244,42 +231,41 @@ static Initializer *new_init(Type *ty, int len, Node *expr, Token *tok) {
     return init;
 } 
 
-static Var *new_var(char *name, Type *ty) {
+static Var *new_var(Context *ctx, char *name, Type *ty) {
     Var *var = calloc(1, sizeof(Var));
     var->name = name;
     var->ty = ty;
     var->align = ty->align;
-    push_scope(name)->var = var;
+    push_scope(ctx, name)->var = var;
     return var;
 }
 
-static Var *new_lvar(char *name, Type *ty) {
-    Var *var = new_var(name, ty);
+static Var *new_lvar(Context *ctx, char *name, Type *ty) {
+    Var *var = new_var(ctx, name, ty);
     var->is_local = true;
-    var->next = locals;
-    locals = var;
+    var->next = ctx->locals;
+    ctx->locals = var;
     return var;
 }
 
-static Var *new_gvar(char *name, Type *ty, bool is_static, bool is_definition) {
-    Var *var = new_var(name, ty);
+static Var *new_gvar(Context *ctx, char *name, Type *ty, bool is_static, bool is_definition) {
+    Var *var = new_var(ctx, name, ty);
     var->is_static = is_static;
     if (is_definition) {
-        var->next = globals;
-        globals = var;
+        var->next = ctx->globals;
+        ctx->globals = var;
     }
     return var;
 }
 
-static char *new_unique_name(void) {
-    static int id = 0;
-    char *buf = calloc(1, 20);
-    sprintf(buf, ".L.data.%d", id++);
+static char *new_unique_name(Context *ctx) {
+    char *buf = calloc(1, strlen(ctx->unique_prefix) + 20);
+    sprintf(buf, "%s%d", ctx->unique_prefix, ctx->unique_id++);
     return buf;
 }
 
-static Var *new_string_literal(char *p, Type *ty) {
-    Var *var = new_gvar(new_unique_name(), ty, true, true);
+static Var *new_string_literal(Context *ctx, char *p, Type *ty) {
+    Var *var = new_gvar(ctx, new_unique_name(ctx), ty, true, true);
     var->init_data = p;
     return var;
 }
@@ -290,62 +276,112 @@ static char *get_ident(Token *tok) {
     return strndup(tok->loc, tok->len);
 }
 
-static Type *find_typedef(Token *tok) {
+static Type *find_typedef(Context *ctx, Token *tok) {
     if (tok->kind == TK_IDENT) {
-        VarScope *sc = find_var(tok);
+        VarScope *sc = find_var(ctx, tok);
         if (sc)
             return sc->type_def;
     }
     return NULL;
 }
 
-static void push_tag_scope(Token *tok, Type *ty) {
+static void push_tag_scope(Context *ctx, Token *tok, Type *ty) {
     TagScope *sc = calloc(1, sizeof(TagScope));
-    sc->next = tag_scope;
+    sc->next = ctx->tag_scope;
     sc->name = strndup(tok->loc, tok->len);
-    sc->depth = scope_depth;
+    sc->depth = ctx->scope_depth;
     sc->ty = ty;
-    tag_scope = sc;
+    ctx->tag_scope = sc;
 }
 
 // Create a node for "__func__" local variable and add that
 // to the current scope.
-static void add_func_ident(char *func) {
+static void add_func_ident(Context *ctx, char *func) {
     Type *ty = array_of(ty_char, strlen(func) + 1);
-    Var *var = new_string_literal(func, ty);
-    push_scope("__func__")->var = var;
+    Var *var = new_string_literal(ctx, func, ty);
+    push_scope(ctx, "__func__")->var = var;
+}
+
+// A function body is parsed after all file-scope declarations have been
+// read, possibly on another thread. It is parsed against a snapshot of
+// the file scope taken at the beginning of the function, so it sees the
+// same names as it would if it were parsed in place. Anonymous globals
+// such as string literals get names local to the function.
+typedef struct FuncBody FuncBody;
+struct FuncBody {
+    FuncBody *next;
+    Context ctx;
+    Function *fn;
+    Token *tok;     // "{" of the body
+};
+
+// Returns the token after the "}" matching the "{" at `tok`,
+// or NULL if there's no such "}".
+static Token *skip_body(Token *tok) {
+    int depth = 0;
+    for (; tok->kind != TK_EOF; tok = tok->next) {
+        if (equal(tok, "{"))
+            depth++;
+        else if (equal(tok, "}") && --depth == 0)
+            return tok->next;
+    }
+    return NULL;
 }
 
 // funcdef = typespec declarator compound-stmt
-static Function *funcdef(Token **rest, Token *tok) {
-    locals = NULL;
-
-    VarAttr attr = {};
-    Type *ty = typespec(&tok, tok, &attr);
-    ty = declarator(&tok, tok, ty);
-
+static FuncBody *funcdef(Context *ctx, Token **rest, Token *tok, Type *ty, VarAttr *attr) {
     if (!ty->name)
         error_tok(ty->name_pos, "function name omitted");
+    for (Type *t = ty->params; t; t = t->next)
+        if (!t->name)
+            error_tok(t->name_pos, "parameter name omitted");
 
     Function *fn = calloc(1, sizeof(Function));
     fn->name = get_ident(ty->name);
-    fn->is_static = attr.is_static;
+    fn->is_static = attr->is_static;
     fn->is_variadic = ty->is_variadic;
 
-    enter_scope();
-    for (Type *t = ty->params; t; t = t->next) {
-        if (!t->name)
-            error_tok(t->name_pos, "parameter name omitted");
-        new_lvar(get_ident(t->name), t);
-    }
-    fn->params = locals;
-
-    tok = skip(tok, "{");
-    add_func_ident(fn->name);
-    fn->body = compound_stmt(rest, tok);
-    fn->locals = locals;
-    leave_scope();
-    return fn;
+    FuncBody *fb = calloc(1, sizeof(FuncBody));
+    fb->ctx = *ctx;
+    fb->fn = fn;
+    fb->tok = tok;
+
+    char *prefix = calloc(1, strlen(fn->name) + 20);
+    sprintf(prefix, ".L.data.%s.", fn->name);
+    fb->ctx.unique_prefix = prefix;
+    fb->ctx.unique_id = 0;
+    fb->ctx.locals = NULL;
+    fb->ctx.globals = NULL;
+
+    skip(tok, "{");
+    *rest = skip_body(tok);
+    return fb;
+}
+
+static void parse_body(void *arg, int i) {
+    FuncBody *fb = ((FuncBody **)arg)[i];
+    Context *ctx = &fb->ctx;
+    Function *fn = fb->fn;
+    double trace_start = trace_now(ctx);
+
+    enter_scope(ctx);
+    for (Type *t = ctx->current_fn->ty->params; t; t = t->next)
+        new_lvar(ctx, get_ident(t->name), t);
+    fn->params = ctx->locals;
+
+    Token *tok = fb->tok->next;
+    add_func_ident(ctx, fn->name);
+    fn->body = compound_stmt(ctx, &tok, tok);
+    fold_constants(fn->body);
+    fn->locals = ctx->locals;
+    leave_scope(ctx);
+
+    // Scalar variables whose address is never taken, including
+    // parameters, don't have to be in memory.
+    for (Var *var = fn->locals; var; var = var->next)
+        var->is_promoted = !var->is_addr_taken &&
+                           (is_numeric(var->ty) || var->ty->kind == TY_PTR);
+    trace_span(ctx, "parse", fn->name, trace_start);
 }
 
 // typespec = typename typename* 
@@ -363,7 +399,7 @@ static Function *funcdef(Token **rest, Token *tok) {
 // while keeping the "current" type object that the typenames up
 // until that point represent. When we reach a non-typename token,
 // we returns the current type object.
-static Type *typespec(Token **rest, Token *tok, VarAttr *attr) {
+static Type *typespec(Context *ctx, Token **rest, Token *tok, VarAttr *attr) {
     // We use a single integer as counters for all typenames.
     // For example, bits 0 and 1 represents how many times we saw the
     // keyword "void" so for. With this, we can use a switch statement
@@ -386,7 +422,7 @@ static Type *typespec(Token **rest, Token *tok, VarAttr *attr) {
     int counter = 0;
     bool is_const = false;
 
-    while (is_typename(tok)) {
+    while (is_typename(ctx, tok)) {
         // Handle storage class specifiers.
         if (equal(tok, "typedef") || equal(tok, "static") || equal(tok, "extern")) {
             if (!attr)
@@ -410,8 +446,9 @@ static Type *typespec(Token **rest, Token *tok, VarAttr *attr) {
             continue;
         }
 
+        // These keywords are accepted but have no effect.
         if (consume(&tok, tok, "volatile") || consume(&tok, tok, "register") ||
-            consume(&tok, tok, "_Noreturn"))
+            consume(&tok, tok, "_Noreturn") || consume(&tok, tok, "inline"))
             continue;
 
         if (equal(tok, "_Alignas")) {
@@ -419,26 +456,26 @@ static Type *typespec(Token **rest, Token *tok, VarAttr *attr) {
                 error_tok(tok, "_Alignas is not allowed in this context");
             tok = skip(tok->next, "(");
 
-            if (is_typename(tok))
-                attr->align = typename(&tok, tok)->align;
+            if (is_typename(ctx, tok))
+                attr->align = typename(ctx, &tok, tok)->align;
             else
-                attr->align = const_expr(&tok, tok);
+                attr->align = const_expr(ctx, &tok, tok);
             tok = skip(tok, ")");
             continue;
         }
 
         // Handle user-defined types
-        Type *ty2 = find_typedef(tok);
+        Type *ty2 = find_typedef(ctx, tok);
         if (equal(tok, "struct") || equal(tok, "union") || equal(tok, "enum") || ty2) {
             if (counter)
                 break;
             
             if (equal(tok, "struct")) {
-                ty = struct_decl(&tok, tok->next);
+                ty = struct_decl(ctx, &tok, tok->next);
             } else if (equal(tok, "union")) {
-                ty = union_decl(&tok, tok->next);
+                ty = union_decl(ctx, &tok, tok->next);
             } else if (equal(tok, "enum")) {
-                ty = enum_specifier(&tok, tok->next);
+                ty = enum_specifier(ctx, &tok, tok->next);
             } else {
                 ty = ty2;
                 tok = tok->next;
@@ -543,10 +580,14 @@ static Type *typespec(Token **rest, Token *tok, VarAttr *attr) {
         tok = tok->next;
     }
 
-    if (is_const) {
+    // Builtin types such as ty_int are shared by all compilations, and
+    // declarator() writes a name to a type it returns, so we hand out a
+    // copy. An incomplete struct is not copied because it has to be the
+    // same object that will be completed later.
+    if (ty->size >= 0 || is_const)
         ty = copy_type(ty);
+    if (is_const)
         ty->is_const = true;
-    }
     
     *rest = tok;
     return ty;
@@ -554,7 +595,7 @@ static Type *typespec(Token **rest, Token *tok, VarAttr *attr) {
 
 // func-params = ("void" | param ("," param)* ("," "...")?)? ")"
 // param       = typespec declarator
-static Type *func_params(Token **rest, Token *tok, Type *ty) {
+static Type *func_params(Context *ctx, Token **rest, Token *tok, Type *ty) {
     if (equal(tok, "void") && equal(tok->next, ")")) {
         *rest = tok->next->next;
         return func_type(ty);
@@ -575,8 +616,8 @@ static Type *func_params(Token **rest, Token *tok, Type *ty) {
             break;
         }
 
-        Type *ty2 = typespec(&tok, tok, NULL);
-        ty2 = declarator(&tok, tok, ty2);
+        Type *ty2 = typespec(ctx, &tok, tok, NULL);
+        ty2 = declarator(ctx, &tok, tok, ty2);
 
         // "array of T" is converted to "pointer to T" only in the parameter
         // context. For example, *argv[] is converted to **argv by this.
@@ -597,27 +638,27 @@ static Type *func_params(Token **rest, Token *tok, Type *ty) {
 }
 
 // array-dimentions = const-expr? "]" type-suffix
-static Type *array_dimentions(Token **rest, Token *tok, Type *ty) {
+static Type *array_dimentions(Context *ctx, Token **rest, Token *tok, Type *ty) {
     if (equal(tok, "]")) {
-        ty = type_suffix(rest, tok->next, ty);
+        ty = type_suffix(ctx, rest, tok->next, ty);
         return array_of(ty, -1);
     }
 
-    int sz = const_expr(&tok, tok);
+    int sz = const_expr(ctx, &tok, tok);
     tok = skip(tok, "]");
-    ty = type_suffix(rest, tok, ty);
+    ty = type_suffix(ctx, rest, tok, ty);
     return array_of(ty, sz);
 }
 
 // type-suffix = "(" func-params
 //             | "[" array-dimentions
 //             | ε
-static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
+static Type *type_suffix(Context *ctx, Token **rest, Token *tok, Type *ty) {
     if (equal(tok, "("))
-        return func_params(rest, tok->next, ty);
+        return func_params(ctx, rest, tok->next, ty);
 
     if (equal(tok, "["))
-        return array_dimentions(rest, tok->next, ty);
+        return array_dimentions(ctx, rest, tok->next, ty);
 
     *rest = tok;
     return ty;
@@ -639,14 +680,14 @@ static Type *pointers(Token **rest, Token *tok, Type *ty) {
 }
 
 // declarator = pointers ("(" declarator ")" | ident) type-suffix
-static Type *declarator(Token **rest, Token *tok, Type *ty) {
+static Type *declarator(Context *ctx, Token **rest, Token *tok, Type *ty) {
     ty = pointers(&tok, tok, ty);
 
     if (equal(tok, "(")) {
         Type *placeholder = calloc(1, sizeof(Type));
-        Type *new_ty = declarator(&tok, tok->next, placeholder);
+        Type *new_ty = declarator(ctx, &tok, tok->next, placeholder);
         tok = skip(tok, ")");
-        *placeholder = *type_suffix(rest, tok, ty);
+        *placeholder = *type_suffix(ctx, rest, tok, ty);
         return new_ty;
     }
 
@@ -658,31 +699,31 @@ static Type *declarator(Token **rest, Token *tok, Type *ty) {
         tok = tok->next;
     }
 
-    ty = type_suffix(rest, tok, ty);
+    ty = type_suffix(ctx, rest, tok, ty);
     ty->name = name;
     ty->name_pos = name_pos;
     return ty;
 }
 
 // abstract-declarator = pointers ("(" abstract-declarator ")")? type-suffix
-static Type *abstract_declarator(Token **rest, Token *tok, Type *ty) {
+static Type *abstract_declarator(Context *ctx, Token **rest, Token *tok, Type *ty) {
     ty = pointers(&tok, tok, ty);
 
     if (equal(tok, "(")) {
         Type *placeholder = calloc(1, sizeof(Type));
-        Type *new_ty = abstract_declarator(&tok, tok->next, placeholder);
+        Type *new_ty = abstract_declarator(ctx, &tok, tok->next, placeholder);
         tok = skip(tok, ")");
-        *placeholder = *type_suffix(rest, tok, ty);
+        *placeholder = *type_suffix(ctx, rest, tok, ty);
         return new_ty;
     }
 
-    return type_suffix(rest, tok, ty);
+    return type_suffix(ctx, rest, tok, ty);
 }
 
 // type-name = typespec abstract-declarator
-static Type *typename(Token **rest, Token *tok) {
-    Type *ty = typespec(&tok, tok, NULL);
-    return abstract_declarator(rest, tok, ty);
+static Type *typename(Context *ctx, Token **rest, Token *tok) {
+    Type *ty = typespec(ctx, &tok, tok, NULL);
+    return abstract_declarator(ctx, rest, tok, ty);
 }
 
 static bool is_end(Token *tok) {
@@ -707,7 +748,7 @@ static bool consume_end(Token **rest, Token *tok) {
 //                | ident ("{" enum-list? "}")?
 //
 // enum-list = ident ("=" num)? ("," ident ("=" num)?)* ","?
-static Type *enum_specifier(Token **rest, Token *tok) {
+static Type *enum_specifier(Context *ctx, Token **rest, Token *tok) {
     Type *ty = enum_type();
 
     // Read a struct tag.
@@ -718,7 +759,7 @@ static Type *enum_specifier(Token **rest, Token *tok) {
     }
 
     if (tag && !equal(tok, "{")) {
-        TagScope *sc = find_tag(tag);
+        TagScope *sc = find_tag(ctx, tag);
         if (!sc)
             error_tok(tag, "unknown enum type");
         if (sc->ty->kind != TY_ENUM)
@@ -740,22 +781,22 @@ static Type *enum_specifier(Token **rest, Token *tok) {
         tok = tok->next;
 
         if (equal(tok, "="))
-            val = const_expr(&tok, tok->next);
+            val = const_expr(ctx, &tok, tok->next);
 
-        VarScope *sc = push_scope(name);
+        VarScope *sc = push_scope(ctx, name);
         sc->enum_ty = ty;
         sc->enum_val = val++;
     }
 
     if (tag)
-        push_tag_scope(tag, ty);
+        push_tag_scope(ctx, tag, ty);
     return ty;
 }
 
 // declaration = typespec (declarator ("=" expr)? ("," declarator ("=" expr)?)*)? ";"
-static Node *declaration(Token **rest, Token *tok) {
+static Node *declaration(Context *ctx, Token **rest, Token *tok) {
     VarAttr attr = {};
-    Type *basety = typespec(&tok, tok, &attr);
+    Type *basety = typespec(ctx, &tok, tok, &attr);
 
     Node head = {};
     Node *cur = &head;
@@ -765,7 +806,7 @@ static Node *declaration(Token **rest, Token *tok) {
         if (i++ > 0)
             tok = skip(tok, ",");
 
-        Type *ty = declarator(&tok, tok, basety);
+        Type *ty = declarator(ctx, &tok, tok, basety);
         if (!ty->name)
             error_tok(ty->name_pos, "variable declared void");
 
@@ -773,26 +814,26 @@ static Node *declaration(Token **rest, Token *tok) {
             error_tok(tok, "variable declared void");
 
         if (attr.is_typedef) {
-            push_scope(get_ident(ty->name))->type_def = ty;
+            push_scope(ctx, get_ident(ty->name))->type_def = ty;
             continue;
         }
 
         if (attr.is_static) {
             // static local variable
-            Var *var = new_gvar(new_unique_name(), ty, true, true);
-            push_scope(get_ident(ty->name))->var = var;
+            Var *var = new_gvar(ctx, new_unique_name(ctx), ty, true, true);
+            push_scope(ctx, get_ident(ty->name))->var = var;
 
             if (equal(tok, "="))
-                gvar_initializer(&tok, tok->next, var);
+                gvar_initializer(ctx, &tok, tok->next, var);
             continue;
         }
 
-        Var *var = new_lvar(get_ident(ty->name), ty);
+        Var *var = new_lvar(ctx, get_ident(ty->name), ty);
         if (attr.align)
             var->align = attr.align;
 
         if (equal(tok, "=")) {
-            Node *expr = lvar_initializer(&tok, tok->next, var);
+            Node *expr = lvar_initializer(ctx, &tok, tok->next, var);
             cur = cur->next = new_unary(ND_EXPR_STMT, expr, tok);
         }
     }
@@ -803,31 +844,31 @@ static Node *declaration(Token **rest, Token *tok) {
     return node;
 }
 
-static Token *skip_excess_elements(Token *tok) {
+static Token *skip_excess_elements(Context *ctx, Token *tok) {
     while (!consume_end(&tok, tok)) {
         tok = skip(tok, ",");
         if (equal(tok, "{"))
-            tok = skip_excess_elements(tok->next);
+            tok = skip_excess_elements(ctx, tok->next);
         else
-            assign(&tok, tok);
+            assign(ctx, &tok, tok);
     }
     return tok;
 }
 
-static Token *skip_end(Token *tok) {
+static Token *skip_end(Context *ctx, Token *tok) {
     if (consume_end(&tok, tok))
         return tok;
     warn_tok(tok, "excess elements in initializer");
-    return skip_excess_elements(tok);
+    return skip_excess_elements(ctx, tok);
 }
 
-static int count_array_init_elements(Token *tok, Type *ty) {
+static int count_array_init_elements(Context *ctx, Token *tok, Type *ty) {
     tok = skip(tok, "{");
     int len = 0;
     while (!is_end(tok)) {
         if (len++ > 0)
             tok = skip(tok, ",");
-        initializer(&tok, tok, ty->base);
+        initializer(ctx, &tok, tok, ty->base);
     }
     return len;
 }
@@ -877,28 +918,28 @@ static Initializer *utf32_string_initializer(Token **rest, Token *tok, Type *ty)
 }
 
 // array-initializer = "{" initializer ("," initializer)* ","? "}"
-static Initializer *array_initializer(Token **rest, Token *tok, Type *ty) {
+static Initializer *array_initializer(Context *ctx, Token **rest, Token *tok, Type *ty) {
     bool has_paren = consume(&tok, tok, "{");
     Initializer *init = new_init(ty, ty->array_len, NULL, tok);
 
     for (int i = 0; i < ty->array_len && !is_end(tok); i++) {
         if (i > 0)
             tok = skip(tok, ",");
-        init->children[i] = initializer(&tok, tok, ty->base);
+        init->children[i] = initializer(ctx, &tok, tok, ty->base);
     }
 
     if (has_paren)
-        tok = skip_end(tok);
+        tok = skip_end(ctx, tok);
     *rest = tok;
     return init;
 }
 
 // struct-initializer = "{" initializer ("," initializer)* ","? "}"
 //                    | initializer ("," initializer)* ","
-static Initializer *struct_initializer(Token **rest, Token *tok, Type *ty) {
+static Initializer *struct_initializer(Context *ctx, Token **rest, Token *tok, Type *ty) {
     if (!equal(tok, "{")) {
         Token *tok2;
-        Node *expr = assign(&tok2, tok);
+        Node *expr = assign(ctx, &tok2, tok);
         add_type(expr);
         if (expr->ty->kind == TY_STRUCT) {
             Initializer *init = new_init(ty, 0, expr, tok);
@@ -918,16 +959,16 @@ static Initializer *struct_initializer(Token **rest, Token *tok, Type *ty) {
     for (Member *mem = ty->members; mem && !is_end(tok); mem = mem->next, i++) {
         if (i > 0)
             tok = skip(tok, ",");
-        init->children[i] = initializer(&tok, tok, mem->ty);
+        init->children[i] = initializer(ctx, &tok, tok, mem->ty);
     }
 
     if (has_paren)
-        tok = skip_end(tok);
+        tok = skip_end(ctx, tok);
     *rest = tok;
     return init;
 }
 
-static Initializer *initializer2(Token **rest, Token *tok, Type *ty) {
+static Initializer *initializer2(Context *ctx, Token **rest, Token *tok, Type *ty) {
     if (ty->kind == TY_ARRAY && ty->base->kind == TY_CHAR &&
             tok->kind == TK_STR && tok->ty->base->size == 1)
         return string_initializer(rest, tok, ty);
@@ -941,23 +982,23 @@ static Initializer *initializer2(Token **rest, Token *tok, Type *ty) {
         return utf32_string_initializer(rest, tok, ty);
 
     if (ty->kind == TY_ARRAY)
-        return array_initializer(rest, tok, ty);
+        return array_initializer(ctx, rest, tok, ty);
 
     if (ty->kind == TY_STRUCT)
-        return struct_initializer(rest, tok, ty);
+        return struct_initializer(ctx, rest, tok, ty);
 
     Token *start = tok;
     bool has_paren = consume(&tok, tok, "{");
-    Initializer *init = new_init(ty, 0, assign(&tok, tok), start);
+    Initializer *init = new_init(ty, 0, assign(ctx, &tok, tok), start);
     if (has_paren)
-        tok = skip_end(tok);
+        tok = skip_end(ctx, tok);
     *rest = tok;
     return init;
 }
 
 // initializer = string-initializer | array-initializer | struct-initializer
 //             | "{" assign "}" | assign
-static Initializer *initializer(Token **rest, Token *tok, Type *ty) {
+static Initializer *initializer(Context *ctx, Token **rest, Token *tok, Type *ty) {
     // An array length can be omitted if an array has an initializer
     // (e.g. `int x[] = {1,2,3}`). If it's omitted, count the number
     // of initializer elements.
@@ -966,11 +1007,11 @@ static Initializer *initializer(Token **rest, Token *tok, Type *ty) {
         if (tok->kind == TK_STR)
             len = tok->ty->array_len;
         else
-            len = count_array_init_elements(tok, ty);
+            len = count_array_init_elements(ctx, tok, ty);
         *ty = *array_of(ty->base, len);
     }
 
-    return initializer2(rest, tok, ty);
+    return initializer2(ctx, rest, tok, ty);
 }
 
 Node *init_desg_expr(InitDesg *desg, Token *tok) {
@@ -1029,8 +1070,8 @@ static Node *create_lvar_init(Initializer *init, Type *ty, InitDesg *desg, Token
 //   x[0][1] = 7;
 //   x[1][0] = 8;
 //   x[1][1] = 9;
-static Node *lvar_initializer(Token **rest, Token *tok, Var *var) {
-    Initializer *init = initializer(rest, tok, var->ty);
+static Node *lvar_initializer(Context *ctx, Token **rest, Token *tok, Var *var) {
+    Initializer *init = initializer(ctx, rest, tok, var->ty);
     InitDesg desg = {NULL, 0, NULL, var};
     return create_lvar_init(init, var->ty, &desg, tok);
 }
@@ -1135,8 +1176,8 @@ write_gvar_data(Relocation *cur, Initializer *init, Type *ty, char *buf, int off
 // embedded to .data section. This function serializes Initializer
 // objects to a flat byte array. It is a compile error if  an
 // initializer list contains a non-constant expression.
-static void gvar_initializer(Token **rest, Token *tok, Var *var) {
-    Initializer *init = initializer(rest, tok, var->ty);
+static void gvar_initializer(Context *ctx, Token **rest, Token *tok, Var *var) {
+    Initializer *init = initializer(ctx, rest, tok, var->ty);
 
     Relocation head = {};
     char *buf = calloc(1, var->ty->size);
@@ -1146,17 +1187,18 @@ static void gvar_initializer(Token **rest, Token *tok, Var *var) {
 }
 
 // Returns true if a given token represents a type.
-static bool is_typename(Token *tok) {
+static bool is_typename(Context *ctx, Token *tok) {
     static char *kw[] = {
         "void", "_Bool", "char", "short", "int", "long", "float", "double",
         "struct", "union", "typedef", "enum", "static", "extern", "_Alignas",
         "signed", "unsigned", "const", "volatile", "register", "_Noreturn",
+        "inline",
     };
 
     for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
         if (equal(tok, kw[i]))
             return true;
-    return find_typedef(tok);
+    return find_typedef(ctx, tok);
 }
 
 // stmt = "return" expr? ";"
@@ -1173,28 +1215,28 @@ static bool is_typename(Token *tok) {
 //      | ident ":" stmt
 //      | "{" compound-stmt
 //      | expr-stmt
-static Node *stmt(Token **rest, Token *tok) {
+static Node *stmt(Context *ctx, Token **rest, Token *tok) {
     if (equal(tok, "return")) {
         Node *node = new_node(ND_RETURN, tok); 
         if (consume(rest, tok->next, ";"))
             return node;
 
-        Node *exp = expr(&tok, tok->next);
+        Node *exp = expr(ctx, &tok, tok->next);
         *rest = skip(tok, ";");
 
         add_type(exp);
-        node->lhs = new_cast(exp, current_fn->ty->return_ty);
+        node->lhs = new_cast(exp, ctx->current_fn->ty->return_ty);
         return node;
     }
 
     if (equal(tok, "if")) {
         Node *node = new_node(ND_IF, tok);
         tok = skip(tok->next, "(");
-        node->cond = expr(&tok, tok);
+        node->cond = expr(ctx, &tok, tok);
         tok = skip(tok, ")");
-        node->then = stmt(&tok, tok);
+        node->then = stmt(ctx, &tok, tok);
         if (equal(tok, "else"))
-            node->els = stmt(&tok, tok->next);
+            node->els = stmt(ctx, &tok, tok->next);
         *rest = tok;
         return node;
     }
@@ -1202,38 +1244,38 @@ static Node *stmt(Token **rest, Token *tok) {
     if (equal(tok, "switch")) {
         Node *node = new_node(ND_SWITCH, tok);
         tok = skip(tok->next, "(");
-        node->cond = expr(&tok, tok);
+        node->cond = expr(ctx, &tok, tok);
         tok = skip(tok, ")");
 
-        Node *sw = current_switch;
-        current_switch = node;
-        node->then = stmt(rest, tok);
-        current_switch = sw;
+        Node *sw = ctx->current_switch;
+        ctx->current_switch = node;
+        node->then = stmt(ctx, rest, tok);
+        ctx->current_switch = sw;
         return node;
     }
 
     if (equal(tok, "case")) {
-        if (!current_switch)
+        if (!ctx->current_switch)
             error_tok(tok, "stray case");
 
         Node *node = new_node(ND_CASE, tok);
-        int val = const_expr(&tok, tok->next);
+        int val = const_expr(ctx, &tok, tok->next);
         tok = skip(tok, ":");
-        node->lhs = stmt(rest, tok);
+        node->lhs = stmt(ctx, rest, tok);
         node->val = val;
-        node->case_next = current_switch->case_next;
-        current_switch->case_next = node;
+        node->case_next = ctx->current_switch->case_next;
+        ctx->current_switch->case_next = node;
         return node;
     }
 
     if (equal(tok, "default")) {
-        if (!current_switch)
+        if (!ctx->current_switch)
             error_tok(tok, "stray case");
 
         Node *node = new_node(ND_CASE, tok);
         tok = skip(tok->next, ":");
-        node->lhs = stmt(rest, tok);
-        current_switch->default_case = node;
+        node->lhs = stmt(ctx, rest, tok);
+        ctx->current_switch->default_case = node;
         return node;
     }
 
@@ -1241,41 +1283,41 @@ static Node *stmt(Token **rest, Token *tok) {
         Node *node = new_node(ND_FOR, tok);
         tok = skip(tok->next, "(");
 
-        enter_scope();
+        enter_scope(ctx);
 
-        if (is_typename(tok))
-            node->init = declaration(&tok, tok);
+        if (is_typename(ctx, tok))
+            node->init = declaration(ctx, &tok, tok);
         else
-            node->init = expr_stmt(&tok, tok);
+            node->init = expr_stmt(ctx, &tok, tok);
 
         if (!equal(tok, ";"))
-            node->cond = expr(&tok, tok);
+            node->cond = expr(ctx, &tok, tok);
         tok = skip(tok, ";");
 
         if (!equal(tok, ")"))
-            node->inc = expr(&tok, tok);
+            node->inc = expr(ctx, &tok, tok);
         tok = skip(tok, ")");
 
-        node->then = stmt(rest, tok);
-        leave_scope();
+        node->then = stmt(ctx, rest, tok);
+        leave_scope(ctx);
         return node;
     }
 
     if (equal(tok, "while")) {
         Node *node = new_node(ND_FOR, tok);
         tok = skip(tok->next, "(");
-        node->cond = expr(&tok, tok);
+        node->cond = expr(ctx, &tok, tok);
         tok = skip(tok, ")");
-        node->then = stmt(rest, tok);
+        node->then = stmt(ctx, rest, tok);
         return node;
     }
 
     if (equal(tok, "do")) {
         Node *node = new_node(ND_DO, tok);
-        node->then = stmt(&tok, tok->next);
+        node->then = stmt(ctx, &tok, tok->next);
         tok = skip(tok, "while");
         tok = skip(tok, "(");
-        node->cond = expr(&tok, tok);
+        node->cond = expr(ctx, &tok, tok);
         tok = skip(tok, ")");
         *rest = skip(tok, ";");
         return node;
@@ -1301,35 +1343,35 @@ static Node *stmt(Token **rest, Token *tok) {
     if (tok->kind == TK_IDENT && equal(tok->next, ":")) {
         Node *node = new_node(ND_LABEL, tok);
         node->label_name = strndup(tok->loc, tok->len);
-        node->lhs = stmt(rest, tok->next->next);
+        node->lhs = stmt(ctx, rest, tok->next->next);
         return node;
     }
 
     if (equal(tok, "{"))
-        return compound_stmt(rest, tok->next);
+        return compound_stmt(ctx, rest, tok->next);
 
-    return expr_stmt(rest, tok);
+    return expr_stmt(ctx, rest, tok);
 }
 
 
 // compound-stmt = (declaration | stmt)* "}"
-static Node *compound_stmt(Token **rest, Token *tok) {
+static Node *compound_stmt(Context *ctx, Token **rest, Token *tok) {
     Node *node = new_node(ND_BLOCK, tok);
 
     Node head = {};
     Node *cur = &head;
 
-    enter_scope();
+    enter_scope(ctx);
 
     while (!equal(tok, "}")) {
-        if (is_typename(tok))
-            cur = cur->next = declaration(&tok, tok);
+        if (is_typename(ctx, tok))
+            cur = cur->next = declaration(ctx, &tok, tok);
         else
-            cur = cur->next = stmt(&tok, tok);
+            cur = cur->next = stmt(ctx, &tok, tok);
         add_type(cur);
     }
 
-    leave_scope();
+    leave_scope(ctx);
 
     node->body = head.next;
     *rest = tok->next;
@@ -1337,7 +1379,7 @@ static Node *compound_stmt(Token **rest, Token *tok) {
 }
 
 // expr-stmt = expr? ";"
-static Node *expr_stmt(Token **rest, Token *tok) {
+static Node *expr_stmt(Context *ctx, Token **rest, Token *tok) {
     if (equal(tok, ";")) {
         Node *node = new_node(ND_BLOCK, tok);
         *rest = tok->next;
@@ -1345,17 +1387,17 @@ static Node *expr_stmt(Token **rest, Token *tok) {
     }
 
     Node *node = new_node(ND_EXPR_STMT, tok);
-    node->lhs = expr(&tok, tok);
+    node->lhs = expr(ctx, &tok, tok);
     *rest = skip(tok, ";");
     return node;
 }
 
 // expr = assign ("," expr)?
-static Node *expr(Token **rest, Token *tok) {
-    Node *node = assign(&tok, tok);
+static Node *expr(Context *ctx, Token **rest, Token *tok) {
+    Node *node = assign(ctx, &tok, tok);
 
     if (equal(tok, ","))
-        return new_binary(ND_COMMA, node, expr(rest, tok->next), tok);
+        return new_binary(ND_COMMA, node, expr(ctx, rest, tok->next), tok);
 
     *rest = tok;
     return node;
@@ -1491,8 +1533,8 @@ static long eval_rval(Node *node, Var **var) {
     error_tok(node->tok, "invalid initializer");
 }
 
-long const_expr(Token **rest, Token *tok) {
-    Node *node = conditional(rest, tok);
+long const_expr(Context *ctx, Token **rest, Token *tok) {
+    Node *node = conditional(ctx, rest, tok);
     return eval(node);
 }
 
@@ -1529,17 +1571,311 @@ static double eval_double(Node *node) {
     error_tok(node->tok, "not a constant expression");
 }
 
+// Constant folding
+//
+// After a function is parsed, every subexpression whose operands are
+// constants is replaced with its value. The value is computed with the
+// wraparound and signedness rules of the generated code, and anything
+// whose result depends on the machine, such as division by zero or an
+// oversized shift, is left to run.
+
+// Returns the value of an integer constant as the generated code
+// would hold it.
+static long normalize(Type *ty, long val) {
+    if (ty->kind == TY_BOOL)
+        return val != 0;
+
+    switch (ty->size) {
+    case 1:
+        return ty->is_unsigned ? (unsigned char)val : (signed char)val;
+    case 2:
+        return ty->is_unsigned ? (unsigned short)val : (short)val;
+    case 4:
+        if (ty->is_unsigned)
+            return (unsigned int)val;
+        return (int)val;
+    }
+    return val;
+}
+
+static bool is_num(Node *node) {
+    return node && node->kind == ND_NUM && is_numeric(node->ty);
+}
+
+static long num_val(Node *node) {
+    return normalize(node->ty, node->val);
+}
+
+static double num_fval(Node *node) {
+    if (is_flonum(node->ty))
+        return node->fval;
+    if (node->ty->is_unsigned)
+        return (unsigned long)num_val(node);
+    return num_val(node);
+}
+
+static bool is_true(Node *node) {
+    if (is_flonum(node->ty))
+        return node->fval != 0;
+    return num_val(node) != 0;
+}
+
+static void set_num(Node *node, long val) {
+    node->kind = ND_NUM;
+    node->val = normalize(node->ty, val);
+    node->lhs = node->rhs = node->cond = node->then = node->els = NULL;
+}
+
+static void set_fnum(Node *node, double fval) {
+    node->kind = ND_NUM;
+    node->fval = (node->ty->kind == TY_FLOAT) ? (float)fval : fval;
+    node->lhs = node->rhs = node->cond = node->then = node->els = NULL;
+}
+
+static void fold_cast(Node *node) {
+    Node *lhs = node->lhs;
+    Type *ty = node->ty;
+    if (!is_num(lhs) || !is_numeric(ty))
+        return;
+
+    if (ty->kind == TY_BOOL) {
+        set_num(node, is_true(lhs));
+        return;
+    }
+
+    if (is_flonum(ty)) {
+        // A signed integer is rounded to float directly, while an
+        // unsigned long goes through double as in the generated code.
+        if (ty->kind == TY_FLOAT && is_integer(lhs->ty) &&
+            !(lhs->ty->size == 8 && lhs->ty->is_unsigned))
+            set_fnum(node, (float)num_val(lhs));
+        else
+            set_fnum(node, num_fval(lhs));
+        return;
+    }
+
+    if (is_flonum(lhs->ty)) {
+        double d = lhs->fval;
+        if (!(-9223372036854775808.0 <= d && d < 9223372036854775808.0))
+            return;
+        set_num(node, (long)d);
+        return;
+    }
+
+    set_num(node, num_val(lhs));
+}
+
+static void fold_compare(Node *node) {
+    Node *lhs = node->lhs;
+    Node *rhs = node->rhs;
+
+    if (is_flonum(lhs->ty)) {
+        double a = lhs->fval;
+        double b = rhs->fval;
+        switch (node->kind) {
+        case ND_EQ: set_num(node, a == b); return;
+        case ND_NE: set_num(node, a != b); return;
+        case ND_LT: set_num(node, a < b); return;
+        case ND_LE: set_num(node, a <= b); return;
+        }
+        return;
+    }
+
+    long a = num_val(lhs);
+    long b = num_val(rhs);
+    switch (node->kind) {
+    case ND_EQ:
+        set_num(node, a == b);
+        return;
+    case ND_NE:
+        set_num(node, a != b);
+        return;
+    case ND_LT:
+        if (lhs->ty->is_unsigned)
+            set_num(node, (unsigned long)a < (unsigned long)b);
+        else
+            set_num(node, a < b);
+        return;
+    case ND_LE:
+        if (lhs->ty->is_unsigned)
+            set_num(node, (unsigned long)a <= (unsigned long)b);
+        else
+            set_num(node, a <= b);
+        return;
+    }
+}
+
+static void fold_binary(Node *node) {
+    Node *lhs = node->lhs;
+    Node *rhs = node->rhs;
+    Type *ty = node->ty;
+
+    if (is_flonum(ty)) {
+        double a = lhs->fval;
+        double b = rhs->fval;
+        switch (node->kind) {
+        case ND_ADD: set_fnum(node, a + b); return;
+        case ND_SUB: set_fnum(node, a - b); return;
+        case ND_MUL: set_fnum(node, a * b); return;
+        case ND_DIV: set_fnum(node, a / b); return;
+        }
+        return;
+    }
+
+    // A shift of a type narrower than int isn't promoted, so leave it
+    // as the generated code computes it.
+    if (ty->size < 4)
+        return;
+
+    // Compute in unsigned arithmetic, which wraps around.
+    unsigned long a = num_val(lhs);
+    unsigned long b = num_val(rhs);
+
+    switch (node->kind) {
+    case ND_ADD:
+        set_num(node, a + b);
+        return;
+    case ND_SUB:
+        set_num(node, a - b);
+        return;
+    case ND_MUL:
+        set_num(node, a * b);
+        return;
+    case ND_DIV:
+    case ND_MOD: {
+        // Division by zero and the overflow of the most negative
+        // number divided by -1 trap at run-time.
+        if (b == 0 || (!ty->is_unsigned && (long)b == -1))
+            return;
+
+        long val;
+        if (ty->is_unsigned)
+            val = (node->kind == ND_DIV) ? a / b : a % b;
+        else
+            val = (node->kind == ND_DIV) ? (long)a / (long)b : (long)a % (long)b;
+        set_num(node, val);
+        return;
+    }
+    case ND_BITAND:
+        set_num(node, a & b);
+        return;
+    case ND_BITOR:
+        set_num(node, a | b);
+        return;
+    case ND_BITXOR:
+        set_num(node, a ^ b);
+        return;
+    case ND_SHL:
+    case ND_SHR:
+        if ((long)b < 0 || (long)b >= ty->size * 8)
+            return;
+        if (node->kind == ND_SHL)
+            set_num(node, a << b);
+        else if (ty->is_unsigned)
+            set_num(node, a >> b);
+        else
+            set_num(node, (long)a >> b);
+        return;
+    }
+}
+
+static bool same_type(Type *ty1, Type *ty2) {
+    return ty1->kind == ty2->kind && ty1->size == ty2->size &&
+           ty1->is_unsigned == ty2->is_unsigned;
+}
+
+static void fold_node(Node *node) {
+    Node *lhs = node->lhs;
+    Node *rhs = node->rhs;
+
+    switch (node->kind) {
+    case ND_CAST:
+        fold_cast(node);
+        return;
+    case ND_NOT:
+        if (is_num(lhs))
+            set_num(node, !is_true(lhs));
+        return;
+    case ND_BITNOT:
+        if (is_num(lhs) && is_integer(node->ty) && node->ty->size >= 4)
+            set_num(node, ~num_val(lhs));
+        return;
+    case ND_LOGAND:
+    case ND_LOGOR:
+        // The right-hand side isn't evaluated if the left-hand side
+        // decides the result.
+        if (!is_num(lhs))
+            return;
+        if (is_true(lhs) == (node->kind == ND_LOGOR))
+            set_num(node, is_true(lhs));
+        else if (is_num(rhs))
+            set_num(node, is_true(rhs));
+        return;
+    case ND_COND: {
+        if (!is_num(node->cond) || !is_numeric(node->ty))
+            return;
+        Node *val = is_true(node->cond) ? node->then : node->els;
+        if (!same_type(val->ty, node->ty))
+            return;
+        Node *next = node->next;
+        *node = *val;
+        node->next = next;
+        return;
+    }
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        if (is_num(lhs) && is_num(rhs))
+            fold_compare(node);
+        return;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_MOD:
+    case ND_BITAND:
+    case ND_BITOR:
+    case ND_BITXOR:
+    case ND_SHL:
+    case ND_SHR:
+        if (is_num(lhs) && is_num(rhs) && is_numeric(node->ty))
+            fold_binary(node);
+        return;
+    }
+}
+
+static void fold_constants(Node *node) {
+    for (; node; node = node->next) {
+        fold_constants(node->lhs);
+        fold_constants(node->rhs);
+        fold_constants(node->cond);
+        fold_constants(node->then);
+        fold_constants(node->els);
+        fold_constants(node->init);
+        fold_constants(node->inc);
+        fold_constants(node->body);
+        fold_node(node);
+    }
+}
+
 // Convert `A op= B` to `tmp = &A, *tmp = *tmp op B`
 // where tmp is a fresh pointer variable.
-static Node *to_assign(Node *binary) {
+static Node *to_assign(Context *ctx, Node *binary) {
     add_type(binary->lhs);
     add_type(binary->rhs);
 
-    Var *var = new_lvar("", pointer_to(binary->lhs->ty));
+    // A variable is evaluated without side effects, so `A op= B` is
+    // simply `A = A op B`. This keeps the address of a local variable
+    // from being taken, so the variable can live in a register.
+    if (binary->lhs->kind == ND_VAR)
+        return new_binary(ND_ASSIGN, binary->lhs, binary, binary->tok);
+
+    Var *var = new_lvar(ctx, "", pointer_to(binary->lhs->ty));
     Token *tok = binary->tok;
 
     Node *expr1 = new_binary(ND_ASSIGN, new_var_node(var, tok),
-                             new_unary(ND_ADDR, binary->lhs, tok), tok);
+                             new_addr(binary->lhs, tok), tok);
 
     Node *expr2 =
         new_binary(ND_ASSIGN,
@@ -1556,49 +1892,49 @@ static Node *to_assign(Node *binary) {
 // assign    = conditional (assign-op assign)?
 // assign-op = "=" | "+=" | "*=" | "/=" | "%=" | "&=" | "|=" | "^="
 //           | "<<=" | ">>="
-static Node *assign(Token **rest, Token *tok) {
-    Node *node = conditional(&tok, tok);
+static Node *assign(Context *ctx, Token **rest, Token *tok) {
+    Node *node = conditional(ctx, &tok, tok);
 
     if (equal(tok, "="))
-        return new_binary(ND_ASSIGN, node, assign(rest, tok->next), tok);
+        return new_binary(ND_ASSIGN, node, assign(ctx, rest, tok->next), tok);
 
     if (equal(tok, "+="))
-        return to_assign(new_add(node, assign(rest, tok->next), tok));
+        return to_assign(ctx, new_add(node, assign(ctx, rest, tok->next), tok));
 
     if (equal(tok, "-="))
-        return to_assign(new_sub(node, assign(rest, tok->next), tok));
+        return to_assign(ctx, new_sub(node, assign(ctx, rest, tok->next), tok));
 
     if (equal(tok, "*="))
-        return to_assign(new_binary(ND_MUL, node, assign(rest, tok->next), tok));
+        return to_assign(ctx, new_binary(ND_MUL, node, assign(ctx, rest, tok->next), tok));
 
     if (equal(tok, "/="))
-        return to_assign(new_binary(ND_DIV, node, assign(rest, tok->next), tok));
+        return to_assign(ctx, new_binary(ND_DIV, node, assign(ctx, rest, tok->next), tok));
 
     if (equal(tok, "%="))
-        return to_assign(new_binary(ND_MOD, node, assign(rest, tok->next), tok));
+        return to_assign(ctx, new_binary(ND_MOD, node, assign(ctx, rest, tok->next), tok));
 
     if (equal(tok, "&="))
-        return to_assign(new_binary(ND_BITAND, node, assign(rest, tok->next), tok));
+        return to_assign(ctx, new_binary(ND_BITAND, node, assign(ctx, rest, tok->next), tok));
 
     if (equal(tok, "|="))
-        return to_assign(new_binary(ND_BITOR, node, assign(rest, tok->next), tok));
+        return to_assign(ctx, new_binary(ND_BITOR, node, assign(ctx, rest, tok->next), tok));
 
     if (equal(tok, "^="))
-        return to_assign(new_binary(ND_BITXOR, node, assign(rest, tok->next), tok));
+        return to_assign(ctx, new_binary(ND_BITXOR, node, assign(ctx, rest, tok->next), tok));
 
     if (equal(tok, "<<="))
-        return to_assign(new_binary(ND_SHL, node, assign(rest, tok->next), tok));
+        return to_assign(ctx, new_binary(ND_SHL, node, assign(ctx, rest, tok->next), tok));
 
     if (equal(tok, ">>="))
-        return to_assign(new_binary(ND_SHR, node, assign(rest, tok->next), tok));
+        return to_assign(ctx, new_binary(ND_SHR, node, assign(ctx, rest, tok->next), tok));
 
     *rest = tok;
     return node;
 }
 
 // conditional = logor ("?" expr ":" conditional)?
-static Node *conditional(Token **rest, Token *tok) {
-    Node *node = logor(&tok, tok);
+static Node *conditional(Context *ctx, Token **rest, Token *tok) {
+    Node *node = logor(ctx, &tok, tok);
 
     if (!equal(tok, "?")) {
         *rest = tok;
@@ -1607,81 +1943,81 @@ static Node *conditional(Token **rest, Token *tok) {
 
     Node *cond = new_node(ND_COND, tok);
     cond->cond = node;
-    cond->then = expr(&tok, tok->next);
+    cond->then = expr(ctx, &tok, tok->next);
     tok = skip(tok, ":");
-    cond->els = conditional(rest, tok);
+    cond->els = conditional(ctx, rest, tok);
     return cond;
 }
 
 // logor = logand ("||" logand)*
-static Node *logor(Token **rest, Token *tok) {
-    Node *node = logand(&tok, tok);
+static Node *logor(Context *ctx, Token **rest, Token *tok) {
+    Node *node = logand(ctx, &tok, tok);
     while (equal(tok, "||")) {
         Token *start = tok;
-        node = new_binary(ND_LOGOR, node, logand(&tok, tok->next), start);
+        node = new_binary(ND_LOGOR, node, logand(ctx, &tok, tok->next), start);
     }
     *rest = tok;
     return node;
 }
 
 // logand = bitor ("&&" bitor)*
-static Node *logand(Token **rest, Token *tok) {
-    Node *node = bitor(&tok, tok);
+static Node *logand(Context *ctx, Token **rest, Token *tok) {
+    Node *node = bitor(ctx, &tok, tok);
     while (equal(tok, "&&")) {
         Token *start = tok;
-        node = new_binary(ND_LOGAND, node, bitor(&tok, tok->next), start);
+        node = new_binary(ND_LOGAND, node, bitor(ctx, &tok, tok->next), start);
     }
     *rest = tok;
     return node;
 }
 
 // bitor = bitxor ("|" bitxor)*
-static Node *bitor(Token **rest, Token *tok) {
-    Node *node = bitxor(&tok, tok);
+static Node *bitor(Context *ctx, Token **rest, Token *tok) {
+    Node *node = bitxor(ctx, &tok, tok);
     while (equal(tok, "|")) {
         Token *start = tok;
-        node = new_binary(ND_BITOR, node, bitxor(&tok, tok->next), start);
+        node = new_binary(ND_BITOR, node, bitxor(ctx, &tok, tok->next), start);
     }
     *rest = tok;
     return node;
 }
 
 // bitxor = bitand ("^" bitand)*
-static Node *bitxor(Token **rest, Token *tok) {
-    Node *node = bitand(&tok, tok);
+static Node *bitxor(Context *ctx, Token **rest, Token *tok) {
+    Node *node = bitand(ctx, &tok, tok);
     while (equal(tok, "^")) {
         Token *start = tok;
-        node = new_binary(ND_BITXOR, node, bitand(&tok, tok->next), start);
+        node = new_binary(ND_BITXOR, node, bitand(ctx, &tok, tok->next), start);
     }
     *rest = tok;
     return node;
 }
 
 // bitand = equality ("&" equality)*
-static Node *bitand(Token **rest, Token *tok) {
-    Node *node = equality(&tok, tok);
+static Node *bitand(Context *ctx, Token **rest, Token *tok) {
+    Node *node = equality(ctx, &tok, tok);
     while (equal(tok, "&")) {
         Token *start = tok;
-        node = new_binary(ND_BITAND, node, equality(&tok, tok->next), start);
+        node = new_binary(ND_BITAND, node, equality(ctx, &tok, tok->next), start);
     }
     *rest = tok;
     return node;
 }
 
 // equality = relational ("==" relational | "!=" relational)*
-static Node *equality(Token **rest, Token *tok) {
-    Node *node = relational(&tok, tok);
+static Node *equality(Context *ctx, Token **rest, Token *tok) {
+    Node *node = relational(ctx, &tok, tok);
 
     for (;;) {
         Token *start = tok;
 
         if (equal(tok, "==")) {
-            node = new_binary(ND_EQ, node, relational(&tok, tok->next), start);
+            node = new_binary(ND_EQ, node, relational(ctx, &tok, tok->next), start);
             continue;
         }
 
         if (equal(tok, "!=")) {
-            node = new_binary(ND_NE, node, relational(&tok, tok->next), start);
+            node = new_binary(ND_NE, node, relational(ctx, &tok, tok->next), start);
             continue;
         }
 
@@ -1691,29 +2027,29 @@ static Node *equality(Token **rest, Token *tok) {
 }
 
 // relational = shift ("<" shift | "<=" shift | ">" shift | ">=" shift)*
-static Node *relational(Token **rest, Token *tok) {
-    Node *node = shift(&tok, tok);
+static Node *relational(Context *ctx, Token **rest, Token *tok) {
+    Node *node = shift(ctx, &tok, tok);
 
     for (;;) {
         Token *start = tok;
 
         if (equal(tok, "<")) {
-            node = new_binary(ND_LT, node, shift(&tok, tok->next), start);
+            node = new_binary(ND_LT, node, shift(ctx, &tok, tok->next), start);
             continue;
         }
 
         if (equal(tok, "<=")) {
-            node = new_binary(ND_LE, node, shift(&tok, tok->next), start);
+            node = new_binary(ND_LE, node, shift(ctx, &tok, tok->next), start);
             continue;
         }
 
         if (equal(tok, ">")) {
-            node = new_binary(ND_LT, shift(&tok, tok->next), node, start);
+            node = new_binary(ND_LT, shift(ctx, &tok, tok->next), node, start);
             continue;
         }
 
         if (equal(tok, ">=")) {
-            node = new_binary(ND_LE, shift(&tok, tok->next), node, start);
+            node = new_binary(ND_LE, shift(ctx, &tok, tok->next), node, start);
             continue;
         }
 
@@ -1723,18 +2059,18 @@ static Node *relational(Token **rest, Token *tok) {
 }
 
 // shift = add ("<<" add | ">>" add)*
-static Node *shift(Token **rest, Token *tok) {
-    Node *node = add(&tok, tok);
+static Node *shift(Context *ctx, Token **rest, Token *tok) {
+    Node *node = add(ctx, &tok, tok);
 
     for (;;) {
         Token *start = tok;
 
         if (equal(tok, "<<")) {
-            node = new_binary(ND_SHL, node, add(&tok, tok->next), start);
+            node = new_binary(ND_SHL, node, add(ctx, &tok, tok->next), start);
             continue;
         }
         if (equal(tok, ">>")) {
-            node = new_binary(ND_SHR, node, add(&tok, tok->next), start);
+            node = new_binary(ND_SHR, node, add(ctx, &tok, tok->next), start);
             continue;
         }
 
@@ -1796,19 +2132,19 @@ static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
 } 
 
 // add = mul ("+" mul | "-" mul)*
-static Node *add(Token **rest, Token *tok) {
-    Node *node = mul(&tok, tok);
+static Node *add(Context *ctx, Token **rest, Token *tok) {
+    Node *node = mul(ctx, &tok, tok);
 
     for (;;) {
         Token *start = tok;
 
         if (equal(tok, "+")) {
-            node = new_add(node, mul(&tok, tok->next), start);
+            node = new_add(node, mul(ctx, &tok, tok->next), start);
             continue;
         }
 
         if (equal(tok, "-")) {
-            node = new_sub(node, mul(&tok, tok->next), start);
+            node = new_sub(node, mul(ctx, &tok, tok->next), start);
             continue;
         }
 
@@ -1818,24 +2154,24 @@ static Node *add(Token **rest, Token *tok) {
 }
 
 // mul = cast ("*" cast | "/" cast | "%" cast)*
-static Node *mul(Token **rest, Token *tok) {
-    Node *node = cast(&tok, tok);
+static Node *mul(Context *ctx, Token **rest, Token *tok) {
+    Node *node = cast(ctx, &tok, tok);
 
     for (;;) {
         Token *start = tok;
 
         if (equal(tok, "*")) {
-            node = new_binary(ND_MUL, node, cast(&tok, tok->next), start);
+            node = new_binary(ND_MUL, node, cast(ctx, &tok, tok->next), start);
             continue;
         }
 
         if (equal(tok, "/")) {
-            node = new_binary(ND_DIV, node, cast(&tok, tok->next), start);
+            node = new_binary(ND_DIV, node, cast(ctx, &tok, tok->next), start);
             continue;
         }
 
         if (equal(tok, "%")) {
-            node = new_binary(ND_MOD, node, cast(&tok, tok->next), start);
+            node = new_binary(ND_MOD, node, cast(ctx, &tok, tok->next), start);
             continue;
         }
 
@@ -1845,15 +2181,15 @@ static Node *mul(Token **rest, Token *tok) {
 }
 
 // compound-literal = initializer "}"
-static Node *compound_literal(Token **rest, Token *tok, Type *ty, Token *start) {
-    if (scope_depth == 0) {
-        Var *var = new_gvar(new_unique_name(), ty, true, true);
-        gvar_initializer(rest, tok, var);
+static Node *compound_literal(Context *ctx, Token **rest, Token *tok, Type *ty, Token *start) {
+    if (ctx->scope_depth == 0) {
+        Var *var = new_gvar(ctx, new_unique_name(ctx), ty, true, true);
+        gvar_initializer(ctx, rest, tok, var);
         return new_var_node(var, start);
     }
 
-    Var *var = new_lvar(new_unique_name(), ty);
-    Node *lhs = lvar_initializer(rest, tok, var);
+    Var *var = new_lvar(ctx, new_unique_name(ctx), ty);
+    Node *lhs = lvar_initializer(ctx, rest, tok, var);
     Node *rhs = new_var_node(var, tok);
     return new_binary(ND_COMMA, lhs, rhs, tok);
 }
@@ -1861,65 +2197,65 @@ static Node *compound_literal(Token **rest, Token *tok, Type *ty, Token *start)
 // cast = "(" type-name ")" "{" compound-literal
 //      | "(" type-name ")" cast
 //      | unary
-static Node *cast(Token **rest, Token *tok) {
-    if (equal(tok, "(") && is_typename(tok->next)) {
+static Node *cast(Context *ctx, Token **rest, Token *tok) {
+    if (equal(tok, "(") && is_typename(ctx, tok->next)) {
         Token *start = tok;
-        Type *ty = typename(&tok, tok->next);
+        Type *ty = typename(ctx, &tok, tok->next);
         tok = skip(tok, ")");
 
         if (equal(tok, "{"))
-            return compound_literal(rest, tok, ty, start);
+            return compound_literal(ctx, rest, tok, ty, start);
 
-        Node *node = new_unary(ND_CAST, cast(rest, tok), start);
+        Node *node = new_unary(ND_CAST, cast(ctx, rest, tok), start);
         add_type(node->lhs);
         node->ty = ty;
         return node;
     }
 
-    return unary(rest, tok);
+    return unary(ctx, rest, tok);
 }
 
 // unary = ("+" | "-" | "*" | "&" | "!" | "~") cast
 //       | ("++" | "--") unary
 //       | postfix
-static Node *unary(Token **rest, Token *tok) {
+static Node *unary(Context *ctx, Token **rest, Token *tok) {
     if (equal(tok, "+"))
-        return cast(rest, tok->next);
+        return cast(ctx, rest, tok->next);
 
     if (equal(tok, "-"))
-        return new_binary(ND_SUB, new_num(0, tok), cast(rest, tok->next), tok);
+        return new_binary(ND_SUB, new_num(0, tok), cast(ctx, rest, tok->next), tok);
 
     if (equal(tok, "&"))
-        return new_unary(ND_ADDR, cast(rest, tok->next), tok);
+        return new_addr(cast(ctx, rest, tok->next), tok);
 
     if (equal(tok, "*"))
-        return new_unary(ND_DEREF, cast(rest, tok->next), tok);
+        return new_unary(ND_DEREF, cast(ctx, rest, tok->next), tok);
 
     if (equal(tok, "!"))
-        return new_unary(ND_NOT, cast(rest, tok->next), tok);
+        return new_unary(ND_NOT, cast(ctx, rest, tok->next), tok);
 
     if (equal(tok, "~"))
-        return new_unary(ND_BITNOT, cast(rest, tok->next), tok);
+        return new_unary(ND_BITNOT, cast(ctx, rest, tok->next), tok);
 
     // Read ++i as i+=1
     if (equal(tok, "++"))
-        return to_assign(new_add(unary(rest, tok->next), new_num(1, tok), tok));
+        return to_assign(ctx, new_add(unary(ctx, rest, tok->next), new_num(1, tok), tok));
     
     // Read --i as i-=1
     if (equal(tok, "--"))
-        return to_assign(new_sub(unary(rest, tok->next), new_num(1, tok), tok));
+        return to_assign(ctx, new_sub(unary(ctx, rest, tok->next), new_num(1, tok), tok));
 
-    return postfix(rest, tok);
+    return postfix(ctx, rest, tok);
 }
 
 // struct-members = (typespec declarator ("," declarator)* ";")*
-static Member *struct_members(Token **rest, Token *tok) {
+static Member *struct_members(Context *ctx, Token **rest, Token *tok) {
     Member head = {};
     Member *cur = &head;
 
     while (!equal(tok, "}")) {
         VarAttr attr = {};
-        Type *basety = typespec(&tok, tok, &attr);
+        Type *basety = typespec(ctx, &tok, tok, &attr);
         int i = 0;
 
         // Anonymous struct member
@@ -1937,13 +2273,13 @@ static Member *struct_members(Token **rest, Token *tok) {
                 tok = skip(tok, ",");
 
             Member *mem = calloc(1, sizeof(Member));
-            mem->ty = declarator(&tok, tok, basety);
+            mem->ty = declarator(ctx, &tok, tok, basety);
             mem->name = mem->ty->name;
             mem->align = attr.align ? attr.align : mem->ty->align;
 
             if (consume(&tok, tok, ":")) {
                 mem->is_bitfield = true;
-                mem->bit_width = const_expr(&tok, tok);
+                mem->bit_width = const_expr(ctx, &tok, tok);
 
                 // Unlike other variables, bitfields are unsigned by default
                 // as per the x86-64 psABI spec.
@@ -1962,7 +2298,7 @@ static Member *struct_members(Token **rest, Token *tok) {
 }
 
 // struct-union-decl = ident? ("{" struct-members)?
-static Type *struct_union_decl(Token **rest, Token *tok) {
+static Type *struct_union_decl(Context *ctx, Token **rest, Token *tok) {
     // Read a tag
     Token *tag = NULL;
     if (tok->kind == TK_IDENT) {
@@ -1973,13 +2309,13 @@ static Type *struct_union_decl(Token **rest, Token *tok) {
     if (tag && !equal(tok, "{")) {
         *rest = tok;
 
-        TagScope *sc = find_tag(tag);
+        TagScope *sc = find_tag(ctx, tag);
         if (sc)
             return sc->ty;
 
         Type *ty = struct_type();
         ty->size = -1;
-        push_tag_scope(tag, ty);
+        push_tag_scope(ctx, tag, ty);
         return ty;
     }
 
@@ -1987,26 +2323,31 @@ static Type *struct_union_decl(Token **rest, Token *tok) {
 
     // Construct a struct object
     Type *ty = struct_type();
-    ty->members = struct_members(rest, tok);
+    ty->members = struct_members(ctx, rest, tok);
 
     if (tag) {
         // If this is a redefinition, overwrite a previous type.
         // Otherwise, register the struct type.
-        TagScope *sc = find_tag(tag);
-        if (sc && sc->depth == scope_depth) {
+        TagScope *sc = find_tag(ctx, tag);
+        if (sc && sc->depth == ctx->scope_depth) {
             *sc->ty = *ty;
             return sc->ty;
         }
 
-        push_tag_scope(tag, ty);
+        push_tag_scope(ctx, tag, ty);
     }
 
     return ty;
 }
 
 // struct-decl = struct-union-decl
-static Type *struct_decl(Token **rest, Token *tok) {
-    Type *ty = struct_union_decl(rest, tok);
+static Type *struct_decl(Context *ctx, Token **rest, Token *tok) {
+    // A struct referred to by its tag has been laid out already. We must
+    // not write to it because function bodies are parsed in parallel.
+    bool is_ref = tok->kind == TK_IDENT && !equal(tok->next, "{");
+    Type *ty = struct_union_decl(ctx, rest, tok);
+    if (is_ref || ty->size < 0)
+        return ty;
 
     // Assign offset within the struct to members
     int bits = 0;
@@ -2039,8 +2380,11 @@ static Type *struct_decl(Token **rest, Token *tok) {
 }
 
 // union-decl = struct-union-decl
-static Type *union_decl(Token **rest, Token *tok) {
-    Type *ty = struct_union_decl(rest, tok);
+static Type *union_decl(Context *ctx, Token **rest, Token *tok) {
+    bool is_ref = tok->kind == TK_IDENT && !equal(tok->next, "{");
+    Type *ty = struct_union_decl(ctx, rest, tok);
+    if (is_ref || ty->size < 0)
+        return ty;
 
     // If union, we don't have to assign offsets because they
     // are already initialized to zero. We need to compute the
@@ -2108,12 +2452,19 @@ static Node *struct_ref(Node *node, Token *tok) {
 
 // Convert A++ to `tmp = &A, *tmp = *tmp + 1, *tmp - 1`
 // where tmp is a fresh pointer variable.
-static Node *new_inc_dec(Node *node, Token *tok, int addend) {
+static Node *new_inc_dec(Context *ctx, Node *node, Token *tok, int addend) {
     add_type(node);
-    Var *var = new_lvar("", pointer_to(node->ty));
+
+    // A variable doesn't need a pointer: `(A = A + 1) - 1`.
+    if (node->kind == ND_VAR) {
+        Node *assign = new_binary(ND_ASSIGN, node, new_add(node, new_num(addend, tok), tok), tok);
+        return new_add(assign, new_num(-addend, tok), tok);
+    }
+
+    Var *var = new_lvar(ctx, "", pointer_to(node->ty));
 
     Node *expr1 = new_binary(ND_ASSIGN, new_var_node(var, tok),
-                            new_unary(ND_ADDR, node, tok), tok);
+                            new_addr(node, tok), tok);
 
     Node *expr2 =
         new_binary(ND_ASSIGN,
@@ -2133,19 +2484,19 @@ static Node *new_inc_dec(Node *node, Token *tok, int addend) {
 //
 // postfix-tail = ("[" expr "]" | "(" func-args ")"
 //              | "." ident | "->" ident | "++" | "--")
-static Node *postfix(Token **rest, Token *tok) {
-    Node *node = primary(&tok, tok);
+static Node *postfix(Context *ctx, Token **rest, Token *tok) {
+    Node *node = primary(ctx, &tok, tok);
 
     for (;;) {
         if (equal(tok, "(")) {
-            node = funcall(&tok, tok->next, node);
+            node = funcall(ctx, &tok, tok->next, node);
             continue;
         }
 
         if (equal(tok, "[")) {
             // x[y] is short for *(x+y)
             Token *start = tok;
-            Node *idx = expr(&tok, tok->next);
+            Node *idx = expr(ctx, &tok, tok->next);
             tok = skip(tok, "]");
             node = new_unary(ND_DEREF, new_add(node, idx, start), start);
             continue;
@@ -2166,13 +2517,13 @@ static Node *postfix(Token **rest, Token *tok) {
         }
 
         if (equal(tok, "++")) {
-            node = new_inc_dec(node, tok, 1);
+            node = new_inc_dec(ctx, node, tok, 1);
             tok = tok->next;
             continue;
         }
 
         if (equal(tok, "--")) {
-            node = new_inc_dec(node, tok, -1);
+            node = new_inc_dec(ctx, node, tok, -1);
             tok = tok->next;
             continue;
         }
@@ -2186,7 +2537,7 @@ static Node *postfix(Token **rest, Token *tok) {
 //
 // foo(a,b,c) is compiled to (t1=a, t2=b, t3=c, foo(t1, t2, t3))
 // where t1, t2 and t3 are fresh local variables.
-static Node *funcall(Token **rest, Token *tok, Node *fn) {
+static Node *funcall(Context *ctx, Token **rest, Token *tok, Node *fn) {
     add_type(fn);
 
     if (fn->ty->kind != TY_FUNC &&
@@ -2203,7 +2554,7 @@ static Node *funcall(Token **rest, Token *tok, Node *fn) {
         if (nargs)
             tok = skip(tok, ",");
 
-        Node *arg = assign(&tok, tok);
+        Node *arg = assign(ctx, &tok, tok);
         add_type(arg);
 
         if (param_ty) {
@@ -2214,8 +2565,8 @@ static Node *funcall(Token **rest, Token *tok, Node *fn) {
         }
 
         Var *var = arg->ty->base
-            ? new_lvar("", pointer_to(arg->ty->base))
-            : new_lvar("", arg->ty);
+            ? new_lvar(ctx, "", pointer_to(arg->ty->base))
+            : new_lvar(ctx, "", arg->ty);
 
         args = realloc(args, sizeof(*args) * (nargs + 1));
         args[nargs] = var;
@@ -2243,43 +2594,43 @@ static Node *funcall(Token **rest, Token *tok, Node *fn) {
 //         | ident
 //         | str
 //         | num
-static Node *primary(Token **rest, Token *tok) {
+static Node *primary(Context *ctx, Token **rest, Token *tok) {
     if (equal(tok, "(") && equal(tok->next, "{")) {
         // This is a GNU statement expression
         Node *node = new_node(ND_STMT_EXPR, tok);
-        node->body = compound_stmt(&tok, tok->next->next)->body;
+        node->body = compound_stmt(ctx, &tok, tok->next->next)->body;
         *rest = skip(tok, ")");
         return node;
     }
 
     if (equal(tok, "(")) {
-        Node *node = expr(&tok, tok->next);
+        Node *node = expr(ctx, &tok, tok->next);
         *rest = skip(tok, ")");
         return node;
     }
 
-    if (equal(tok, "sizeof") && equal(tok->next, "(") && is_typename(tok->next->next)) {
-        Type *ty = typename(&tok, tok->next->next);
+    if (equal(tok, "sizeof") && equal(tok->next, "(") && is_typename(ctx, tok->next->next)) {
+        Type *ty = typename(ctx, &tok, tok->next->next);
         *rest = skip(tok, ")");
         return new_ulong(ty->size, tok);
     }
 
     if (equal(tok, "sizeof")) {
-        Node *node = unary(rest, tok->next);
+        Node *node = unary(ctx, rest, tok->next);
         add_type(node);
         return new_ulong(node->ty->size, tok);
     }
 
     if (equal(tok, "_Alignof")) {
         tok = skip(tok->next, "(");
-        Type *ty = typename(&tok, tok);
+        Type *ty = typename(ctx, &tok, tok);
         *rest = skip(tok, ")");
         return new_ulong(ty->align, tok);
     }
 
     if (tok->kind == TK_IDENT) {
         // Variable or enum constant
-        VarScope *sc = find_var(tok);
+        VarScope *sc = find_var(ctx, tok);
         *rest = tok->next;
 
         if (sc) {
@@ -2292,7 +2643,7 @@ static Node *primary(Token **rest, Token *tok) {
         if (equal(tok->next, "(")) {
             warn_tok(tok, "implicit declaration of a function");
             char *name = strndup(tok->loc, tok->len);
-            Var *var = new_gvar(name, func_type(ty_int), true, false);
+            Var *var = new_gvar(ctx, name, func_type(ty_int), true, false);
             return new_var_node(var, tok);
         }
 
@@ -2300,7 +2651,7 @@ static Node *primary(Token **rest, Token *tok) {
     }
     
     if (tok->kind == TK_STR) {
-        Var *var = new_string_literal(tok->str, tok->ty);
+        Var *var = new_string_literal(ctx, tok->str, tok->ty);
         *rest = tok->next;
         return new_var_node(var, tok);
     }
@@ -2322,44 +2673,64 @@ static Node *primary(Token **rest, Token *tok) {
     return node;
 }
 
+static void parse_bodies(Context *ctx, FuncBody *fb, int n) {
+    FuncBody **bodies = calloc(n, sizeof(FuncBody *));
+    for (int i = 0; i < n; i++, fb = fb->next)
+        bodies[i] = fb;
+    parallel_for(ctx, n, parse_body, bodies);
+}
+
 // program = (funcdef | global-var)*
-Program *parse(Token *tok) {
+Program *parse(Context *ctx, Token *tok) {
     // Add built-in function type
-    new_gvar("__builtin_va_start", func_type(ty_void), true, false);
+    new_gvar(ctx, "__builtin_va_start", func_type(ty_void), true, false);
 
     // Read source code until EOF
-    Function head = {};
-    Function *cur = &head;
-    globals = NULL;
+    FuncBody head = {};
+    FuncBody *cur = &head;
+    int nbodies = 0;
+    ctx->globals = NULL;
+    ctx->unique_prefix = ".L.data.";
 
     while (tok->kind != TK_EOF) {
-        Token *start = tok;
         VarAttr attr = {};
-        Type *basety = typespec(&tok, tok, &attr);
+        Type *basety = typespec(ctx, &tok, tok, &attr);
         if (consume(&tok, tok, ";"))
             continue;
-        Type *ty = declarator(&tok, tok, basety);
+        Type *ty = declarator(ctx, &tok, tok, basety);
 
         // Typedef
         if (attr.is_typedef) {
             for (;;) {
                 if (!ty->name)
                     error_tok(ty->name_pos, "typedef name omitted");
-                push_scope(get_ident(ty->name))->type_def = ty;
+                push_scope(ctx, get_ident(ty->name))->type_def = ty;
 
                 if (consume(&tok, tok, ";"))
                     break;
                 tok = skip(tok, ",");
-                ty = declarator(&tok, tok, basety);
+                ty = declarator(ctx, &tok, tok, basety);
             }
             continue;
         }
 
         // Function
         if (ty->kind == TY_FUNC) {
-            current_fn = new_gvar(get_ident(ty->name), ty, attr.is_static, false);
-            if (!consume(&tok, tok, ";"))
-                cur = cur->next = funcdef(&tok, start);
+            ctx->current_fn = new_gvar(ctx, get_ident(ty->name), ty, attr.is_static, false);
+            if (consume(&tok, tok, ";"))
+                continue;
+
+            FuncBody *fb = funcdef(ctx, &tok, tok, ty, &attr);
+            if (!tok) {
+                // The body has no closing brace. Parse it now to report
+                // an error at the right place, after errors in the
+                // preceding functions if any.
+                parse_bodies(ctx, head.next, nbodies);
+                parse_body(&fb, 0);
+                error_tok(fb->tok, "unterminated function body");
+            }
+            cur = cur->next = fb;
+            nbodies++;
             continue;
         }
 
@@ -2368,22 +2739,40 @@ Program *parse(Token *tok) {
             if (!ty->name)
                 error_tok(ty->name_pos, "variable name omitted");
 
-            Var *var = new_gvar(get_ident(ty->name), ty, attr.is_static, !attr.is_extern);
+            Var *var = new_gvar(ctx, get_ident(ty->name), ty, attr.is_static, !attr.is_extern);
             if (attr.align)
                 var->align = attr.align;
 
             if (equal(tok, "="))
-                gvar_initializer(&tok, tok->next, var);
+                gvar_initializer(ctx, &tok, tok->next, var);
 
             if (consume(&tok, tok, ";"))
                 break;
             tok = skip(tok, ",");
-            ty = declarator(&tok, tok, basety);
+            ty = declarator(ctx, &tok, tok, basety);
         }
     }
 
+    parse_bodies(ctx, head.next, nbodies);
+
+    // Collect functions and the globals their bodies have defined.
+    Function fn_head = {};
+    Function *fn_cur = &fn_head;
+
+    for (FuncBody *fb = head.next; fb; fb = fb->next) {
+        fn_cur = fn_cur->next = fb->fn;
+
+        Var *var = fb->ctx.globals;
+        if (!var)
+            continue;
+        while (var->next)
+            var = var->next;
+        var->next = ctx->globals;
+        ctx->globals = fb->ctx.globals;
+    }
+
     Program *prog = calloc(1, sizeof(Program));
-    prog->globals = globals;
-    prog->fns = head.next;
+    prog->globals = ctx->globals;
+    prog->fns = fn_head.next;
     return prog;
 } 
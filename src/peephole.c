@@ -0,0 +1,419 @@
+#include "711cc.h"
+
+// This file is a peephole optimizer for the x86-64 backend. With -O1
+// and above, the code generator appends the instructions of a function
+// to a list instead of printing them, and the rules below rewrite short
+// sequences of adjacent instructions to shorter ones before the list is
+// printed. Instructions are built from an opcode and operands, so the
+// rules compare them without parsing any text.
+//
+// A rule is tried at each instruction and matches the instructions that
+// follow it. Labels end a sequence, while directives such as `.loc` are
+// skipped. Every rule removes at least one instruction, so the rewriting
+// always ends.
+
+static char *reg8[] = {
+    "%al", "%cl", "%dl", "%bl", "%sil", "%dil", "%r8b", "%r9b",
+    "%r10b", "%r11b", "%r12b", "%r13b", "%r14b", "%r15b", "%bpl", "%spl",
+};
+static char *reg16[] = {
+    "%ax", "%cx", "%dx", "%bx", "%si", "%di", "%r8w", "%r9w",
+    "%r10w", "%r11w", "%r12w", "%r13w", "%r14w", "%r15w", "%bp", "%sp",
+};
+static char *reg32[] = {
+    "%eax", "%ecx", "%edx", "%ebx", "%esi", "%edi", "%r8d", "%r9d",
+    "%r10d", "%r11d", "%r12d", "%r13d", "%r14d", "%r15d", "%ebp", "%esp",
+};
+static char *reg64[] = {
+    "%rax", "%rcx", "%rdx", "%rbx", "%rsi", "%rdi", "%r8", "%r9",
+    "%r10", "%r11", "%r12", "%r13", "%r14", "%r15", "%rbp", "%rsp", "%rip",
+};
+
+// Mnemonics in the order of AsmOp
+static char *op_names[] = {
+    NULL, NULL, "mov", "movabs", "movl", "movq", "movd", "movaps",
+    "movzbl", "movzwl", "movsbl", "movswl", "movslq", "lea", "add", "sub",
+    "imul", "and", "or", "xor", "not", "shl", "shr", "sar", "cmp", "div",
+    "idiv", "cqo", "cdq", "set", "j", "jmp", "call", "push", "pop", "ret",
+    "xorps", "movss", "movsd", "addss", "addsd", "subss", "subsd", "mulss",
+    "mulsd", "divss", "divsd", "ucomiss", "ucomisd", "cvtss2sd", "cvtsd2ss",
+    "cvttss2si", "cvttsd2si", "cvtsi2ssl", "cvtsi2sdl", "cvtsi2ssq", "cvtsi2sdq",
+};
+
+static char *cond_names[] = {
+    "e", "ne", "l", "ge", "le", "g", "b", "ae", "be", "a", "p", "np",
+};
+
+// Appends a copy of an instruction to a list.
+void append_asm(AsmList *list, AsmInsn *insn) {
+    AsmInsn *copy = malloc(sizeof(AsmInsn));
+    *copy = *insn;
+    copy->next = NULL;
+    copy->prev = list->tail;
+    if (list->tail)
+        list->tail->next = copy;
+    else
+        list->head = copy;
+    list->tail = copy;
+}
+
+static void delete_insn(AsmList *list, AsmInsn *insn) {
+    if (insn->prev)
+        insn->prev->next = insn->next;
+    else
+        list->head = insn->next;
+    if (insn->next)
+        insn->next->prev = insn->prev;
+    else
+        list->tail = insn->prev;
+}
+
+// Returns the line after an instruction, skipping directives.
+static AsmInsn *next_insn(AsmInsn *insn) {
+    insn = insn->next;
+    while (insn && insn->op == AS_LOC)
+        insn = insn->next;
+    return insn;
+}
+
+static bool is_label(AsmInsn *insn) {
+    return insn && insn->op == AS_LABEL;
+}
+
+static bool is_op(AsmInsn *insn, AsmOp op) {
+    return insn && insn->op == op;
+}
+
+static bool startswith(char *p, char *q) {
+    return strncmp(p, q, strlen(q)) == 0;
+}
+
+static bool same_operand(AsmOperand *a, AsmOperand *b) {
+    if (a->kind != b->kind || a->reg != b->reg || a->size != b->size || a->val != b->val)
+        return false;
+    if (!a->sym || !b->sym)
+        return a->sym == b->sym;
+    return !strcmp(a->sym, b->sym);
+}
+
+static bool is_reg64(AsmOperand *opnd) {
+    return opnd->kind == OPND_REG && opnd->size == 8;
+}
+
+static bool is_reg8(AsmOperand *opnd, int reg) {
+    return opnd->kind == OPND_REG && opnd->size == 1 && opnd->reg == reg;
+}
+
+static bool is_reg32(AsmOperand *opnd, int reg) {
+    return opnd->kind == OPND_REG && opnd->size == 4 && opnd->reg == reg;
+}
+
+static bool is_imm(AsmOperand *opnd, long val) {
+    return opnd->kind == OPND_IMM && !opnd->sym && opnd->val == val;
+}
+
+// Returns true if an operand is a jump target within the function.
+static bool is_bb_label(AsmOperand *opnd) {
+    return opnd->kind == OPND_SYM && startswith(opnd->sym, ".L.bb.");
+}
+
+// A move that doesn't change any bits. A 32-bit move to itself isn't
+// one, because it clears the upper half of the register.
+//
+//   mov %r10, %r10
+static bool self_move(AsmList *list, AsmInsn *insn) {
+    if (insn->nargs != 2 || !same_operand(&insn->args[0], &insn->args[1]))
+        return false;
+    if (insn->op == AS_MOVAPS || (insn->op == AS_MOV && is_reg64(&insn->args[0]))) {
+        delete_insn(list, insn);
+        return true;
+    }
+    return false;
+}
+
+// Moving a value back to where it came from, such as reloading a
+// value that has just been stored.
+//
+//   mov %rax, -8(%rbp)           mov %rax, -8(%rbp)
+//   mov -8(%rbp), %rax     =>
+static bool move_back(AsmList *list, AsmInsn *insn) {
+    if (insn->op != AS_MOV && insn->op != AS_MOVSD && insn->op != AS_MOVSS &&
+        insn->op != AS_MOVAPS)
+        return false;
+
+    AsmOperand *src = &insn->args[0];
+    AsmOperand *dst = &insn->args[1];
+    if (insn->op == AS_MOV &&
+        !(is_reg64(src) && (is_reg64(dst) || dst->kind == OPND_MEM)) &&
+        !(is_reg64(dst) && src->kind == OPND_MEM))
+        return false;
+    if (src->kind == OPND_IMM)
+        return false;
+
+    // A load must not change the register that addresses the memory.
+    if (src->kind == OPND_MEM && dst->kind == OPND_REG && src->reg == dst->reg)
+        return false;
+
+    AsmInsn *next = next_insn(insn);
+    if (!is_op(next, insn->op) || !same_operand(&next->args[0], dst) ||
+        !same_operand(&next->args[1], src))
+        return false;
+    delete_insn(list, next);
+    return true;
+}
+
+// A value pushed to the stack and popped right away.
+//
+//   push %rax                    mov %rax, %rdi
+//   pop %rdi               =>
+static bool push_pop(AsmList *list, AsmInsn *insn) {
+    if (insn->op != AS_PUSH)
+        return false;
+    AsmInsn *next = next_insn(insn);
+    if (!is_op(next, AS_POP))
+        return false;
+
+    if (!same_operand(&insn->args[0], &next->args[0])) {
+        insn->op = AS_MOV;
+        insn->args[1] = next->args[0];
+        insn->nargs = 2;
+    } else {
+        delete_insn(list, insn);
+    }
+    delete_insn(list, next);
+    return true;
+}
+
+// Testing a boolean that has just been set from the flags. setcc and
+// movzx don't change the flags, so branch on them directly.
+//
+//   setl %r10b                   setl %r10b
+//   movzbl %r10b, %r10d          movzbl %r10b, %r10d
+//   cmp $0, %r10d                jl .L1
+//   jne .L1                =>
+static bool branch_on_flags(AsmList *list, AsmInsn *insn) {
+    if (insn->op != AS_SET)
+        return false;
+
+    AsmInsn *movz = next_insn(insn);
+    if (!is_op(movz, AS_MOVZBL) || !same_operand(&movz->args[0], &insn->args[0]))
+        return false;
+
+    AsmInsn *cmp = next_insn(movz);
+    if (!is_op(cmp, AS_CMP) || !is_imm(&cmp->args[0], 0) ||
+        !same_operand(&cmp->args[1], &movz->args[1]))
+        return false;
+
+    AsmInsn *jne = next_insn(cmp);
+    if (!is_op(jne, AS_JCC) || jne->cc != CC_NE)
+        return false;
+
+    jne->cc = insn->cc;
+    delete_insn(list, cmp);
+    return true;
+}
+
+// The scratch register %rax doesn't hold a value at the beginning of
+// a basic block, so a boolean set to it before a conditional branch
+// is dead once the branch reads the flags.
+//
+//   sete %al                     je .L.bb.f.1
+//   movzbl %al, %eax       =>    jmp .L.bb.f.2
+//   je .L.bb.f.1
+//   jmp .L.bb.f.2
+static bool dead_boolean(AsmList *list, AsmInsn *insn) {
+    if (insn->op != AS_SET || !is_reg8(&insn->args[0], RAX))
+        return false;
+
+    AsmInsn *movz = next_insn(insn);
+    if (!is_op(movz, AS_MOVZBL) || !is_reg8(&movz->args[0], RAX) ||
+        !is_reg32(&movz->args[1], RAX))
+        return false;
+
+    AsmInsn *jcc = next_insn(movz);
+    if (!is_op(jcc, AS_JCC) || !is_bb_label(&jcc->args[0]))
+        return false;
+
+    AsmInsn *next = next_insn(jcc);
+    if (!next)
+        return false;
+    if (!(next->op == AS_JMP || next->op == AS_LABEL) || !is_bb_label(&next->args[0]))
+        return false;
+
+    delete_insn(list, insn);
+    delete_insn(list, movz);
+    return true;
+}
+
+// A jump to the label that follows it.
+//
+//   jmp .L1
+// .L1:                     =>  .L1:
+static bool jump_to_next(AsmList *list, AsmInsn *insn) {
+    if (insn->op != AS_JMP && insn->op != AS_JCC)
+        return false;
+    if (insn->args[0].kind != OPND_SYM)
+        return false;
+
+    for (AsmInsn *label = next_insn(insn); is_label(label); label = next_insn(label)) {
+        if (!strcmp(insn->args[0].sym, label->args[0].sym)) {
+            delete_insn(list, insn);
+            return true;
+        }
+    }
+    return false;
+}
+
+// A conditional branch over an unconditional one.
+//
+//   je .L1                       jne .L2
+//   jmp .L2                .L1:
+// .L1:                     =>
+static bool branch_over_jump(AsmList *list, AsmInsn *insn) {
+    if (insn->op != AS_JCC)
+        return false;
+
+    AsmInsn *jmp = next_insn(insn);
+    if (!is_op(jmp, AS_JMP) || jmp->args[0].kind != OPND_SYM)
+        return false;
+
+    AsmInsn *label = next_insn(jmp);
+    if (!is_label(label) || strcmp(insn->args[0].sym, label->args[0].sym))
+        return false;
+
+    insn->cc ^= 1;
+    insn->args[0] = jmp->args[0];
+    delete_insn(list, jmp);
+    return true;
+}
+
+// An immediate added to an address that has just been computed.
+//
+//   lea -16(%rbp), %rax          lea -8(%rbp), %rax
+//   add $8, %rax           =>
+static bool lea_add(AsmList *list, AsmInsn *insn) {
+    if (insn->op != AS_LEA || !is_reg64(&insn->args[1]) || insn->args[0].sym)
+        return false;
+
+    AsmInsn *add = next_insn(insn);
+    if (!is_op(add, AS_ADD) || add->args[0].kind != OPND_IMM || add->args[0].sym ||
+        !same_operand(&add->args[1], &insn->args[1]))
+        return false;
+
+    long val = insn->args[0].val + add->args[0].val;
+    if (val != (int)val)
+        return false;
+
+    insn->args[0].val = val;
+    delete_insn(list, add);
+    return true;
+}
+
+typedef struct {
+    char *name;
+    bool (*apply)(AsmList *list, AsmInsn *insn);
+} PeepholeRule;
+
+static PeepholeRule rules[] = {
+    {"self-move", self_move},
+    {"move-back", move_back},
+    {"push-pop", push_pop},
+    {"branch-on-flags", branch_on_flags},
+    {"dead-boolean", dead_boolean},
+    {"jump-to-next", jump_to_next},
+    {"branch-over-jump", branch_over_jump},
+    {"lea-add", lea_add},
+};
+
+// The longest sequence that a rule matches
+#define MAX_WINDOW 4
+
+void peephole(AsmList *list) {
+    for (AsmInsn *insn = list->head; insn;) {
+        AsmInsn *prev = insn->prev;
+        bool changed = false;
+        for (int i = 0; i < sizeof(rules) / sizeof(*rules); i++) {
+            if (rules[i].apply(list, insn)) {
+                changed = true;
+                break;
+            }
+        }
+
+        if (!changed) {
+            insn = insn->next;
+            continue;
+        }
+
+        // A rewrite may complete a sequence that starts a few
+        // instructions earlier, so go back and try again there.
+        for (int i = 0; i < MAX_WINDOW - 1 && prev && prev->prev; i++)
+            prev = prev->prev;
+        insn = prev ? prev : list->head;
+    }
+}
+
+static void format_operand(char *buf, int len, AsmInsn *insn, AsmOperand *opnd) {
+    switch (opnd->kind) {
+    case OPND_REG: {
+        char *name = opnd->size == 1 ? reg8[opnd->reg] : opnd->size == 2 ? reg16[opnd->reg] :
+                     opnd->size == 4 ? reg32[opnd->reg] : reg64[opnd->reg];
+        // An indirect call
+        snprintf(buf, len, "%s%s", insn->op == AS_CALL ? "*" : "", name);
+        return;
+    }
+    case OPND_XMM:
+        snprintf(buf, len, "%%xmm%d", opnd->reg);
+        return;
+    case OPND_IMM:
+        if (opnd->sym)
+            snprintf(buf, len, "$%s", opnd->sym);
+        else
+            snprintf(buf, len, "$%ld", opnd->val);
+        return;
+    case OPND_MEM:
+        if (opnd->sym)
+            snprintf(buf, len, "%s(%s)", opnd->sym, reg64[opnd->reg]);
+        else if (opnd->val)
+            snprintf(buf, len, "%ld(%s)", opnd->val, reg64[opnd->reg]);
+        else
+            snprintf(buf, len, "(%s)", reg64[opnd->reg]);
+        return;
+    case OPND_SYM:
+        break;
+    }
+    snprintf(buf, len, "%s", opnd->sym);
+}
+
+void print_insn(Context *ctx, AsmInsn *insn) {
+    if (insn->op == AS_LABEL) {
+        println(ctx, "%s:", insn->args[0].sym);
+        return;
+    }
+    if (insn->op == AS_LOC) {
+        println(ctx, "  .loc %ld %ld", insn->args[0].val, insn->args[1].val);
+        return;
+    }
+
+    char *name = op_names[insn->op];
+    char *cc = (insn->op == AS_SET || insn->op == AS_JCC) ? cond_names[insn->cc] : "";
+    if (insn->nargs == 0) {
+        println(ctx, "  %s", name);
+        return;
+    }
+
+    char arg0[256];
+    format_operand(arg0, sizeof(arg0), insn, &insn->args[0]);
+    if (insn->nargs == 1) {
+        println(ctx, "  %s%s %s", name, cc, arg0);
+        return;
+    }
+
+    char arg1[256];
+    format_operand(arg1, sizeof(arg1), insn, &insn->args[1]);
+    println(ctx, "  %s%s %s, %s", name, cc, arg0, arg1);
+}
+
+void print_asm(Context *ctx, AsmList *list) {
+    for (AsmInsn *insn = list->head; insn; insn = insn->next)
+        print_insn(ctx, insn);
+}
@@ -32,22 +32,20 @@ struct MacroArg {
     Token *tok;
 };
 
-typedef Token *macro_handler_fn(Token *);
+typedef Token *macro_handler_fn(Context *, Token *);
 
-typedef struct Macro Macro;
 struct Macro {
     Macro *next;
     char *name;
     bool is_objlike;    // Object-like or function-like
     MacroParam *params;
-    bool is_variadic;
+    char *va_args_name; // Name of variable arguments, or NULL if not variadic
     Token *body;
     bool deleted;
     macro_handler_fn *handler;
 };
 
 // `#if` can be nested, so we use a stack to manage nested `#if`s.
-typedef struct CondIncl CondIncl;
 struct CondIncl {
     CondIncl *next; 
     enum { IN_THEN, IN_ELIF, IN_ELSE } ctx;
@@ -61,11 +59,37 @@ struct Hideset {
     char *name;
 };
 
-static Macro *macros;
-static CondIncl *cond_incl;
+// With -ftrace or -H, an included header is a span from the #include
+// until the preprocessor reaches the token after the header's tokens.
+struct IncludeSpan {
+    IncludeSpan *next;
+    char *path;
+    IncludeStat *stat;
+    Token *end;
+    double start;
+};
+
+// -H reports, for each file included, what it cost to include it.
+// Times are in microseconds and include the headers it includes.
+struct IncludeStat {
+    IncludeStat *next;
+    char *path;
+    int depth;          // Include depth when first requested
+    long bytes;
+    long tokens;        // Tokens read, over all requests
+    double lex_time;    // Time reading and tokenizing
+    double pp_time;     // Time from the #include to the end of the file
+    int count;          // Number of times requested
+    int guarded;        // Number of times its include guard skipped it
+};
 
-static Token *preprocess2(Token *tok);
-static Macro *find_macro(Token *tok);
+// Macro expansions are many and mostly short, so only those that take
+// at least this many microseconds are traced.
+#define MACRO_TRACE_MIN_US 20
+
+static Token *preprocess2(Context *ctx, Token *tok);
+static Macro *find_macro(Context *ctx, Token *tok);
+static Token *apply_macro(Context *ctx, Token *tok, Macro *m);
 
 static bool is_hash(Token *tok) {
     return tok->at_bol && equal(tok, "#");
@@ -211,9 +235,9 @@ static char *quote_string(char *str) {
     return buf;
 }
 
-static Token *new_str_token(char *str, Token *tmpl) {
+static Token *new_str_token(Context *ctx, char *str, Token *tmpl) {
     char *buf = quote_string(str);
-    return tokenize(tmpl->filename, tmpl->file_no, buf);
+    return tokenize(ctx, tmpl->filename, tmpl->file_no, buf);
 }
 
 // Copy all tokens until the next newline, terminate them with
@@ -231,13 +255,13 @@ static Token *copy_line(Token **rest, Token *tok) {
     return head.next;
 }
 
-static Token *new_num_token(int val, Token *tmpl) {
+static Token *new_num_token(Context *ctx, int val, Token *tmpl) {
     char *buf = calloc(1, 30);
     sprintf(buf, "%d\n", val);
-    return tokenize(tmpl->filename, tmpl->file_no, buf);
+    return tokenize(ctx, tmpl->filename, tmpl->file_no, buf);
 }
 
-static Token *read_const_expr(Token **rest, Token *tok) {
+static Token *read_const_expr(Context *ctx, Token **rest, Token *tok) {
     tok = copy_line(rest, tok);
 
     Token head = {};
@@ -252,13 +276,13 @@ static Token *read_const_expr(Token **rest, Token *tok) {
 
             if (tok->kind != TK_IDENT)
                 error_tok(start, "macro name must be an identifier");
-            Macro *m = find_macro(tok);
+            Macro *m = find_macro(ctx, tok);
             tok = tok->next;
 
             if (has_paren)
                 tok = skip(tok, ")");
 
-            cur = cur->next = new_num_token(m ? 1 : 0, start);
+            cur = cur->next = new_num_token(ctx, m ? 1 : 0, start);
             continue;
         }
 
@@ -271,16 +295,16 @@ static Token *read_const_expr(Token **rest, Token *tok) {
 }
 
 // Read and evaluate a constant expression.
-static long eval_const_expr(Token **rest, Token *tok) {
-    Token *expr = read_const_expr(rest, tok);
-    expr = preprocess2(expr);
+static long eval_const_expr(Context *ctx, Token **rest, Token *tok) {
+    Token *expr = read_const_expr(ctx, rest, tok);
+    expr = preprocess2(ctx, expr);
 
     // The standard requires we replace remaining non-macro
     // identifiers with "0" before evaluating a constant expression.
     for (Token *t = expr; t->kind != TK_EOF; t = t->next) {
         if (t->kind == TK_IDENT) {
             Token *next = t->next;
-            *t = *new_num_token(0, t);
+            *t = *new_num_token(ctx, 0, t);
             t->next = next;
         }
     }
@@ -289,43 +313,43 @@ static long eval_const_expr(Token **rest, Token *tok) {
     convert_pp_tokens(expr);
 
     Token *rest2;
-    long val = const_expr(&rest2, expr);
+    long val = const_expr(ctx, &rest2, expr);
     if (rest2->kind != TK_EOF)
         error_tok(rest2, "extra token");
     return val;
 }
 
-static CondIncl *push_cond_incl(Token *tok, bool included) {
+static CondIncl *push_cond_incl(Context *ctx, Token *tok, bool included) {
     CondIncl *ci = calloc(1, sizeof(CondIncl));
-    ci->next = cond_incl;
+    ci->next = ctx->cond_incl;
     ci->ctx = IN_THEN;
     ci->tok = tok;
     ci->included = included;
-    cond_incl = ci;
+    ctx->cond_incl = ci;
     return ci;
 }
 
-static Macro *find_macro(Token *tok) {
+static Macro *find_macro(Context *ctx, Token *tok) {
     if (tok->kind != TK_IDENT)
         return NULL;
 
-    for (Macro *m = macros; m; m = m->next)
+    for (Macro *m = ctx->macros; m; m = m->next)
         if (strlen(m->name) == tok->len && !strncmp(m->name, tok->loc, tok->len))
             return m->deleted ? NULL : m;
     return NULL;
 }
 
-static Macro *add_macro(char *name, bool is_objlike, Token *body) {
+static Macro *add_macro(Context *ctx, char *name, bool is_objlike, Token *body) {
     Macro *m = calloc(1, sizeof(Macro));
-    m->next = macros;
+    m->next = ctx->macros;
     m->name = name;
     m->is_objlike = is_objlike;
     m->body = body;
-    macros = m;
+    ctx->macros = m;
     return m;
 }
 
-static MacroParam *read_macro_params(Token **rest, Token *tok, bool *is_variadic) {
+static MacroParam *read_macro_params(Token **rest, Token *tok, char **va_args_name) {
     MacroParam head = {};
     MacroParam *cur = &head;
 
@@ -334,7 +358,7 @@ static MacroParam *read_macro_params(Token **rest, Token *tok, bool *is_variadic
             tok = skip(tok, ",");
 
         if (equal(tok, "...")) {
-            *is_variadic = true;
+            *va_args_name = "__VA_ARGS__";
             tok = tok->next;
             skip(tok, ")");
             break;
@@ -342,6 +366,15 @@ static MacroParam *read_macro_params(Token **rest, Token *tok, bool *is_variadic
 
         if (tok->kind != TK_IDENT)
             error_tok(tok, "expected an identifier");
+
+        // GNU extension: a named variadic parameter such as `args...`.
+        if (equal(tok->next, "...")) {
+            *va_args_name = strndup(tok->loc, tok->len);
+            tok = tok->next->next;
+            skip(tok, ")");
+            break;
+        }
+
         MacroParam *m = calloc(1, sizeof(MacroParam));
         m->name = strndup(tok->loc, tok->len);
         cur = cur->next = m;
@@ -352,7 +385,7 @@ static MacroParam *read_macro_params(Token **rest, Token *tok, bool *is_variadic
     return head.next;
 }
 
-static void read_macro_definition(Token **rest, Token *tok) {
+static void read_macro_definition(Context *ctx, Token **rest, Token *tok) {
     if (tok->kind != TK_IDENT)
         error_tok(tok, "macro name must be an identifier");
     char *name = strndup(tok->loc, tok->len);
@@ -360,15 +393,15 @@ static void read_macro_definition(Token **rest, Token *tok) {
 
     if (!tok->has_space && equal(tok, "(")) {
         // Function-like macro
-        bool is_variadic = false;
-        MacroParam *params = read_macro_params(&tok, tok->next, &is_variadic);
+        char *va_args_name = NULL;
+        MacroParam *params = read_macro_params(&tok, tok->next, &va_args_name);
 
-        Macro *m = add_macro(name, false, copy_line(rest, tok));
+        Macro *m = add_macro(ctx, name, false, copy_line(rest, tok));
         m->params = params;
-        m->is_variadic = is_variadic;
+        m->va_args_name = va_args_name;
     } else {
         // Object-like macro
-        add_macro(name, true, copy_line(rest, tok));
+        add_macro(ctx, name, true, copy_line(rest, tok));
     }
 }
 
@@ -404,7 +437,7 @@ static MacroArg *read_macro_arg_one(Token **rest, Token *tok, bool read_rest) {
 }
 
 static MacroArg *
-read_macro_args(Token **rest, Token *tok, MacroParam *params, bool is_variadic) {
+read_macro_args(Token **rest, Token *tok, MacroParam *params, char *va_args_name) {
     Token *start = tok;
     tok = tok->next->next;
 
@@ -419,11 +452,11 @@ read_macro_args(Token **rest, Token *tok, MacroParam *params, bool is_variadic)
         cur->name = pp->name;
     }
 
-    if (is_variadic) {
+    if (va_args_name) {
         if (pp != params)
             tok = skip(tok, ",");
         cur = cur->next = read_macro_arg_one(&tok, tok, true);
-        cur->name = "__VA_ARGS__";
+        cur->name = va_args_name;
     } else if (pp) {
         error_tok(start, "too many arguments");
     }
@@ -466,29 +499,29 @@ static char *join_tokens(Token *tok, Token *end) {
 
 // Concatenates all tokens in `arg` and returns a new string token.
 // This function is used for the stringizing operator (#).
-static Token *stringize(Token *hash, Token *arg) {
+static Token *stringize(Context *ctx, Token *hash, Token *arg) {
     // Create a new string token. We neet to set some value to its
     // source location for error reporting function, so we use a macro
     // name token as a template.
     char *s = join_tokens(arg, NULL);
-    return new_str_token(s, hash);
+    return new_str_token(ctx, s, hash);
 }
 
 // Concatenate two tokens to create a new token.
-static Token *paste(Token *lhs, Token *rhs) {
+static Token *paste(Context *ctx, Token *lhs, Token *rhs) {
     // Paste the two tokens.
     char *buf = calloc(1, lhs->len + rhs->len + 1);
     sprintf(buf, "%.*s%.*s", lhs->len, lhs->loc, rhs->len, rhs->loc);
 
     // Tokenize the resulting string.
-    Token *tok = tokenize(lhs->filename, lhs->file_no, buf);
+    Token *tok = tokenize(ctx, lhs->filename, lhs->file_no, buf);
     if (tok->next->kind != TK_EOF)
         error_tok(lhs, "pasting forms '%s', an invalid token", buf);
     return tok;
 }
 
 // Replace func-like macro paramters with given arguments.
-static Token *subst(Token *tok, MacroArg *args) {
+static Token *subst(Context *ctx, Token *tok, MacroArg *args) {
     Token head = {};
     Token *cur = &head;
 
@@ -498,7 +531,7 @@ static Token *subst(Token *tok, MacroArg *args) {
             Token *arg = find_arg(args, tok->next);
             if (!arg)
                 error_tok(tok->next, "'#' is not followed by a macro paramter");
-            cur = cur->next = stringize(tok, arg);
+            cur = cur->next = stringize(ctx, tok, arg);
             tok = tok->next->next;
             continue;
         }
@@ -530,11 +563,11 @@ static Token *subst(Token *tok, MacroArg *args) {
             }
 
             if (rhs) {
-                *cur = *paste(cur, rhs);
+                *cur = *paste(ctx, cur, rhs);
                 for (Token *t = rhs->next; t->kind != TK_EOF; t = t->next)
                     cur = cur->next = copy_token(t);
             } else {
-                *cur = *paste(cur, y);
+                *cur = *paste(ctx, cur, y);
             }
 
             tok = y->next;
@@ -549,11 +582,11 @@ static Token *subst(Token *tok, MacroArg *args) {
                 }
 
                 if (rhs) {
-                    *cur = *paste(cur, rhs);
+                    *cur = *paste(ctx, cur, rhs);
                     for (Token *t = rhs->next; t->kind != TK_EOF; t = t->next)
                         cur = cur->next = copy_token(t);
                 } else {
-                    *cur = *paste(cur, r);
+                    *cur = *paste(ctx, cur, r);
                 }
                 tok = r->next;
             }
@@ -565,7 +598,7 @@ static Token *subst(Token *tok, MacroArg *args) {
         // before they are substituted into a macro body.
         Token *arg = find_arg(args, tok);
         if (arg) {
-            arg = preprocess2(arg);
+            arg = preprocess2(ctx, arg);
             for (Token *t = arg; t->kind != TK_EOF; t = t->next)
                 cur = cur->next = copy_token(t);
             tok = tok->next;
@@ -584,37 +617,48 @@ static Token *subst(Token *tok, MacroArg *args) {
 
 // If tok is a macro, expand it and return true.
 // Otherwise, do nothing and return false.
-static bool expand_macro(Token **rest, Token *tok) {
+static bool expand_macro(Context *ctx, Token **rest, Token *tok) {
     if (hideset_contains(tok->hideset, tok->loc, tok->len))
         return false;
 
-    Macro *m = find_macro(tok);
+    Macro *m = find_macro(ctx, tok);
     if (!m)
         return false;
 
+    // If a funclike macro token is not followed by an argument list.
+    // treat if as a normal identifier.
+    if (!m->handler && !m->is_objlike && !equal(tok->next, "("))
+        return false;
+
+    Phase prev = enter_phase(ctx, PHASE_MACRO);
+    double start = trace_now(ctx);
+    *rest = apply_macro(ctx, tok, m);
+    if (ctx->trace && trace_now(ctx) - start >= MACRO_TRACE_MIN_US)
+        trace_span(ctx, "macro", m->name, start);
+    enter_phase(ctx, prev);
+    return true;
+}
+
+// Expands a macro and returns the resulting token list followed by
+// the tokens after the macro invocation.
+static Token *apply_macro(Context *ctx, Token *tok, Macro *m) {
     // Built-in dynamic macro application such as __LINE__
     if (m->handler) {
-        *rest = m->handler(tok);
-        (*rest)->next = tok->next;
-        return true;
+        Token *t = m->handler(ctx, tok);
+        t->next = tok->next;
+        return t;
     }
 
     // Object-like macro application
     if (m->is_objlike) {
         Hideset *hs = hideset_union(tok->hideset, new_hideset(m->name));
         Token *body = add_hideset(m->body, hs);
-        *rest = append(body, tok->next);
-        return true;
+        return append(body, tok->next);
     }
 
-    // If a funclike macro token is not followed by an argument list.
-    // treat if as a normal identifier.
-    if (!equal(tok->next, "("))
-        return false;
-
     // Function-like macro application
     Token *macro_token = tok;
-    MacroArg *args = read_macro_args(&tok, tok, m->params, m->is_variadic);
+    MacroArg *args = read_macro_args(&tok, tok, m->params, m->va_args_name);
     Token *rparen = tok;
 
     // Tokens that consist a func-like macro invocation may have different
@@ -625,10 +669,75 @@ static bool expand_macro(Token **rest, Token *tok) {
     Hideset *hs = hideset_intersection(macro_token->hideset, rparen->hideset);
     hs = hideset_union(hs, new_hideset(m->name));
 
-    Token *body = subst(m->body, args);
+    Token *body = subst(ctx, m->body, args);
     body = add_hideset(body, hs);
-    *rest = append(body, tok->next);
-    return true;
+    return append(body, tok->next);
+}
+
+// If the whole file is in `#ifndef NAME ... #endif`, returns NAME.
+static Token *include_guard(Token *tok) {
+    if (!is_hash(tok) || !equal(tok->next, "ifndef") || tok->next->next->kind != TK_IDENT)
+        return NULL;
+    Token *name = tok->next->next;
+    tok = skip_cond_incl(name->next);
+    if (tok->kind == TK_EOF || !equal(tok->next, "endif") || tok->next->next->kind != TK_EOF)
+        return NULL;
+    return name;
+}
+
+static IncludeStat *find_include_stat(Context *ctx, char *path) {
+    IncludeStat head = {};
+    head.next = ctx->include_stats;
+    IncludeStat *cur = &head;
+    for (; cur->next; cur = cur->next)
+        if (!strcmp(cur->next->path, path))
+            return cur->next;
+
+    // Files are listed in the order in which they are first included.
+    IncludeStat *stat = calloc(1, sizeof(IncludeStat));
+    stat->path = path;
+    cur->next = stat;
+    ctx->include_stats = head.next;
+    return stat;
+}
+
+static void push_include_span(Context *ctx, char *path, Token *tok, Token *end,
+                              double start, double lex_time) {
+    IncludeSpan *span = calloc(1, sizeof(IncludeSpan));
+    span->next = ctx->include_span;
+    span->path = path;
+    span->end = end;
+    span->start = start;
+
+    if (ctx->opt_H) {
+        IncludeStat *stat = find_include_stat(ctx, path);
+        if (stat->count++ == 0) {
+            stat->depth = 1;
+            for (IncludeSpan *s = ctx->include_span; s; s = s->next)
+                stat->depth++;
+            stat->bytes = tok->input ? strlen(tok->input) : 0;
+        }
+        stat->lex_time += lex_time;
+
+        Token *guard = include_guard(tok);
+        if (guard && find_macro(ctx, guard))
+            stat->guarded++;
+
+        for (; tok->kind != TK_EOF; tok = tok->next)
+            stat->tokens++;
+        span->stat = stat;
+    }
+
+    ctx->include_span = span;
+}
+
+static void pop_include_span(Context *ctx) {
+    IncludeSpan *span = ctx->include_span;
+    if (ctx->trace)
+        trace_span(ctx, "include", span->path, span->start);
+    if (span->stat)
+        span->stat->pp_time += now_us() - span->start;
+    ctx->include_span = span->next;
 }
 
 // Returns a new string "dir/file".
@@ -644,18 +753,90 @@ static bool file_exists(char *path) {
     return !stat(path, &st);
 }
 
-static char *search_include_paths(char *filename, Token *start) {
+// A resolved include path is valid only for the same working directory
+// and the same list of include paths, which `key` represents.
+struct CachedPath {
+    CachedPath *next;
+    char *key;
+    char *filename;
+    char *path;
+};
+
+static char *search_key(Context *ctx) {
+    if (ctx->search_key)
+        return ctx->search_key;
+
+    char *cwd = getcwd(NULL, 0);
+    int len = strlen(cwd ? cwd : "") + 1;
+    for (char **p = ctx->include_paths; *p; p++)
+        len += strlen(*p) + 1;
+
+    char *buf = calloc(1, len);
+    strcat(buf, cwd ? cwd : "");
+    for (char **p = ctx->include_paths; *p; p++) {
+        strcat(buf, "\t");
+        strcat(buf, *p);
+    }
+    free(cwd);
+    ctx->search_key = buf;
+    return buf;
+}
+
+void add_cached_path(SharedCache *cache, char *key, char *filename, char *path) {
+    CachedPath *cp = calloc(1, sizeof(CachedPath));
+    cp->key = key;
+    cp->filename = filename;
+    cp->path = path;
+
+    pthread_mutex_lock(&cache->mu);
+    cp->next = cache->paths;
+    cache->paths = cp;
+    if (cache->log)
+        fprintf(cache->log, "I\t%s\t%s\t%s\n", filename, path, key);
+    pthread_mutex_unlock(&cache->mu);
+}
+
+// A file found before may have been removed since, or a file of the
+// same name may have been created in a directory that is searched
+// earlier. In either case, the search has to be done again.
+static bool is_valid_path(Context *ctx, CachedPath *cp) {
+    for (char **p = ctx->include_paths; *p; p++) {
+        char *path = join_paths(*p, cp->filename);
+        bool same = !strcmp(path, cp->path);
+        bool exists = file_exists(path);
+        free(path);
+        if (same || exists)
+            return same && exists;
+    }
+    return false;
+}
+
+static char *search_include_paths(Context *ctx, char *filename, Token *start) {
+    // The same headers are included over and over again, so we remember
+    // where we found them.
+    SharedCache *cache = ctx->cache;
+    char *key = search_key(ctx);
+    pthread_mutex_lock(&cache->mu);
+    CachedPath *cp = cache->paths;
+    while (cp && (strcmp(cp->filename, filename) || strcmp(cp->key, key)))
+        cp = cp->next;
+    pthread_mutex_unlock(&cache->mu);
+    if (cp && is_valid_path(ctx, cp))
+        return cp->path;
+
     // Search a file from the include paths.
-    for (char **p = include_paths; *p; p++) {
+    for (char **p = ctx->include_paths; *p; p++) {
         char *path = join_paths(*p, filename);
-        if (file_exists(path))
-            return path;
+        if (!file_exists(path))
+            continue;
+        add_cached_path(cache, key, filename, path);
+        return path;
     }
     error_tok(start, "'%s': file not found", filename);
 }
 
 // Read an #include argument.
-static char *read_include_path(Token **rest, Token *tok) {
+static char *read_include_path(Context *ctx, Token **rest, Token *tok) {
     // Pattern 1: #include "foo.h"
     if (tok->kind == TK_STR) {
         // A double-quoted filename for #include is a special kind of
@@ -669,7 +850,7 @@ static char *read_include_path(Token **rest, Token *tok) {
 
         if (file_exists(filename))
             return filename;
-        return search_include_paths(filename, start);
+        return search_include_paths(ctx, filename, start);
     }
 
     // Pattern 2: #include <foo.h>
@@ -685,29 +866,93 @@ static char *read_include_path(Token **rest, Token *tok) {
 
         char *filename = join_tokens(start->next, tok);
         *rest = skip_line(tok->next);
-        return search_include_paths(filename, start);
+        return search_include_paths(ctx, filename, start);
     }
 
     // Pattern 3: #include FOO
     // In this case FOO must be macro-expanded to either
     // a single string token or a sequence of "<" ... ">".
     if (tok->kind == TK_IDENT) {
-        Token *tok2 = preprocess(copy_line(rest, tok));
-        return read_include_path(&tok2, tok2);
+        Token *tok2 = preprocess(ctx, copy_line(rest, tok));
+        return read_include_path(ctx, &tok2, tok2);
     }
 
     error_tok(tok, "expected a filename");
 }
 
+static bool is_line_marker(Token *tok) {
+    return is_hash(tok) &&
+           (equal(tok->next, "line") ||
+            (tok->next->kind == TK_PP_NUM && !tok->next->at_bol));
+}
+
+// Read a #line directive or a GNU linemarker such as `# 12 "foo.c" 1`,
+// which -E output contains. `start` is the "#" token. It renumbers the
+// following lines of the same file, and renames them if a filename is
+// given, until the next such directive.
+static Token *read_line_marker(Context *ctx, Token *start, Token *tok) {
+    if (equal(tok, "line"))
+        tok = tok->next;
+
+    char *end;
+    long line_no = strtol(tok->loc, &end, 10);
+    if (tok->kind != TK_PP_NUM || tok->at_bol || end != tok->loc + tok->len)
+        error_tok(tok, "invalid line number");
+    tok = tok->next;
+
+    char *filename = start->filename;
+    int file_no = start->file_no;
+    if (tok->kind == TK_STR && !tok->at_bol) {
+        filename = tok->str;
+        tok = tok->next;
+
+        // A marker at the beginning of the main file names the main
+        // file itself, so that the file doesn't appear twice in .file
+        // directives.
+        char **paths = get_input_files(ctx);
+        file_no = 0;
+        if (start->file_no == 1 && start->loc == start->input) {
+            paths[0] = filename;
+            file_no = 1;
+        }
+        for (int i = 0; !file_no && paths[i]; i++)
+            if (!strcmp(paths[i], filename))
+                file_no = i + 1;
+        if (!file_no)
+            file_no = add_input_file(ctx, filename);
+    }
+
+    // Ignore the flags of a linemarker.
+    while (!tok->at_bol && tok->kind != TK_EOF)
+        tok = tok->next;
+
+    int delta = line_no - (start->line_no + 1);
+    // The "#" of the next directive gets the filename too, because a
+    // #line without a filename keeps the current one. It keeps its line
+    // number, from which the next directive computes its own delta.
+    for (Token *t = tok; t->kind != TK_EOF && t->input == start->input; t = t->next) {
+        t->filename = filename;
+        t->file_no = file_no;
+        if (is_line_marker(t))
+            break;
+        t->line_no += delta;
+    }
+    return tok;
+}
+
 // Visit all tokens in `tok` while evaluating preprocessing
 // macros and directives.
-static Token *preprocess2(Token *tok) {
+static Token *preprocess2(Context *ctx, Token *tok) {
     Token head = {};
     Token *cur = &head;
 
     while (tok->kind != TK_EOF) {
+        // End the spans of headers whose tokens we have gone past.
+        while (ctx->include_span && tok == ctx->include_span->end)
+            pop_include_span(ctx);
+
         // If it is a macro, expand it.
-        if (expand_macro(&tok, tok))
+        if (!ctx->opt_fpreprocessed && expand_macro(ctx, &tok, tok))
             continue;
 
         // Pass through if it not a "#"
@@ -720,17 +965,38 @@ static Token *preprocess2(Token *tok) {
         Token *start = tok;
         tok = tok->next;
 
+        // Preprocessed input may come from another machine. Only its
+        // linemarkers are processed, so that it can't make us read files.
+        if (ctx->opt_fpreprocessed) {
+            if (!is_line_marker(start))
+                error_tok(start, "invalid preprocessing directive in preprocessed input");
+            tok = read_line_marker(ctx, start, tok);
+            continue;
+        }
+
         if (equal(tok, "include")) {
-            char *path = read_include_path(&tok, tok->next);
-            Token *tok2 = tokenize_file(path);
+            Phase prev = enter_phase(ctx, PHASE_INCLUDE);
+            bool measure = ctx->trace || ctx->opt_H;
+            double start = measure ? now_us() : 0;
+            char *path = read_include_path(ctx, &tok, tok->next);
+            double lex_start = measure ? now_us() : 0;
+            Token *tok2 = tokenize_file(ctx, path);
             if (!tok2)
                 error_tok(tok, "%s", strerror(errno));
+            if (measure)
+                push_include_span(ctx, path, tok2, tok, start, now_us() - lex_start);
             tok = append(tok2, tok);
+            enter_phase(ctx, prev);
             continue;
         }
 
         if (equal(tok, "define")) {
-            read_macro_definition(&tok, tok->next);
+            read_macro_definition(ctx, &tok, tok->next);
+            continue;
+        }
+
+        if (is_line_marker(start)) {
+            tok = read_line_marker(ctx, start, tok);
             continue;
         }
 
@@ -741,65 +1007,77 @@ static Token *preprocess2(Token *tok) {
             char *name = strndup(tok->loc, tok->len);
             tok = skip_line(tok->next);
 
-            Macro *m = add_macro(name, true, NULL);
+            Macro *m = add_macro(ctx, name, true, NULL);
             m->deleted = true;
             continue;
         }
 
         if (equal(tok, "if")) {
-            long val = eval_const_expr(&tok, tok->next);
-            push_cond_incl(start, val);
+            Phase prev = enter_phase(ctx, PHASE_COND);
+            long val = eval_const_expr(ctx, &tok, tok->next);
+            push_cond_incl(ctx, start, val);
             if (!val)
                 tok = skip_cond_incl(tok);
+            enter_phase(ctx, prev);
             continue;
         }
 
         if (equal(tok, "ifdef")) {
-            bool defined = find_macro(tok->next);
-            push_cond_incl(tok, defined);
+            Phase prev = enter_phase(ctx, PHASE_COND);
+            bool defined = find_macro(ctx, tok->next);
+            push_cond_incl(ctx, tok, defined);
             tok = skip_line(tok->next->next);
             if (!defined)
                 tok = skip_cond_incl(tok);
+            enter_phase(ctx, prev);
             continue;
         }
 
         if (equal(tok, "ifndef")) {
-            bool defined = find_macro(tok->next);
-            push_cond_incl(tok, !defined);
+            Phase prev = enter_phase(ctx, PHASE_COND);
+            bool defined = find_macro(ctx, tok->next);
+            push_cond_incl(ctx, tok, !defined);
             tok = skip_line(tok->next->next);
             if (defined)
                 tok = skip_cond_incl(tok);
+            enter_phase(ctx, prev);
             continue;
         }
 
         if (equal(tok, "elif")) {
-            if (!cond_incl || cond_incl->ctx == IN_ELSE)
+            Phase prev = enter_phase(ctx, PHASE_COND);
+            if (!ctx->cond_incl || ctx->cond_incl->ctx == IN_ELSE)
                 error_tok(start, "stray #elif");
-            cond_incl->ctx = IN_ELIF;
+            ctx->cond_incl->ctx = IN_ELIF;
 
-            if (!cond_incl->included && eval_const_expr(&tok, tok->next))
-                cond_incl->included = true;
+            if (!ctx->cond_incl->included && eval_const_expr(ctx, &tok, tok->next))
+                ctx->cond_incl->included = true;
             else
                 tok = skip_cond_incl(tok);
+            enter_phase(ctx, prev);
             continue;
         }
 
         if (equal(tok, "else")) {
-            if (!cond_incl || cond_incl->ctx == IN_ELSE)
+            Phase prev = enter_phase(ctx, PHASE_COND);
+            if (!ctx->cond_incl || ctx->cond_incl->ctx == IN_ELSE)
                 error_tok(start, "stray #else");
-            cond_incl->ctx = IN_ELSE;
+            ctx->cond_incl->ctx = IN_ELSE;
             tok = skip_line(tok->next);
 
-            if (cond_incl->included)
+            if (ctx->cond_incl->included)
                 tok = skip_cond_incl(tok);
+            enter_phase(ctx, prev);
             continue;
         }
 
         if (equal(tok, "endif")) {
-            if (!cond_incl)
+            Phase prev = enter_phase(ctx, PHASE_COND);
+            if (!ctx->cond_incl)
                 error_tok(start, "stray #endif");
-            cond_incl = cond_incl->next;
+            ctx->cond_incl = ctx->cond_incl->next;
             tok = skip_line(tok->next);
+            enter_phase(ctx, prev);
             continue;
         }
 
@@ -817,28 +1095,27 @@ static Token *preprocess2(Token *tok) {
     return head.next;
 }
 
-void define_macro(char *name, char *buf) {
-    Token *tok = tokenize("(internal)", 1, buf);
-    add_macro(name, true, tok);
+void define_macro(Context *ctx, char *name, char *buf) {
+    Token *tok = tokenize(ctx, "(internal)", 1, buf);
+    add_macro(ctx, name, true, tok);
 }
 
-static Macro *add_builtin(char *name, macro_handler_fn *fn) {
-    Macro *m = add_macro(name, true, NULL);
+static Macro *add_builtin(Context *ctx, char *name, macro_handler_fn *fn) {
+    Macro *m = add_macro(ctx, name, true, NULL);
     m->handler = fn;
     return m;
 }
 
-static Token *file_macro(Token *tmpl) {
-    return new_str_token(tmpl->filename, tmpl);
+static Token *file_macro(Context *ctx, Token *tmpl) {
+    return new_str_token(ctx, tmpl->filename, tmpl);
 }
 
-static Token *line_macro(Token *tmpl) {
-    return new_num_token(tmpl->line_no, tmpl);
+static Token *line_macro(Context *ctx, Token *tmpl) {
+    return new_num_token(ctx, tmpl->line_no, tmpl);
 }
 
-static Token *counter_macro(Token *tmpl) {
-    static int i = 0;
-    return new_num_token(i++, tmpl);
+static Token *counter_macro(Context *ctx, Token *tmpl) {
+    return new_num_token(ctx, ctx->counter++, tmpl);
 }
 
 // __DATE__ is expanded to the current date, e.g. "Jul 24 2020".
@@ -848,77 +1125,79 @@ static char *format_date(struct tm *tm) {
         "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
     };
 
-    static char buf[14];
+    char *buf = calloc(1, 30);
     sprintf(buf, "\"%s %2d %d\"", mon[tm->tm_mon], tm->tm_mday, tm->tm_year + 1900);
     return buf;
 }
 
 // __TIME__ is expanded to the current time, e.g. "02:09:35".
 static char *format_time(struct tm *tm) {
-    static char buf[11];
+    char *buf = calloc(1, 30);
     sprintf(buf, "\"%2d:%2d:%2d\"", tm->tm_hour, tm->tm_min, tm->tm_sec);
     return buf;
 }
 
-void init_macros(void) {
+void init_macros(Context *ctx) {
     // Define predefined macros
-    define_macro("__711cc__", "1");
-    define_macro("_LP64", "1");
-    define_macro("__ELF__", "1");
-    define_macro("__LP64__", "1");
-    define_macro("__SIZEOF_DOUBLE__", "8");
-    define_macro("__SIZEOF_FLOAT__", "4");
-    define_macro("__SIZEOF_INT__", "4");
-    define_macro("__SIZEOF_LONG_DOUBLE__", "8");
-    define_macro("__SIZEOF_LONG_LONG__", "8");
-    define_macro("__SIZEOF_LONG__", "8");
-    define_macro("__SIZEOF_POINTER__", "8");
-    define_macro("__SIZEOF_PTRDIFT_T__", "8");
-    define_macro("__SIZEOF_SHORT__", "2");
-    define_macro("__SIZEOF_SIZE_T__", "8");
-    define_macro("__STDC_HOSTED__", "1");
-    define_macro("__STDC_ISO_10646__", "201103L");
-    define_macro("__STDC_NO_ATOMICS__", "1");
-    define_macro("__STDC_NO_COMPLEX__", "1");
-    define_macro("__STDC_NO_THREADS__", "1");
-    define_macro("__STDC_NO_VLA__", "1");
-    define_macro("__STDC_UTF_16__", "1");
-    define_macro("__STDC_UTF_32__", "1");
-    define_macro("__STDC_VERSION__", "201112L");
-    define_macro("__STDC__", "1");
-    define_macro("__USER_LABEL_PREFIX__", "");
-    define_macro("__amd64", "1");
-    define_macro("__amd64__", "1");
-    define_macro("__gnu_linux__", "1");
-    define_macro("__linux", "1");
-    define_macro("__linux__", "1");
-    define_macro("__unix", "1");
-    define_macro("__unix__", "1");
-    define_macro("__x86_64", "1");
-    define_macro("__x86_64__", "1");
-    define_macro("linux", "1");
-    define_macro("__alignof__", "_Alignof");
-    define_macro("__const__", "const");
-    define_macro("__inline__", "inline");
-    define_macro("__restrict", "restrict");
-    define_macro("__restrict__", "restrict");
-    define_macro("__signed__", "signed");
-    define_macro("__typeof__", "typeof");
-    define_macro("__volatile__", "volatile");
-
-    add_builtin("__FILE__", file_macro);
-    add_builtin("__LINE__", line_macro);
-    add_builtin("__COUNTER__", counter_macro);
+    define_macro(ctx, "__711cc__", "1");
+    define_macro(ctx, "_LP64", "1");
+    define_macro(ctx, "__ELF__", "1");
+    define_macro(ctx, "__LP64__", "1");
+    define_macro(ctx, "__SIZEOF_DOUBLE__", "8");
+    define_macro(ctx, "__SIZEOF_FLOAT__", "4");
+    define_macro(ctx, "__SIZEOF_INT__", "4");
+    define_macro(ctx, "__SIZEOF_LONG_DOUBLE__", "8");
+    define_macro(ctx, "__SIZEOF_LONG_LONG__", "8");
+    define_macro(ctx, "__SIZEOF_LONG__", "8");
+    define_macro(ctx, "__SIZEOF_POINTER__", "8");
+    define_macro(ctx, "__SIZEOF_PTRDIFT_T__", "8");
+    define_macro(ctx, "__SIZEOF_SHORT__", "2");
+    define_macro(ctx, "__SIZEOF_SIZE_T__", "8");
+    define_macro(ctx, "__STDC_HOSTED__", "1");
+    define_macro(ctx, "__STDC_ISO_10646__", "201103L");
+    define_macro(ctx, "__STDC_NO_ATOMICS__", "1");
+    define_macro(ctx, "__STDC_NO_COMPLEX__", "1");
+    define_macro(ctx, "__STDC_NO_THREADS__", "1");
+    define_macro(ctx, "__STDC_NO_VLA__", "1");
+    define_macro(ctx, "__STDC_UTF_16__", "1");
+    define_macro(ctx, "__STDC_UTF_32__", "1");
+    define_macro(ctx, "__STDC_VERSION__", "201112L");
+    define_macro(ctx, "__STDC__", "1");
+    define_macro(ctx, "__USER_LABEL_PREFIX__", "");
+    define_macro(ctx, "__amd64", "1");
+    define_macro(ctx, "__amd64__", "1");
+    define_macro(ctx, "__gnu_linux__", "1");
+    define_macro(ctx, "__linux", "1");
+    define_macro(ctx, "__linux__", "1");
+    define_macro(ctx, "__unix", "1");
+    define_macro(ctx, "__unix__", "1");
+    define_macro(ctx, "__x86_64", "1");
+    define_macro(ctx, "__x86_64__", "1");
+    define_macro(ctx, "linux", "1");
+    define_macro(ctx, "__alignof__", "_Alignof");
+    define_macro(ctx, "__const__", "const");
+    define_macro(ctx, "__inline", "inline");
+    define_macro(ctx, "__inline__", "inline");
+    define_macro(ctx, "__restrict", "restrict");
+    define_macro(ctx, "__restrict__", "restrict");
+    define_macro(ctx, "__signed__", "signed");
+    define_macro(ctx, "__typeof__", "typeof");
+    define_macro(ctx, "__volatile__", "volatile");
+
+    add_builtin(ctx, "__FILE__", file_macro);
+    add_builtin(ctx, "__LINE__", line_macro);
+    add_builtin(ctx, "__COUNTER__", counter_macro);
 
     time_t now = time(NULL);
-    struct tm *tm = localtime(&now);
-    define_macro("__DATE__", format_date(tm));
-    define_macro("__TIME__", format_time(tm));
+    struct tm tm;
+    localtime_r(&now, &tm);
+    define_macro(ctx, "__DATE__", format_date(&tm));
+    define_macro(ctx, "__TIME__", format_time(&tm));
 }
 
 // Concatenate adjacent string literals into a single string literal
 // as per the C spec.
-static void join_adjacent_string_literals(Token *tok) {
+static void join_adjacent_string_literals(Context *ctx, Token *tok) {
     while (tok->kind != TK_EOF) {
         Token *tok2 = tok->next;
 
@@ -927,7 +1206,11 @@ static void join_adjacent_string_literals(Token *tok) {
             sprintf(buf, "\"%.*s%.*s\"",
                     tok->len - 2, tok->loc + 1,
                     tok2->len - 2, tok2->loc + 1);
-            *tok = *tokenize(tok->filename, tok->file_no, buf);
+            Token *t = tokenize(ctx, tok->filename, tok->file_no, buf);
+            t->line_no = tok->line_no;
+            t->at_bol = tok->at_bol;
+            t->has_space = tok->has_space;
+            *tok = *t;
             tok->next = tok2->next;
             continue;
         }
@@ -936,13 +1219,34 @@ static void join_adjacent_string_literals(Token *tok) {
     }
 }
 
+// Prints the statistics collected for -H. Like GCC's -H, the dots
+// before a filename show its include depth.
+void print_include_report(Context *ctx, FILE *out, char *filename) {
+    fprintf(out, "Include report for %s:\n", filename);
+    fprintf(out, "  %10s %10s %10s %10s %6s %8s  %s\n",
+            "bytes", "tokens", "lex (ms)", "pp (ms)", "count", "guarded", "file");
+
+    for (IncludeStat *stat = ctx->include_stats; stat; stat = stat->next) {
+        fprintf(out, "  %10ld %10ld %10.2f %10.2f %6d %8d  ", stat->bytes, stat->tokens,
+                stat->lex_time / 1000, stat->pp_time / 1000, stat->count, stat->guarded);
+        for (int i = 0; i < stat->depth; i++)
+            fputc('.', out);
+        fprintf(out, " %s\n", stat->path);
+    }
+}
+
 // Entry point function of the preprocessor.
-Token *preprocess(Token *tok) {
-    init_macros();
-    tok = preprocess2(tok);
-    if (cond_incl)
-        error_tok(cond_incl->tok, "unterminated conditional directive");
+Token *preprocess(Context *ctx, Token *tok) {
+    Phase prev = enter_phase(ctx, PHASE_PREPROCESS);
+    tok = preprocess2(ctx, tok);
+    while (ctx->include_span)
+        pop_include_span(ctx);
+    if (ctx->cond_incl)
+        error_tok(ctx->cond_incl->tok, "unterminated conditional directive");
+
+    enter_phase(ctx, PHASE_CONVERT);
     convert_pp_tokens(tok);
-    join_adjacent_string_literals(tok);
+    join_adjacent_string_literals(ctx, tok);
+    enter_phase(ctx, prev);
     return tok;
 }
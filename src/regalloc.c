@@ -0,0 +1,449 @@
+#include "711cc.h"
+
+// This file assigns machine registers to the virtual registers of a
+// function with linear scan, as in Poletto and Sarkar, "Linear Scan
+// Register Allocation".
+//
+// Instructions are numbered in layout order, and the live interval of
+// a register runs from its first definition to its last use, extended
+// over the blocks it is live through. Intervals are visited in the
+// order they start. An interval gets a free register if there is one.
+// Otherwise the interval that ends last, either the new one or one in
+// a register, is spilled to the stack for its whole lifetime.
+//
+// An interval that contains a call prefers a register that is preserved
+// across calls. If it gets one that is not, the register is saved and
+// restored around each call that the interval contains.
+
+typedef struct {
+    VReg *vreg;
+    int start;
+    int end;
+    bool across_call;
+    int hint;           // Parameter register to compute the value in, or -1
+} Interval;
+
+// Positions of the instructions that constrain register assignment
+typedef struct {
+    int *calls;         // Calls in increasing order
+    Insn **call_insns;
+    int ncalls;
+    int params_end;     // Position after the last parameter
+} Positions;
+
+// A constant or an address is recomputed at each use, so it needs
+// neither a register nor a stack slot.
+bool is_remat(VReg *reg) {
+    return reg->ndefs == 1 && (reg->def->kind == IR_IMM || reg->def->kind == IR_ADDR);
+}
+
+// Sets of the registers that live across blocks are bit vectors
+// indexed by Liveness.global.
+static bool set_has(unsigned long *set, int i) {
+    return (set[i / 64] >> (i % 64)) & 1;
+}
+
+static void set_add(unsigned long *set, int i) {
+    set[i / 64] |= 1UL << (i % 64);
+}
+
+typedef struct {
+    IRFunction *ir;
+    Interval **intervals;   // By register id
+    int *global;            // Index of a register that lives across blocks, or -1
+    VReg **globals;
+    int nglobals;
+} Liveness;
+
+static void extend(Liveness *l, VReg *reg, int pos) {
+    if (!reg || is_remat(reg))
+        return;
+
+    Interval *iv = l->intervals[reg->id];
+    if (!iv) {
+        iv = calloc(1, sizeof(Interval));
+        iv->vreg = reg;
+        iv->start = pos;
+        iv->end = pos;
+        iv->hint = -1;
+        l->intervals[reg->id] = iv;
+        return;
+    }
+    if (pos < iv->start)
+        iv->start = pos;
+    if (iv->end < pos)
+        iv->end = pos;
+}
+
+// Marks a register as living across blocks if it is read in a block
+// before the block defines it.
+static void find_global(Liveness *l, bool *defined, VReg *reg) {
+    if (!reg || is_remat(reg) || defined[reg->id] || l->global[reg->id] != -1)
+        return;
+    l->global[reg->id] = l->nglobals;
+    l->globals[l->nglobals++] = reg;
+}
+
+static void gen_kill(Liveness *l, unsigned long *gen, unsigned long *kill, VReg *reg, bool is_def) {
+    if (!reg || l->global[reg->id] == -1)
+        return;
+    int i = l->global[reg->id];
+    if (is_def)
+        set_add(kill, i);
+    else if (!set_has(kill, i))
+        set_add(gen, i);
+}
+
+// Computes the live intervals of a function.
+static Interval **build_intervals(IRFunction *ir, int *ninterval, Positions *p) {
+    Liveness l = {0};
+    l.ir = ir;
+    l.intervals = calloc(ir->nregs + 1, sizeof(Interval *));
+    l.global = calloc(ir->nregs + 1, sizeof(int));
+    l.globals = calloc(ir->nregs + 1, sizeof(VReg *));
+    for (int i = 0; i <= ir->nregs; i++)
+        l.global[i] = -1;
+
+    // Registers whose values flow between blocks. Most registers
+    // are temporaries of a single block and skip the data flow
+    // analysis below.
+    bool *defined = calloc(ir->nregs + 1, sizeof(bool));
+    for (int b = 0; b < ir->norder; b++) {
+        BasicBlock *bb = ir->order[b];
+        for (Insn *insn = bb->insns; insn; insn = insn->next) {
+            find_global(&l, defined, insn->lhs);
+            find_global(&l, defined, insn->rhs);
+            for (int i = 0; i < insn->nargs; i++)
+                find_global(&l, defined, insn->args[i]);
+            if (insn->dst)
+                defined[insn->dst->id] = true;
+        }
+        for (Insn *insn = bb->insns; insn; insn = insn->next)
+            if (insn->dst)
+                defined[insn->dst->id] = false;
+    }
+
+    // Backward data flow analysis of the live registers at the
+    // beginning and the end of each block
+    int n = ir->nblocks;
+    int words = (l.nglobals + 63) / 64;
+    unsigned long **gen = calloc(n, sizeof(unsigned long *));
+    unsigned long **kill = calloc(n, sizeof(unsigned long *));
+    unsigned long **live_in = calloc(n, sizeof(unsigned long *));
+    unsigned long **live_out = calloc(n, sizeof(unsigned long *));
+
+    for (int b = 0; b < ir->norder; b++) {
+        BasicBlock *bb = ir->order[b];
+        gen[bb->id] = calloc(words, sizeof(unsigned long));
+        kill[bb->id] = calloc(words, sizeof(unsigned long));
+        live_in[bb->id] = calloc(words, sizeof(unsigned long));
+        live_out[bb->id] = calloc(words, sizeof(unsigned long));
+
+        for (Insn *insn = bb->insns; insn; insn = insn->next) {
+            gen_kill(&l, gen[bb->id], kill[bb->id], insn->lhs, false);
+            gen_kill(&l, gen[bb->id], kill[bb->id], insn->rhs, false);
+            for (int i = 0; i < insn->nargs; i++)
+                gen_kill(&l, gen[bb->id], kill[bb->id], insn->args[i], false);
+            gen_kill(&l, gen[bb->id], kill[bb->id], insn->dst, true);
+        }
+    }
+
+    for (bool changed = true; changed && words;) {
+        changed = false;
+        for (int b = ir->norder - 1; b >= 0; b--) {
+            BasicBlock *bb = ir->order[b];
+            unsigned long *out = live_out[bb->id];
+            unsigned long *in = live_in[bb->id];
+
+            BasicBlock *succ[2];
+            int nsucc = successors(bb, succ);
+            for (int i = 0; i < nsucc; i++)
+                for (int w = 0; w < words; w++)
+                    out[w] |= live_in[succ[i]->id][w];
+
+            for (int w = 0; w < words; w++) {
+                unsigned long val = gen[bb->id][w] | (out[w] & ~kill[bb->id][w]);
+                if (val != in[w]) {
+                    in[w] = val;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Number the instructions in layout order and build intervals.
+    int pos = 0;
+    int cap = 16;
+    p->calls = calloc(cap, sizeof(int));
+    p->call_insns = calloc(cap, sizeof(Insn *));
+
+    for (BasicBlock *bb = ir->bbs; bb; bb = bb->next) {
+        int from = pos;
+        for (Insn *insn = bb->insns; insn; insn = insn->next) {
+            extend(&l, insn->lhs, pos);
+            extend(&l, insn->rhs, pos);
+            for (int i = 0; i < insn->nargs; i++)
+                extend(&l, insn->args[i], pos);
+            extend(&l, insn->dst, pos);
+
+            if (insn->kind == IR_CALL) {
+                if (p->ncalls == cap) {
+                    cap *= 2;
+                    p->calls = realloc(p->calls, sizeof(int) * cap);
+                    p->call_insns = realloc(p->call_insns, sizeof(Insn *) * cap);
+                }
+                p->calls[p->ncalls] = pos;
+                p->call_insns[p->ncalls++] = insn;
+            }
+            if (insn->kind == IR_PARAM)
+                p->params_end = pos + 1;
+            pos++;
+        }
+        int to = pos - 1;
+
+        for (int w = 0; w < words; w++) {
+            if (!live_in[bb->id][w] && !live_out[bb->id][w])
+                continue;
+            for (int i = w * 64; i < l.nglobals && i < w * 64 + 64; i++) {
+                if (set_has(live_in[bb->id], i))
+                    extend(&l, l.globals[i], from);
+                if (set_has(live_out[bb->id], i))
+                    extend(&l, l.globals[i], to);
+            }
+        }
+    }
+
+    Interval **intervals = calloc(ir->nregs + 1, sizeof(Interval *));
+    int cnt = 0;
+    for (int i = 0; i <= ir->nregs; i++)
+        if (l.intervals[i])
+            intervals[cnt++] = l.intervals[i];
+    *ninterval = cnt;
+    return intervals;
+}
+
+static int compare_start(const void *a, const void *b) {
+    Interval *x = *(Interval **)a;
+    Interval *y = *(Interval **)b;
+    if (x->start != y->start)
+        return x->start - y->start;
+    return x->vreg->id - y->vreg->id;
+}
+
+// Returns the index of the first call after the start of an interval.
+static int first_call(Interval *iv, Positions *p) {
+    int lo = 0, hi = p->ncalls;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (p->calls[mid] <= iv->start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Returns true if there is a call strictly inside an interval. A call
+// that reads or defines the register doesn't count, because arguments
+// are read before the call and the result is written after it.
+static bool crosses_call(Interval *iv, Positions *p) {
+    int i = first_call(iv, p);
+    return i < p->ncalls && p->calls[i] < iv->end;
+}
+
+// Records a register that a call clobbers while it holds a live value,
+// so that the backend saves it around the call.
+static void add_live(Insn *call, VReg *reg) {
+    if (call->nlive % 8 == 0)
+        call->live = realloc(call->live, sizeof(VReg *) * (call->nlive + 8));
+    call->live[call->nlive++] = reg;
+}
+
+// An argument that is computed only to be passed to a call, and that
+// isn't live across another call, is computed right in the register
+// that it is passed in instead of being moved there at the call.
+static void set_hints(IRFunction *ir, Interval **intervals, int n, Positions *p, RegSet *set) {
+    Interval **by_id = calloc(ir->nregs + 1, sizeof(Interval *));
+    for (int i = 0; i < n; i++)
+        by_id[intervals[i]->vreg->id] = intervals[i];
+
+    for (int i = 0; i < p->ncalls; i++) {
+        Insn *call = p->call_insns[i];
+        int gp = 0;
+        int fp = 0;
+
+        for (int j = 0; j < call->nargs; j++) {
+            VReg *arg = call->args[j];
+            int r = -1;
+            if (is_flonum(arg->ty)) {
+                if (fp < set->nfp_args)
+                    r = set->fp_args[fp];
+                fp++;
+            } else {
+                if (gp < set->ngp_args)
+                    r = set->gp_args[gp];
+                gp++;
+            }
+
+            // Incoming parameters are in these registers until the
+            // last of them is read.
+            Interval *iv = by_id[arg->id];
+            if (r == -1 || !iv || arg->nuses != 1 || iv->across_call ||
+                    iv->end != p->calls[i] || iv->start < p->params_end)
+                continue;
+            iv->hint = r;
+        }
+    }
+}
+
+typedef struct {
+    Interval **active;  // Intervals in registers
+    int nactive;
+    bool used[32];      // Registers in use
+} Allocator;
+
+static bool is_fp_interval(Interval *iv) {
+    return is_flonum(iv->vreg->ty);
+}
+
+static int find_free(Allocator *a, int *regs, int n) {
+    for (int i = 0; i < n; i++)
+        if (!a->used[regs[i]])
+            return regs[i];
+    return -1;
+}
+
+static bool contains(int *regs, int n, int r) {
+    for (int i = 0; i < n; i++)
+        if (regs[i] == r)
+            return true;
+    return false;
+}
+
+static void assign(Allocator *a, Interval *iv, int r) {
+    iv->vreg->reg = r;
+    a->used[r] = true;
+    a->active[a->nactive++] = iv;
+}
+
+void allocate_registers(IRFunction *ir, RegSet *set) {
+    build_cfg(ir);
+    count_defs(ir);
+
+    for (BasicBlock *bb = ir->bbs; bb; bb = bb->next) {
+        for (Insn *insn = bb->insns; insn; insn = insn->next) {
+            if (insn->dst)
+                insn->dst->reg = -1;
+            if (insn->lhs)
+                insn->lhs->reg = -1;
+            if (insn->rhs)
+                insn->rhs->reg = -1;
+            for (int i = 0; i < insn->nargs; i++)
+                insn->args[i]->reg = -1;
+            insn->nlive = 0;
+        }
+    }
+
+    int n;
+    Positions p = {0};
+    Interval **intervals = build_intervals(ir, &n, &p);
+    qsort(intervals, n, sizeof(Interval *), compare_start);
+    for (int i = 0; i < n; i++)
+        intervals[i]->across_call = crosses_call(intervals[i], &p);
+    set_hints(ir, intervals, n, &p, set);
+
+    // General-purpose registers, preferring those that don't have to
+    // be saved in the prologue, or for an interval that contains a
+    // call, those that don't have to be saved around the call
+    int ngp = set->ncaller_saved + set->ncallee_saved;
+    int *gp = calloc(ngp, sizeof(int));
+    int *gp_across_call = calloc(ngp, sizeof(int));
+    for (int i = 0; i < set->ncaller_saved; i++) {
+        gp[i] = set->caller_saved[i];
+        gp_across_call[set->ncallee_saved + i] = set->caller_saved[i];
+    }
+    for (int i = 0; i < set->ncallee_saved; i++) {
+        gp[set->ncaller_saved + i] = set->callee_saved[i];
+        gp_across_call[i] = set->callee_saved[i];
+    }
+
+    Allocator gp_alloc = {0};
+    Allocator fp_alloc = {0};
+    gp_alloc.active = calloc(ngp + set->ngp_args + 1, sizeof(Interval *));
+    fp_alloc.active = calloc(set->nfp + set->nfp_args + 1, sizeof(Interval *));
+
+    for (int i = 0; i < n; i++) {
+        Interval *cur = intervals[i];
+
+        bool is_fp = is_fp_interval(cur);
+        Allocator *a = is_fp ? &fp_alloc : &gp_alloc;
+
+        // Expire intervals that end before this one starts. One that
+        // ends exactly where this one starts is still live there, for
+        // example when both are live into the same block.
+        int j = 0;
+        for (int k = 0; k < a->nactive; k++) {
+            Interval *iv = a->active[k];
+            if (iv->end < cur->start)
+                a->used[iv->vreg->reg] = false;
+            else
+                a->active[j++] = iv;
+        }
+        a->nactive = j;
+
+        if (cur->hint != -1 && !a->used[cur->hint]) {
+            assign(a, cur, cur->hint);
+            continue;
+        }
+
+        // Registers that this interval may use
+        int *regs;
+        int nregs;
+        if (is_fp) {
+            regs = set->fp;
+            nregs = set->nfp;
+        } else {
+            regs = cur->across_call ? gp_across_call : gp;
+            nregs = ngp;
+        }
+
+        int r = find_free(a, regs, nregs);
+        if (r != -1) {
+            assign(a, cur, r);
+            continue;
+        }
+
+        // Spill the interval that ends last.
+        int victim = -1;
+        for (int k = 0; k < a->nactive; k++) {
+            Interval *iv = a->active[k];
+            if (!contains(regs, nregs, iv->vreg->reg))
+                continue;
+            if (victim == -1 || a->active[victim]->end < iv->end)
+                victim = k;
+        }
+
+        if (victim == -1 || a->active[victim]->end <= cur->end)
+            continue;
+
+        Interval *iv = a->active[victim];
+        r = iv->vreg->reg;
+        iv->vreg->reg = -1;
+        a->active[victim] = a->active[--a->nactive];
+        a->used[r] = false;
+        assign(a, cur, r);
+    }
+
+    // Tell each call which of its caller-saved registers hold values
+    // that are used after it.
+    for (int i = 0; i < n; i++) {
+        Interval *iv = intervals[i];
+        int r = iv->vreg->reg;
+        if (!iv->across_call || r == -1)
+            continue;
+        if (!is_fp_interval(iv) && !contains(set->caller_saved, set->ncaller_saved, r))
+            continue;
+        for (int j = first_call(iv, &p); j < p.ncalls && p.calls[j] < iv->end; j++)
+            add_live(p.call_insns[j], iv->vreg);
+    }
+}
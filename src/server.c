@@ -0,0 +1,487 @@
+#include "711cc.h"
+
+// A compile server keeps tokenized headers, resolved include paths and
+// the table of predefined macros in memory, and compiles files on behalf
+// of clients so that they don't pay for process startup and header
+// processing every time.
+//
+// A client sends its arguments, working directory and environment to
+// the server over a Unix socket. The server forks a handler for each
+// request, and the handler forks a compiler process that starts from a
+// copy of the server's memory. The handler sends what the compiler wrote
+// to stdout and stderr and its exit status back to the client.
+//
+// The compiler process logs cache entries it has added, and the server
+// adds the same entries to its own cache when the request is done, so
+// the cache gets warmer over time.
+
+extern char **environ;
+
+static bool write_all(int fd, char *buf, long len) {
+    while (len > 0) {
+        long n = write(fd, buf, len);
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, char *buf, long len) {
+    while (len > 0) {
+        long n = read(fd, buf, len);
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool write_int(int fd, int val) {
+    return write_all(fd, (char *)&val, sizeof(val));
+}
+
+static bool read_int(int fd, int *val) {
+    return read_all(fd, (char *)val, sizeof(*val));
+}
+
+static bool write_str(int fd, char *str, long len) {
+    return write_int(fd, len) && write_all(fd, str, len);
+}
+
+static char *read_str(int fd, int *len) {
+    if (!read_int(fd, len) || *len < 0)
+        return NULL;
+    char *buf = calloc(1, *len + 1);
+    if (!read_all(fd, buf, *len))
+        return NULL;
+    return buf;
+}
+
+// Reads a list of strings sent by write_strs().
+static char **read_strs(int fd, int *len) {
+    if (!read_int(fd, len) || *len < 0)
+        return NULL;
+    char **strs = calloc(*len + 1, sizeof(char *));
+    int n;
+    for (int i = 0; i < *len; i++)
+        if (!(strs[i] = read_str(fd, &n)))
+            return NULL;
+    return strs;
+}
+
+static bool write_strs(int fd, char **strs, int len) {
+    if (!write_int(fd, len))
+        return false;
+    for (int i = 0; i < len; i++)
+        if (!write_str(fd, strs[i], strlen(strs[i])))
+            return false;
+    return true;
+}
+
+// A socket address is a 2-byte address family followed by a path. We
+// build it by hand instead of using struct sockaddr_un because we align
+// its sun_path member to 16 bytes, which the kernel doesn't expect.
+typedef struct {
+    char buf[110];
+    int len;
+} Address;
+
+static void set_address(Address *addr, char *path) {
+    sa_family_t family = AF_UNIX;
+    int len = strlen(path);
+    if (sizeof(family) + len >= sizeof(addr->buf))
+        error("socket path too long: %s", path);
+    memset(addr, 0, sizeof(*addr));
+    memcpy(addr->buf, &family, sizeof(family));
+    memcpy(addr->buf + sizeof(family), path, len);
+    addr->len = sizeof(family) + len + 1;
+}
+
+// Returns an unlinked temporary file.
+static int new_tempfile(void) {
+    char *path = strdup("/tmp/711cc-XXXXXX");
+    int fd = mkstemp(path);
+    if (fd == -1)
+        error("cannot create a temporary file: %s: %s", path, strerror(errno));
+    unlink(path);
+    free(path);
+    return fd;
+}
+
+// Sends the contents of a file to the client.
+static bool send_file(int conn, int fd) {
+    long len = lseek(fd, 0, SEEK_END);
+    lseek(fd, 0, SEEK_SET);
+    char *buf = calloc(1, len + 1);
+    bool ok = read_all(fd, buf, len) && write_str(conn, buf, len);
+    free(buf);
+    return ok;
+}
+
+// Runs the compiler in a child process with the given standard output
+// and error, and returns its exit status. `argv` is terminated by NULL.
+// If `log` is not -1, the compiler logs the cache entries it adds there.
+static int run_compiler(Context *ctx, char **argv, int out, int err, int log) {
+    int argc = 0;
+    while (argv[argc])
+        argc++;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(out, 1);
+        dup2(err, 2);
+        if (log != -1)
+            ctx->cache->log = fdopen(log, "w");
+        exit(run_driver(ctx, argc, argv));
+    }
+
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1)
+        return 1;
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    return 1;
+}
+
+noreturn static void handle_request(Context *ctx, int conn, int log) {
+    int argc, envc, len;
+    char **argv = read_strs(conn, &argc);
+    char *cwd = argv ? read_str(conn, &len) : NULL;
+    char **env = cwd ? read_strs(conn, &envc) : NULL;
+    if (!env || argc < 1 || chdir(cwd))
+        _exit(1);
+    environ = env;
+
+    int out = new_tempfile();
+    int err = new_tempfile();
+    int status = run_compiler(ctx, argv, out, err, log);
+
+    if (send_file(conn, out) && send_file(conn, err))
+        write_int(conn, status);
+    _exit(0);
+}
+
+typedef struct {
+    Context ctx;
+    char *path;
+} WarmFile;
+
+static void *warm_file_thread(void *arg) {
+    WarmFile *wf = arg;
+    char *buf;
+    size_t len;
+    set_diag_stream(open_memstream(&buf, &len));
+    tokenize_file(&wf->ctx, wf->path);
+    return NULL;
+}
+
+// Adds the cache entries logged by a compiler process to our cache.
+// A file is tokenized by a thread because an error in it must not
+// terminate the server.
+static void warm_cache(Context *ctx, int log) {
+    lseek(log, 0, SEEK_SET);
+    FILE *in = fdopen(log, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    long len;
+
+    while ((len = getline(&line, &cap, in)) > 0) {
+        if (line[len - 1] == '\n')
+            line[len - 1] = '\0';
+
+        if (!strncmp(line, "F\t", 2)) {
+            WarmFile *wf = calloc(1, sizeof(WarmFile));
+            wf->ctx = *ctx;
+            wf->path = strdup(line + 2);
+
+            pthread_t thr;
+            if (!pthread_create(&thr, NULL, warm_file_thread, wf))
+                pthread_join(thr, NULL);
+            continue;
+        }
+
+        if (!strncmp(line, "I\t", 2)) {
+            char *filename = strdup(line + 2);
+            char *path = strchr(filename, '\t');
+            char *key = path ? strchr(path + 1, '\t') : NULL;
+            if (!key)
+                continue;
+            *path++ = '\0';
+            *key++ = '\0';
+            add_cached_path(ctx->cache, key, filename, path);
+        }
+    }
+
+    free(line);
+    fclose(in);
+}
+
+typedef struct Handler Handler;
+struct Handler {
+    Handler *next;
+    pid_t pid;
+    int log;
+};
+
+void run_server(Context *ctx, char *path) {
+    signal(SIGPIPE, SIG_IGN);
+
+    Address addr;
+    set_address(&addr, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1)
+        error("socket: %s", strerror(errno));
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)addr.buf, addr.len) ||
+        listen(sock, 64))
+        error("%s: %s", path, strerror(errno));
+
+    Handler *handlers = NULL;
+
+    for (;;) {
+        // Reap finished handlers and learn from their requests.
+        for (Handler **h = &handlers; *h;) {
+            if (waitpid((*h)->pid, NULL, WNOHANG) <= 0) {
+                h = &(*h)->next;
+                continue;
+            }
+            warm_cache(ctx, (*h)->log);
+            *h = (*h)->next;
+        }
+
+        struct pollfd pfd = {};
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, handlers ? 10 : 1000) <= 0)
+            continue;
+
+        int conn = accept(sock, NULL, NULL);
+        if (conn == -1)
+            continue;
+
+        int log = new_tempfile();
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(sock);
+            handle_request(ctx, conn, log);
+        }
+        close(conn);
+
+        if (pid == -1) {
+            close(log);
+            continue;
+        }
+
+        Handler *h = calloc(1, sizeof(Handler));
+        h->pid = pid;
+        h->log = log;
+        h->next = handlers;
+        handlers = h;
+    }
+}
+
+static bool forward_output(int conn, FILE *out) {
+    int len;
+    char *buf = read_str(conn, &len);
+    if (!buf)
+        return false;
+    fwrite(buf, 1, len, out);
+    free(buf);
+    return true;
+}
+
+int run_client(char *path, int argc, char **argv) {
+    Address addr;
+    set_address(&addr, path);
+
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn == -1 || connect(conn, (struct sockaddr *)addr.buf, addr.len))
+        error("cannot connect to %s: %s", path, strerror(errno));
+
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd)
+        error("getcwd: %s", strerror(errno));
+
+    int envc = 0;
+    while (environ[envc])
+        envc++;
+
+    if (!write_strs(conn, argv, argc) || !write_str(conn, cwd, strlen(cwd)) ||
+        !write_strs(conn, environ, envc))
+        error("%s: cannot send a request", path);
+
+    int status;
+    if (!forward_output(conn, stdout) || !forward_output(conn, stderr) ||
+        !read_int(conn, &status))
+        error("%s: connection closed by the server", path);
+    return status;
+}
+
+// A worker compiles preprocessed code for clients, possibly on other
+// machines, in the spirit of distcc. Preprocessing is much cheaper than
+// parsing, code generation and assembling, and it depends on headers
+// that only the client has, so a client preprocesses a file itself and
+// sends the result with linemarkers to a worker, which compiles it with
+// -fpreprocessed and sends back the output file.
+//
+// Workers listen on TCP. An address is HOST:PORT, or just PORT for
+// the loopback interface.
+
+static struct addrinfo *resolve(char *addr, bool passive) {
+    char *host = "127.0.0.1";
+    char *port = addr;
+    char *colon = strrchr(addr, ':');
+    if (colon) {
+        host = strndup(addr, colon - addr);
+        port = colon + 1;
+    }
+
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (passive)
+        hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo *res;
+    if (getaddrinfo(host, port, &hints, &res))
+        return NULL;
+    return res;
+}
+
+// Writes preprocessed code to be compiled by a worker. A linemarker
+// at the top names the main file after the input file of the client,
+// even if the code begins with the contents of a header.
+static bool write_input(char *path, char *filename, char *text, long len) {
+    FILE *out = fopen(path, "w");
+    if (!out)
+        return false;
+    fprintf(out, "# 1 \"");
+    for (char *p = filename; *p; p++) {
+        if (*p == '\\' || *p == '"')
+            fputc('\\', out);
+        fputc(*p, out);
+    }
+    fprintf(out, "\"\n");
+    bool ok = fwrite(text, 1, len, out) == len;
+    return !fclose(out) && ok;
+}
+
+static bool is_worker_option(char *arg) {
+    return !strcmp(arg, "-S") || !strcmp(arg, "-c") ||
+           !strcmp(arg, "-fpic") || !strcmp(arg, "-fno-pic") ||
+           !strcmp(arg, "-O0") || !strcmp(arg, "-O1") || !strcmp(arg, "-O2") ||
+           !strncmp(arg, "--feature=", 10);
+}
+
+noreturn static void handle_work(Context *ctx, int conn) {
+    signal(SIGCHLD, SIG_DFL);
+
+    int nflags, len, text_len;
+    char **flags = read_strs(conn, &nflags);
+    char *filename = flags ? read_str(conn, &len) : NULL;
+    char *text = filename ? read_str(conn, &text_len) : NULL;
+    if (!text || strchr(filename, '\n'))
+        _exit(1);
+
+    // Accept only the options that clients send.
+    for (int i = 0; i < nflags; i++)
+        if (!is_worker_option(flags[i]))
+            _exit(1);
+
+    char *dir = mkdtemp(strdup("/tmp/711cc-XXXXXX"));
+    if (!dir)
+        _exit(1);
+    char *input = calloc(1, strlen(dir) + 10);
+    char *output = calloc(1, strlen(dir) + 10);
+    sprintf(input, "%s/input.i", dir);
+    sprintf(output, "%s/output", dir);
+
+    char **argv = calloc(nflags + 6, sizeof(char *));
+    int argc = 0;
+    argv[argc++] = "711cc";
+    for (int i = 0; i < nflags; i++)
+        argv[argc++] = flags[i];
+    argv[argc++] = "-fpreprocessed";
+    argv[argc++] = "-o";
+    argv[argc++] = output;
+    argv[argc++] = input;
+
+    int err = new_tempfile();
+    int status = 1;
+    if (write_input(input, filename, text, text_len))
+        status = run_compiler(ctx, argv, err, err, -1);
+
+    FILE *out = fopen(output, "r");
+    bool ok = out ? send_file(conn, fileno(out)) : write_str(conn, "", 0);
+    if (ok && send_file(conn, err))
+        write_int(conn, status);
+
+    unlink(input);
+    unlink(output);
+    rmdir(dir);
+    _exit(0);
+}
+
+void run_worker(Context *ctx, char *addr) {
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_IGN);
+
+    struct addrinfo *res = resolve(addr, true);
+    if (!res)
+        error("--worker: cannot resolve %s", addr);
+
+    int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sock == -1)
+        error("socket: %s", strerror(errno));
+
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(sock, res->ai_addr, res->ai_addrlen) || listen(sock, 64))
+        error("%s: %s", addr, strerror(errno));
+
+    for (;;) {
+        int conn = accept(sock, NULL, NULL);
+        if (conn == -1)
+            continue;
+        if (fork() == 0) {
+            close(sock);
+            handle_work(ctx, conn);
+        }
+        close(conn);
+    }
+}
+
+// Compiles preprocessed code on a worker. `flags` is terminated by NULL.
+// The output file is written to `out` and diagnostics to `diag`. Returns
+// the exit status of the compilation, or -1 if the worker can't be
+// reached.
+int run_on_worker(char *addr, char **flags, char *filename, char *text,
+                  FILE *out, FILE *diag) {
+    int nflags = 0;
+    while (flags[nflags])
+        nflags++;
+
+    struct addrinfo *res = resolve(addr, false);
+    if (!res)
+        return -1;
+
+    int conn = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    bool connected = conn != -1 && !connect(conn, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+
+    int status = -1;
+    if (connected && write_strs(conn, flags, nflags) &&
+        write_str(conn, filename, strlen(filename)) &&
+        write_str(conn, text, strlen(text)) &&
+        forward_output(conn, out) && forward_output(conn, diag))
+        if (!read_int(conn, &status))
+            status = -1;
+
+    if (conn != -1)
+        close(conn);
+    return status;
+}
@@ -0,0 +1,500 @@
+#include "711cc.h"
+
+// This file converts the IR of a function to static single assignment
+// (SSA) form and back. In SSA form, every register has exactly one
+// defining instruction, and a phi instruction at the beginning of a
+// block selects the value of a register by the predecessor control
+// came from. Optimization passes work on SSA form because a use of a
+// register has exactly one definition that reaches it.
+//
+// Phis are placed at the iterated dominance frontiers of the blocks
+// that define a register, and the registers are then renamed in a walk
+// over the dominator tree, as in Cytron et al., "Efficiently Computing
+// Static Single Assignment Form and the Control Dependence Graph".
+// Dominators are computed with the algorithm of Cooper, Harvey and
+// Kennedy, "A Simple, Fast Dominance Algorithm".
+
+// Stores the successors of a block to `out` and returns their number.
+int successors(BasicBlock *bb, BasicBlock **out) {
+    Insn *insn = bb->last;
+    if (!insn)
+        return 0;
+
+    if (insn->kind == IR_JMP) {
+        out[0] = insn->then;
+        return 1;
+    }
+
+    if (insn->kind == IR_BR) {
+        out[0] = insn->then;
+        if (insn->els == insn->then)
+            return 1;
+        out[1] = insn->els;
+        return 2;
+    }
+    return 0;
+}
+
+// Removes the phi arguments that come from a given block.
+static void remove_phi_args(BasicBlock *bb, BasicBlock *pred) {
+    for (Insn *insn = bb->insns; insn && insn->kind == IR_PHI; insn = insn->next) {
+        int j = 0;
+        for (int i = 0; i < insn->nargs; i++) {
+            if (insn->bbs[i] == pred)
+                continue;
+            insn->args[j] = insn->args[i];
+            insn->bbs[j] = insn->bbs[i];
+            j++;
+        }
+        insn->nargs = j;
+    }
+}
+
+// Computes the predecessors of the blocks and orders them in reverse
+// postorder. Blocks that can't be reached from the entry block are
+// removed from the function.
+void build_cfg(IRFunction *ir) {
+    int n = ir->nblocks;
+    bool *visited = calloc(n, sizeof(bool));
+    int *nvisited = calloc(n, sizeof(int));
+    BasicBlock **stack = calloc(n, sizeof(BasicBlock *));
+    BasicBlock **post = calloc(n, sizeof(BasicBlock *));
+    int sp = 0;
+    int npost = 0;
+
+    // Depth-first search with an explicit stack, which doesn't
+    // overflow for long chains of blocks.
+    stack[sp++] = ir->bbs;
+    visited[ir->bbs->id] = true;
+    while (sp) {
+        BasicBlock *bb = stack[sp - 1];
+        BasicBlock *succ[2];
+        int nsucc = successors(bb, succ);
+
+        if (nvisited[bb->id] < nsucc) {
+            BasicBlock *s = succ[nvisited[bb->id]++];
+            if (!visited[s->id]) {
+                visited[s->id] = true;
+                stack[sp++] = s;
+            }
+            continue;
+        }
+        post[npost++] = bb;
+        sp--;
+    }
+
+    // Remove unreachable blocks.
+    for (BasicBlock *bb = ir->bbs; bb; bb = bb->next) {
+        while (bb->next && !visited[bb->next->id]) {
+            BasicBlock *dead = bb->next;
+            BasicBlock *succ[2];
+            int nsucc = successors(dead, succ);
+            for (int i = 0; i < nsucc; i++)
+                remove_phi_args(succ[i], dead);
+            bb->next = dead->next;
+        }
+    }
+
+    ir->order = calloc(npost, sizeof(BasicBlock *));
+    ir->norder = npost;
+    for (int i = 0; i < npost; i++) {
+        BasicBlock *bb = post[npost - i - 1];
+        ir->order[i] = bb;
+        bb->rpo = i;
+        bb->npreds = 0;
+    }
+
+    for (int i = 0; i < npost; i++) {
+        BasicBlock *succ[2];
+        int nsucc = successors(ir->order[i], succ);
+        for (int j = 0; j < nsucc; j++)
+            succ[j]->npreds++;
+    }
+
+    for (int i = 0; i < npost; i++) {
+        BasicBlock *bb = ir->order[i];
+        bb->preds = calloc(bb->npreds, sizeof(BasicBlock *));
+        bb->npreds = 0;
+    }
+
+    for (int i = 0; i < npost; i++) {
+        BasicBlock *succ[2];
+        int nsucc = successors(ir->order[i], succ);
+        for (int j = 0; j < nsucc; j++)
+            succ[j]->preds[succ[j]->npreds++] = ir->order[i];
+    }
+}
+
+static BasicBlock *intersect(BasicBlock *a, BasicBlock *b) {
+    while (a != b) {
+        while (a->rpo > b->rpo)
+            a = a->idom;
+        while (b->rpo > a->rpo)
+            b = b->idom;
+    }
+    return a;
+}
+
+// Computes the immediate dominator of each block. build_cfg() must
+// have been called.
+void build_dominators(IRFunction *ir) {
+    for (int i = 0; i < ir->norder; i++)
+        ir->order[i]->idom = NULL;
+
+    BasicBlock *entry = ir->order[0];
+    entry->idom = entry;
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 1; i < ir->norder; i++) {
+            BasicBlock *bb = ir->order[i];
+            BasicBlock *idom = NULL;
+            for (int j = 0; j < bb->npreds; j++) {
+                BasicBlock *pred = bb->preds[j];
+                if (!pred->idom)
+                    continue;
+                idom = idom ? intersect(pred, idom) : pred;
+            }
+            if (bb->idom != idom) {
+                bb->idom = idom;
+                changed = true;
+            }
+        }
+    }
+    entry->idom = NULL;
+}
+
+typedef struct BlockList BlockList;
+struct BlockList {
+    BlockList *next;
+    BasicBlock *bb;
+};
+
+static BlockList *add_block(BlockList *list, BasicBlock *bb) {
+    BlockList *l = calloc(1, sizeof(BlockList));
+    l->bb = bb;
+    l->next = list;
+    return l;
+}
+
+// The dominance frontier of a block is the set of blocks where its
+// dominance ends, i.e. the join points that a definition in the block
+// reaches along with other definitions.
+static BlockList **dominance_frontiers(IRFunction *ir) {
+    BlockList **df = calloc(ir->nblocks, sizeof(BlockList *));
+
+    for (int i = 0; i < ir->norder; i++) {
+        BasicBlock *bb = ir->order[i];
+        if (bb->npreds < 2)
+            continue;
+
+        for (int j = 0; j < bb->npreds; j++) {
+            for (BasicBlock *b = bb->preds[j]; b && b != bb->idom; b = b->idom) {
+                if (df[b->id] && df[b->id]->bb == bb)
+                    break;
+                df[b->id] = add_block(df[b->id], bb);
+            }
+        }
+    }
+    return df;
+}
+
+// Inserts phis for a register at the iterated dominance frontier of
+// the blocks that define it.
+static void insert_phis(IRFunction *ir, VReg *reg, BlockList *defs,
+                        BlockList **df, int *has_phi, int *queued) {
+    BlockList *work = NULL;
+    for (BlockList *l = defs; l; l = l->next) {
+        if (queued[l->bb->id] != reg->id) {
+            queued[l->bb->id] = reg->id;
+            work = add_block(work, l->bb);
+        }
+    }
+
+    while (work) {
+        BasicBlock *bb = work->bb;
+        work = work->next;
+
+        for (BlockList *l = df[bb->id]; l; l = l->next) {
+            BasicBlock *join = l->bb;
+            if (has_phi[join->id] == reg->id)
+                continue;
+            has_phi[join->id] = reg->id;
+
+            // The original register is kept in lhs until renaming.
+            Insn *phi = new_insn(IR_PHI, reg->ty, NULL);
+            phi->dst = reg;
+            phi->lhs = reg;
+            phi->nargs = join->npreds;
+            phi->args = calloc(join->npreds, sizeof(VReg *));
+            phi->bbs = calloc(join->npreds, sizeof(BasicBlock *));
+            for (int i = 0; i < join->npreds; i++)
+                phi->bbs[i] = join->preds[i];
+            insert_insn(join, join->insns, phi);
+
+            if (queued[join->id] != reg->id) {
+                queued[join->id] = reg->id;
+                work = add_block(work, join);
+            }
+        }
+    }
+}
+
+typedef struct Name Name;
+struct Name {
+    Name *next;
+    VReg *reg;
+};
+
+typedef struct {
+    IRFunction *ir;
+    int nregs;          // Number of registers before renaming
+    bool *is_renamed;   // True for registers to be renamed, by id
+    Name **names;       // Stacks of current names, by id
+    int *log;           // Ids of the registers pushed to the stacks
+    int nlog;
+    int caplog;
+} Renamer;
+
+static void push_name(Renamer *r, VReg *orig, VReg *reg) {
+    Name *name = calloc(1, sizeof(Name));
+    name->reg = reg;
+    name->next = r->names[orig->id];
+    r->names[orig->id] = name;
+
+    if (r->nlog == r->caplog) {
+        r->caplog = r->caplog ? r->caplog * 2 : 64;
+        r->log = realloc(r->log, sizeof(int) * r->caplog);
+    }
+    r->log[r->nlog++] = orig->id;
+}
+
+// Returns the current name of a register, or NULL if no definition
+// of it reaches here.
+static VReg *current_name(Renamer *r, VReg *reg) {
+    Name *name = r->names[reg->id];
+    return name ? name->reg : NULL;
+}
+
+// Returns a register to use in place of a given one, which is read
+// at `pos`. A read of a register that is never assigned gets zero.
+static VReg *rename_use(Renamer *r, BasicBlock *bb, Insn *pos, VReg *reg) {
+    if (!reg || reg->id > r->nregs || !r->is_renamed[reg->id])
+        return reg;
+
+    VReg *name = current_name(r, reg);
+    if (name)
+        return name;
+
+    Insn *insn = new_insn(is_flonum(reg->ty) ? IR_FIMM : IR_IMM, reg->ty, pos->tok);
+    insn->dst = new_vreg(r->ir, reg->ty);
+    insert_insn(bb, pos, insn);
+    return insn->dst;
+}
+
+static void rename_block(Renamer *r, BasicBlock *bb) {
+    for (Insn *insn = bb->insns; insn; insn = insn->next) {
+        VReg *orig = insn->dst;
+        if (insn->kind == IR_PHI) {
+            orig = insn->lhs;
+        } else {
+            insn->lhs = rename_use(r, bb, insn, insn->lhs);
+            insn->rhs = rename_use(r, bb, insn, insn->rhs);
+            for (int i = 0; i < insn->nargs; i++)
+                insn->args[i] = rename_use(r, bb, insn, insn->args[i]);
+        }
+
+        if (orig && r->is_renamed[orig->id]) {
+            insn->dst = new_vreg(r->ir, orig->ty);
+            push_name(r, orig, insn->dst);
+        }
+    }
+
+    BasicBlock *succ[2];
+    int nsucc = successors(bb, succ);
+    for (int i = 0; i < nsucc; i++)
+        for (Insn *phi = succ[i]->insns; phi && phi->kind == IR_PHI; phi = phi->next)
+            for (int j = 0; j < phi->nargs; j++)
+                if (phi->bbs[j] == bb)
+                    phi->args[j] = current_name(r, phi->lhs);
+}
+
+// Renames registers in a preorder walk over the dominator tree, so
+// that the current name of a register on entry to a block is that of
+// the definition that dominates the block.
+static void rename_regs(Renamer *r) {
+    IRFunction *ir = r->ir;
+    BlockList **kids = calloc(ir->nblocks, sizeof(BlockList *));
+    for (int i = ir->norder - 1; i > 0; i--) {
+        BasicBlock *bb = ir->order[i];
+        kids[bb->idom->id] = add_block(kids[bb->idom->id], bb);
+    }
+
+    // Each block is on the stack twice: once to rename it and
+    // once to pop the names it pushed after its subtree is done.
+    int *mark = calloc(ir->nblocks, sizeof(int));
+    bool *done = calloc(ir->nblocks, sizeof(bool));
+    BasicBlock **stack = calloc(ir->norder * 2, sizeof(BasicBlock *));
+    int sp = 0;
+    stack[sp++] = ir->order[0];
+
+    while (sp) {
+        BasicBlock *bb = stack[--sp];
+        if (done[bb->id]) {
+            while (r->nlog > mark[bb->id]) {
+                int id = r->log[--r->nlog];
+                r->names[id] = r->names[id]->next;
+            }
+            continue;
+        }
+
+        done[bb->id] = true;
+        mark[bb->id] = r->nlog;
+        rename_block(r, bb);
+        stack[sp++] = bb;
+        for (BlockList *l = kids[bb->id]; l; l = l->next)
+            stack[sp++] = l->bb;
+    }
+}
+
+// Converts a function to SSA form. Registers assigned by more than
+// one instruction are renamed so that each name is assigned once.
+void to_ssa(IRFunction *ir) {
+    build_cfg(ir);
+    build_dominators(ir);
+    count_defs(ir);
+
+    int nregs = ir->nregs;
+    bool *is_renamed = calloc(nregs + 1, sizeof(bool));
+    BlockList **defs = calloc(nregs + 1, sizeof(BlockList *));
+    VReg **regs = calloc(nregs + 1, sizeof(VReg *));
+
+    for (int i = 0; i < ir->norder; i++) {
+        BasicBlock *bb = ir->order[i];
+        for (Insn *insn = bb->insns; insn; insn = insn->next) {
+            VReg *dst = insn->dst;
+            if (!dst || dst->ndefs < 2)
+                continue;
+            is_renamed[dst->id] = true;
+            regs[dst->id] = dst;
+            if (!defs[dst->id] || defs[dst->id]->bb != bb)
+                defs[dst->id] = add_block(defs[dst->id], bb);
+        }
+    }
+
+    BlockList **df = dominance_frontiers(ir);
+    int *has_phi = calloc(ir->nblocks, sizeof(int));
+    int *queued = calloc(ir->nblocks, sizeof(int));
+    for (int i = 1; i <= nregs; i++)
+        if (regs[i])
+            insert_phis(ir, regs[i], defs[i], df, has_phi, queued);
+
+    Renamer r = {0};
+    r.ir = ir;
+    r.nregs = nregs;
+    r.is_renamed = is_renamed;
+    r.names = calloc(nregs + 1, sizeof(Name *));
+    rename_regs(&r);
+
+    for (int i = 0; i < ir->norder; i++)
+        for (Insn *insn = ir->order[i]->insns; insn && insn->kind == IR_PHI; insn = insn->next)
+            insn->lhs = NULL;
+    count_defs(ir);
+}
+
+// Sequentializes the parallel copies dst[i] = src[i], which all read
+// their sources before any of them writes, and inserts them before
+// `pos`. A cycle of copies, e.g. a swap, is broken with a temporary.
+static void insert_copies(IRFunction *ir, BasicBlock *bb, Insn *pos,
+                          VReg **dst, VReg **src, int n) {
+    while (n > 0) {
+        int i = 0;
+        for (; i < n; i++) {
+            bool is_read = false;
+            for (int j = 0; j < n; j++)
+                if (j != i && src[j] == dst[i])
+                    is_read = true;
+            if (!is_read)
+                break;
+        }
+
+        if (i == n) {
+            // Every destination is still to be read. Save one of them.
+            VReg *tmp = new_vreg(ir, dst[0]->ty);
+            Insn *insn = new_insn(IR_MOV, tmp->ty, pos->tok);
+            insn->dst = tmp;
+            insn->lhs = dst[0];
+            insert_insn(bb, pos, insn);
+            for (int j = 0; j < n; j++)
+                if (src[j] == dst[0])
+                    src[j] = tmp;
+            continue;
+        }
+
+        Insn *insn = new_insn(IR_MOV, dst[i]->ty, pos->tok);
+        insn->dst = dst[i];
+        insn->lhs = src[i];
+        insert_insn(bb, pos, insn);
+        n--;
+        dst[i] = dst[n];
+        src[i] = src[n];
+    }
+}
+
+// Converts a function out of SSA form by replacing each phi with
+// copies at the end of the predecessors. An edge from a block with
+// two successors to a block with phis is split first, so that the
+// copies run only when control takes that edge.
+void from_ssa(IRFunction *ir) {
+    build_cfg(ir);
+
+    for (int k = 0; k < ir->norder; k++) {
+        BasicBlock *bb = ir->order[k];
+        if (!bb->insns || bb->insns->kind != IR_PHI)
+            continue;
+
+        int nphis = 0;
+        for (Insn *phi = bb->insns; phi && phi->kind == IR_PHI; phi = phi->next)
+            nphis++;
+        VReg **dst = calloc(nphis, sizeof(VReg *));
+        VReg **src = calloc(nphis, sizeof(VReg *));
+
+        for (int i = 0; i < bb->npreds; i++) {
+            BasicBlock *pred = bb->preds[i];
+            int n = 0;
+            for (Insn *phi = bb->insns; phi && phi->kind == IR_PHI; phi = phi->next) {
+                for (int j = 0; j < phi->nargs; j++) {
+                    if (phi->bbs[j] == pred && phi->args[j] && phi->args[j] != phi->dst) {
+                        dst[n] = phi->dst;
+                        src[n] = phi->args[j];
+                        n++;
+                        break;
+                    }
+                }
+            }
+            if (n == 0)
+                continue;
+
+            BasicBlock *succ[2];
+            if (successors(pred, succ) == 2) {
+                BasicBlock *edge = new_block(ir);
+                Insn *jmp = new_insn(IR_JMP, NULL, pred->last->tok);
+                jmp->then = bb;
+                insert_insn(edge, NULL, jmp);
+
+                if (pred->last->then == bb)
+                    pred->last->then = edge;
+                else
+                    pred->last->els = edge;
+                edge->next = pred->next;
+                pred->next = edge;
+                pred = edge;
+            }
+            insert_copies(ir, pred, pred->last, dst, src, n);
+        }
+
+        while (bb->insns && bb->insns->kind == IR_PHI)
+            remove_insn(bb, bb->insns);
+    }
+    count_defs(ir);
+}
@@ -0,0 +1,513 @@
+#include "711cc.h"
+
+// -ftime-report measures where a compilation spends its time. The
+// compiler is always in one of the phases below, and every time it
+// enters or leaves a phase, the wall and CPU time since the last switch
+// is added to the phase it was in. Time is thus attributed to the
+// innermost phase: reading a header is "file reading" even though it
+// happens while handling an #include.
+//
+// Memory allocations are counted per phase as well, and for -fmem-report
+// per kind of object. All allocations in the compiler go through the
+// wrappers below, which are installed by macros in 711cc.h. The macros
+// pass the size argument as text, and the kind of an allocation is
+// derived from it: `calloc(1, sizeof(Token))` allocates a Token. Each
+// thread counts to a table of its own without locking, and the tables
+// are merged when the report is printed.
+//
+// With -fperf-counters, hardware performance counters of the compiling
+// thread are read at every phase switch as well, so that the report
+// shows whether a phase is bound by cache misses or by branch misses.
+
+static char *phase_names[] = {
+    "other",
+    "file reading",
+    "tokenize",
+    "preprocess: include",
+    "preprocess: macro",
+    "preprocess: conditional",
+    "preprocess: other",
+    "convert_pp_tokens",
+    "cache lookup",
+    "offload",
+    "parse",
+    "stack layout",
+    "codegen",
+    "output copy",
+    "assembler",
+};
+
+#define MAX_KINDS 100
+#define MAX_SITES 512
+
+// Hardware counters read by -fperf-counters.
+typedef enum {
+    CNT_CYCLES,
+    CNT_INSTRUCTIONS,
+    CNT_L1D_MISSES,
+    CNT_LLC_MISSES,
+    CNT_BRANCH_MISSES,
+    NUM_COUNTERS,
+} Counter;
+
+static char *counter_names[] = {
+    "cycles", "instructions", "L1D misses", "LLC misses", "branch misses",
+};
+
+// The perf_event_attr type and config of each counter.
+static int counter_types[] = {0, 0, 3, 3, 0};
+static long counter_configs[] = {0, 1, 0x10000, 0x10002, 5};
+
+// The first fields of struct perf_event_attr. <linux/perf_event.h>
+// uses inline assembly that we can't compile, but the kernel accepts
+// this prefix as the first version of the struct.
+typedef struct {
+    uint32_t type;
+    uint32_t size;
+    uint64_t config;
+    uint64_t sample_period;
+    uint64_t sample_type;
+    uint64_t read_format;
+    uint64_t flags;
+    uint32_t wakeup_events;
+    uint32_t bp_type;
+    uint64_t config1;
+} PerfEventAttr;
+
+#define PERF_FORMAT_GROUP 8
+#define PERF_FLAG_EXCLUDE_KERNEL (1 << 5)
+#define PERF_FLAG_EXCLUDE_HV (1 << 6)
+
+// glibc has no wrapper for perf_event_open, and declares syscall()
+// only for _DEFAULT_SOURCE.
+long syscall(long number, ...);
+
+// Allocations counted by one thread for a report
+typedef struct AllocStats AllocStats;
+struct AllocStats {
+    AllocStats *next;
+    TimeReport *report;
+    long allocs[NUM_PHASES];
+    long bytes[NUM_PHASES];
+
+    // The size text of a call site is a string literal, so its address
+    // identifies the call site. `sites` is a hash table that maps it to
+    // the kind of the allocations there.
+    char *sites[MAX_SITES];
+    int site_kinds[MAX_SITES];
+
+    char *kinds[MAX_KINDS];
+    long kind_allocs[MAX_KINDS];
+    long kind_bytes[MAX_KINDS];
+    int nkinds;
+};
+
+struct TimeReport {
+    pthread_mutex_t mu;
+    Phase phase;
+    double last_wall;
+    double last_cpu;
+
+    double wall[NUM_PHASES];
+    double cpu[NUM_PHASES];
+    long allocs[NUM_PHASES];
+    long bytes[NUM_PHASES];
+
+    // Counters are read as a group through the first counter opened.
+    // `slot` maps a counter to its position in the group, or is -1 if
+    // the counter isn't available.
+    bool perf;
+    int group_fd;
+    int nopen;
+    int fds[NUM_COUNTERS];
+    int slot[NUM_COUNTERS];
+    char *perf_error;
+    uint64_t last_count[NUM_COUNTERS];
+    uint64_t counts[NUM_PHASES][NUM_COUNTERS];
+
+    // Tables of the threads, and their sums, which merge_allocs()
+    // computes
+    AllocStats *stats;
+    char *kinds[MAX_KINDS];
+    long kind_allocs[MAX_KINDS];
+    long kind_bytes[MAX_KINDS];
+    int nkinds;
+};
+
+// Allocations are counted to the table of the current thread for the
+// report of the compilation running on it. Checking a global flag first
+// keeps the wrappers cheap when no report is requested.
+static bool enabled;
+static pthread_key_t stats_key;
+static pthread_once_t report_once = PTHREAD_ONCE_INIT;
+
+static void init_stats_key(void) {
+    pthread_key_create(&stats_key, NULL);
+}
+
+// Makes the current thread count allocations for a report.
+static void use_report(TimeReport *r) {
+    AllocStats *s = pthread_getspecific(stats_key);
+    if (s && s->report == r)
+        return;
+
+    s = (calloc)(1, sizeof(AllocStats));
+    s->report = r;
+    pthread_mutex_lock(&r->mu);
+    s->next = r->stats;
+    r->stats = s;
+    pthread_mutex_unlock(&r->mu);
+    pthread_setspecific(stats_key, s);
+}
+
+static double now(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Opens the hardware counters for the current thread. Counters that
+// the CPU or the kernel doesn't provide are left out, and if none can
+// be opened, the reason is reported instead of the counts.
+static void open_counters(TimeReport *r) {
+    r->group_fd = -1;
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        PerfEventAttr attr = {};
+        attr.type = counter_types[i];
+        attr.size = sizeof(attr);
+        attr.config = counter_configs[i];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.flags = PERF_FLAG_EXCLUDE_KERNEL | PERF_FLAG_EXCLUDE_HV;
+
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, r->group_fd, 0);
+        r->fds[i] = fd;
+        r->slot[i] = -1;
+        if (fd == -1) {
+            if (!r->perf_error)
+                r->perf_error = (strdup)(strerror(errno));
+            continue;
+        }
+        if (r->group_fd == -1)
+            r->group_fd = fd;
+        r->slot[i] = r->nopen++;
+    }
+}
+
+// Reads the counters into `val`. Returns false if they can't be read.
+static bool read_counters(TimeReport *r, uint64_t *val) {
+    uint64_t buf[NUM_COUNTERS + 1];
+    if (r->group_fd == -1 || read(r->group_fd, buf, sizeof(buf)) <= 0)
+        return false;
+    for (int i = 0; i < NUM_COUNTERS; i++)
+        val[i] = r->slot[i] == -1 ? 0 : buf[r->slot[i] + 1];
+    return true;
+}
+
+TimeReport *new_time_report(bool perf) {
+    pthread_once(&report_once, init_stats_key);
+    enabled = true;
+
+    TimeReport *r = (calloc)(1, sizeof(TimeReport));
+    pthread_mutex_init(&r->mu, NULL);
+    r->perf = perf;
+    if (perf) {
+        open_counters(r);
+        read_counters(r, r->last_count);
+    }
+    r->last_wall = now(CLOCK_MONOTONIC);
+    r->last_cpu = now(CLOCK_THREAD_CPUTIME_ID);
+    return r;
+}
+
+// Makes allocations on the current thread count toward a report.
+// Threads that work for a compilation call this when they start.
+void set_time_report(TimeReport *r) {
+    if (enabled)
+        use_report(r);
+}
+
+// Switches to a new phase and returns the previous one, which the
+// caller passes to enter_phase() again when it is done.
+Phase enter_phase(Context *ctx, Phase phase) {
+    TimeReport *r = ctx->time_report;
+    if (!r)
+        return PHASE_OTHER;
+
+    double wall = now(CLOCK_MONOTONIC);
+    double cpu = now(CLOCK_THREAD_CPUTIME_ID);
+
+    pthread_mutex_lock(&r->mu);
+    Phase prev = r->phase;
+
+    uint64_t count[NUM_COUNTERS];
+    if (r->perf && read_counters(r, count)) {
+        for (int i = 0; i < NUM_COUNTERS; i++) {
+            r->counts[prev][i] += count[i] - r->last_count[i];
+            r->last_count[i] = count[i];
+        }
+    }
+
+    r->wall[prev] += wall - r->last_wall;
+    r->cpu[prev] += cpu - r->last_cpu;
+    r->last_wall = wall;
+    r->last_cpu = cpu;
+    r->phase = phase;
+    pthread_mutex_unlock(&r->mu);
+
+    use_report(r);
+    return prev;
+}
+
+// Adds CPU time spent outside the current thread, such as by helper
+// threads or child processes, to the current phase.
+void add_cpu_time(Context *ctx, double sec) {
+    TimeReport *r = ctx->time_report;
+    if (!r)
+        return;
+    pthread_mutex_lock(&r->mu);
+    r->cpu[r->phase] += sec;
+    pthread_mutex_unlock(&r->mu);
+}
+
+// Returns the CPU time used by the current thread.
+double thread_cpu_time(void) {
+    return now(CLOCK_THREAD_CPUTIME_ID);
+}
+
+// Returns the user and system time in a struct rusage.
+double rusage_time(struct rusage *ru) {
+    return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 +
+           ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+// Returns the index of a kind in a table, adding it if it isn't there.
+static int lookup_kind(char **kinds, int *nkinds, char *name, int len) {
+    for (int i = 0; i < *nkinds; i++)
+        if (!strncmp(kinds[i], name, len) && !kinds[i][len])
+            return i;
+    if (*nkinds == MAX_KINDS)
+        return 0;
+    kinds[*nkinds] = (strndup)(name, len);
+    return (*nkinds)++;
+}
+
+// Returns the index of the kind of an allocation whose size argument
+// is `expr`. "sizeof(T)" is a T and "sizeof(T) * n" is an array of T.
+// Sizes computed from string lengths are strings.
+static int find_kind(AllocStats *s, char *expr) {
+    char buf[100];
+    char *name = "other";
+    int len = 5;
+    char *end = strchr(expr, ')');
+    if (!strncmp(expr, "sizeof(", 7) && end) {
+        name = expr + 7;
+        len = end - name;
+        if (end[1]) {
+            snprintf(buf, sizeof(buf), "%.*s[]", len, name);
+            name = buf;
+            len = strlen(buf);
+        }
+    } else if (strstr(expr, "strlen")) {
+        name = "strings";
+        len = 7;
+    }
+    return lookup_kind(s->kinds, &s->nkinds, name, len);
+}
+
+// Returns the index of the kind of the allocations at a call site.
+// Only the first allocation at a call site computes it from the text.
+static int site_kind(AllocStats *s, char *expr) {
+    int h = ((unsigned long)expr >> 3) % MAX_SITES;
+    for (int i = 0; i < MAX_SITES; i++) {
+        int j = (h + i) % MAX_SITES;
+        if (s->sites[j] == expr)
+            return s->site_kinds[j];
+        if (!s->sites[j]) {
+            s->sites[j] = expr;
+            s->site_kinds[j] = find_kind(s, expr);
+            return s->site_kinds[j];
+        }
+    }
+    return find_kind(s, expr);
+}
+
+// Counts `size` bytes allocated for `expr`. A buffer that grows is
+// counted as an allocation once, and then only by how much it grows.
+// The phase is read without the lock, so an allocation that races with
+// a phase switch on another thread may count toward either phase.
+static void count_alloc(size_t size, char *expr, bool is_new) {
+    AllocStats *s = pthread_getspecific(stats_key);
+    if (!s)
+        return;
+    Phase phase = s->report->phase;
+    s->allocs[phase] += is_new;
+    s->bytes[phase] += size;
+    int kind = site_kind(s, expr);
+    s->kind_allocs[kind] += is_new;
+    s->kind_bytes[kind] += size;
+}
+
+// Sums the tables of all threads to the report. The caller must hold
+// the lock.
+static void merge_allocs(TimeReport *r) {
+    for (int i = 0; i < NUM_PHASES; i++)
+        r->allocs[i] = r->bytes[i] = 0;
+    for (int i = 0; i < r->nkinds; i++)
+        r->kind_allocs[i] = r->kind_bytes[i] = 0;
+
+    for (AllocStats *s = r->stats; s; s = s->next) {
+        for (int i = 0; i < NUM_PHASES; i++) {
+            r->allocs[i] += s->allocs[i];
+            r->bytes[i] += s->bytes[i];
+        }
+        for (int i = 0; i < s->nkinds; i++) {
+            int k = lookup_kind(r->kinds, &r->nkinds, s->kinds[i], strlen(s->kinds[i]));
+            r->kind_allocs[k] += s->kind_allocs[i];
+            r->kind_bytes[k] += s->kind_bytes[i];
+        }
+    }
+}
+
+// Prints the counts of each phase, which don't include the assembler
+// or helper threads, and closes the counters.
+static void print_counters(TimeReport *r, FILE *out) {
+    if (r->nopen == 0) {
+        fprintf(out, "  hardware counters unavailable: %s\n", r->perf_error);
+        return;
+    }
+
+    fprintf(out, "\n  %-24s", "phase");
+    for (int i = 0; i < NUM_COUNTERS; i++)
+        fprintf(out, " %14s", counter_names[i]);
+    fprintf(out, " %6s\n", "IPC");
+
+    for (int i = 0; i < NUM_PHASES; i++) {
+        uint64_t *c = r->counts[i];
+        if (c[CNT_CYCLES] == 0 && c[CNT_INSTRUCTIONS] == 0)
+            continue;
+        fprintf(out, "  %-24s", phase_names[i]);
+        for (int j = 0; j < NUM_COUNTERS; j++) {
+            if (r->slot[j] == -1)
+                fprintf(out, " %14s", "n/a");
+            else
+                fprintf(out, " %14lu", c[j]);
+        }
+        if (c[CNT_CYCLES])
+            fprintf(out, " %6.2f", (double)c[CNT_INSTRUCTIONS] / c[CNT_CYCLES]);
+        fprintf(out, "\n");
+    }
+
+    for (int i = 0; i < NUM_COUNTERS; i++)
+        if (r->fds[i] != -1)
+            close(r->fds[i]);
+    r->nopen = 0;
+    r->group_fd = -1;
+}
+
+void print_time_report(Context *ctx, FILE *out, char *filename) {
+    TimeReport *r = ctx->time_report;
+    enter_phase(ctx, r->phase);
+    pthread_mutex_lock(&r->mu);
+    merge_allocs(r);
+    pthread_mutex_unlock(&r->mu);
+
+    fprintf(out, "Time report for %s:\n", filename);
+    fprintf(out, "  %-24s %10s %10s %10s %12s\n",
+            "phase", "wall (ms)", "cpu (ms)", "allocs", "bytes");
+
+    double wall = 0, cpu = 0;
+    long allocs = 0, bytes = 0;
+    for (int i = 0; i < NUM_PHASES; i++) {
+        wall += r->wall[i];
+        cpu += r->cpu[i];
+        allocs += r->allocs[i];
+        bytes += r->bytes[i];
+
+        // Skip phases that didn't run.
+        if (r->wall[i] == 0 && r->allocs[i] == 0)
+            continue;
+        fprintf(out, "  %-24s %10.2f %10.2f %10ld %12ld\n", phase_names[i],
+                r->wall[i] * 1000, r->cpu[i] * 1000, r->allocs[i], r->bytes[i]);
+    }
+    fprintf(out, "  %-24s %10.2f %10.2f %10ld %12ld\n", "total",
+            wall * 1000, cpu * 1000, allocs, bytes);
+
+    if (r->perf)
+        print_counters(r, out);
+}
+
+// -fmem-report prints allocations by kind of object and by phase, and
+// the peak resident set size. Nothing in the compiler is freed, so the
+// bytes allocated are roughly the memory a compilation holds at its end.
+void print_mem_report(Context *ctx, FILE *out, char *filename) {
+    TimeReport *r = ctx->time_report;
+    pthread_mutex_lock(&r->mu);
+    merge_allocs(r);
+
+    // Sort kinds by bytes in descending order.
+    int idx[MAX_KINDS];
+    for (int i = 0; i < r->nkinds; i++) {
+        int j = i;
+        for (; j > 0 && r->kind_bytes[idx[j - 1]] < r->kind_bytes[i]; j--)
+            idx[j] = idx[j - 1];
+        idx[j] = i;
+    }
+
+    fprintf(out, "Memory report for %s:\n", filename);
+    fprintf(out, "  %-24s %10s %12s\n", "kind", "allocs", "bytes");
+    long allocs = 0, bytes = 0;
+    for (int i = 0; i < r->nkinds; i++) {
+        int k = idx[i];
+        fprintf(out, "  %-24s %10ld %12ld\n", r->kinds[k], r->kind_allocs[k], r->kind_bytes[k]);
+        allocs += r->kind_allocs[k];
+        bytes += r->kind_bytes[k];
+    }
+    fprintf(out, "  %-24s %10ld %12ld\n\n", "total", allocs, bytes);
+
+    fprintf(out, "  %-24s %10s %12s\n", "phase", "allocs", "bytes");
+    for (int i = 0; i < NUM_PHASES; i++)
+        if (r->allocs[i])
+            fprintf(out, "  %-24s %10ld %12ld\n", phase_names[i], r->allocs[i], r->bytes[i]);
+    pthread_mutex_unlock(&r->mu);
+
+    // The peak RSS is of the whole process, which includes the other
+    // files being compiled with -j.
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(out, "\n  peak RSS: %ld KiB\n", ru.ru_maxrss);
+}
+
+void *counted_calloc(size_t n, size_t size, char *expr) {
+    if (enabled)
+        count_alloc(n * size, expr, true);
+    return (calloc)(n, size);
+}
+
+void *counted_malloc(size_t size, char *expr) {
+    if (enabled)
+        count_alloc(size, expr, true);
+    return (malloc)(size);
+}
+
+void *counted_realloc(void *ptr, size_t size, char *expr) {
+    if (!enabled)
+        return (realloc)(ptr, size);
+
+    // The old size is what the allocator reports, which may be a bit
+    // more than was asked for.
+    size_t old = ptr ? malloc_usable_size(ptr) : 0;
+    count_alloc(size > old ? size - old : 0, expr, !ptr);
+    return (realloc)(ptr, size);
+}
+
+char *counted_strdup(char *s) {
+    if (enabled)
+        count_alloc(strlen(s) + 1, "strlen", true);
+    return (strdup)(s);
+}
+
+char *counted_strndup(char *s, size_t n) {
+    if (enabled)
+        count_alloc(strnlen(s, n) + 1, "strlen", true);
+    return (strndup)(s, n);
+}
@@ -1,21 +1,41 @@
 #include "711cc.h"
 
-// Input filename
-static char *current_filename;
+// A compilation running on a worker thread registers a stream to buffer
+// its diagnostics, and an error terminates only that thread so that the
+// driver can report errors of all input files in a deterministic order.
+static pthread_key_t diag_key;
+static pthread_once_t diag_once = PTHREAD_ONCE_INIT;
 
-// Input string
-static char *current_input;
+static void init_diag_key(void) {
+    pthread_key_create(&diag_key, NULL);
+}
+
+void set_diag_stream(FILE *out) {
+    pthread_once(&diag_once, init_diag_key);
+    pthread_setspecific(diag_key, out);
+}
+
+FILE *diag_stream(void) {
+    pthread_once(&diag_once, init_diag_key);
+    FILE *out = pthread_getspecific(diag_key);
+    return out ? out : stderr;
+}
 
-// A list of all input files
-static char **input_files;
+// Terminates the current compilation after its error has been reported.
+void die(void) {
+    if (diag_stream() != stderr)
+        pthread_exit(NULL);
+    exit(1);
+}
 
 // Reports an error and exit
 void error(char *fmt, ...) {
+    FILE *out = diag_stream();
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    vfprintf(out, fmt, ap);
+    fprintf(out, "\n");
+    die();
 }
 
 // Reports an error location in the following format.
@@ -24,6 +44,8 @@ void error(char *fmt, ...) {
 //               ^ <error message here>
 static void verror_at(char *filename, char *input, int line_no,
                       char *loc, char *fmt, va_list ap) {
+    FILE *out = diag_stream();
+
     // Find a line containing `loc`.
     char *line = loc;
     while (input < line && line[-1] != '\n')
@@ -34,35 +56,35 @@ static void verror_at(char *filename, char *input, int line_no,
         end++;
 
     // Print out the line.
-    int indent = fprintf(stderr, "%s:%d: ", filename, line_no);
-    fprintf(stderr, "%.*s\n", (int)(end - line), line);
+    int indent = fprintf(out, "%s:%d: ", filename, line_no);
+    fprintf(out, "%.*s\n", (int)(end - line), line);
 
     // Show the error message.
     int pos = loc - line + indent;
 
-    fprintf(stderr, "%*s", pos, ""); // print pos spaces.
-    fprintf(stderr, "^ ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
+    fprintf(out, "%*s", pos, ""); // print pos spaces.
+    fprintf(out, "^ ");
+    vfprintf(out, fmt, ap);
+    fprintf(out, "\n");
 }
 
-noreturn static void error_at(char *loc, char *fmt, ...) {
+noreturn static void error_at(Context *ctx, char *loc, char *fmt, ...) {
     int line_no = 1;
-    for (char *p = current_input; p < loc; p++)
+    for (char *p = ctx->current_input; p < loc; p++)
         if (*p == '\n')
             line_no++;
 
     va_list ap;
     va_start(ap, fmt);
-    verror_at(current_filename, current_input, line_no, loc, fmt, ap);
-    exit(1);
+    verror_at(ctx->current_filename, ctx->current_input, line_no, loc, fmt, ap);
+    die();
 }
 
 void error_tok(Token *tok, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
     verror_at(tok->filename, tok->input, tok->line_no, tok->loc, fmt, ap);
-    exit(1);
+    die();
 }
 
 void warn_tok(Token *tok, char *fmt, ...) {
@@ -94,13 +116,13 @@ bool consume(Token **rest, Token *tok, char *str) {
 }
 
 // Create a new token and add it as the next token of `cur`.
-static Token *new_token(TokenKind kind, Token *cur, char *str, int len) {
+static Token *new_token(Context *ctx, TokenKind kind, Token *cur, char *str, int len) {
     Token *tok = calloc(1, sizeof(Token));
     tok->kind = kind;
     tok->loc = str;
     tok->len = len;
-    tok->filename = current_filename;
-    tok->input = current_input;
+    tok->filename = ctx->current_filename;
+    tok->input = ctx->current_input;
     cur->next = tok;
     return tok;
 }
@@ -138,7 +160,7 @@ static bool is_keyword(Token *tok) {
         "enum", "static", "break", "continue", "goto", "switch", "case",
         "default", "extern", "_Alignof", "_Alignas", "do", "signed",
         "unsigned", "const", "volatile", "register", "restrict",
-        "_Noreturn", "float", "double",
+        "_Noreturn", "float", "double", "inline",
     };
 
     for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
@@ -147,7 +169,7 @@ static bool is_keyword(Token *tok) {
     return false;
 }
 
-static int read_escaped_char(char **new_ops, char *p) {
+static int read_escaped_char(Context *ctx, char **new_ops, char *p) {
     if ('0' <= *p && *p <= '7') {
         // Read an octal number
         int c = *p++ - '0';
@@ -164,7 +186,7 @@ static int read_escaped_char(char **new_ops, char *p) {
         // Read a hexadecimal number
         p++;
         if (!is_hex(*p))
-            error_at(p, "invalid hex escape sequence");
+            error_at(ctx, p, "invalid hex escape sequence");
 
         int c = 0;
         for (; is_hex(*p); p++) {
@@ -196,7 +218,7 @@ static int read_escaped_char(char **new_ops, char *p) {
 // encoded in one to four bytes. One byte UTF-8 code points are
 // identical to ASCII. Non-ASCII characters are encoded using more
 // than one byte.
-static int read_utf8_char(char **new_pos, char *p) {
+static int read_utf8_char(Context *ctx, char **new_pos, char *p) {
     if ((unsigned char)*p < 0b10000000) {
         *new_pos = p + 1;
         return *p;
@@ -216,12 +238,12 @@ static int read_utf8_char(char **new_pos, char *p) {
         len = 2;
         c = *p++ & 0b11111;
     } else {
-        error_at(start, "invalid UTF-8 sequence");
+        error_at(ctx, start, "invalid UTF-8 sequence");
     }
 
     for (int i = 0; i < len - 1; i++) {
         if (!(*p & 0b10000000))
-          error_at(start, "invalid UTF-8 sequence");
+          error_at(ctx, start, "invalid UTF-8 sequence");
         c = (c << 6) | (*p & 0b111111);
         p++;
     }
@@ -231,30 +253,30 @@ static int read_utf8_char(char **new_pos, char *p) {
 }
 
 // Find a closing double-quote
-static char *string_literal_end(char *p) {
+static char *string_literal_end(Context *ctx, char *p) {
     char *start = p;
     for (; *p != '"'; p++) {
         if (*p == '\0')
-            error_at(start, "unclosed starting literal");
+            error_at(ctx, start, "unclosed starting literal");
         if (*p == '\\')
             p++;
     }
     return p;
 }
 
-static Token *read_string_literal(Token *cur, char *start) {
-    char *end = string_literal_end(start + 1);
+static Token *read_string_literal(Context *ctx, Token *cur, char *start) {
+    char *end = string_literal_end(ctx, start + 1);
     char *buf = calloc(1, end - start);
     int len = 0;
 
     for (char *p = start + 1; p < end;) {
         if (*p == '\\')
-            buf[len++] = read_escaped_char(&p, p + 1);
+            buf[len++] = read_escaped_char(ctx, &p, p + 1);
         else
             buf[len++] = *p++;
     }
 
-    Token *tok = new_token(TK_STR, cur, start, end - start + 1);
+    Token *tok = new_token(ctx, TK_STR, cur, start, end - start + 1);
     tok->ty = array_of(ty_char, len + 1);
     tok->str = buf;
     return tok;
@@ -267,18 +289,18 @@ static Token *read_string_literal(Token *cur, char *start) {
 // equal to or larger than that are encoded in 4 bytes. Each 2 bytes
 // in the 4 byte sequence is called "surrogate", and a 4 byte sequence
 // is called a "surrogate pair".
-static Token *read_utf16_string_literal(Token *cur, char *start) {
-    char *end = string_literal_end(start + 1);
+static Token *read_utf16_string_literal(Context *ctx, Token *cur, char *start) {
+    char *end = string_literal_end(ctx, start + 1);
     uint16_t *buf = calloc(2, end - start);
     int len = 0;
 
     for (char *p = start + 1; p < end;) {
         if (*p == '\\') {
-            buf[len++] = read_escaped_char(&p, p + 1);
+            buf[len++] = read_escaped_char(ctx, &p, p + 1);
             continue;
         }
 
-        uint32_t c = read_utf8_char(&p, p);
+        uint32_t c = read_utf8_char(ctx, &p, p);
         if (c < 0x10000) {
             // Encode a code point in 2 bytes.
             buf[len++] = c;
@@ -290,7 +312,7 @@ static Token *read_utf16_string_literal(Token *cur, char *start) {
         }
     }
 
-    Token *tok = new_token(TK_STR, cur, start, end - start + 1);
+    Token *tok = new_token(ctx, TK_STR, cur, start, end - start + 1);
     tok->ty = array_of(ty_ushort, len + 1);
     tok->str = (char *)buf;
     return tok;
@@ -300,40 +322,40 @@ static Token *read_utf16_string_literal(Token *cur, char *start) {
 //
 // UTF-32 is a fixed-width encoding for Unicode. Each code point is
 // encoded in 4 bytes.
-static Token *read_utf32_string_literal(Token *cur, char *start, Type *ty) {
-    char *end = string_literal_end(start + 1);
+static Token *read_utf32_string_literal(Context *ctx, Token *cur, char *start, Type *ty) {
+    char *end = string_literal_end(ctx, start + 1);
     uint32_t *buf = calloc(4, end - start);
     int len = 0;
 
     for (char *p = start + 1; p < end;) {
         if (*p == '\\')
-            buf[len++] = read_escaped_char(&p, p + 1);
+            buf[len++] = read_escaped_char(ctx, &p, p + 1);
         else
-            buf[len++] = read_utf8_char(&p, p);
+            buf[len++] = read_utf8_char(ctx, &p, p);
     }
 
-    Token *tok = new_token(TK_STR, cur, start, end - start + 1);
+    Token *tok = new_token(ctx, TK_STR, cur, start, end - start + 1);
     tok->ty = array_of(ty, len + 1);
     tok->str = (char *)buf;
     return tok;
 }
 
-static Token *read_char_literal(Token *cur, char *start, Type *ty) {
+static Token *read_char_literal(Context *ctx, Token *cur, char *start, Type *ty) {
     char *p = start + 1;
     if (*p == '\0')
-        error_at(start, "unclosed char literal");
+        error_at(ctx, start, "unclosed char literal");
 
     int c;
     if (*p == '\\')
-        c = read_escaped_char(&p, p + 1);
+        c = read_escaped_char(ctx, &p, p + 1);
     else
-        c = read_utf8_char(&p, p);
+        c = read_utf8_char(ctx, &p, p);
 
     if (*p != '\'')
-        error_at(p, "char literal too long");
+        error_at(ctx, p, "char literal too long");
     p++;
 
-    Token *tok = new_token(TK_NUM, cur, start, p - start);
+    Token *tok = new_token(ctx, TK_NUM, cur, start, p - start);
     tok->val = c;
     tok->ty = ty;
     return tok;
@@ -467,8 +489,8 @@ void convert_pp_tokens(Token *tok) {
 }
 
 // Initialize token position info for all tokens
-static void add_line_info(Token *tok) {
-    char *p = current_input;
+static void add_line_info(Context *ctx, Token *tok) {
+    char *p = ctx->current_input;
     int line_no = 1;
     bool at_bol = true;
     bool has_space =false;
@@ -493,10 +515,10 @@ static void add_line_info(Token *tok) {
     } while (*p++);
 }
 
-// Tokenize `current_input` and returns new tokens
-Token *tokenize(char *filename, int file_no, char *p) {
-    current_filename = filename;
-    current_input = p;
+// Tokenize a given string and returns new tokens
+Token *tokenize(Context *ctx, char *filename, int file_no, char *p) {
+    ctx->current_filename = filename;
+    ctx->current_input = p;
     Token head = {};
     Token *cur = &head;
 
@@ -513,7 +535,7 @@ Token *tokenize(char *filename, int file_no, char *p) {
         if (startswith(p, "/*")) {
             char *q = strstr(p + 2, "*/");
             if (!q)
-                error_at(p, "unclosed block comment");
+                error_at(ctx, p, "unclosed block comment");
             p = q + 2;
             continue;
         }
@@ -535,55 +557,55 @@ Token *tokenize(char *filename, int file_no, char *p) {
                 else
                     break;
             }
-            cur = new_token(TK_PP_NUM, cur, q, p - q);
+            cur = new_token(ctx, TK_PP_NUM, cur, q, p - q);
             continue;
         }
 
         // String literal
         if (*p == '"') {
-            cur = read_string_literal(cur, p);
+            cur = read_string_literal(ctx, cur, p);
             p += cur->len;
             continue;
         }
 
         // UTF-8 string literal
         if (startswith(p, "u8\"")) {
-            cur = read_string_literal(cur, p + 2);
+            cur = read_string_literal(ctx, cur, p + 2);
             p += cur->len + 2;
             continue;
         }
 
         // UTF-16 string literal
         if (startswith(p, "u\"")) {
-            cur = read_utf16_string_literal(cur, p + 1);
+            cur = read_utf16_string_literal(ctx, cur, p + 1);
             p += cur->len + 1;
             continue;
         }
 
         // UTF-32 string literal
         if (startswith(p, "U\"")) {
-            cur = read_utf32_string_literal(cur, p + 1, ty_uint);
+            cur = read_utf32_string_literal(ctx, cur, p + 1, ty_uint);
             p += cur->len + 1;
             continue;
         }
 
         // Wide string literal
         if (startswith(p, "L\"")) {
-            cur = read_utf32_string_literal(cur, p + 1, ty_int);
+            cur = read_utf32_string_literal(ctx, cur, p + 1, ty_int);
             p += cur->len + 1;
             continue;
         }
 
         // Character literal
         if (*p == '\'') {
-            cur = read_char_literal(cur, p, ty_int);
+            cur = read_char_literal(ctx, cur, p, ty_int);
             p += cur->len;
             continue;
         }
 
         // UTF-16 character literal
         if (startswith(p, "u'")) {
-            cur = read_char_literal(cur, p + 1, ty_ushort);
+            cur = read_char_literal(ctx, cur, p + 1, ty_ushort);
             p += cur->len + 1;
 
             // It is usually a programming error if a u'' literal cannot be
@@ -597,14 +619,14 @@ Token *tokenize(char *filename, int file_no, char *p) {
 
         // UTF-32 character literal
         if (startswith(p, "U'")) {
-            cur = read_char_literal(cur, p + 1, ty_uint);
+            cur = read_char_literal(ctx, cur, p + 1, ty_uint);
             p += cur->len + 1;
             continue;
         }
 
         // Wide character literal
         if (startswith(p, "L'")) {
-            cur = read_char_literal(cur, p + 1, ty_int);
+            cur = read_char_literal(ctx, cur, p + 1, ty_int);
             p += cur->len + 1;
             continue;
         }
@@ -614,14 +636,14 @@ Token *tokenize(char *filename, int file_no, char *p) {
             char *q = p++;
             while (is_alnum(*p) || (*p & 0x80))
                 p++;
-            cur = new_token(TK_IDENT, cur, q, p - q);
+            cur = new_token(ctx, TK_IDENT, cur, q, p - q);
             continue;
         }
 
         // Three-letter punctuators
         if (startswith(p, "<<=") || startswith(p, ">>=") ||
             startswith(p, "...")) {
-            cur = new_token(TK_RESERVED, cur, p, 3);
+            cur = new_token(ctx, TK_RESERVED, cur, p, 3);
             p += 3;
             continue;
         }
@@ -637,25 +659,25 @@ Token *tokenize(char *filename, int file_no, char *p) {
             startswith(p, "^=") || startswith(p, "&&") ||
             startswith(p, "||") || startswith(p, "<<") ||
             startswith(p, ">>") || startswith(p, "##")) {
-            cur = new_token(TK_RESERVED, cur, p, 2);
+            cur = new_token(ctx, TK_RESERVED, cur, p, 2);
             p += 2;
             continue;
         }
 
         // Single-letter punctuators
         if (ispunct(*p)) {
-            cur = new_token(TK_RESERVED, cur, p++, 1);
+            cur = new_token(ctx, TK_RESERVED, cur, p++, 1);
             continue;
         }
 
-        error_at(p, "invalid token");
+        error_at(ctx, p, "invalid token");
     }
 
-    new_token(TK_EOF, cur, p, 0);
+    new_token(ctx, TK_EOF, cur, p, 0);
 
     for (Token *t = head.next; t; t = t->next)
         t->file_no = file_no;
-    add_line_info(head.next);
+    add_line_info(ctx, head.next);
     return head.next;
 }
 
@@ -700,8 +722,18 @@ static char *read_file(char *path) {
     return buf;
 }
 
-char **get_input_files(void) {
-    return input_files;
+char **get_input_files(Context *ctx) {
+    return ctx->input_files;
+}
+
+// Saves the filename for assembler .file directive, and returns its
+// file number.
+int add_input_file(Context *ctx, char *path) {
+    int file_no = ctx->file_no;
+    ctx->input_files = realloc(ctx->input_files, sizeof(char *) * (file_no + 2));
+    ctx->input_files[file_no] = path;
+    ctx->input_files[file_no + 1] = NULL;
+    return ++ctx->file_no;
 }
 
 // Replaces \r or \r\n with \n.
@@ -817,21 +849,111 @@ static void convert_universal_chars(char *p) {
     *q = '\0';
 }
 
-Token *tokenize_file(char *path) {
-    char *p = read_file(path);
-    if (!p)
+// A cached file is identified by its absolute path, and it is valid as
+// long as the file has the same size and modification time, so that a
+// long-running compile server notices edited headers.
+struct CachedFile {
+    CachedFile *next;
+    char *path;
+    long size;
+    long mtime_sec;
+    long mtime_nsec;
+    Token *tok;
+};
+
+static char *absolute_path(char *path) {
+    if (path[0] == '/')
+        return path;
+
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd)
+        return path;
+    char *buf = calloc(1, strlen(cwd) + strlen(path) + 2);
+    sprintf(buf, "%s/%s", cwd, path);
+    free(cwd);
+    return buf;
+}
+
+static Token *copy_tokens(Token *tok, char *filename, int file_no) {
+    Token head = {};
+    Token *cur = &head;
+
+    for (; tok; tok = tok->next) {
+        Token *t = calloc(1, sizeof(Token));
+        *t = *tok;
+        t->next = NULL;
+        t->filename = filename;
+        t->file_no = file_no;
+        cur = cur->next = t;
+    }
+    return head.next;
+}
+
+static Token *find_cached_file(SharedCache *cache, char *key, struct stat *st) {
+    pthread_mutex_lock(&cache->mu);
+    CachedFile *cf = cache->files;
+    while (cf && strcmp(cf->path, key))
+        cf = cf->next;
+    pthread_mutex_unlock(&cache->mu);
+
+    if (!cf || cf->size != st->st_size || cf->mtime_sec != st->st_mtim.tv_sec ||
+        cf->mtime_nsec != st->st_mtim.tv_nsec)
         return NULL;
+    return cf->tok;
+}
+
+static void add_cached_file(SharedCache *cache, char *key, struct stat *st, Token *tok) {
+    CachedFile *cf = calloc(1, sizeof(CachedFile));
+    cf->path = key;
+    cf->size = st->st_size;
+    cf->mtime_sec = st->st_mtim.tv_sec;
+    cf->mtime_nsec = st->st_mtim.tv_nsec;
+    cf->tok = copy_tokens(tok, key, 0);
+
+    // A newer entry shadows stale ones for the same file.
+    pthread_mutex_lock(&cache->mu);
+    cf->next = cache->files;
+    cache->files = cf;
+    if (cache->log)
+        fprintf(cache->log, "F\t%s\n", key);
+    pthread_mutex_unlock(&cache->mu);
+}
+
+Token *tokenize_file(Context *ctx, char *path) {
+    // Headers are usually included by many compilations, so a file
+    // is tokenized once and later requests get a copy of the tokens.
+    // Stdin can be read only once and is never cached.
+    Phase prev = enter_phase(ctx, PHASE_READ);
+    struct stat st;
+    bool cacheable = strcmp(path, "-") != 0 && !stat(path, &st);
+    char *key = cacheable ? absolute_path(path) : NULL;
+    Token *cached = cacheable ? find_cached_file(ctx->cache, key, &st) : NULL;
+    char *p = NULL;
+
+    if (!cached) {
+        p = read_file(path);
+        if (!p) {
+            enter_phase(ctx, prev);
+            return NULL;
+        }
+    }
 
-    canonicalize_newline(p);
-    remove_backslash_newline(p);
-    convert_universal_chars(p);
+    enter_phase(ctx, PHASE_TOKENIZE);
+    int file_no = add_input_file(ctx, path);
+    Token *tok;
 
-    // Save the filename for assembler .file directive
-    static int file_no;
-    input_files = realloc(input_files, sizeof(char *) * (file_no + 2));
-    input_files[file_no] = path;
-    input_files[file_no + 1] = NULL;
-    file_no++;
+    if (cached) {
+        tok = copy_tokens(cached, path, file_no);
+    } else {
+        canonicalize_newline(p);
+        remove_backslash_newline(p);
+        convert_universal_chars(p);
+
+        tok = tokenize(ctx, path, file_no, p);
+        if (cacheable)
+            add_cached_file(ctx->cache, key, &st, tok);
+    }
 
-    return tokenize(path, file_no, p);
+    enter_phase(ctx, prev);
+    return tok;
 }
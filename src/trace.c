@@ -0,0 +1,123 @@
+#include "711cc.h"
+
+// -ftrace=FILE writes what the compiler does over time as a trace in
+// the Chrome trace event format, which chrome://tracing and Perfetto
+// can display. Every span is a "complete" event with a start time and
+// a duration, recorded when the span ends. Spans of the same thread
+// nest, so a header included by another header shows up under it.
+//
+// Events are written as they are recorded and the closing bracket is
+// written at exit, so the file is valid even after a compile error.
+
+struct Trace {
+    pthread_mutex_t mu;
+    FILE *out;
+    double start;
+    int nevents;
+    int next_tid;
+};
+
+static Trace *current;
+static pthread_key_t tid_key;
+
+// Returns a monotonic time in microseconds.
+double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void close_trace(void) {
+    pthread_mutex_lock(&current->mu);
+    fprintf(current->out, "\n]\n");
+    fclose(current->out);
+    pthread_mutex_unlock(&current->mu);
+}
+
+Trace *open_trace(char *path) {
+    if (current)
+        error("-ftrace: given more than once");
+
+    FILE *out = fopen(path, "w");
+    if (!out)
+        error("-ftrace: cannot open %s: %s", path, strerror(errno));
+
+    Trace *t = calloc(1, sizeof(Trace));
+    pthread_mutex_init(&t->mu, NULL);
+    t->out = out;
+    t->start = now_us();
+    t->next_tid = 1;
+    pthread_key_create(&tid_key, NULL);
+
+    fprintf(out, "[");
+    current = t;
+    atexit(close_trace);
+    return t;
+}
+
+static void print_json_string(FILE *out, char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(out, "\\u%04x", *s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+// Starts an event. The caller must hold the lock.
+static void begin_event(Trace *t) {
+    fprintf(t->out, t->nevents++ ? ",\n" : "\n");
+}
+
+// Each thread is a row in the viewer. Threads are numbered in the
+// order in which they record their first event.
+static long current_tid(Trace *t) {
+    long tid = (long)pthread_getspecific(tid_key);
+    if (!tid) {
+        tid = t->next_tid++;
+        pthread_setspecific(tid_key, (void *)tid);
+    }
+    return tid;
+}
+
+// Returns the current time for trace_span(), or 0 if -ftrace isn't given.
+double trace_now(Context *ctx) {
+    if (!ctx->trace)
+        return 0;
+    return now_us();
+}
+
+// Records a span from `start`, returned by trace_now(), until now.
+void trace_span(Context *ctx, char *cat, char *name, double start) {
+    Trace *t = ctx->trace;
+    if (!t)
+        return;
+    double end = now_us();
+
+    pthread_mutex_lock(&t->mu);
+    begin_event(t);
+    fprintf(t->out, "{\"name\":");
+    print_json_string(t->out, name);
+    fprintf(t->out, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%ld}",
+            cat, start - t->start, end - start, getpid(), current_tid(t));
+    pthread_mutex_unlock(&t->mu);
+}
+
+// Names the row of the current thread in the viewer.
+void trace_thread_name(Context *ctx, char *name) {
+    Trace *t = ctx->trace;
+    if (!t)
+        return;
+
+    pthread_mutex_lock(&t->mu);
+    begin_event(t);
+    fprintf(t->out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":",
+            getpid(), current_tid(t));
+    print_json_string(t->out, name);
+    fprintf(t->out, "}}");
+    pthread_mutex_unlock(&t->mu);
+}
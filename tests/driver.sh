@@ -0,0 +1,41 @@
+#!/bin/bash
+# Tests of the compiler driver. Run from the top directory.
+
+tmp=$(mktemp -d /tmp/711cc-test-XXXXXX)
+trap 'rm -rf $tmp' EXIT
+
+# Checks that compiling `input` as a preprocessed file fails with `message`.
+assert_preprocessed_error() {
+    message="$1"
+    input="$2"
+
+    printf "$input" > $tmp/in.i
+    if ./711cc -fpreprocessed -S -o $tmp/out.s $tmp/in.i 2> $tmp/err; then
+        echo "-fpreprocessed $input => error expected, but succeeded"
+        exit 1
+    fi
+    if ! grep -q "$message" $tmp/err; then
+        echo "-fpreprocessed $input => '$message' expected, but got:"
+        cat $tmp/err
+        exit 1
+    fi
+    echo "-fpreprocessed $input => $message"
+}
+
+assert_preprocessed_error 'invalid preprocessing directive' '#include "/etc/hostname"\nint x;\n'
+assert_preprocessed_error 'invalid preprocessing directive' '# 1 "a.c"\n#define X 1\nint x = X;\n'
+assert_preprocessed_error 'invalid preprocessing directive' '#if 1\nint x;\n#endif\n'
+
+# Linemarkers and #line are accepted.
+printf '# 1 "a.c"\nint x = 1;\n#line 10 "b.c"\nint y = 2;\n' > $tmp/in.i
+./711cc -fpreprocessed -S -o $tmp/out.s $tmp/in.i || exit 1
+
+# The RISC-V backend doesn't use the IR.
+printf 'int main() { return 0; }\n' > $tmp/in.c
+if ./711cc --feature=riscv64 -fdump-ir -S -o $tmp/out.s $tmp/in.c 2> $tmp/err ||
+   ! grep -q 'supported only for x86-64' $tmp/err; then
+    echo "--feature=riscv64 -fdump-ir => error expected"
+    exit 1
+fi
+
+echo OK
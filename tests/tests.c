@@ -141,6 +141,7 @@ void ret_none() {
 }
 
 static int static_fn() { return 3; }
+static inline int inline_fn() { return 4; }
 
 int param_decay(int x[]) { return x[0]; }
 
@@ -264,11 +265,11 @@ int main() {
 
     assert(3, ({ int x=3; *&x; }), "({ int x=3; *&x; })");
     assert(3, ({ int x=3; int *y=&x; int **z=&y; **z; }), "({ int x=3; int *y=&x; int **z=&y; **z; })");
-    assert(5, ({ int x=3; int y=5; *(&x+1); }), "({ int x=3; int y=5; *(&x+1); })");
-    assert(3, ({ int x=3; int y=5; *(&y-1); }), "({ int x=3; int y=5; *(&y-1); })");
+    assert(5, ({ int x=3; int y=5; &y; *(&x+1); }), "({ int x=3; int y=5; &y; *(&x+1); })");
+    assert(3, ({ int x=3; int y=5; &x; *(&y-1); }), "({ int x=3; int y=5; &x; *(&y-1); })");
     assert(5, ({ int x=3; int *y=&x; *y=5; x; }), "({ int x=3; int *y=&x; *y=5; x; })");
-    assert(7, ({ int x=3; int y=5; *(&x+1)=7; y; }), "({ int x=3; int y=5; *(&x+1)=7; y; })");
-    assert(7, ({ int x=3; int y=5; *(&y-1)=7; x; }), "({ int x=3; int y=5; *(&y-1)=7; x; })");
+    assert(7, ({ int x=3; int y=5; &y; *(&x+1)=7; y; }), "({ int x=3; int y=5; &y; *(&x+1)=7; y; })");
+    assert(7, ({ int x=3; int y=5; &x; *(&y-1)=7; x; }), "({ int x=3; int y=5; &x; *(&y-1)=7; x; })");
     assert(2, ({ int x=3; (&x+2)-&x; }), "({ int x=3; (&x+2)-&x; })");
     assert(8, ({ int x, y; x=3; y=5; x+y; }), "({ int x, y; x=3; y=5; x+y; })");
     assert(8, ({ int x=3, y=5; x+y; }), "({ int x=3, y=5; x+y; })");
@@ -382,6 +383,7 @@ int main() {
     assert(6, ({ int i=2, j=3; (i=5,j)=6; j; }), "({ int i=2, j=3; (i=5,j)=6; j; })");
 
     assert(21, add6(1,2,3,4,5,6), "add6(1,2,3,4,5,6)");
+    assert(26, ({ int x=3; add6(x*2, sub2(x,1), x+1, add2(x,x), x-1, sub2(9,x)); }), "({ int x=3; add6(x*2, sub2(x,1), x+1, add2(x,x), x-1, sub2(9,x)); })");
 
     assert(2, ({ int x[5]; int *y=x+2; y-x; }), "({ int x[5]; int *y=x+2; y-x; })");
 
@@ -410,8 +412,8 @@ int main() {
     assert(8, ({ struct {char a; int b;} x; sizeof(x); }), "({ struct {char a; int b;} x; sizeof(x); })");
     assert(8, ({ struct {int a; char b;} x; sizeof(x); }), "({ struct {int a; char b;} x; sizeof(x); })");
 
-    assert(7, ({ int x; int y; char z; char *a=&y; char *b=&z; b-a; }), "({ int x; int y; char z; char *a=&y; char *b=&z; b-a; })");
-    assert(1, ({ int x; char y; int z; char *a=&y; char *b=&z; b-a; }), "({ int x; char y; int z; char *a=&y; char *b=&z; b-a; })");
+    assert(7, ({ int x; int y; char z; char *a=&y; char *b=&z; &x; b-a; }), "({ int x; int y; char z; char *a=&y; char *b=&z; &x; b-a; })");
+    assert(1, ({ int x; char y; int z; char *a=&y; char *b=&z; &x; b-a; }), "({ int x; char y; int z; char *a=&y; char *b=&z; &x; b-a; })");
 
     assert(2, ({ struct t {char a[2];}; { struct t {char a[4];}; } struct t y; sizeof(y); }), "({ struct t {char a[2];}; { struct t {char a[4];}; } struct t y; sizeof(y); })");
     assert(3, ({ struct t {int x;}; int t=1; struct t y; y.x=2; t+y.x; }), "({ struct t {int x;}; int t=1; struct t y; y.x=2; t+y.x; })");
@@ -524,6 +526,12 @@ int main() {
     assert(0, (long)-2 >= -1, "(long)-2 >= -1");
   
     assert(0, 2147483647 + 2147483647 + 2, "2147483647 + 2147483647 + 2");
+    assert(44, (char)300, "(char)300");
+    assert(0, -1 < 1U, "-1 < 1U");
+    assert(1, (unsigned char)-1 == 255, "(unsigned char)-1 == 255");
+    assert(1, (_Bool)0.5, "(_Bool)0.5");
+    assert(1, (float)16777217 == 16777216.0, "(float)16777217 == 16777216.0");
+    assert(3, 0 ? 1 / 0 : 3, "0 ? 1 / 0 : 3");
     assert((long)-1, ({ long x; x=-1; x; }), "({ long x; x=-1; x; })");
   
     assert(1, ({ char x[3]; x[0]=0; x[1]=1; x[2]=2; char *y=x+1; y[0]; }), "({ char x[3]; x[0]=0; x[1]=1; x[2]=2; char *y=x+1; y[0]; })");
@@ -564,6 +572,7 @@ int main() {
     assert(4, ({ enum t { zero, one, two }; enum t y; sizeof(y); }), "({ enum t { zero, one, two }; enum t y; sizeof(y); })");
 
     assert(3, static_fn(), "static_fn()");
+    assert(4, inline_fn(), "inline_fn()");
 
     assert(55, ({ int j=0; for (int i=0; i<=10; i=i+1) j=j+i; j; }), "({ int j=0; for (int i=0; i<=10; i=i+1) j=j+i; j; })");
     assert(3, ({ int i=3; int j=0; for (int i=0; i<=10; i=i+1) j=j+i; i; }), "({ int i=3; int j=0; for (int i=0; i<=10; i=i+1) j=j+i; i; })");
@@ -1193,6 +1202,7 @@ int main() {
 
     assert(7, add_float3(2.5, 2.5, 2.5), "add_float3(2.5, 2.5, 2.5)");
     assert(7, add_double3(2.5, 2.5, 2.5), "add_double3(2.5, 2.5, 2.5)");
+    assert(18, ({ double x=1.5, y=0; for (int i=0; i<4; i++) y += add_double(x, x) + x; y; }), "({ double x=1.5, y=0; for (int i=0; i<4; i++) y += add_double(x, x) + x; y; })");
 
     assert(0, ({ char buf[100]; sprintf(buf, "%.1f", (float)3.5); strcmp(buf, "3.5"); }), "({ char buf[100]; sprintf(buf, \"%.1f\", (float)3.5); strcmp(buf, \"3.5\"); })");
 
@@ -1694,5 +1704,15 @@ of(char), \
     assert(L'x', ({ wchar_t x[] = L"🤔x"; x[1]; }), "({ wchar_t x[] = L\"🤔x\"; x[1]; })");
 
 
+#line 500 "line.c"
+    assert(500, __LINE__, "__LINE__");
+    assert(0, strcmp(__FILE__, "line.c"), "strcmp(__FILE__, \"line.c\")");
+#line 600
+    assert(600, __LINE__, "__LINE__");
+    assert(0, strcmp(__FILE__, "line.c"), "strcmp(__FILE__, \"line.c\")");
+# 700 "linemarker.c" 2
+    assert(700, __LINE__, "__LINE__");
+    assert(0, strcmp(__FILE__, "linemarker.c"), "strcmp(__FILE__, \"linemarker.c\")");
+
     printf("OK\n");
 }